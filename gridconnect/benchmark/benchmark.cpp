@@ -0,0 +1,3161 @@
+/* benchmark.cpp : reproducible benchmarks for the CBOR codec and the battery store
+
+status: early stage prototyping - architectural decisions aren't finalized
+
+Copyright (c)   (c) 2015,2016 tk@satware.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this
+software and associated documentation files (the "Software"), to deal in the Software
+without restriction, including without limitation the rights to use, copy, modify,
+merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be included in all copies
+or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+/*
+  usage: gridconnect-benchmark [--quick] [--filter text] [--dir path] [--json file] [--cbor file]
+
+  Every benchmark uses fixed seeds and sizes, so two runs on the same machine do the
+  same work. The results go to the console and optionally to a JSON or CBOR file,
+  which can be kept per release and compared to spot regressions.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if SATAG_HTTPS
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "httpclient.h"
+#endif
+
+#include "c++bor.h"
+#include "storage.h"
+#include "shardedstore.h"
+#include "async.h"
+#include "ingest.h"
+#include "replay.h"
+#include "upload.h"
+#include "columnar.h"
+#include "capture.h"
+#include "compress.h"
+#include "sampleclock.h"
+#include "metrics.h"
+
+using namespace std;
+using namespace satag;
+
+namespace
+{
+  /*
+    one measured figure, value is in unit, the latency percentiles are in nanoseconds
+  */
+  struct result
+  {
+    string name;
+    string unit;
+    double value = 0;
+    uint64_t ops = 0;
+    double seconds = 0;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+  };
+
+  struct options
+  {
+    bool quick = false;
+    string filter;
+    string dir = ".";
+    string json;
+    string cbor;
+  };
+
+  typedef std::chrono::steady_clock clock_type;
+
+  double secondsSince(clock_type::time_point start)
+  {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  /*
+    counts the items of a decoded stream, so the decoder work can't be optimized away
+  */
+  class counting : public cbor::listener
+  {
+  public:
+    uint64_t items = 0;
+    void int32(int32_t value) override { ++items; }
+    void int64(int64_t value) override { ++items; }
+    void int64p(uint64_t value) override { ++items; }
+    void int64n(uint64_t value) override { ++items; }
+    void string(const char* value, size_t len, bool complete) override { ++items; }
+    void bytes(const uint8_t* mem, size_t len, bool complete) override { ++items; }
+    void float16(float value) override { ++items; }
+    void float32(float value) override { ++items; }
+    void float64(double value) override { ++items; }
+    void boolean(bool value) override { ++items; }
+    void null() override { ++items; }
+    void tag(uint64_t tag) override { ++items; }
+    void array(uint64_t nums) override { ++items; }
+    void map(uint64_t nums) override { ++items; }
+    void stringahead(uint64_t len) override {}
+    void bytesahead(uint64_t len) override {}
+    void time(const char* value) override { ++items; }
+    void time(int64_t value) override { ++items; }
+  };
+
+  /*
+    the samples of a battery: a few devices with ~40 entities each, values around a
+    working point with noise, negative values for charging, one sample per second
+  */
+  vector<energy::bx::sample> makeSamples(size_t count, int64_t start)
+  {
+    std::mt19937 rng(4711);
+    std::normal_distribution<double> noise(0.0, 50.0);
+    vector<energy::bx::sample> result(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      auto& s = result[i];
+      s.id = 0;
+      s.device = 1 + (int)(i % 4);
+      s.entity = 100 + (int)((i / 4) % 40);
+      s.value = (int)(((s.entity % 3) - 1) * 2300 + noise(rng));
+      s.sampletime = start + (int64_t)(i / 160) * energy::bx::kTicksPerSecond + (int64_t)(i % 160);
+    }
+    return result;
+  }
+
+  void key(cbor::listener& out, const char* s)
+  {
+    out.string(s, strlen(s), true);
+  }
+
+  /*
+    an upload batch as sent to the server: self describing CBOR with the gateway id
+    and an array of { device, entity, value, time } maps
+  */
+  void encodeBatch(cbor::listener& out, const vector<energy::bx::sample>& samples)
+  {
+    out.tag(55799);
+    out.map(2);
+    key(out, "gateway");
+    key(out, "bx-4711");
+    key(out, "samples");
+    out.array(samples.size());
+    for (auto& s : samples)
+    {
+      out.map(4);
+      key(out, "d");
+      out.int32(s.device);
+      key(out, "e");
+      out.int32(s.entity);
+      key(out, "v");
+      out.int32(s.value);
+      key(out, "t");
+      out.int64(s.sampletime);
+    }
+  }
+
+  // ----------------------------------------------------------------------------
+
+  bool benchCodec(const options& opt, vector<result>& results)
+  {
+    const size_t batch = 1000;
+    const int rounds = opt.quick ? 50 : 500;
+    auto samples = makeSamples(batch, 1450000000LL * energy::bx::kTicksPerSecond);
+
+    vector<uint8_t> payload;
+    payload.reserve(64 * 1024);
+    cbor::encoder e([&](const uint8_t* mem, size_t len)
+    {
+      payload.insert(payload.end(), mem, mem + len);
+    });
+
+    auto start = clock_type::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+      payload.clear();
+      encodeBatch(e, samples);
+    }
+    double t = secondsSince(start);
+    result enc;
+    enc.name = "cbor.encode";
+    enc.unit = "MB/s";
+    enc.ops = (uint64_t)rounds * batch;
+    enc.seconds = t;
+    enc.value = (double)payload.size() * rounds / t / 1e6;
+    results.push_back(enc);
+
+    // the decoder feeding an encoder has to reproduce the payload byte by byte
+    vector<uint8_t> copy;
+    cbor::encoder c([&](const uint8_t* mem, size_t len)
+    {
+      copy.insert(copy.end(), mem, mem + len);
+    });
+    cbor::decoder roundtrip(c, 4096);
+    if (!roundtrip.parse(payload.data(), payload.size()) || !roundtrip.ok() || (copy != payload))
+    {
+      cerr << "cbor round trip failed" << endl;
+      return false;
+    }
+
+    counting items;
+    cbor::decoder d(items, 4096);
+    start = clock_type::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+      d.reset();
+      d.parse(payload.data(), payload.size());
+    }
+    t = secondsSince(start);
+    if (!d.ok())
+    {
+      cerr << "cbor decode failed" << endl;
+      return false;
+    }
+    result dec;
+    dec.name = "cbor.decode";
+    dec.unit = "MB/s";
+    dec.ops = items.items;
+    dec.seconds = t;
+    dec.value = (double)payload.size() * rounds / t / 1e6;
+    results.push_back(dec);
+    return true;
+  }
+
+  /*
+    sustained logDSPEvent ingestion, every batch is one transaction with synchronous=FULL
+  */
+  bool benchIngest(const options& opt, size_t batch, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-ingest.sq3";
+    remove(file.c_str());
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    size_t commits = opt.quick ? 50 : 500;
+    if (batch * commits > 200000)
+    {
+      commits = 200000 / batch;
+    }
+    auto samples = makeSamples(batch * commits, energy::bx::store::now());
+    vector<energy::bx::sample> chunk;
+    chunk.reserve(batch);
+    bool ok = true;
+    auto start = clock_type::now();
+    for (size_t i = 0; ok && (i < samples.size()); i += batch)
+    {
+      if (batch == 1)
+      {
+        ok = s.logDSPEvent(samples[i].device, samples[i].entity, samples[i].value);
+      }
+      else
+      {
+        chunk.assign(samples.begin() + i, samples.begin() + i + batch);
+        ok = s.logDSPEvents(chunk);
+      }
+    }
+    double t = secondsSince(start);
+    s.close();
+    remove(file.c_str());
+    if (!ok)
+    {
+      cerr << "ingest failed" << endl;
+      return false;
+    }
+    result r;
+    r.name = "store.ingest.batch" + to_string(batch);
+    r.unit = "samples/s";
+    r.ops = samples.size();
+    r.seconds = t;
+    r.value = samples.size() / t;
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    store.rollup.late ingests batches of 1000 samples with 100 late ones each, which
+    fall up to 15 minutes behind the newest. One batch is rolled back by a trigger.
+    Afterwards both rollup tables must match a GROUP BY over CollectedData.
+  */
+  bool benchRollup(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-rollup.sq3";
+    remove(file.c_str());
+    const size_t batch = 1000;
+    const size_t batches = opt.quick ? 20 : 200;
+    const int kPoison = -999999;    // the trigger fails the insert of this value
+    int64_t start = (energy::bx::store::now() / energy::bx::kTicksPerSecond - 86400) * energy::bx::kTicksPerSecond;
+    auto samples = makeSamples(batch * batches, start);
+    std::mt19937 rng(4711);
+    std::uniform_int_distribution<int64_t> behind(1, 900 * energy::bx::kTicksPerSecond);
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+      samples[i].sampletime = start + (int64_t)i * 50000;
+      if ((i % 10) == 9)
+      {
+        samples[i].sampletime -= behind(rng);
+      }
+    }
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    bool ok = true;
+    vector<energy::bx::sample> chunk;
+    auto begin = clock_type::now();
+    for (size_t i = 0; ok && (i < samples.size()); i += batch)
+    {
+      chunk.assign(samples.begin() + i, samples.begin() + i + batch);
+      if (i == batch * (batches / 2))
+      {
+        util::db d(file.c_str(), SQLITE_OPEN_READWRITE);
+        ok = d.execute("create trigger benchfail before insert on CurrentState when new.entityvalue=-999999 "
+          "begin select raise(abort,'rolled back'); end;");
+        chunk.back().value = kPoison;
+        ok = ok && !s.logDSPEvents(chunk);
+        ok = ok && d.execute("drop trigger benchfail;");
+        chunk.back().value = samples[i + batch - 1].value;
+      }
+      ok = ok && s.logDSPEvents(chunk);
+    }
+    double t = secondsSince(begin);
+    s.close();
+    for (int level = 0; ok && (level < energy::bx::rollup::kLevels); ++level)
+    {
+      long long length = energy::bx::rollup::kResolutions[level];
+      int resolution = (int)(length / energy::bx::kTicksPerSecond);
+      char sql[1024];
+      snprintf(sql, sizeof(sql),
+        "with g as (select device,entity,(sampletime/%lld)*%lld as starttime,min(entityvalue) as minvalue,"
+        "max(entityvalue) as maxvalue,sum(entityvalue) as sumvalue,count(*) as samples,max(sampletime) as lasttime "
+        "from CollectedData group by 1,2,3) "
+        "select (select count(*) from g),(select count(*) from `Rollup%d`),(select count(*) from g where not exists "
+        "(select 1 from `Rollup%d` r where r.device=g.device and r.entity=g.entity and r.starttime=g.starttime "
+        "and r.minvalue=g.minvalue and r.maxvalue=g.maxvalue and r.sumvalue=g.sumvalue and r.samples=g.samples "
+        "and r.lasttime=g.lasttime));", length, length, resolution, resolution);
+      util::db d(file.c_str(), SQLITE_OPEN_READONLY);
+      int64_t groups = 0, rows = 0, wrong = -1;
+      ok = util::query(d, sql).run([&](util::query& row)
+      {
+        groups = row[0];
+        rows = row[1];
+        wrong = row[2];
+      });
+      if (!ok || (groups != rows) || (wrong != 0))
+      {
+        cerr << "Rollup" << resolution << " doesn't match CollectedData (" << rows << " rows for " << groups
+          << " windows, " << wrong << " differ)" << endl;
+        ok = false;
+      }
+    }
+    remove(file.c_str());
+    if (!ok)
+    {
+      return false;
+    }
+    result r;
+    r.name = "store.rollup.late";
+    r.unit = "samples/s";
+    r.ops = samples.size();
+    r.seconds = t;
+    r.value = samples.size() / t;
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    the partitions of hourly partitioning as written: the samples of each hour in the
+    order they were logged
+  */
+  typedef std::map<int64_t, vector<energy::bx::sample>> hourmap;
+
+  int64_t hourOf(int64_t sampletime)
+  {
+    const int64_t hour = 3600 * energy::bx::kTicksPerSecond;
+    return ((sampletime / hour) - (((sampletime % hour) < 0) ? 1 : 0)) * hour;
+  }
+
+  /*
+    checks that the store lists exactly the partitions of hours and that every table
+    holds the samples of its hour
+  */
+  bool samePartitions(energy::bx::store& s, util::db& d, const hourmap& hours, const char* when)
+  {
+    const int64_t hour = 3600 * energy::bx::kTicksPerSecond;
+    vector<std::pair<string, int64_t>> listed;
+    bool hourlong = true;
+    bool ok = s.listPartitions([&](const char* name, int64_t starttime, int64_t endtime)
+    {
+      hourlong &= (endtime == starttime + hour);
+      listed.push_back(std::make_pair(string(name), starttime));
+    });
+    ok = ok && hourlong && (listed.size() == hours.size());
+    auto it = hours.begin();
+    for (size_t i = 0; ok && (i < listed.size()); ++i, ++it)
+    {
+      int64_t rows = -1, first = 0, last = 0;
+      string sql = "select count(*),min(sampletime),max(sampletime) from `" + listed[i].first + "`;";
+      ok = (listed[i].second == it->first) && util::query(d, sql.c_str()).run([&](util::query& row)
+      {
+        rows = row[0];
+        first = row[1];
+        last = row[2];
+      });
+      int64_t expectedFirst = INT64_MAX, expectedLast = INT64_MIN;
+      for (auto& x : it->second)
+      {
+        expectedFirst = std::min(expectedFirst, x.sampletime);
+        expectedLast = std::max(expectedLast, x.sampletime);
+      }
+      ok = ok && (rows == (int64_t)it->second.size()) && (first == expectedFirst) && (last == expectedLast);
+    }
+    int64_t tables = -1;
+    bool counted = util::query(d, "select count(*) from sqlite_master where type='table' and name like 'CollectedData\\_%' escape '\\';")
+      .run([&](util::query& row) { tables = row[0]; });
+    if (!ok || !counted || (tables != (int64_t)hours.size()))
+    {
+      cerr << when << ": " << listed.size() << " partitions listed, " << tables << " tables, " << hours.size() << " expected" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    reads from..to in pages of limit rows, which end inside the partitions and between
+    them, and compares with the samples written in that range
+  */
+  bool sameRange(energy::bx::store& s, const hourmap& hours, int64_t from, int64_t to, size_t limit)
+  {
+    vector<energy::bx::sample> expected;
+    for (auto& h : hours)
+    {
+      for (auto& x : h.second)
+      {
+        if ((x.sampletime >= from) && (x.sampletime < to))
+        {
+          expected.push_back(x);
+        }
+      }
+    }
+    // the ids follow the order of logging, which the samples of an hour are in
+    std::stable_sort(expected.begin(), expected.end(), [](const energy::bx::sample& a, const energy::bx::sample& b)
+    {
+      return a.sampletime < b.sampletime;
+    });
+    vector<energy::bx::sample> read;
+    energy::bx::samplecursor cursor;
+    bool ok = true;
+    while (ok && !cursor.done)
+    {
+      ok = s.readSamples(from, to, cursor, limit, [&](const energy::bx::sample& x) { read.push_back(x); });
+    }
+    ok = ok && (read.size() == expected.size());
+    for (size_t i = 0; ok && (i < read.size()); ++i)
+    {
+      ok = (read[i].device == expected[i].device) && (read[i].entity == expected[i].entity)
+        && (read[i].value == expected[i].value) && (read[i].sampletime == expected[i].sampletime);
+    }
+    if (!ok)
+    {
+      cerr << "readSamples over partitions: " << read.size() << " rows, " << expected.size() << " expected" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    store.partitions: samples/s into hourly partitions, every tenth sample an hour late.
+    Checks the routing of the samples into their partitions, reads spanning partitions,
+    a rollback of a batch which created a partition (the list is reread) and the
+    retention by dropPartitionsBefore.
+  */
+  bool benchPartitions(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-partitions.sq3";
+    remove(file.c_str());
+    const int64_t hour = 3600 * energy::bx::kTicksPerSecond;
+    const size_t batch = 500;
+    const int count = opt.quick ? 6 : 48;
+    const size_t rows = (size_t)count * (opt.quick ? 2000 : 20000);
+    const int kPoison = -999999;    // the trigger fails the insert of this value
+    int64_t start = hourOf(energy::bx::store::now()) - (count + 1) * hour;
+    auto samples = makeSamples(rows, start);
+    hourmap hours;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+      samples[i].sampletime = start + (int64_t)i * (count * hour / (int64_t)rows);
+      if ((i % 10) == 9)
+      {
+        samples[i].sampletime -= hour;
+      }
+      hours[hourOf(samples[i].sampletime)].push_back(samples[i]);
+    }
+    energy::bx::store s;
+    if (!s.open(file.c_str(), energy::bx::hourly))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    bool ok = true;
+    auto begin = clock_type::now();
+    for (size_t i = 0; ok && (i < samples.size()); i += batch)
+    {
+      ok = s.logDSPEvents(vector<energy::bx::sample>(samples.begin() + i, samples.begin() + std::min(samples.size(), i + batch)));
+    }
+    double t = secondsSince(begin);
+    util::db d(file.c_str(), SQLITE_OPEN_READWRITE);
+    ok = ok && samePartitions(s, d, hours, "routing");
+    ok = ok && sameRange(s, hours, start + hour + hour / 2, start + (count - 1) * hour - hour / 3, 97)
+      && sameRange(s, hours, INT64_MIN, INT64_MAX, 1000);
+    // a batch which starts a new hour and fails: the partition it created is rolled back
+    vector<energy::bx::sample> next(samples.end() - 10, samples.end());
+    for (size_t i = 0; i < next.size(); ++i)
+    {
+      next[i].sampletime = start + count * hour + (int64_t)i;
+    }
+    ok = ok && d.execute("create trigger benchfail before insert on CurrentState when new.entityvalue=-999999 "
+      "begin select raise(abort,'rolled back'); end;");
+    int value = next.back().value;
+    next.back().value = kPoison;
+    ok = ok && !s.logDSPEvents(next) && samePartitions(s, d, hours, "rollback");
+    ok = ok && d.execute("drop trigger benchfail;");
+    next.back().value = value;
+    ok = ok && s.logDSPEvents(next);
+    hours[start + count * hour] = next;
+    ok = ok && samePartitions(s, d, hours, "after the rollback") && sameRange(s, hours, start + (count - 1) * hour, INT64_MAX, 7);
+    // retention: the hours before the cut are dropped, the ids go on
+    int64_t cut = start + 2 * hour;
+    int64_t last = s.lastSampleId();
+    ok = ok && s.dropPartitionsBefore(cut);
+    hours.erase(hours.begin(), hours.lower_bound(cut));
+    ok = ok && samePartitions(s, d, hours, "retention") && sameRange(s, hours, INT64_MIN, INT64_MAX, 1000);
+    ok = ok && s.logDSPEvent(1, 100, 1) && (s.lastSampleId() == last + 1);
+    d.close();
+    s.close();
+    remove(file.c_str());
+    if (!ok)
+    {
+      cerr << "partitions failed" << endl;
+      return false;
+    }
+    result r;
+    r.name = "store.partitions";
+    r.unit = "samples/s";
+    r.ops = samples.size();
+    r.seconds = t;
+    r.value = samples.size() / t;
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    logDSPEvent(s) with the journal: the producer only waits for the append (and with
+    journalsynced the fdatasync), applying the journal is timed on its own. The journal
+    of the last run is replayed into a new database like after a crash.
+  */
+  bool benchJournal(const options& opt, vector<result>& results)
+  {
+    struct run
+    {
+      const char* name;
+      size_t batch;
+      energy::bx::journaling mode;
+    };
+    const run runs[] =
+    {
+      { "store.journal.batch1", 1, energy::bx::journaled },
+      { "store.journal.synced.batch1", 1, energy::bx::journalsynced },
+      { "store.journal.batch100", 100, energy::bx::journaled },
+    };
+    string file = opt.dir + "/bench-journal.sq3";
+    string journal = energy::bx::store::journalName(file.c_str());
+    string copy = opt.dir + "/bench-journal-replay.sq3";
+    string copyJournal = energy::bx::store::journalName(copy.c_str());
+    size_t count = opt.quick ? 20000 : 200000;
+    auto samples = makeSamples(count, energy::bx::store::now());
+    for (auto& r : runs)
+    {
+      remove(file.c_str());
+      remove(journal.c_str());
+      energy::bx::store s;
+      if (!s.open(file.c_str(), energy::bx::unpartitioned, r.mode))
+      {
+        cerr << "can't open " << file << endl;
+        return false;
+      }
+      size_t n = (r.mode == energy::bx::journalsynced) ? count / 10 : count;
+      bool ok = true;
+      auto start = clock_type::now();
+      for (size_t i = 0; ok && (i < n); i += r.batch)
+      {
+        ok = s.logDSPEvents(samples.data() + i, std::min(r.batch, n - i));
+      }
+      double t = secondsSince(start);
+      if (!ok)
+      {
+        cerr << "journal append failed" << endl;
+        return false;
+      }
+      result append;
+      append.name = r.name;
+      append.unit = "samples/s";
+      append.ops = n;
+      append.seconds = t;
+      append.value = n / t;
+      results.push_back(append);
+      if (r.batch > 1)
+      {
+        // the journal as a crash would leave it
+        FILE* in = fopen(journal.c_str(), "rb");
+        FILE* out = fopen(copyJournal.c_str(), "wb");
+        char buffer[65536];
+        size_t len;
+        while (in && out && ((len = fread(buffer, 1, sizeof(buffer), in)) > 0))
+        {
+          fwrite(buffer, 1, len, out);
+        }
+        if (in)
+        {
+          fclose(in);
+        }
+        if (out)
+        {
+          fclose(out);
+        }
+      }
+      start = clock_type::now();
+      ok = s.applyJournal();
+      t = secondsSince(start);
+      s.close();
+      if (!ok)
+      {
+        cerr << "journal apply failed" << endl;
+        return false;
+      }
+      if (r.batch > 1)
+      {
+        result apply;
+        apply.name = "store.journal.apply";
+        apply.unit = "samples/s";
+        apply.ops = n;
+        apply.seconds = t;
+        apply.value = n / t;
+        results.push_back(apply);
+      }
+    }
+    remove(file.c_str());
+    remove(journal.c_str());
+
+    remove(copy.c_str());
+    energy::bx::store s;
+    auto start = clock_type::now();
+    bool ok = s.open(copy.c_str());
+    double t = secondsSince(start);
+    size_t rows = 0;
+    energy::bx::samplecursor cursor;
+    while (ok && !cursor.done)
+    {
+      ok = s.readSamples(INT64_MIN, INT64_MAX, cursor, 10000, [&](const energy::bx::sample&) { ++rows; });
+    }
+    s.close();
+    remove(copy.c_str());
+    remove(copyJournal.c_str());
+    if (!ok || (rows != count))
+    {
+      cerr << "journal replay: " << rows << " of " << count << " samples" << endl;
+      return false;
+    }
+    result replay;
+    replay.name = "store.journal.replay";
+    replay.unit = "samples/s";
+    replay.ops = rows;
+    replay.seconds = t;
+    replay.value = rows / t;
+    results.push_back(replay);
+    return true;
+  }
+
+  /*
+    settings: reads of a snapshot the way a control loop does them, and batches of
+    upserts with a listener. A reopened store has to see the last batch.
+  */
+  bool benchSettings(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-settings.sq3";
+    remove(file.c_str());
+    const int devices = 16;
+    const int entities = 64;
+    const int rounds = opt.quick ? 20 : 200;
+    size_t notified = 0;
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    s.onSettingsChanged([&](const vector<energy::bx::setting>& changed) { notified += changed.size(); });
+    vector<energy::bx::setting> batch(devices * entities);
+    bool ok = true;
+    auto start = clock_type::now();
+    for (int r = 0; ok && (r < rounds); ++r)
+    {
+      for (size_t i = 0; i < batch.size(); ++i)
+      {
+        batch[i].device = (int)i / entities;
+        batch[i].entity = (int)i % entities;
+        batch[i].value = (int64_t)r * 1000 + (int64_t)i;
+      }
+      ok = s.saveSettings(batch);
+    }
+    double t = secondsSince(start);
+    if (!ok || (notified != batch.size() * rounds))
+    {
+      cerr << "settings: " << notified << " of " << batch.size() * rounds << " changes told" << endl;
+      return false;
+    }
+    result save;
+    save.name = "store.settings.batch";
+    save.unit = "settings/s";
+    save.ops = batch.size() * rounds;
+    save.seconds = t;
+    save.value = save.ops / t;
+    results.push_back(save);
+
+    uint64_t reads = opt.quick ? 2000000 : 20000000;
+    int64_t sum = 0;
+    start = clock_type::now();
+    auto snapshot = s.settings();
+    for (uint64_t i = 0; i < reads; ++i)
+    {
+      sum += snapshot->get((int)(i % devices), (int)(i % entities));
+    }
+    t = secondsSince(start);
+    result read;
+    read.name = "store.settings.read";
+    read.unit = "reads/s";
+    read.ops = reads;
+    read.seconds = t;
+    read.value = reads / t;
+    results.push_back(read);
+    s.close();
+
+    s.open(file.c_str());
+    int64_t last = (int64_t)(rounds - 1) * 1000 + (int64_t)batch.size() - 1;
+    bool kept = (sum != 0) && (s.settings()->size() == batch.size()) && (s.getSetting(devices - 1, entities - 1) == (int)last);
+    s.close();
+    remove(file.c_str());
+    if (!kept)
+    {
+      cerr << "settings weren't kept" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    runEvent latency: time from the call until the oldest pending command was handed
+    to the callback and removed, with a queue of commands waiting
+  */
+  bool benchRunEvent(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-commands.sq3";
+    remove(file.c_str());
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    const int commands = opt.quick ? 200 : 2000;
+    {
+      util::db d(file.c_str(), SQLITE_OPEN_READWRITE);
+      util::query insert(d, "insert into ControlCommandsIn (device,text1,text2,exectime) values (?1,?2,?3,?4);");
+      d.begin();
+      for (int i = 0; i < commands; ++i)
+      {
+        insert.bind(1) = 1 + i % 4;
+        insert.bind(2) = "setpoint";
+        insert.bind(3) = to_string(i % 5000);
+        insert.bind(4) = (int64_t)i;
+        insert.run();
+      }
+      d.commit();
+    }
+    util::metrics::histogram latency;
+    int dispatched = 0;
+    auto start = clock_type::now();
+    for (int i = 0; i < commands; ++i)
+    {
+      auto t0 = clock_type::now();
+      s.runEvent([&](int device, const char* text1, const char* text2)
+      {
+        ++dispatched;
+        return true;
+      });
+      latency.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - t0).count());
+    }
+    double t = secondsSince(start);
+    s.close();
+    remove(file.c_str());
+    if (dispatched != commands)
+    {
+      cerr << "runEvent dispatched " << dispatched << " of " << commands << " commands" << endl;
+      return false;
+    }
+    std::unique_ptr<util::metrics::histogram::snapshot> snap(new util::metrics::histogram::snapshot());
+    latency.take(*snap);
+    result r;
+    r.name = "store.runevent";
+    r.unit = "commands/s";
+    r.ops = commands;
+    r.seconds = t;
+    r.value = commands / t;
+    r.p50 = snap->percentile(50);
+    r.p99 = snap->percentile(99);
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    the texts of an event row, a NULL text is told apart from an empty one
+  */
+  bool sameEvent(const energy::bx::event& a, const energy::bx::event& b)
+  {
+    return (a.eventid == b.eventid) && (a.source == b.source) && (a.null1 == b.null1) && (a.text1 == b.text1)
+      && (a.null2 == b.null2) && (a.text2 == b.text2);
+  }
+
+  bool sameEvents(energy::bx::store& s, const vector<energy::bx::event>& expected, const char* when)
+  {
+    vector<energy::bx::event> read;
+    bool ok = s.readEvents(0, expected.size() + 1, [&](const energy::bx::event& e) { read.push_back(e); });
+    ok = ok && (read.size() == expected.size());
+    size_t i = 0;
+    for (; ok && (i < read.size()); ++i)
+    {
+      ok = sameEvent(read[i], expected[i]) && ((expected[i].id == 0) || (read[i].id == expected[i].id));
+    }
+    if (!ok)
+    {
+      cerr << when << ": " << read.size() << " events read of " << expected.size();
+      if (i > 0)
+      {
+        --i;
+        cerr << ", event " << i << " is " << read[i].source << "/" << (read[i].null1 ? "NULL" : read[i].text1) << "/"
+          << (read[i].null2 ? "NULL" : read[i].text2) << " instead of " << expected[i].source << "/"
+          << (expected[i].null1 ? "NULL" : expected[i].text1) << "/" << (expected[i].null2 ? "NULL" : expected[i].text2);
+      }
+      cerr << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    the ControlStateOut texts through the view, "NULL" for a NULL text
+  */
+  bool sameStates(util::db& d, const vector<std::pair<string, string>>& expected, const char* when)
+  {
+    vector<std::pair<string, string>> read;
+    bool ok = util::query(d, "select text1,text2 from ControlStateOutText order by device,entity;").run([&](util::query& row)
+    {
+      auto t1 = row[0].text();
+      auto t2 = row[1].text();
+      read.push_back(std::make_pair(t1.isNull() ? string("NULL") : "'" + t1.str() + "'",
+        t2.isNull() ? string("NULL") : "'" + t2.str() + "'"));
+    });
+    if (!ok || (read != expected))
+    {
+      cerr << when << ": " << read.size() << " states read of " << expected.size() << ", or their texts differ" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    a database of user_version 6 with the texts in Eventlog and ControlStateOut is
+    migrated: the rows keep their ids and texts, each text is in Strings once, and
+    new rows with the same texts refer to those
+  */
+  bool internMigration(const options& opt)
+  {
+    string file = opt.dir + "/bench-intern.sq3";
+    remove(file.c_str());
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    s.close();
+    // back to the layout of version 6
+    bool ok = true;
+    {
+      util::db d(file.c_str(), SQLITE_OPEN_READWRITE);
+      ok = d.execute(
+        "DROP VIEW EventlogText; DROP VIEW ControlStateOutText; DROP TABLE Eventlog; DROP TABLE ControlStateOut; DROP TABLE Strings;"
+        "CREATE TABLE `Eventlog` (`id` INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE, `eventid` INTEGER NOT NULL,"
+        "`source` TEXT NOT NULL, `text1` TEXT, `text2` TEXT, `logtime` INTEGER, `uploaded` INTEGER);"
+        "CREATE TABLE ControlStateOut (`device` INTEGER NOT NULL, `entity` INTEGER NOT NULL, `text1` TEXT, `text2` TEXT,"
+        "`logtime` INTEGER NOT NULL, `uploaded` INTEGER NOT NULL);"
+        "CREATE UNIQUE INDEX `ControlStateOutIndex` ON `ControlStateOut` (`device` ,`entity` );"
+        "INSERT INTO Eventlog (id,eventid,source,text1,text2,logtime,uploaded) VALUES "
+        "(3,1,'NetIn','setpoint','4711',1,1),(5,2,'NetIn','setpoint',NULL,2,0),(6,3,'DSP','',NULL,3,0),"
+        "(9,4,'','NetIn','',4,0),(10,5,'DSP',NULL,'setpoint',5,0);"
+        "INSERT INTO ControlStateOut (device,entity,text1,text2,logtime,uploaded) VALUES "
+        "(1,1,'setpoint','4711',1,0),(1,2,NULL,'',2,0),(2,1,'mode','standby',3,0),(2,2,'',NULL,4,0);"
+        "PRAGMA USER_VERSION=6;");
+    }
+    vector<energy::bx::event> expected(5);
+    const char* rows[5][3] = { { "NetIn", "setpoint", "4711" }, { "NetIn", "setpoint", nullptr }, { "DSP", "", nullptr },
+      { "", "NetIn", "" }, { "DSP", nullptr, "setpoint" } };
+    const int64_t ids[5] = { 3, 5, 6, 9, 10 };
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+      auto& e = expected[i];
+      e.id = ids[i];
+      e.eventid = (int)i + 1;
+      e.source = rows[i][0];
+      e.null1 = !rows[i][1];
+      e.text1 = rows[i][1] ? rows[i][1] : "";
+      e.null2 = !rows[i][2];
+      e.text2 = rows[i][2] ? rows[i][2] : "";
+    }
+    vector<std::pair<string, string>> states = { { "'setpoint'", "'4711'" }, { "NULL", "''" }, { "'mode'", "'standby'" }, { "''", "NULL" } };
+    ok = ok && s.open(file.c_str());
+    {
+      util::db d(file.c_str(), SQLITE_OPEN_READWRITE);
+      // NetIn, setpoint, 4711, DSP, '', mode and standby, each once (text is unique)
+      int64_t strings = 0;
+      ok = ok && sameEvents(s, expected, "migrated") && sameStates(d, states, "migrated")
+        && util::query(d, "select count(*) from Strings;").run([&](util::query& row) { strings = row[0]; });
+      if (ok && (strings != 7))
+      {
+        cerr << "migrated Strings has " << strings << " rows, 7 expected" << endl;
+        ok = false;
+      }
+      size_t dsp = 0;
+      ok = ok && s.readEvents("DSP", 0, 100, [&](const energy::bx::event&) { ++dsp; }) && (dsp == 2);
+      // the texts are found again, nothing is added
+      ok = ok && s.logEvent(6, "NetIn", 1, "mode", "", true) && s.logState(3, 1, "4711", "DSP");
+      energy::bx::event e = expected[0];
+      e.id = 11;
+      e.eventid = 6;
+      e.text1 = "mode";
+      e.text2 = "";
+      expected.push_back(e);
+      states.push_back(std::make_pair("'4711'", "'DSP'"));
+      ok = ok && sameEvents(s, expected, "after the migration") && sameStates(d, states, "after the migration")
+        && util::query(d, "select count(*) from Strings;").run([&](util::query& row) { strings = row[0]; });
+      if (ok && (strings != 7))
+      {
+        cerr << "Strings grew to " << strings << " rows with known texts" << endl;
+        ok = false;
+      }
+    }
+    s.close();
+    remove(file.c_str());
+    if (!ok)
+    {
+      cerr << "interned texts of version 6 failed" << endl;
+    }
+    return ok;
+  }
+
+  /*
+    logEvent and readEvents with interned texts: the sources and command names repeat,
+    every fourth text1 is new, some texts are empty or NULL. The full run has more new
+    texts than the caches hold. A logEvent which fails after adding a text must not
+    leave its id in the cache. store.events is the logEvent rate with its latency,
+    store.events.read the rate of readEvents for one source.
+  */
+  bool benchEvents(const options& opt, vector<result>& results)
+  {
+    if (!internMigration(opt))
+    {
+      return false;
+    }
+    string file = opt.dir + "/bench-events.sq3";
+    remove(file.c_str());
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    const int events = opt.quick ? 1000 : 20000;
+    const char* sources[] = { "NetIn", "NetOut", "DSP", "" };
+    const char* commands[] = { "setpoint", "mode", "reset" };
+    vector<energy::bx::event> expected(events);
+    for (int i = 0; i < events; ++i)
+    {
+      auto& e = expected[i];
+      e.eventid = i;
+      e.source = sources[i % 4];
+      e.null1 = ((i % 5) == 4);
+      e.text1 = e.null1 || ((i % 7) == 6) ? "" : ((i % 4) == 3) ? "fault " + to_string(i) : commands[i % 3];
+      e.null2 = ((i % 3) == 2);
+      e.text2 = e.null2 ? "" : to_string(i % 50);
+    }
+    util::metrics::histogram latency;
+    bool ok = true;
+    auto start = clock_type::now();
+    for (int i = 0; ok && (i < events); ++i)
+    {
+      auto& e = expected[i];
+      auto t0 = clock_type::now();
+      ok = s.logEvent(e.eventid, e.source.c_str(), 1, e.null1 ? nullptr : e.text1.c_str(), e.null2 ? nullptr : e.text2.c_str(), true);
+      latency.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - t0).count());
+    }
+    double t = secondsSince(start);
+    size_t netin = 0;
+    auto begin = clock_type::now();
+    ok = ok && s.readEvents("NetIn", 0, events, [&](const energy::bx::event& e) { netin += (e.source == "NetIn"); });
+    double read = secondsSince(begin);
+    ok = ok && (netin == (size_t)(events + 3) / 4) && sameEvents(s, expected, "interned");
+    // a failing logEvent: its new text is rolled back with the row and has to be added again
+    {
+      util::db d(file.c_str(), SQLITE_OPEN_READWRITE);
+      ok = ok && d.execute("create trigger benchfail before insert on Eventlog when new.eventid=-1 "
+        "begin select raise(abort,'rolled back'); end;");
+      ok = ok && !s.logEvent(-1, "Rollback", 1, "rolled back", nullptr, false);
+      ok = ok && d.execute("drop trigger benchfail;");
+    }
+    energy::bx::event e;
+    e.eventid = events;
+    e.source = "Rollback";
+    e.null1 = false;
+    e.text1 = "fault 3";    // the next new text gets the id the rolled back one had
+    expected.push_back(e);
+    e.eventid = events + 1;
+    e.source = "new after rollback";
+    e.text1 = "rolled back";
+    expected.push_back(e);
+    for (size_t i = events; ok && (i < expected.size()); ++i)
+    {
+      ok = s.logEvent(expected[i].eventid, expected[i].source.c_str(), 1, expected[i].text1.c_str(), nullptr, true);
+    }
+    ok = ok && sameEvents(s, expected, "after a rollback");
+    s.close();
+    remove(file.c_str());
+    if (!ok)
+    {
+      cerr << "interned events failed" << endl;
+      return false;
+    }
+    std::unique_ptr<util::metrics::histogram::snapshot> snap(new util::metrics::histogram::snapshot());
+    latency.take(*snap);
+    result r;
+    r.name = "store.events";
+    r.unit = "events/s";
+    r.ops = events;
+    r.seconds = t;
+    r.value = events / t;
+    r.p50 = snap->percentile(50);
+    r.p99 = snap->percentile(99);
+    results.push_back(r);
+    r = result();
+    r.name = "store.events.read";
+    r.unit = "events/s";
+    r.ops = netin;
+    r.seconds = read;
+    r.value = netin / read;
+    results.push_back(r);
+    return true;
+  }
+
+  void removeShards(const string& file, size_t shards)
+  {
+    for (size_t i = 0; i < shards; ++i)
+    {
+      remove(energy::bx::shardedstore::shardName(file.c_str(), i, shards).c_str());
+    }
+  }
+
+  /*
+    writes the samples through a shardedstore of the given shards and reads them back
+    merged, writes is the time from the first logDSPEvents until flush() returned
+  */
+  bool shardedRoundTrip(const string& file, size_t shards, util::scheduler* pool, const vector<energy::bx::sample>& samples,
+    vector<energy::bx::sample>& read, double& writes)
+  {
+    removeShards(file, shards);
+    energy::bx::shardedstore s;
+    if (!s.open(file.c_str(), shards, energy::bx::unpartitioned, pool))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    const size_t batch = 100;
+    auto start = clock_type::now();
+    bool ok = true;
+    for (size_t i = 0; i < samples.size(); i += batch)
+    {
+      auto end = samples.begin() + std::min(samples.size(), i + batch);
+      ok &= s.logDSPEvents(vector<energy::bx::sample>(samples.begin() + i, end));
+    }
+    ok &= s.flush();
+    writes = secondsSince(start);
+    read.clear();
+    ok &= s.readSamples(INT64_MIN, INT64_MAX, [&](const energy::bx::sample& r) { read.push_back(r); return true; });
+    ok &= (s.failed() == 0);
+    s.close();
+    removeShards(file, shards);
+    if (!ok)
+    {
+      cerr << shards << " shards: writing or reading failed" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    the merged read of N shards has to equal the read of one shard: the same rows in
+    sampletime order, each device in the order it was written. Between devices with
+    the same sampletime the order is the shard index, not the id, so only the
+    sampletimes are compared there.
+  */
+  bool sameMerge(const vector<energy::bx::sample>& one, const vector<energy::bx::sample>& many, size_t shards)
+  {
+    if (one.size() != many.size())
+    {
+      cerr << shards << " shards read " << many.size() << " of " << one.size() << " rows" << endl;
+      return false;
+    }
+    std::map<int, vector<size_t>> devices[2];
+    for (size_t i = 0; i < one.size(); ++i)
+    {
+      if ((one[i].sampletime != many[i].sampletime) || ((i > 0) && (many[i].sampletime < many[i - 1].sampletime)))
+      {
+        cerr << shards << " shards: row " << i << " at " << many[i].sampletime << " instead of " << one[i].sampletime << endl;
+        return false;
+      }
+      devices[0][one[i].device].push_back(i);
+      devices[1][many[i].device].push_back(i);
+    }
+    for (auto& d : devices[0])
+    {
+      auto& rows = devices[1][d.first];
+      bool same = (rows.size() == d.second.size());
+      for (size_t i = 0; same && (i < rows.size()); ++i)
+      {
+        auto& a = one[d.second[i]];
+        auto& b = many[rows[i]];
+        same = (a.entity == b.entity) && (a.value == b.value) && (a.sampletime == b.sampletime);
+      }
+      if (!same)
+      {
+        cerr << shards << " shards: device " << d.first << " differs from one shard" << endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*
+    close() right after queueing must write everything that was queued, with writer
+    threads and with a pool
+  */
+  bool shardedClose(const string& file, size_t shards, util::scheduler* pool, const vector<energy::bx::sample>& samples)
+  {
+    removeShards(file, shards);
+    energy::bx::shardedstore s;
+    if (!s.open(file.c_str(), shards, energy::bx::unpartitioned, pool))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    bool ok = s.logDSPEvents(samples);
+    size_t pending = s.pending();
+    s.close();
+    size_t rows = 0;
+    ok &= s.open(file.c_str(), shards, energy::bx::unpartitioned)
+      && s.readSamples(INT64_MIN, INT64_MAX, [&](const energy::bx::sample&) { ++rows; return true; });
+    s.close();
+    removeShards(file, shards);
+    if (!ok || (rows != samples.size()))
+    {
+      cerr << "close with " << pending << " queued" << (pool ? " on a pool" : "") << ": " << rows << " of " << samples.size()
+        << " rows written" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    store.sharded: samples/s of 16 devices written through 4 shards until flush()
+    returned. The rows read back are checked against a single shard first.
+  */
+  bool benchSharded(const options& opt, vector<result>& results)
+  {
+    const size_t shards = 4;
+    const size_t rows = opt.quick ? 20000 : 200000;
+    string file = opt.dir + "/bench-sharded.sq3";
+    auto samples = makeSamples(rows, energy::bx::store::now());
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+      // more devices than shards, and 8 devices sharing each sampletime
+      samples[i].device = 1 + (int)(i % 16);
+      samples[i].sampletime = samples[0].sampletime + (int64_t)(i / 8) * 1000;
+    }
+    vector<energy::bx::sample> one, many;
+    double single = 0, t = 0;
+    util::scheduler pool(2);
+    pool.start();
+    bool ok = shardedRoundTrip(file, 1, nullptr, samples, one, single)
+      && shardedRoundTrip(file, shards, nullptr, samples, many, t) && sameMerge(one, many, shards)
+      && shardedRoundTrip(file, shards, &pool, samples, many, single) && sameMerge(one, many, shards)
+      && shardedClose(file, shards, nullptr, samples) && shardedClose(file, shards, &pool, samples);
+    pool.stop();
+    if (!ok)
+    {
+      return false;
+    }
+    result r;
+    r.name = "store.sharded";
+    r.unit = "samples/s";
+    r.ops = rows;
+    r.seconds = t;
+    r.value = rows / t;
+    results.push_back(r);
+    return true;
+  }
+
+#if SATAG_COROUTINES
+  util::task<void> asyncWriter(energy::bx::shardedstore& s, int device, int writes, util::metrics::histogram& latency,
+    std::atomic<int>& failed, std::atomic<int>& running)
+  {
+    for (int i = 0; i < writes; ++i)
+    {
+      auto t0 = clock_type::now();
+      bool ok = co_await s.logDSPEventAsync(device, 100 + i % 40, i);
+      latency.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - t0).count());
+      if (!ok)
+      {
+        ++failed;
+      }
+    }
+    --running;
+  }
+
+#ifdef __linux__
+  util::task<bool> asyncWrite(energy::bx::shardedstore& s, int value, int& resumed)
+  {
+    bool ok = co_await s.logDSPEventAsync(1, 1, value);
+    ++resumed;
+    co_return ok;
+  }
+
+  /*
+    a journal append which fails, here at the file size limit like on a full disk,
+    completes the awaiting write once with false, the next append works again
+  */
+  bool journalFailure(const options& opt)
+  {
+    string file = opt.dir + "/bench-journal-fail.sq3";
+    string journal = energy::bx::store::journalName(file.c_str());
+    remove(file.c_str());
+    remove(journal.c_str());
+    energy::bx::shardedstore s;
+    if (!s.open(file.c_str(), 1, energy::bx::unpartitioned, nullptr, energy::bx::journaled))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    int resumed = 0;
+    bool first = util::syncWait(asyncWrite(s, 1, resumed));
+    s.flush();
+    // nothing is queued now, only the append grows a file
+    struct rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    struct rlimit full = limit;
+    full.rlim_cur = 0;
+    auto handler = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &full);
+    bool failing = util::syncWait(asyncWrite(s, 2, resumed));
+    int resumedOnFailure = resumed;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    signal(SIGXFSZ, handler);
+    bool last = util::syncWait(asyncWrite(s, 3, resumed));
+    s.flush();
+    size_t rows = 0;
+    s.readSamples(INT64_MIN, INT64_MAX, [&](const energy::bx::sample&) { ++rows; return true; });
+    size_t failed = s.failed();
+    s.close();
+    remove(file.c_str());
+    remove(journal.c_str());
+    if (!first || failing || !last || (resumedOnFailure != 2) || (resumed != 3) || (rows != 2) || (failed != 1))
+    {
+      cerr << "failed journal append: writes " << first << failing << last << ", resumed " << resumedOnFailure << "/" << resumed
+        << ", " << rows << " rows, " << failed << " failed" << endl;
+      return false;
+    }
+    return true;
+  }
+#endif
+
+  util::task<void> commandWaiter(energy::bx::shardedstore& s, std::atomic<int>& commands, std::atomic<int>& empty)
+  {
+    energy::bx::command c = co_await s.nextCommand();
+    ++(c.id != 0 ? commands : empty);
+  }
+
+  util::task<bool> removeCommand(energy::bx::shardedstore& s)
+  {
+    energy::bx::command c = co_await s.nextCommand();
+    co_return co_await s.removeCommandAsync(c.id);
+  }
+
+  /*
+    every nextCommand() waiting at the same time is resumed by addCommands, and the
+    ones still waiting when the store closes complete with an empty command
+  */
+  bool commandWaiters(const options& opt, util::scheduler& pool)
+  {
+    string file = opt.dir + "/bench-waiters.sq3";
+    remove(file.c_str());
+    energy::bx::shardedstore s;
+    if (!s.open(file.c_str(), 1, energy::bx::unpartitioned, &pool))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    std::atomic<int> commands{ 0 };
+    std::atomic<int> empty{ 0 };
+    auto waitFor = [](std::atomic<int>& n, int count)
+    {
+      auto until = clock_type::now() + std::chrono::seconds(5);
+      while ((n.load() < count) && (clock_type::now() < until))
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    };
+    for (int i = 0; i < 3; ++i)
+    {
+      util::spawn(pool, commandWaiter(s, commands, empty));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    energy::bx::command c;
+    c.device = 1;
+    c.text1 = "SetPower";
+    c.text2 = "0";
+    c.exectime = energy::bx::store::now();
+    s.addCommands({ c });
+    waitFor(commands, 3);
+    util::syncWait(removeCommand(s));
+    for (int i = 0; i < 2; ++i)
+    {
+      util::spawn(pool, commandWaiter(s, commands, empty));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    s.close();
+    waitFor(empty, 2);
+    remove(file.c_str());
+    if ((commands.load() != 3) || (empty.load() != 2))
+    {
+      cerr << "command waiters: " << commands.load() << " of 3 resumed by a command, " << empty.load() << " of 2 by close" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    many flows on two scheduler threads, each one awaits the commit of every sample
+    before it writes the next, like a device loop written with co_await would
+  */
+  bool benchAsync(const options& opt, vector<result>& results)
+  {
+#ifdef __linux__
+    if (!journalFailure(opt))
+    {
+      return false;
+    }
+#endif
+    const size_t shards = 2;
+    string file = opt.dir + "/bench-async.sq3";
+    for (size_t i = 0; i < shards; ++i)
+    {
+      remove(energy::bx::shardedstore::shardName(file.c_str(), i, shards).c_str());
+    }
+    util::scheduler pool(2);
+    pool.start();
+    if (!commandWaiters(opt, pool))
+    {
+      pool.stop();
+      return false;
+    }
+    energy::bx::shardedstore s;
+    if (!s.open(file.c_str(), shards, energy::bx::unpartitioned, &pool))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    const int flows = opt.quick ? 64 : 256;
+    const int writes = opt.quick ? 50 : 200;
+    util::metrics::histogram latency;
+    std::atomic<int> failed{ 0 };
+    std::atomic<int> running{ flows };
+    auto start = clock_type::now();
+    for (int f = 0; f < flows; ++f)
+    {
+      util::spawn(pool, asyncWriter(s, 1 + f, writes, latency, failed, running));
+    }
+    while (running.load() > 0)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double t = secondsSince(start);
+    s.close();
+    pool.stop();
+    for (size_t i = 0; i < shards; ++i)
+    {
+      remove(energy::bx::shardedstore::shardName(file.c_str(), i, shards).c_str());
+    }
+    if (failed.load() != 0)
+    {
+      cerr << "async: " << failed.load() << " writes failed" << endl;
+      return false;
+    }
+    std::unique_ptr<util::metrics::histogram::snapshot> snap(new util::metrics::histogram::snapshot());
+    latency.take(*snap);
+    result r;
+    r.name = "store.async";
+    r.unit = "samples/s";
+    r.ops = (uint64_t)flows * writes;
+    r.seconds = t;
+    r.value = r.ops / t;
+    r.p50 = snap->percentile(50);
+    r.p99 = snap->percentile(99);
+    results.push_back(r);
+    return true;
+  }
+#endif
+
+  /*
+    bulk import of a capture file: frames of 1000 sample maps, each behind a
+    self-describe tag like the DSP writes them. import.decode is the parser side
+    alone (split, parallel decode, sort), import.capture the whole import.
+  */
+  bool benchImport(const options& opt, vector<result>& results)
+  {
+    const size_t count = opt.quick ? 200000 : 2000000;
+    string capture = opt.dir + "/bench-capture.cbor";
+    string file = opt.dir + "/bench-import.sq3";
+    FILE* f = fopen(capture.c_str(), "wb");
+    if (!f)
+    {
+      cerr << "can't create " << capture << endl;
+      return false;
+    }
+    {
+      cbor::encoder e([&](const uint8_t* mem, size_t len)
+      {
+        fwrite(mem, 1, len, f);
+      });
+      auto samples = makeSamples(count, energy::bx::store::now() - (int64_t)count * energy::bx::kTicksPerSecond);
+      for (size_t i = 0; i < samples.size(); ++i)
+      {
+        if (i % 1000 == 0)
+        {
+          e.tag(55799);
+          e.array(std::min((size_t)1000, samples.size() - i));
+        }
+        auto& s = samples[i];
+        e.map(4);
+        e.int32(1);
+        e.int32(s.device);
+        e.int32(2);
+        e.int32(s.entity);
+        e.int32(3);
+        e.int32(s.value);
+        e.int32(4);
+        e.int64(s.sampletime);
+      }
+    }
+    fclose(f);
+
+    remove(file.c_str());
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    energy::bx::importer importer(s);
+    energy::bx::importstats stats;
+    auto start = clock_type::now();
+    bool ok = importer.importFile(capture.c_str(), stats);
+    double t = secondsSince(start);
+    s.close();
+    remove(file.c_str());
+    remove(capture.c_str());
+    if (!ok || (stats.samples != count))
+    {
+      cerr << "import stored " << stats.samples << " of " << count << " samples" << endl;
+      return false;
+    }
+    result decode;
+    decode.name = "import.decode";
+    decode.unit = "MB/s";
+    decode.ops = stats.samples;
+    decode.seconds = stats.decodeSeconds;
+    decode.value = stats.bytes / 1e6 / stats.decodeSeconds;
+    results.push_back(decode);
+    result r;
+    r.name = "import.capture";
+    r.unit = "samples/s";
+    r.ops = stats.samples;
+    r.seconds = t;
+    r.value = stats.samples / t;
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    the upload body: the samples are pulled from the store as a CBOR sequence in
+    64 KiB reads like curl does it and split into items again on the other side
+  */
+  bool benchUploadStream(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-stream.sq3";
+    remove(file.c_str());
+    const size_t rows = opt.quick ? 20000 : 200000;
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    auto samples = makeSamples(rows, energy::bx::store::now());
+    s.logDSPEvents(samples);
+    uint64_t items = 0;
+    cbor::sequencereader split([&](const uint8_t* item, size_t len)
+    {
+      ++items;
+      return true;
+    });
+    vector<uint8_t> buffer(65536);
+    auto start = clock_type::now();
+    energy::bx::uploadstream body(s, 0);
+    size_t n;
+    while ((n = body.read(buffer.data(), buffer.size())) > 0)
+    {
+      split.feed(buffer.data(), n);
+    }
+    double t = secondsSince(start);
+    s.close();
+    remove(file.c_str());
+    if ((items != rows) || split.pending() || body.failed())
+    {
+      cerr << "upload stream sent " << items << " of " << rows << " samples" << endl;
+      return false;
+    }
+    result r;
+    r.name = "upload.stream";
+    r.unit = "samples/s";
+    r.ops = items;
+    r.seconds = t;
+    r.value = items / t;
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    compression of upload bodies of 10 seconds of samples (1600) each: the ratio and the
+    CPU time per MB of CBOR for every codec which is compiled in. The zstd dictionary
+    is trained on the first half of the bodies and measured on the second half, every
+    body is decompressed again and compared.
+  */
+  bool benchCompression(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-compress.sq3";
+    remove(file.c_str());
+    const size_t perBody = 1600;
+    const size_t count = opt.quick ? 20 : 100;
+    vector<vector<uint8_t>> training;
+    vector<vector<uint8_t>> bodies;
+    {
+      energy::bx::store s;
+      if (!s.open(file.c_str()))
+      {
+        cerr << "can't open " << file << endl;
+        return false;
+      }
+      s.logDSPEvents(makeSamples(perBody * count * 2, energy::bx::store::now()));
+      int64_t position = 0;
+      for (size_t i = 0; i < count * 2; ++i)
+      {
+        energy::bx::uploadstream body(s, position, INT64_MAX, perBody);
+        vector<uint8_t> b(65536);
+        size_t used = 0, n;
+        while ((n = body.read(b.data() + used, b.size() - used)) > 0)
+        {
+          used += n;
+          b.resize(std::max(b.size(), used + 65536));
+        }
+        b.resize(used);
+        (i < count ? training : bodies).push_back(b);
+        position = body.position();
+      }
+      s.close();
+      remove(file.c_str());
+    }
+
+    struct codec
+    {
+      const char* name;
+      util::contentencoding encoding;
+      int level;
+      bool dictionary;
+    };
+    vector<uint8_t> dictionary;
+    bool trained = util::trainDictionary(training, 16384, dictionary);
+    for (const codec& c : { codec{ "deflate1", util::deflate, 1, false }, codec{ "deflate6", util::deflate, 6, false },
+      codec{ "zstd3", util::zstd, 3, false }, codec{ "zstd3.dict", util::zstd, 3, true } })
+    {
+      if (!util::encodingAvailable(c.encoding) || (c.dictionary && !trained))
+      {
+        continue;
+      }
+      const vector<uint8_t>* dict = c.dictionary ? &dictionary : nullptr;
+      uint64_t in = 0, out = 0;
+      vector<vector<uint8_t>> compressed(bodies.size());
+      std::clock_t cpu = std::clock();
+      for (size_t i = 0; i < bodies.size(); ++i)
+      {
+        size_t pos = 0;
+        const vector<uint8_t>& b = bodies[i];
+        util::compressingreader z([&](uint8_t* dest, size_t len)
+        {
+          size_t n = std::min(len, b.size() - pos);
+          memcpy(dest, b.data() + pos, n);
+          pos += n;
+          return n;
+        }, c.encoding, c.level, dict);
+        vector<uint8_t> chunk(16384);
+        size_t n;
+        while ((n = z.read(chunk.data(), chunk.size())) > 0)
+        {
+          compressed[i].insert(compressed[i].end(), chunk.begin(), chunk.begin() + n);
+        }
+        in += z.bytesIn();
+        out += z.bytesOut();
+      }
+      double seconds = (double)(std::clock() - cpu) / CLOCKS_PER_SEC;
+      for (size_t i = 0; i < bodies.size(); ++i)
+      {
+        vector<uint8_t> restored;
+        util::decompressor d(c.encoding, [&](const uint8_t* mem, size_t len)
+        {
+          restored.insert(restored.end(), mem, mem + len);
+          return true;
+        }, dict);
+        if (!d.feed(compressed[i].data(), compressed[i].size()) || !d.finished() || (restored != bodies[i]))
+        {
+          cerr << c.name << " didn't restore body " << i << endl;
+          return false;
+        }
+      }
+      result ratio;
+      ratio.name = string("upload.") + c.name + ".ratio";
+      ratio.unit = "x";
+      ratio.ops = in;
+      ratio.seconds = seconds;
+      ratio.value = (double)in / std::max<uint64_t>(1, out);
+      results.push_back(ratio);
+      result cost;
+      cost.name = string("upload.") + c.name + ".cpu";
+      cost.unit = "ms/MB";
+      cost.ops = in;
+      cost.seconds = seconds;
+      cost.value = seconds * 1e3 / (in / 1e6);
+      results.push_back(cost);
+    }
+    return true;
+  }
+
+  bool sameSamples(const vector<energy::bx::sample>& a, const vector<energy::bx::sample>& b)
+  {
+    bool same = (a.size() == b.size());
+    for (size_t i = 0; same && (i < a.size()); ++i)
+    {
+      same = (a[i].device == b[i].device) && (a[i].entity == b[i].entity)
+        && (a[i].value == b[i].value) && (a[i].sampletime == b[i].sampletime);
+    }
+    return same;
+  }
+
+  // the series of a columnar batch come back in (device, entity) order, each in the order written
+  void seriesOrder(vector<energy::bx::sample>& samples)
+  {
+    std::stable_sort(samples.begin(), samples.end(), [](const energy::bx::sample& a, const energy::bx::sample& b)
+    {
+      return (a.device != b.device) ? (a.device < b.device) : (a.entity < b.entity);
+    });
+  }
+
+  /*
+    columnarRoundTrip encodes the samples as one columnar batch, decodes it and compares
+  */
+  bool columnarRoundTrip(const char* name, vector<energy::bx::sample> samples)
+  {
+    vector<uint8_t> bytes;
+    cbor::encoder out([&](const uint8_t* mem, size_t len) { bytes.insert(bytes.end(), mem, mem + len); });
+    energy::bx::columnarencoder encoder;
+    encoder.encode(out, samples.data(), samples.size());
+    vector<energy::bx::sample> restored;
+    energy::bx::columnarreader reader(restored);
+    cbor::decoder decoder(reader, 256);
+    decoder.parse(bytes.data(), bytes.size());
+    seriesOrder(samples);
+    if (!decoder.ok() || (reader.invalid() != 0) || (reader.batches() != 1) || !sameSamples(samples, restored))
+    {
+      cerr << "columnar batch with " << name << " didn't restore the samples (" << restored.size() << " of " << samples.size() << ")" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    the cases regular battery samples don't reach: irregular times, intervals and
+    value steps which go back or jump far, columns which need a wider type in the
+    middle of the batch, the int32 bounds, and a series split over two batches
+  */
+  bool columnarEdgeCases(const options& opt)
+  {
+    std::mt19937 rng(4711);
+    const int64_t t0 = 1700000000LL * energy::bx::kTicksPerSecond;
+    auto add = [](vector<energy::bx::sample>& v, int device, int entity, int value, int64_t sampletime)
+    {
+      energy::bx::sample s;
+      s.device = device;
+      s.entity = entity;
+      s.value = value;
+      s.sampletime = sampletime;
+      v.push_back(s);
+    };
+
+    vector<energy::bx::sample> irregular;
+    int64_t t = t0;
+    for (int i = 0; i < 1000; ++i)
+    {
+      t += 1 + (int64_t)(rng() % 5000000);
+      add(irregular, 1 + (i % 2), 7, (int)(rng() % 10001) - 5000, t);
+    }
+
+    vector<energy::bx::sample> jumps;
+    const int64_t kJumps[] = { 1LL << 40, -(1LL << 39), -1, 1LL << 50, 0, -(1LL << 50), 1000000 };
+    const int kSteps[] = { -100000, 2000000000, -2000000000, 1, 0, -1, 123456789 };
+    t = t0;
+    int value = 0;
+    for (int i = 0; i < 700; ++i)
+    {
+      t += kJumps[i % 7];
+      value = (int)((uint32_t)value + (uint32_t)(kSteps[(i / 7) % 7] / ((i % 3) + 1)));   // wraps at the int32 bounds
+      add(jumps, 3, 1, value, t);
+    }
+
+    // the deltas of both columns need 8, then 16, 32 and 64 bits
+    vector<energy::bx::sample> widths;
+    const int64_t kJitter[] = { 0, 100, 30000, 1000000, 10000000000LL };
+    const int kValues[] = { 1, 200, 40000, INT32_MIN, INT32_MAX };
+    t = t0;
+    for (int w = 0; w < 5; ++w)
+    {
+      for (int i = 0; i < 50; ++i)
+      {
+        t += 1000 + ((i == 25) ? kJitter[w] : 0);
+        add(widths, 4, 2, (i == 25) ? kValues[w] : i, t);
+      }
+    }
+
+    vector<energy::bx::sample> bounds;
+    for (int i = 0; i < 100; ++i)
+    {
+      add(bounds, 5, 1, (i % 2) ? INT32_MAX : INT32_MIN, t0 + i);
+      add(bounds, 5, 2, INT32_MIN, t0 + i);
+      add(bounds, 5, 3, INT32_MAX, t0 + i);
+    }
+    add(bounds, 5, 4, INT32_MIN, t0);   // a series of one sample, without a step
+
+    bool ok = columnarRoundTrip("irregular times", irregular)
+      && columnarRoundTrip("negative and large deltas", jumps)
+      && columnarRoundTrip("widening columns", widths)
+      && columnarRoundTrip("int32 bounds", bounds);
+
+    // one series of kBatch + 1 samples through the store: two batches, the second with one sample
+    string file = opt.dir + "/bench-columnar-split.sq3";
+    remove(file.c_str());
+    energy::bx::store s;
+    if (!ok || !s.open(file.c_str()))
+    {
+      return false;
+    }
+    vector<energy::bx::sample> split;
+    t = t0;
+    for (size_t i = 0; i <= energy::bx::uploadstream::kBatch; ++i)
+    {
+      t += 1 + (int64_t)(rng() % 2000000);
+      add(split, 6, 1, (i % 1000 == 0) ? INT32_MIN : (int)(rng() % 65536) - 32768, t);
+    }
+    s.logDSPEvents(split);
+    vector<uint8_t> bytes;
+    vector<uint8_t> buffer(65536);
+    size_t n;
+    energy::bx::uploadstream body(s, 0);
+    body.setFormat(energy::bx::columnarbatches);
+    while ((n = body.read(buffer.data(), buffer.size())) > 0)
+    {
+      bytes.insert(bytes.end(), buffer.begin(), buffer.begin() + n);
+    }
+    s.close();
+    remove(file.c_str());
+    vector<energy::bx::sample> restored;
+    energy::bx::columnarreader reader(restored);
+    cbor::decoder decoder(reader, 256);
+    decoder.parse(bytes.data(), bytes.size());
+    if (body.failed() || (reader.batches() != 2) || (reader.invalid() != 0) || !sameSamples(split, restored))
+    {
+      cerr << "columnar batches split at " << energy::bx::uploadstream::kBatch << " didn't restore the samples ("
+        << reader.batches() << " batches, " << restored.size() << " of " << split.size() << ")" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    columnar upload bodies against sample maps: the same samples read from the store
+    in both layouts, the size ratio before compression and the columnar encoding rate.
+    The columnar body is decoded again with columnarreader and compared, so are the
+    edge cases of columnarEdgeCases.
+  */
+  bool benchColumnar(const options& opt, vector<result>& results)
+  {
+    if (!columnarEdgeCases(opt))
+    {
+      return false;
+    }
+    string file = opt.dir + "/bench-columnar.sq3";
+    remove(file.c_str());
+    const size_t rows = opt.quick ? 20000 : 200000;
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    auto samples = makeSamples(rows, energy::bx::store::now());
+    s.logDSPEvents(samples);
+    vector<uint8_t> buffer(65536);
+    size_t n;
+    energy::bx::uploadstream maps(s, 0);
+    auto start = clock_type::now();
+    while ((n = maps.read(buffer.data(), buffer.size())) > 0)
+    {
+    }
+    double tMaps = secondsSince(start);
+    vector<uint8_t> columns;
+    energy::bx::uploadstream body(s, 0);
+    body.setFormat(energy::bx::columnarbatches);
+    start = clock_type::now();
+    while ((n = body.read(buffer.data(), buffer.size())) > 0)
+    {
+      columns.insert(columns.end(), buffer.begin(), buffer.begin() + n);
+    }
+    double t = secondsSince(start);
+    s.close();
+    remove(file.c_str());
+
+    vector<energy::bx::sample> restored;
+    energy::bx::columnarreader reader(restored);
+    cbor::decoder decoder(reader, 256);
+    decoder.parse(columns.data(), columns.size());
+    auto key = [](const energy::bx::sample& a, const energy::bx::sample& b)
+    {
+      return (a.device != b.device) ? (a.device < b.device) : (a.entity != b.entity) ? (a.entity < b.entity)
+        : (a.sampletime != b.sampletime) ? (a.sampletime < b.sampletime) : (a.value < b.value);
+    };
+    std::sort(samples.begin(), samples.end(), key);
+    std::sort(restored.begin(), restored.end(), key);
+    size_t batches = (rows + energy::bx::uploadstream::kBatch - 1) / energy::bx::uploadstream::kBatch;
+    bool same = (reader.invalid() == 0) && (reader.batches() == batches) && sameSamples(samples, restored);
+    if (body.failed() || maps.failed() || !same)
+    {
+      cerr << "columnar body didn't restore the samples (" << restored.size() << " of " << rows << ")" << endl;
+      return false;
+    }
+    result r;
+    r.name = "upload.columnar";
+    r.unit = "samples/s";
+    r.ops = body.samples();
+    r.seconds = t;
+    r.value = body.samples() / t;
+    results.push_back(r);
+    result ratio;
+    ratio.name = "upload.columnar.size";
+    ratio.unit = "x";
+    ratio.ops = maps.bytes();
+    ratio.seconds = tMaps;
+    ratio.value = (double)maps.bytes() / std::max<uint64_t>(1, columns.size());
+    results.push_back(ratio);
+    return true;
+  }
+
+  /*
+    uploadRounds runs the rounds of uploads as if the server took every batch
+  */
+  bool uploadRounds(energy::bx::uploadscheduler& uploads)
+  {
+    vector<energy::bx::uploadbatch> round;
+    bool ok = true;
+    while (ok && uploads.plan(round) && !round.empty())
+    {
+      for (auto& b : round)
+      {
+        b.sent = true;
+      }
+      ok = uploads.complete(round) || !uploads.backlog();
+    }
+    return ok;
+  }
+
+  /*
+    lateArchive checks that samples stored late with an older sampletime, as an import
+    writes them, are neither archived before the server has them nor lost, and that
+    they read back from the archive in sampletime order once they are archived
+  */
+  bool lateArchive(const options& opt)
+  {
+    string file = opt.dir + "/bench-late.sq3";
+    remove(file.c_str());
+    const int64_t day = 86400 * energy::bx::kTicksPerSecond;
+    int64_t start = (energy::bx::store::now() / day - 2) * day;
+    energy::bx::store s;
+    if (!s.open(file.c_str(), energy::bx::daily))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    energy::bx::uploadscheduler uploads(s);
+    auto samples = makeSamples(4000, start);
+    // the late ones fall between the samples of the first day, some into a day of their own
+    vector<energy::bx::sample> late;
+    for (size_t i = 0; i < 400; ++i)
+    {
+      energy::bx::sample x = samples[i * 10];
+      x.value = -100000 - (int)i;
+      x.sampletime += (i < 300) ? 500 : -day;
+      late.push_back(x);
+    }
+    energy::bx::archivestats stats;
+    bool ok = s.logDSPEvents(samples) && uploadRounds(uploads) && s.archiveUploaded(uploads.uploadedThrough(), 256, stats);
+    ok = ok && s.logDSPEvents(late) && s.archiveUploaded(uploads.uploadedThrough(), 256, stats);
+    size_t rows = 0;
+    energy::bx::samplecursor cursor;
+    ok = ok && s.readSamples(INT64_MIN, INT64_MAX, cursor, 10000, [&](const energy::bx::sample& x) { ++rows; });
+    if (!ok || (rows != late.size()))
+    {
+      cerr << "archive took samples the server doesn't have (" << rows << " of " << late.size() << " rows left)" << endl;
+      return false;
+    }
+    ok = uploadRounds(uploads) && s.archiveUploaded(uploads.uploadedThrough(), 256, stats);
+    samples.insert(samples.end(), late.begin(), late.end());
+    std::stable_sort(samples.begin(), samples.end(), [](const energy::bx::sample& a, const energy::bx::sample& b)
+    {
+      return (a.device != b.device) ? (a.device < b.device) : (a.entity != b.entity) ? (a.entity < b.entity) : (a.sampletime < b.sampletime);
+    });
+    vector<energy::bx::sample> restored;
+    for (int device = 1; ok && (device <= 4); ++device)
+    {
+      for (int entity = 100; ok && (entity < 140); ++entity)
+      {
+        ok = s.readArchive(device, entity, INT64_MIN, INT64_MAX, [&](const energy::bx::sample& x)
+        {
+          restored.push_back(x);
+          return true;
+        });
+      }
+    }
+    rows = 0;
+    cursor = energy::bx::samplecursor();
+    ok = ok && s.readSamples(INT64_MIN, INT64_MAX, cursor, 10000, [&](const energy::bx::sample& x) { ++rows; });
+    s.close();
+    remove(file.c_str());
+    bool same = ok && (rows == 0) && (restored.size() == samples.size());
+    for (size_t i = 0; same && (i < samples.size()); ++i)
+    {
+      // samples of the same time may come back in either order
+      same = (samples[i].device == restored[i].device) && (samples[i].entity == restored[i].entity)
+        && (samples[i].sampletime == restored[i].sampletime);
+    }
+    int64_t values = 0;
+    for (size_t i = 0; same && (i < samples.size()); ++i)
+    {
+      values += samples[i].value - restored[i].value;
+    }
+    if (!same || (values != 0))
+    {
+      cerr << "the archive of late samples isn't complete and in order (" << restored.size() << " of "
+        << samples.size() << ", " << rows << " rows left)" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+    the archive of uploaded samples: store.archive.rowscan reads CollectedData in
+    sampletime order as the uploads do, store.archive moves all rows into blocks,
+    store.archive.size is the estimated row bytes per block byte and store.archive.scan
+    reads the blocks back per (device, entity). The samples read back must be the ones
+    written, and CollectedData must be empty afterwards.
+  */
+  bool benchArchive(const options& opt, vector<result>& results)
+  {
+    if (!lateArchive(opt))
+    {
+      return false;
+    }
+    string file = opt.dir + "/bench-archive.sq3";
+    remove(file.c_str());
+    const size_t rows = opt.quick ? 20000 : 200000;
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    auto samples = makeSamples(rows, energy::bx::store::now());
+    s.logDSPEvents(samples);
+
+    vector<energy::bx::sample> scanned;
+    scanned.reserve(rows);
+    energy::bx::samplecursor cursor;
+    bool ok = true;
+    auto start = clock_type::now();
+    while (ok && !cursor.done)
+    {
+      ok = s.readSamples(INT64_MIN, INT64_MAX, cursor, 10000, [&](const energy::bx::sample& x) { scanned.push_back(x); });
+    }
+    double tRows = secondsSince(start);
+
+    energy::bx::archivestats stats;
+    start = clock_type::now();
+    ok = ok && s.archiveUploaded(s.lastSampleId(), 4096, stats);
+    double tArchive = secondsSince(start);
+
+    vector<energy::bx::sample> restored;
+    restored.reserve(rows);
+    start = clock_type::now();
+    for (int device = 1; ok && (device <= 4); ++device)
+    {
+      for (int entity = 100; ok && (entity < 140); ++entity)
+      {
+        ok = s.readArchive(device, entity, INT64_MIN, INT64_MAX, [&](const energy::bx::sample& x)
+        {
+          restored.push_back(x);
+          return true;
+        });
+      }
+    }
+    double tBlocks = secondsSince(start);
+    size_t left = 0;
+    cursor = energy::bx::samplecursor();
+    ok = ok && s.readSamples(INT64_MIN, INT64_MAX, cursor, 10, [&](const energy::bx::sample& x) { ++left; });
+    s.close();
+    remove(file.c_str());
+
+    // makeSamples is in sampletime order, per pair too
+    std::stable_sort(samples.begin(), samples.end(), [](const energy::bx::sample& a, const energy::bx::sample& b)
+    {
+      return (a.device != b.device) ? (a.device < b.device) : (a.entity < b.entity);
+    });
+    bool same = (restored.size() == samples.size()) && (scanned.size() == rows) && (left == 0) && (stats.rows == rows);
+    for (size_t i = 0; same && (i < samples.size()); ++i)
+    {
+      same = (samples[i].device == restored[i].device) && (samples[i].entity == restored[i].entity)
+        && (samples[i].value == restored[i].value) && (samples[i].sampletime == restored[i].sampletime);
+    }
+    if (!ok || !same)
+    {
+      cerr << "archive didn't restore the samples (" << restored.size() << " of " << rows << ", " << left << " rows left)" << endl;
+      return false;
+    }
+    result r;
+    r.name = "store.archive.rowscan";
+    r.unit = "samples/s";
+    r.ops = rows;
+    r.seconds = tRows;
+    r.value = rows / tRows;
+    results.push_back(r);
+    r.name = "store.archive";
+    r.ops = stats.rows;
+    r.seconds = tArchive;
+    r.value = stats.rows / tArchive;
+    results.push_back(r);
+    r.name = "store.archive.scan";
+    r.ops = restored.size();
+    r.seconds = tBlocks;
+    r.value = restored.size() / tBlocks;
+    results.push_back(r);
+    r.name = "store.archive.size";
+    r.unit = "x";
+    r.ops = stats.blockbytes;
+    r.seconds = tArchive;
+    r.value = stats.ratio();
+    results.push_back(r);
+    return true;
+  }
+
+  /*
+    capture rings: one producer pushes a 50 Hz waveform sampled at 1 kHz into the ring
+    of a channel with a threshold trigger, while a collector stores the frozen windows.
+    capture.push is the producer rate, capture.size raw bytes (time and value) per
+    stored byte. Every window is checked for gaps and read back from Captures.
+  */
+  bool benchCapture(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-capture.sq3";
+    remove(file.c_str());
+    const uint64_t pushes = opt.quick ? 2000000 : 20000000;
+    const int64_t t0 = energy::bx::store::now();
+    const int64_t step = 1000;     // 1 kHz in microseconds
+    auto wave = [](uint64_t i) { return (int)(2300 * sin(2 * 3.14159265358979 * (double)(i % 20) / 20.0)) + (int)(i % 7); };
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    // the producer alone
+    energy::bx::capturebuffer alone(200, 200);
+    energy::bx::capturering& fast = alone.add(7, 12);
+    fast.setThreshold(2000, true);
+    auto start = clock_type::now();
+    for (uint64_t i = 0; i < pushes; ++i)
+    {
+      fast.push(t0 + (int64_t)i * step, wave(i));
+    }
+    double t = secondsSince(start);
+
+    // with a collector, the producer gives way every 1000 samples like it would at 1 kHz
+    energy::bx::capturebuffer captures(200, 200);
+    energy::bx::capturering& ring = captures.add(7, 12);
+    ring.setThreshold(2000, true);
+    std::atomic<bool> done{ false };
+    size_t windows = 0;
+    size_t broken = 0;
+    bool stored = true;
+    std::thread collector([&]()
+    {
+      std::vector<energy::bx::capturewindow> frozen;
+      while (!done.load())
+      {
+        frozen.clear();
+        captures.collect(frozen);
+        for (const auto& w : frozen)
+        {
+          for (size_t i = 1; i < w.samples.size(); ++i)
+          {
+            uint64_t index = (uint64_t)((w.samples[i].sampletime - t0) / step);
+            broken += ((w.samples[i].sampletime - w.samples[i - 1].sampletime != step) || (w.samples[i].value != wave(index))) ? 1 : 0;
+          }
+          energy::bx::capturerecord c;
+          stored &= energy::bx::capturebuffer::pack(w, c, util::encodingAvailable(util::deflate) ? util::deflate : util::identity)
+            && s.saveCapture(c);
+          ++windows;
+        }
+        std::this_thread::yield();
+      }
+    });
+    for (uint64_t i = 0; i < pushes / 10; ++i)
+    {
+      ring.push(t0 + (int64_t)i * step, wave(i));
+      if (i % 1000 == 999)
+      {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+    done = true;
+    collector.join();
+
+    size_t bytes = 0;
+    size_t rows = 0;
+    size_t restored = 0;
+    energy::bx::capturewindow w;
+    s.readCaptures(7, 12, INT64_MIN, INT64_MAX, [&](const energy::bx::capturerecord& c)
+    {
+      bytes += c.data.size();
+      rows += (size_t)c.samples;
+      restored += energy::bx::capturebuffer::unpack(c, w) ? w.samples.size() : 0;
+      return true;
+    });
+    s.close();
+    remove(file.c_str());
+    if ((windows == 0) || (broken > 0) || !stored || (restored != rows))
+    {
+      cerr << "capture: " << windows << " windows, " << broken << " broken samples, " << restored << " of " << rows << " restored" << endl;
+      return false;
+    }
+    result r;
+    r.name = "capture.push";
+    r.unit = "samples/s";
+    r.ops = pushes;
+    r.seconds = t;
+    r.value = pushes / t;
+    results.push_back(r);
+    result ratio;
+    ratio.name = "capture.size";
+    ratio.unit = "x";
+    ratio.ops = windows;
+    ratio.seconds = t;
+    ratio.value = (double)(rows * (sizeof(int64_t) + sizeof(int32_t))) / std::max<size_t>(1, bytes);
+    results.push_back(ratio);
+    return true;
+  }
+
+#ifdef __linux__
+  /*
+    ingestion server with one event loop: clients stream CBOR sample maps over
+    Unix domain or TCP connections, the sink only counts. Besides messages per
+    second the loop thread's CPU time gives messages per core second.
+  */
+  bool benchIngestServer(const options& opt, bool tcp, vector<result>& results)
+  {
+    const int clients = 4;
+    const int messages = opt.quick ? 100000 : 1000000;
+    vector<uint8_t> stream;
+    cbor::encoder e([&](const uint8_t* mem, size_t len)
+    {
+      stream.insert(stream.end(), mem, mem + len);
+    });
+    auto samples = makeSamples(messages / clients, energy::bx::store::now());
+    for (auto& s : samples)
+    {
+      e.map(4);
+      e.int32(1);
+      e.int32(s.device);
+      e.int32(2);
+      e.int32(s.entity);
+      e.int32(3);
+      e.int32(s.value);
+      e.int32(4);
+      e.int64(s.sampletime);
+    }
+
+    std::atomic<uint64_t> received{ 0 };
+    std::atomic<int64_t> loopNanos{ 0 };
+    energy::bx::ingestserver server([&](const vector<energy::bx::sample>& batch)
+    {
+      timespec ts;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+      loopNanos = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+      received += batch.size();
+      return true;
+    });
+    string path = opt.dir + "/bench-ingest.sock";
+    bool listening = tcp ? server.listenTcp("127.0.0.1", 0) : server.listenUnix(path.c_str());
+    if (!listening || !server.start(1))
+    {
+      cerr << "can't start the ingest server" << endl;
+      return false;
+    }
+    int port = server.tcpPort();
+    auto connectTo = [&]() -> int
+    {
+      int fd = -1;
+      if (tcp)
+      {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if ((fd >= 0) && (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0))
+        {
+          close(fd);
+          fd = -1;
+        }
+      }
+      else
+      {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((fd >= 0) && (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0))
+        {
+          close(fd);
+          fd = -1;
+        }
+      }
+      return fd;
+    };
+
+    const uint64_t total = (uint64_t)samples.size() * clients;
+    auto start = clock_type::now();
+    vector<std::thread> senders;
+    for (int c = 0; c < clients; ++c)
+    {
+      senders.emplace_back([&]()
+      {
+        int fd = connectTo();
+        // writes of 4 KiB, like a DSP flushing its output buffer
+        for (size_t pos = 0; (fd >= 0) && (pos < stream.size());)
+        {
+          ssize_t n = write(fd, stream.data() + pos, std::min<size_t>(4096, stream.size() - pos));
+          if (n <= 0)
+          {
+            break;
+          }
+          pos += (size_t)n;
+        }
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+      });
+    }
+    for (auto& t : senders)
+    {
+      t.join();
+    }
+    while ((received.load() < total) && (secondsSince(start) < 30))
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    double t = secondsSince(start);
+    server.stop();
+    if (received.load() != total)
+    {
+      cerr << "ingest: received " << received.load() << " of " << total << " messages" << endl;
+      return false;
+    }
+    const char* name = tcp ? "ingest.tcp" : "ingest.unix";
+    result r;
+    r.name = name;
+    r.unit = "msgs/s";
+    r.ops = total;
+    r.seconds = t;
+    r.value = total / t;
+    results.push_back(r);
+    result core;
+    core.name = string(name) + ".core";
+    core.unit = "msgs/cpu-s";
+    core.ops = total;
+    core.seconds = loopNanos.load() / 1e9;
+    core.value = total / std::max(1e-9, core.seconds);
+    results.push_back(core);
+    return true;
+  }
+
+  /*
+    commands from the server: a local server streams command maps over TCP in bursts,
+    each with the time it was sent, the pieces read go through a commandfeed into the
+    store and a dispatcher takes them with runEvent. commands.feed is the rate and
+    the percentiles of commands.latency, sent to dispatched. The server sends 500
+    commands a second, below what a dispatcher with a commit per command takes, so
+    the latency is that of the path and not of a queue which grows.
+  */
+  bool benchCommandFeed(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-commands.sq3";
+    remove(file.c_str());
+    const size_t total = opt.quick ? 500 : 5000;
+    const size_t burst = 10;          // commands per write, then the server pauses 20 ms
+    auto& latency = util::metrics::registry::instance().getHistogram("commands.latency");
+    energy::bx::store s;
+    if (!s.open(file.c_str()))
+    {
+      cerr << "can't open " << file << endl;
+      return false;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if ((listener < 0) || (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0) || (listen(listener, 1) != 0)
+      || (getsockname(listener, (sockaddr*)&addr, &len) != 0))
+    {
+      cerr << "can't listen for the command server" << endl;
+      if (listener >= 0)
+      {
+        close(listener);
+      }
+      return false;
+    }
+    std::thread server([&]()
+    {
+      int fd = accept(listener, nullptr, nullptr);
+      vector<uint8_t> out;
+      cbor::encoder e([&](const uint8_t* mem, size_t n)
+      {
+        out.insert(out.end(), mem, mem + n);
+      });
+      for (size_t i = 0; (fd >= 0) && (i < total); i += burst)
+      {
+        out.clear();
+        for (size_t j = i; j < std::min(total, i + burst); ++j)
+        {
+          string text1 = "set " + to_string(j);
+          e.map(4);
+          e.int32(1);
+          e.int32(1 + (int)(j % 4));
+          e.int32(2);
+          e.string(text1.c_str(), text1.size(), true);
+          e.int32(3);
+          e.string("power", 5, true);
+          e.int32(4);
+          e.int64(energy::bx::store::now());
+        }
+        if (write(fd, out.data(), out.size()) != (ssize_t)out.size())
+        {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      }
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+    });
+
+    std::mutex lock;
+    std::condition_variable added;
+    bool done = false;
+    std::atomic<size_t> dispatched{ 0 };
+    std::thread dispatcher([&]()
+    {
+      while (true)
+      {
+        bool ran = s.runEvent([&](int device, const char* text1, const char* text2)
+        {
+          ++dispatched;
+          return true;
+        });
+        if (!ran)
+        {
+          std::unique_lock<std::mutex> l(lock);
+          if (done)
+          {
+            break;
+          }
+          added.wait_for(l, std::chrono::milliseconds(10));
+        }
+      }
+    });
+
+    std::unique_ptr<util::metrics::histogram::snapshot> before(new util::metrics::histogram::snapshot());
+    std::unique_ptr<util::metrics::histogram::snapshot> after(new util::metrics::histogram::snapshot());
+    latency.take(*before);
+    energy::bx::commandfeed feed([&](const vector<energy::bx::command>& batch)
+    {
+      bool ok = s.addCommands(batch);
+      added.notify_one();
+      return ok;
+    });
+    bool ok = true;
+    auto start = clock_type::now();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ok = (fd >= 0) && (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+    uint8_t buffer[4096];
+    ssize_t n;
+    while (ok && ((n = read(fd, buffer, sizeof(buffer))) > 0))
+    {
+      ok = feed.parse(buffer, (size_t)n);
+    }
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    server.join();
+    close(listener);
+    while ((dispatched.load() < feed.commands()) && (secondsSince(start) < 30))
+    {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    double t = secondsSince(start);
+    {
+      std::lock_guard<std::mutex> l(lock);
+      done = true;
+    }
+    added.notify_one();
+    dispatcher.join();
+    latency.take(*after);
+    after->subtract(*before);
+    s.close();
+    remove(file.c_str());
+    if (!ok || (feed.commands() != total) || (feed.invalid() != 0) || (dispatched.load() != total) || (after->count != total))
+    {
+      cerr << "commands: " << feed.commands() << " of " << total << " decoded (" << feed.invalid() << " invalid), "
+        << dispatched.load() << " dispatched, " << after->count << " in commands.latency" << endl;
+      return false;
+    }
+    result r;
+    r.name = "commands.feed";
+    r.unit = "commands/s";
+    r.ops = total;
+    r.seconds = t;
+    r.value = total / t;
+    // commands.latency is in microseconds
+    r.p50 = after->percentile(50) * 1000;
+    r.p99 = after->percentile(99) * 1000;
+    results.push_back(r);
+    return true;
+  }
+#endif
+
+#if SATAG_HTTPS
+  /*
+    tlsendpoint is a local HTTPS server for the upload client: a self-signed certificate
+    for 127.0.0.1, written to a file the client takes as its CA bundle, and a thread per
+    connection which answers every request with 200. It counts the connections and the
+    TLS handshakes it made.
+  */
+  class tlsendpoint
+  {
+  public:
+    ~tlsendpoint() { stop(); }
+    bool start(const string& certfile);
+    void stop();
+    int port() const { return mPort; }
+    int connections() const { return mConnections.load(); }
+    int handshakes() const { return mHandshakes.load(); }
+  private:
+    bool certify(const string& certfile);
+    void serve(int fd);
+    SSL_CTX* mContext = nullptr;
+    int mListen = -1;
+    int mPort = 0;
+    std::atomic<int> mConnections{ 0 };
+    std::atomic<int> mHandshakes{ 0 };
+    std::thread mAcceptor;
+    vector<std::thread> mServers;     // one per connection, started by mAcceptor
+  };
+
+  bool tlsendpoint::start(const string& certfile)
+  {
+    mContext = SSL_CTX_new(TLS_server_method());
+    if (!mContext || !certify(certfile))
+    {
+      return false;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    socklen_t len = sizeof(addr);
+    mListen = socket(AF_INET, SOCK_STREAM, 0);
+    if ((mListen < 0) || (bind(mListen, (sockaddr*)&addr, sizeof(addr)) != 0) || (listen(mListen, 16) != 0)
+      || (getsockname(mListen, (sockaddr*)&addr, &len) != 0))
+    {
+      return false;
+    }
+    mPort = ntohs(addr.sin_port);
+    mAcceptor = std::thread([this]()
+    {
+      int fd;
+      while ((fd = accept(mListen, nullptr, nullptr)) >= 0)
+      {
+        ++mConnections;
+        mServers.emplace_back(&tlsendpoint::serve, this, fd);
+      }
+    });
+    return true;
+  }
+
+  /*
+    stop ends the accept loop, the connections end when the client closes them
+  */
+  void tlsendpoint::stop()
+  {
+    if (mListen >= 0)
+    {
+      shutdown(mListen, SHUT_RDWR);
+      close(mListen);
+      mListen = -1;
+    }
+    if (mAcceptor.joinable())
+    {
+      mAcceptor.join();
+    }
+    for (auto& t : mServers)
+    {
+      t.join();
+    }
+    mServers.clear();
+    SSL_CTX_free(mContext);
+    mContext = nullptr;
+  }
+
+  // a P-256 key and a certificate for 127.0.0.1 which signs itself
+  bool tlsendpoint::certify(const string& certfile)
+  {
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    bool ok = kctx && (EVP_PKEY_keygen_init(kctx) > 0)
+      && (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) > 0)
+      && (EVP_PKEY_keygen(kctx, &key) > 0);
+    EVP_PKEY_CTX_free(kctx);
+    X509* cert = ok ? X509_new() : nullptr;
+    if (cert)
+    {
+      X509_set_version(cert, 2);
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+      X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+      X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+      X509_set_pubkey(cert, key);
+      X509_NAME* name = X509_get_subject_name(cert);
+      X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+      X509_set_issuer_name(cert, name);
+      X509V3_CTX v3;
+      X509V3_set_ctx_nodb(&v3);
+      X509V3_set_ctx(&v3, cert, cert, nullptr, nullptr, 0);
+      const std::pair<int, const char*> extensions[] =
+      {
+        { NID_basic_constraints, "critical,CA:TRUE" },
+        { NID_subject_alt_name, "IP:127.0.0.1,DNS:localhost" },
+      };
+      for (auto& x : extensions)
+      {
+        X509_EXTENSION* ext = X509V3_EXT_conf_nid(nullptr, &v3, x.first, x.second);
+        ok = ok && ext && X509_add_ext(cert, ext, -1);
+        X509_EXTENSION_free(ext);
+      }
+      ok = ok && (X509_sign(cert, key, EVP_sha256()) > 0)
+        && (SSL_CTX_use_certificate(mContext, cert) == 1) && (SSL_CTX_use_PrivateKey(mContext, key) == 1);
+      FILE* f = ok ? fopen(certfile.c_str(), "w") : nullptr;
+      ok = f && PEM_write_X509(f, cert);
+      if (f)
+      {
+        fclose(f);
+      }
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+  }
+
+  /*
+    serve runs one connection: HTTP/1.1 requests with a body of a Content-Length or
+    chunked, or none, each answered with 200 "ok" on the same connection
+  */
+  void tlsendpoint::serve(int fd)
+  {
+    timeval timeout = { 10, 0 };    // a client which hangs doesn't hang the benchmark
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    SSL* ssl = SSL_new(mContext);
+    SSL_set_fd(ssl, fd);
+    string in;
+    // more bytes of the request until in holds at least n
+    auto fill = [&](size_t n) -> bool
+    {
+      char buffer[16384];
+      while (in.size() < n)
+      {
+        int got = SSL_read(ssl, buffer, sizeof(buffer));
+        if (got <= 0)
+        {
+          return false;
+        }
+        in.append(buffer, (size_t)got);
+      }
+      return true;
+    };
+    // the next line of in without its CRLF, false at the end of the connection
+    auto line = [&](string& l) -> bool
+    {
+      size_t end;
+      while ((end = in.find("\r\n")) == string::npos)
+      {
+        if (!fill(in.size() + 1))
+        {
+          return false;
+        }
+      }
+      l = in.substr(0, end);
+      in.erase(0, end + 2);
+      return true;
+    };
+    bool open = (SSL_accept(ssl) == 1);
+    if (open)
+    {
+      ++mHandshakes;
+    }
+    while (open)
+    {
+      string l;
+      size_t length = 0;
+      bool chunked = false;
+      open = line(l) && !l.empty();
+      while (open && line(l) && !l.empty())
+      {
+        for (auto& c : l)
+        {
+          c = (char)tolower((unsigned char)c);
+        }
+        if (l.compare(0, 15, "content-length:") == 0)
+        {
+          length = (size_t)strtoull(l.c_str() + 15, nullptr, 10);
+        }
+        chunked = chunked || ((l.compare(0, 18, "transfer-encoding:") == 0) && (l.find("chunked") != string::npos));
+      }
+      if (open && chunked)
+      {
+        size_t chunk;
+        do
+        {
+          open = line(l);
+          chunk = open ? (size_t)strtoull(l.c_str(), nullptr, 16) : 0;
+          open = open && fill(chunk + 2);
+          if (open)
+          {
+            in.erase(0, chunk + 2);
+          }
+        } while (open && (chunk > 0));
+      }
+      else if (open)
+      {
+        open = fill(length);
+        in.erase(0, std::min(length, in.size()));
+      }
+      static const char response[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nok";
+      open = open && (SSL_write(ssl, response, sizeof(response) - 1) == (int)(sizeof(response) - 1));
+    }
+    SSL_free(ssl);
+    close(fd);
+  }
+
+  /*
+    the upload client against a local TLS endpoint: POSTs of 16 KiB one after the
+    other through one httpclient, with the time to the first byte of the response.
+    They must share one connection and one handshake, and every request must have its
+    TTFB in http.ttfb.
+  */
+  bool benchHttps(const options& opt, vector<result>& results)
+  {
+    auto& metrics = util::metrics::registry::instance();
+    auto& connects = metrics.getCounter("http.connects");
+    auto& handshakes = metrics.getCounter("http.handshakes");
+    auto& ttfb = metrics.getHistogram("http.ttfb");
+    string cert = opt.dir + "/bench-https.pem";
+    tlsendpoint server;
+    if (!server.start(cert))
+    {
+      cerr << "can't start the TLS endpoint" << endl;
+      return false;
+    }
+    const size_t requests = opt.quick ? 20 : 200;
+    string payload(16384, 'x');
+    uint64_t connectsBefore = connects.value();
+    uint64_t handshakesBefore = handshakes.value();
+    std::unique_ptr<util::metrics::histogram::snapshot> before(new util::metrics::histogram::snapshot());
+    std::unique_ptr<util::metrics::histogram::snapshot> after(new util::metrics::histogram::snapshot());
+    ttfb.take(*before);
+    bool ok = true;
+    double t = 0;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    {
+      util::httpsettings settings;
+      settings.caInfo = cert;
+      util::httpclient client(settings);
+      string url = "https://127.0.0.1:" + to_string(server.port()) + "/samples";
+      auto start = clock_type::now();
+      for (size_t i = 0; ok && (i < requests); ++i)
+      {
+        util::httprequest r;
+        r.url = url;
+        r.headers.push_back("Content-Type: application/octet-stream");
+        size_t pos = 0;
+        r.body = [&](uint8_t* dest, size_t len)
+        {
+          size_t n = std::min(len, payload.size() - pos);
+          memcpy(dest, payload.data() + pos, n);
+          pos += n;
+          return n;
+        };
+        vector<util::httprequest*> round = { &r };
+        client.perform(round);
+        ok = r.ok();
+        if (!ok)
+        {
+          cerr << "https request failed: " << r.error() << endl;
+        }
+      }
+      t = secondsSince(start);
+    }
+    server.stop();
+    curl_global_cleanup();
+    remove(cert.c_str());
+    ttfb.take(*after);
+    after->subtract(*before);
+    uint64_t newConnects = connects.value() - connectsBefore;
+    uint64_t newHandshakes = handshakes.value() - handshakesBefore;
+    if (ok && ((server.connections() != 1) || (server.handshakes() != 1) || (newConnects != 1) || (newHandshakes != 1)))
+    {
+      cerr << "https: " << requests << " requests took " << server.connections() << " connections and "
+        << server.handshakes() << " handshakes (http.connects " << newConnects << ", http.handshakes " << newHandshakes << ")" << endl;
+      ok = false;
+    }
+    if (ok && (after->count != requests))
+    {
+      cerr << "https: http.ttfb has " << after->count << " of " << requests << " requests" << endl;
+      ok = false;
+    }
+    if (!ok)
+    {
+      return false;
+    }
+    result r;
+    r.name = "http.tls";
+    r.unit = "requests/s";
+    r.ops = requests;
+    r.seconds = t;
+    r.value = requests / t;
+    r.p50 = after->percentile(50);
+    r.p99 = after->percentile(99);
+    results.push_back(r);
+    return true;
+  }
+#endif
+
+  /*
+    the upload scan pages through the samples which were not uploaded yet, in id order
+  */
+  bool benchUploadScan(const options& opt, vector<result>& results)
+  {
+    string file = opt.dir + "/bench-upload.sq3";
+    remove(file.c_str());
+    const size_t rows = opt.quick ? 20000 : 200000;
+    {
+      energy::bx::store s;
+      if (!s.open(file.c_str()))
+      {
+        cerr << "can't open " << file << endl;
+        return false;
+      }
+      auto samples = makeSamples(rows, energy::bx::store::now());
+      s.logDSPEvents(samples);
+      s.close();
+    }
+    util::db d(file.c_str(), SQLITE_OPEN_READONLY);
+    util::query page(d, "select id,device,entity,entityvalue,sampletime from CollectedData "
+      "where uploadtime=0 and id>?1 order by id limit ?2;");
+    uint64_t seen = 0;
+    int64_t checksum = 0;
+    auto start = clock_type::now();
+    int64_t last = 0;
+    size_t got = 0;
+    do
+    {
+      got = 0;
+      page.bind(1) = last;
+      page.bind(2) = 500;
+      page.run([&](util::query& row)
+      {
+        last = row[0];
+        checksum += (int)row[3];
+        ++got;
+      });
+      seen += got;
+    } while (got > 0);
+    double t = secondsSince(start);
+    page.finalize();
+    d.close();
+    remove(file.c_str());
+    if (seen != rows)
+    {
+      cerr << "upload scan saw " << seen << " of " << rows << " rows" << endl;
+      return false;
+    }
+    result r;
+    r.name = "store.uploadscan";
+    r.unit = "rows/s";
+    r.ops = seen;
+    r.seconds = t;
+    r.value = seen / t;
+    results.push_back(r);
+    return true;
+  }
+
+  // ----------------------------------------------------------------------------
+
+  void writeResults(cbor::listener& out, const options& opt, const vector<result>& results)
+  {
+    out.map(4);
+    key(out, "version");
+    out.int32(1);
+    key(out, "time");
+    out.int64(util::sampleclock::now());
+    key(out, "quick");
+    out.boolean(opt.quick);
+    key(out, "results");
+    out.array(results.size());
+    for (auto& r : results)
+    {
+      out.map(7);
+      key(out, "name");
+      key(out, r.name.c_str());
+      key(out, "unit");
+      key(out, r.unit.c_str());
+      key(out, "value");
+      out.float64(r.value);
+      key(out, "ops");
+      out.int64((int64_t)r.ops);
+      key(out, "seconds");
+      out.float64(r.seconds);
+      key(out, "p50ns");
+      out.int64((int64_t)r.p50);
+      key(out, "p99ns");
+      out.int64((int64_t)r.p99);
+    }
+  }
+
+  string toJson(const options& opt, const vector<result>& results)
+  {
+    char line[512];
+    string json = "{\n";
+    snprintf(line, sizeof(line), "  \"version\": 1,\n  \"time\": %lld,\n  \"quick\": %s,\n  \"results\": [\n",
+      (long long)util::sampleclock::now(), opt.quick ? "true" : "false");
+    json += line;
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+      auto& r = results[i];
+      snprintf(line, sizeof(line),
+        "    { \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f, \"ops\": %llu, \"seconds\": %.6f, \"p50ns\": %llu, \"p99ns\": %llu }%s\n",
+        r.name.c_str(), r.unit.c_str(), r.value, (unsigned long long)r.ops, r.seconds,
+        (unsigned long long)r.p50, (unsigned long long)r.p99, (i + 1 < results.size()) ? "," : "");
+      json += line;
+    }
+    json += "  ]\n}\n";
+    return json;
+  }
+
+  bool writeFile(const string& name, const void* mem, size_t len)
+  {
+    FILE* f = fopen(name.c_str(), "wb");
+    if (!f)
+    {
+      cerr << "can't write " << name << endl;
+      return false;
+    }
+    bool result = (fwrite(mem, 1, len, f) == len);
+    fclose(f);
+    return result;
+  }
+
+  bool selected(const options& opt, const char* name)
+  {
+    return opt.filter.empty() || (strstr(name, opt.filter.c_str()) != nullptr);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  options opt;
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (arg == "--quick")
+    {
+      opt.quick = true;
+    }
+    else if ((arg == "--filter") && (i + 1 < argc))
+    {
+      opt.filter = argv[++i];
+    }
+    else if ((arg == "--dir") && (i + 1 < argc))
+    {
+      opt.dir = argv[++i];
+    }
+    else if ((arg == "--json") && (i + 1 < argc))
+    {
+      opt.json = argv[++i];
+    }
+    else if ((arg == "--cbor") && (i + 1 < argc))
+    {
+      opt.cbor = argv[++i];
+    }
+    else
+    {
+      cerr << "usage: " << argv[0] << " [--quick] [--filter text] [--dir path] [--json file] [--cbor file]" << endl;
+      return 2;
+    }
+  }
+
+  vector<result> results;
+  bool ok = true;
+  if (selected(opt, "cbor.encode cbor.decode"))
+  {
+    ok &= benchCodec(opt, results);
+  }
+  for (size_t batch : { 1, 10, 100, 1000 })
+  {
+    if (selected(opt, ("store.ingest.batch" + to_string(batch)).c_str()))
+    {
+      ok &= benchIngest(opt, batch, results);
+    }
+  }
+  if (selected(opt, "store.rollup.late"))
+  {
+    ok &= benchRollup(opt, results);
+  }
+  if (selected(opt, "store.partitions"))
+  {
+    ok &= benchPartitions(opt, results);
+  }
+  if (selected(opt, "store.journal.batch1 store.journal.synced.batch1 store.journal.batch100 store.journal.apply store.journal.replay"))
+  {
+    ok &= benchJournal(opt, results);
+  }
+  if (selected(opt, "store.settings.batch store.settings.read"))
+  {
+    ok &= benchSettings(opt, results);
+  }
+  if (selected(opt, "store.runevent"))
+  {
+    ok &= benchRunEvent(opt, results);
+  }
+  if (selected(opt, "store.events store.events.read"))
+  {
+    ok &= benchEvents(opt, results);
+  }
+  if (selected(opt, "store.sharded"))
+  {
+    ok &= benchSharded(opt, results);
+  }
+  if (selected(opt, "store.uploadscan"))
+  {
+    ok &= benchUploadScan(opt, results);
+  }
+  if (selected(opt, "upload.stream"))
+  {
+    ok &= benchUploadStream(opt, results);
+  }
+  if (selected(opt, "upload.deflate1 upload.deflate6 upload.zstd3 upload.zstd3.dict"))
+  {
+    ok &= benchCompression(opt, results);
+  }
+  if (selected(opt, "upload.columnar upload.columnar.size"))
+  {
+    ok &= benchColumnar(opt, results);
+  }
+  if (selected(opt, "store.archive.rowscan store.archive store.archive.scan store.archive.size"))
+  {
+    ok &= benchArchive(opt, results);
+  }
+  if (selected(opt, "capture.push capture.size"))
+  {
+    ok &= benchCapture(opt, results);
+  }
+  if (selected(opt, "import.decode import.capture"))
+  {
+    ok &= benchImport(opt, results);
+  }
+#ifdef __linux__
+  if (selected(opt, "ingest.unix"))
+  {
+    ok &= benchIngestServer(opt, false, results);
+  }
+  if (selected(opt, "ingest.tcp"))
+  {
+    ok &= benchIngestServer(opt, true, results);
+  }
+  if (selected(opt, "commands.feed"))
+  {
+    ok &= benchCommandFeed(opt, results);
+  }
+#endif
+#if SATAG_HTTPS
+  if (selected(opt, "http.tls"))
+  {
+    ok &= benchHttps(opt, results);
+  }
+#endif
+#if SATAG_COROUTINES
+  if (selected(opt, "store.async"))
+  {
+    ok &= benchAsync(opt, results);
+  }
+#endif
+
+  for (auto& r : results)
+  {
+    char line[256];
+    snprintf(line, sizeof(line), "%-24s %14.1f %-12s %10llu ops %9.3f s", r.name.c_str(), r.value, r.unit.c_str(),
+      (unsigned long long)r.ops, r.seconds);
+    cout << line;
+    if (r.p50 || r.p99)
+    {
+      snprintf(line, sizeof(line), "  p50 %.1f us  p99 %.1f us", r.p50 / 1e3, r.p99 / 1e3);
+      cout << line;
+    }
+    cout << endl;
+  }
+
+  if (!opt.json.empty())
+  {
+    auto json = toJson(opt, results);
+    ok &= writeFile(opt.json, json.data(), json.size());
+  }
+  if (!opt.cbor.empty())
+  {
+    vector<uint8_t> out;
+    cbor::encoder e([&](const uint8_t* mem, size_t len)
+    {
+      out.insert(out.end(), mem, mem + len);
+    });
+    writeResults(e, opt, results);
+    ok &= writeFile(opt.cbor, out.data(), out.size());
+  }
+  return ok ? 0 : 1;
+}
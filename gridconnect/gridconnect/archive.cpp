@@ -0,0 +1,140 @@
+/*
+  archive
+
+  compact columnar blocks for samples which are already uploaded to the batterx grid
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "archive.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      void blockencoder::reset()
+      {
+        mTimes.clear();
+        mValues.clear();
+        mCount = 0;
+      }
+
+      void blockencoder::add(int64_t time, int value)
+      {
+        if (mCount == 0)
+        {
+          putVarint(mTimes, zigzag(time));
+          putVarint(mValues, zigzag(value));
+          mFirstTime = time;
+          mLastDelta = 0;
+        }
+        else
+        {
+          int64_t delta = time - mLastTime;
+          if (mCount == 1)
+          {
+            putVarint(mTimes, zigzag(delta));
+          }
+          else
+          {
+            putVarint(mTimes, zigzag(delta - mLastDelta));
+          }
+          putVarint(mValues, zigzag((int64_t)value - mLastValue));
+          mLastDelta = delta;
+        }
+        mLastTime = time;
+        mLastValue = value;
+        ++mCount;
+      }
+
+      /*
+        finish assembles header and columns, the result is valid until the next call
+      */
+      const std::vector<uint8_t>& blockencoder::finish()
+      {
+        mBlock.clear();
+        mBlock.reserve(mTimes.size() + mValues.size() + 12);
+        mBlock.push_back(kBlockVersion);
+        putVarint(mBlock, mCount);
+        putVarint(mBlock, mTimes.size());
+        mBlock.insert(mBlock.end(), mTimes.begin(), mTimes.end());
+        mBlock.insert(mBlock.end(), mValues.begin(), mValues.end());
+        return mBlock;
+      }
+
+      // ----------------------------------------------------------------------------
+
+      blockdecoder::blockdecoder(const uint8_t * mem, size_t len)
+      {
+        const uint8_t* end = mem + len;
+        uint64_t count = 0;
+        uint64_t valueoffset = 0;
+        if ((len > 0) && (*mem++ == kBlockVersion)
+          && getVarint(mem, end, count)
+          && getVarint(mem, end, valueoffset)
+          && (valueoffset <= (uint64_t)(end - mem)))
+        {
+          mTimes = mem;
+          mTimesEnd = mem + valueoffset;
+          mValues = mTimesEnd;
+          mValuesEnd = end;
+          mCount = (size_t)count;
+          mOk = true;
+        }
+      }
+
+      bool blockdecoder::next(int64_t & time, int & value)
+      {
+        uint64_t t = 0;
+        uint64_t v = 0;
+        if (!mOk || (mRead >= mCount))
+        {
+          return false;
+        }
+        if (!getVarint(mTimes, mTimesEnd, t) || !getVarint(mValues, mValuesEnd, v))
+        {
+          mOk = false;
+          return false;
+        }
+        if (mRead == 0)
+        {
+          mLastTime = unzigzag(t);
+          mLastValue = unzigzag(v);
+        }
+        else
+        {
+          int64_t delta = (mRead == 1) ? unzigzag(t) : mLastDelta + unzigzag(t);
+          mLastTime += delta;
+          mLastDelta = delta;
+          mLastValue += unzigzag(v);
+        }
+        ++mRead;
+        time = mLastTime;
+        value = (int)mLastValue;
+        return true;
+      }
+    }
+  }
+}
@@ -0,0 +1,163 @@
+/*
+  archive
+
+  compact columnar blocks for samples which are already uploaded to the batterx grid
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      /*
+        a block holds the samples of one (device, entity) pair in two columns:
+
+          version         1 byte, currently 1
+          count           varint, number of samples
+          valueoffset     varint, offset of the value column behind the header
+          times           t0, t1-t0, then delta-of-delta, all zigzag varints
+          values          v0, then deltas, all zigzag varints
+
+        regular sample intervals encode to one byte per timestamp, slowly changing
+        values to one or two bytes per value.
+      */
+      const uint8_t kBlockVersion = 1;
+
+      inline uint64_t zigzag(int64_t v)
+      {
+        return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+      }
+
+      inline int64_t unzigzag(uint64_t v)
+      {
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+      }
+
+      // append v as LEB128 varint
+      inline void putVarint(std::vector<uint8_t>& out, uint64_t v)
+      {
+        while (v >= 0x80)
+        {
+          out.push_back((uint8_t)(v | 0x80));
+          v >>= 7;
+        }
+        out.push_back((uint8_t)v);
+      }
+
+      // read a LEB128 varint, returns false on truncated or overlong input
+      inline bool getVarint(const uint8_t*& mem, const uint8_t* end, uint64_t& v)
+      {
+        v = 0;
+        for (int shift = 0; (shift < 64) && (mem < end); shift += 7)
+        {
+          uint8_t b = *mem++;
+          v |= (uint64_t)(b & 0x7f) << shift;
+          if (!(b & 0x80))
+          {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      /*
+        archivestats reports what an archiver run did. rowbytes is an estimate of the
+        space the rows took in CollectedData (record, cell and time index entry).
+      */
+      struct archivestats
+      {
+        size_t rows = 0;          // samples moved into blocks
+        size_t blocks = 0;        // blocks written
+        size_t rowbytes = 0;      // estimated bytes of the rows in the row format
+        size_t blockbytes = 0;    // bytes of the written blocks
+        double ratio() const { return blockbytes ? (double)rowbytes / (double)blockbytes : 0.0; }
+      };
+
+      /*
+        blockencoder collects the samples of one (device, entity) pair, which must be
+        added in sampletime order.
+
+          blockencoder e;
+          e.add(time, value);
+          ...
+          auto& data = e.finish();
+      */
+      class blockencoder
+      {
+      public:
+        void reset();
+        void add(int64_t time, int value);
+        size_t count() const { return mCount; }
+        int64_t firstTime() const { return mFirstTime; }
+        int64_t lastTime() const { return mLastTime; }
+        const std::vector<uint8_t>& finish();
+      private:
+        std::vector<uint8_t> mTimes;    // the time column
+        std::vector<uint8_t> mValues;   // the value column
+        std::vector<uint8_t> mBlock;    // the assembled block
+        size_t mCount = 0;
+        int64_t mFirstTime = 0;
+        int64_t mLastTime = 0;
+        int64_t mLastDelta = 0;
+        int64_t mLastValue = 0;
+      };
+
+      /*
+        blockdecoder streams the samples of a block without unpacking it first.
+
+          blockdecoder d(mem, len);
+          int64_t time;
+          int value;
+          while (d.next(time, value)) ...
+      */
+      class blockdecoder
+      {
+      public:
+        blockdecoder(const uint8_t* mem, size_t len);
+        bool ok() const { return mOk; }
+        size_t count() const { return mCount; }
+        bool next(int64_t& time, int& value);
+      private:
+        const uint8_t* mTimes = nullptr;    // read position in the time column
+        const uint8_t* mTimesEnd = nullptr;
+        const uint8_t* mValues = nullptr;   // read position in the value column
+        const uint8_t* mValuesEnd = nullptr;
+        size_t mCount = 0;
+        size_t mRead = 0;
+        int64_t mLastTime = 0;
+        int64_t mLastDelta = 0;
+        int64_t mLastValue = 0;
+        bool mOk = false;
+      };
+    }
+  }
+}
@@ -0,0 +1,272 @@
+/*
+  async
+
+  coroutine tasks and awaitable completions on top of the scheduler
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+// the coroutine API needs C++20, without it this header is empty
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define SATAG_COROUTINES 1
+#endif
+#endif
+#ifndef SATAG_COROUTINES
+#define SATAG_COROUTINES 0
+#endif
+
+#if SATAG_COROUTINES
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "scheduler.h"
+
+namespace satag
+{
+  namespace util
+  {
+    namespace internal
+    {
+      // resumes the coroutine on the executor, or right here if there is none
+      inline void resumeOn(scheduler* executor, std::coroutine_handle<> h)
+      {
+        if (!executor || !executor->submit([h]() { h.resume(); }))
+        {
+          h.resume();
+        }
+      }
+
+      // a finished task continues the coroutine which awaited it
+      struct finalawaiter
+      {
+        bool await_ready() noexcept { return false; }
+        template<class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+          auto next = h.promise().mContinuation;
+          return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+
+      struct promisebase
+      {
+        std::coroutine_handle<> mContinuation;   // the awaiting coroutine
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        finalawaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { std::terminate(); }   // the gateway doesn't use exceptions
+      };
+
+      template<class T> struct promisevalue : promisebase
+      {
+        T mValue{};
+        void return_value(T value) { mValue = std::move(value); }
+      };
+
+      template<> struct promisevalue<void> : promisebase
+      {
+        void return_void() {}
+      };
+
+      // the frame of a started flow frees itself when it is done
+      struct detached
+      {
+        struct promise_type
+        {
+          detached get_return_object() { return detached{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+          std::suspend_always initial_suspend() noexcept { return {}; }
+          std::suspend_never final_suspend() noexcept { return {}; }
+          void return_void() {}
+          void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> mHandle;
+      };
+    }
+
+    /*
+      task is the return type of an async flow. It starts when it is awaited and
+      continues the awaiting coroutine when it is done:
+
+        task<bool> send(shardedstore& s)
+        {
+          bool ok = co_await s.logDSPEventAsync(1, 2, 3);
+          co_return ok;
+        }
+    */
+    template<class T = void>
+    class task
+    {
+    public:
+      struct promise_type : internal::promisevalue<T>
+      {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+      };
+      typedef std::coroutine_handle<promise_type> handle;
+
+      task(task&& other) noexcept : mHandle(std::exchange(other.mHandle, {})) {}
+      task(const task&) = delete;
+      task& operator=(const task&) = delete;
+      ~task()
+      {
+        if (mHandle)
+        {
+          mHandle.destroy();
+        }
+      }
+      bool await_ready() const noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+      {
+        mHandle.promise().mContinuation = caller;
+        return mHandle;
+      }
+      T await_resume()
+      {
+        if constexpr (!std::is_void<T>::value)
+        {
+          return std::move(mHandle.promise().mValue);
+        }
+      }
+    private:
+      explicit task(handle h) : mHandle(h) {}
+      handle mHandle;
+    };
+
+    /*
+      completion is the awaitable of an operation which finishes on another thread,
+      e.g. the writer of a store. start gets the completion and has to call complete()
+      exactly once, from any thread. The awaiting coroutine continues on the scheduler
+      it was running on, or on the completing thread if it wasn't on one.
+
+      The completion lives in the frame of the awaiting coroutine, an operation in
+      flight costs that and whatever start queues.
+    */
+    template<class T>
+    class completion
+    {
+    public:
+      explicit completion(std::function<void(completion&)> start) : mStart(std::move(start)) {}
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h)
+      {
+        mHandle = h;
+        mExecutor = scheduler::current();
+        // the operation may complete (and resume) before start returns, *this isn't used after it
+        auto start = std::move(mStart);
+        start(*this);
+      }
+      T await_resume() { return std::move(mValue); }
+      void complete(T value)
+      {
+        mValue = std::move(value);
+        internal::resumeOn(mExecutor, mHandle);
+      }
+      scheduler* executor() const { return mExecutor; }
+    private:
+      std::function<void(completion&)> mStart;
+      std::coroutine_handle<> mHandle;
+      scheduler* mExecutor = nullptr;
+      T mValue{};
+    };
+
+    /*
+      co_await resumeOn(pool) continues the coroutine on a worker of pool
+    */
+    struct resumeOn
+    {
+      scheduler& mExecutor;
+      bool await_ready() const noexcept { return scheduler::current() == &mExecutor; }
+      void await_suspend(std::coroutine_handle<> h) { internal::resumeOn(&mExecutor, h); }
+      void await_resume() noexcept {}
+    };
+
+    namespace internal
+    {
+      inline detached runDetached(task<void> t)
+      {
+        co_await t;
+      }
+
+      template<class T> struct syncstate
+      {
+        std::mutex lock;
+        std::condition_variable done;
+        std::optional<typename std::conditional<std::is_void<T>::value, bool, T>::type> value;
+      };
+
+      template<class T> detached runSync(task<T>& t, syncstate<T>& state)
+      {
+        if constexpr (std::is_void<T>::value)
+        {
+          co_await t;
+          std::lock_guard<std::mutex> lock(state.lock);
+          state.value = true;
+          state.done.notify_all();
+        }
+        else
+        {
+          T value = co_await t;
+          std::lock_guard<std::mutex> lock(state.lock);
+          state.value = std::move(value);
+          state.done.notify_all();
+        }
+      }
+    }
+
+    /*
+      spawn starts a flow on a worker of pool, its frame is freed when it is done
+    */
+    inline void spawn(scheduler& pool, task<void> t)
+    {
+      auto d = internal::runDetached(std::move(t));
+      internal::resumeOn(&pool, d.mHandle);
+    }
+
+    /*
+      syncWait runs a flow on the calling thread until it suspends and blocks until
+      it is done, for code which isn't a coroutine itself
+    */
+    template<class T>
+    T syncWait(task<T> t)
+    {
+      internal::syncstate<T> state;
+      internal::runSync(t, state).mHandle.resume();
+      std::unique_lock<std::mutex> lock(state.lock);
+      state.done.wait(lock, [&state]() { return state.value.has_value(); });
+      if constexpr (!std::is_void<T>::value)
+      {
+        return std::move(*state.value);
+      }
+    }
+  }
+}
+
+#endif
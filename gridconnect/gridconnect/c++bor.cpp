@@ -27,6 +27,7 @@
 */
 
 #include "c++bor.h"
+#include "metrics.h"
 #include <cassert>
 #include <iostream>
 #include <cstring>
@@ -38,6 +39,10 @@ namespace satag
   namespace cbor
   {
 
+    // instrumentation, see metrics.h
+    static satag::util::metrics::counter& gDecodedBytes = satag::util::metrics::registry::instance().getCounter("cbor.decode.bytes");
+    static satag::util::metrics::counter& gDecodeErrors = satag::util::metrics::registry::instance().getCounter("cbor.decode.errors");
+
     namespace internal
     {
       float readHalfPrecisionBigEndian(uint8_t* mem)
@@ -56,7 +61,8 @@ namespace satag
       {
         uint32_t p;
         p = (mem[0] << 24) | (mem[1] << 16) | (mem[2] << 8) | (mem[3]);
-        float result = *(float*)(&p);
+        float result;
+        memcpy(&result, &p, sizeof(result));  // no pointer casts, they break strict aliasing
         return result;
       }
       double readDoublePrecisionBigEndian(uint8_t* mem)
@@ -69,7 +75,8 @@ namespace satag
         v = (v << 8) + (*mem++);
         v = (v << 8) + (*mem++);
         v = (v << 8) + (*mem++);
-        double result = *(double*)(&v);
+        double result;
+        memcpy(&result, &v, sizeof(result));
         return result;
       }
     }
@@ -88,6 +95,7 @@ namespace satag
     {
       mMem = mem;
       mBytesLeft = bytesleft;
+      gDecodedBytes.add(bytesleft);
 
       while (mBytesLeft > 0)
       {
@@ -159,49 +167,9 @@ namespace satag
             switch (mMajor)
             {
               case 0:
-                // if the value is larger than positive signed 32bitvalue
-                if (mValue > 0x7fffffff)
-                {
-                  if (mValue > 0x7fffffffffffffff)
-                  {
-
-                    mOut.int64p(mValue);
-                  }
-                  else
-                  {
-                    mOut.int64(mValue);
-                  }
-                }
-                else
-                {
-                  mOut.int32((int)mValue);
-                }
-                countItem();
-                break;
               case 1:
-                // if the value is larger than a positive signed 32bit value
-                if (mValue > 0x7fffffff)
-                {
-                  if (mValue > 0x7fffffffffffffff)
-                  {
-
-                    mOut.int64n(mValue + 1);
-                  }
-                  else
-                  {
-                    int64_t val = mValue;
-                    val = -(val + 1);
-                    mOut.int64(val);
-                  }
-                }
-                else
-                {
-                  int val = (int)mValue;
-                  val = -(val + 1);
-
-                  mOut.int32(val);
-                }
-                countItem();
+                mState = kSigma;
+                emitInteger(mValue);
                 break;
               case 2:
                 mLength = mValue;
@@ -227,7 +195,7 @@ namespace satag
                   else
                   {
                     // array is opened and will be closed on break item
-                    mStack.push_back(stackitem(mState, mLength));
+                    mStack.push_back(stackitem(kReadArray, mLength));
                     mOut.array(mLength);
                   }
                   // in the end, state is on the stack and needs continuing
@@ -247,19 +215,18 @@ namespace satag
                   }
                   else
                   {
-                    // array is opened and will be closed on break item
-                    mStack.push_back(stackitem(mState, mLength));
+                    // map is opened and will be closed on break item
+                    mStack.push_back(stackitem(kReadMap, mLength));
                     mOut.map(mLength);
-                    mMapKeyAhead = true;
                   }
                   // in the end, state is on the stack and needs continuing
                   mState = kSigma;
                 }
                 break;
               case 6:
-                if (mLength <= 0x7fffffff)
+                if (mValue <= 0x7fffffff)
                 {
-                  mOut.tag((int)mLength);
+                  mOut.tag((int)mValue);
                   mState = kSigma;
                 }
                 else
@@ -274,20 +241,25 @@ namespace satag
               if (available(mLength) && (mCollected == 0))
               {
                 // mOut.stringahead(mLength);
-                mOut.string((const char*)mMem, (size_t)mLength, true);
+                mState = kSigma;
+                mOut.string((const char*)mMem, (size_t)mLength, !mIndefiniteString);
                 skip((size_t)mLength);
                 countItem();
               }
               else
               {
                 // the rest of the bytes must be part of the buffer
-                auto rest = mLength-mCollected;
+                auto rest = mLength-mCollectedTotal;
                 if ( rest > mBytesLeft)
                 {
                   rest = mBytesLeft;
                 }
-                addToBuffer(mMem, rest);
-                skip(rest);
+                const uint8_t* mem = mMem;
+                skip((size_t)rest);
+                if (addToBuffer(mem, (size_t)rest))
+                {
+                  mState = kSigma;
+                }
               }
             }
             else
@@ -314,7 +286,8 @@ namespace satag
                 // announcement:
                 // mOut.bytesahead(mLength);
                 // full length
-                mOut.bytes(mMem, (size_t)mLength, true);
+                mState = kSigma;
+                mOut.bytes(mMem, (size_t)mLength, !mIndefiniteBytes);
                 // skip our input stream
                 skip((size_t)mLength);
                 countItem();
@@ -322,13 +295,17 @@ namespace satag
               else
               {
                 // the rest of the bytes must be part of the buffer
-                auto rest = mLength-mCollected;
+                auto rest = mLength-mCollectedTotal;
                 if ( rest > mBytesLeft)
                 {
                   rest = mBytesLeft;
                 }
-                addToBuffer(mMem, rest);
-                skip(rest);
+                const uint8_t* mem = mMem;
+                skip((size_t)rest);
+                if (addToBuffer(mem, (size_t)rest))
+                {
+                  mState = kSigma;
+                }
               }
             }
             else
@@ -392,11 +369,12 @@ namespace satag
             raiseError(stateerror); // stateerror
         }
       }
-      return (mErrorcode != none);
+      return (mErrorcode == none);
     }
 
     void decoder::raiseError(error err)
     {
+      gDecodeErrors.add();
       mErrorcode = err;
       mState = kError;
       mOut.onerror(err);
@@ -453,9 +431,7 @@ namespace satag
               {
                 if (available(4))
                 {
-                  int value = take4();
-                  mOut.int32(mMajor == 0 ? value : -(value + 1));
-                  countItem();
+                  emitInteger((uint32_t)take4());
                 }
                 else
                 {
@@ -468,16 +444,7 @@ namespace satag
               {
                 if (available(8))
                 {
-                  uint64_t value = take8();
-                  if (mMajor == 0)
-                  {
-                    mOut.int64p(value);
-                  }
-                  else
-                  {
-                    mOut.int64n(value + 1);
-                  }
-                  countItem();
+                  emitInteger(take8());
                 }
                 else
                 {
@@ -493,6 +460,53 @@ namespace satag
       }
     }
 
+    /*
+      emits a major 0/1 integer with its value in the smallest fitting type
+    */
+    void decoder::emitInteger(uint64_t value)
+    {
+      if (mMajor == 0)
+      {
+        if (value > 0x7fffffff)
+        {
+          if (value > 0x7fffffffffffffff)
+          {
+            mOut.int64p(value);
+          }
+          else
+          {
+            mOut.int64((int64_t)value);
+          }
+        }
+        else
+        {
+          mOut.int32((int)value);
+        }
+      }
+      else
+      {
+        if (value > 0x7fffffffffffffff)
+        {
+          // below INT64_MIN, passed as the magnitude
+          mOut.int64n(value + 1);
+        }
+        else
+        {
+          // -1 - value in 64 bits, 0x7fffffff still gives INT32_MIN
+          int64_t n = -1 - (int64_t)value;
+          if (n < INT32_MIN)
+          {
+            mOut.int64(n);
+          }
+          else
+          {
+            mOut.int32((int32_t)n);
+          }
+        }
+      }
+      countItem();
+    }
+
     void decoder::readStringOrByteItem(int minor)
     {
       int len = minor;
@@ -565,19 +579,26 @@ namespace satag
             break;
           default: // indefinite
             mLength = kIndefinite;
+            if (mIndefiniteString || mIndefiniteBytes)
+            {
+              raiseError((mMajor == 2) ? nestedindefbytes : nestedindefstring);
+              return;
+            }
             if (mMajor == 2)
             {
-              mState = kReadBinary;
+              mIndefiniteBytes = true;
               mOut.bytesahead(kIndefinite);
+              mStack.push_back(stackitem(kReadBinary, kIndefinite));
             }
             else  // must be 3!
             {
-              mState = kReadString;
+              mIndefiniteString = true;
               mOut.stringahead(kIndefinite);
+              mStack.push_back(stackitem(kReadString, kIndefinite));
             }
-            mStack.push_back(stackitem(kReadArray, kIndefinite));
-            // stack gets popped when a break (0xff) comes in
-            break;
+            // the chunks follow as definite strings, the stack gets popped when a break (0xff) comes in
+            mState = kSigma;
+            return;
         }
       }
       // if we haven't decided to go to the read length part of the statemachine, we might immediately check connect this
@@ -593,7 +614,7 @@ namespace satag
           }
           else
           {
-            mOut.string((const char*)mMem, (size_t)mLength, !mIndefiniteBytes);
+            mOut.string((const char*)mMem, (size_t)mLength, !mIndefiniteString);
           }
           skip((size_t)mLength);
           countItem();
@@ -610,6 +631,7 @@ namespace satag
     void decoder::readArray(int minor)
     {
       mLength = minor;
+      mValue = 0;
       if (minor < 24)
       {
         mOut.array(minor);
@@ -654,6 +676,7 @@ namespace satag
     void decoder::readMap(int minor)
     {
       mLength = minor;
+      mValue = 0;
       if (minor < 24)
       {
         mOut.map(minor);
@@ -665,7 +688,6 @@ namespace satag
         else
         {
           mStack.push_back(stackitem(kReadMap, mLength));
-          mMapKeyAhead = true;
         }
       }
       else
@@ -688,7 +710,6 @@ namespace satag
             mLength = kIndefinite;
             mStack.push_back(stackitem(kReadMap, mLength));
             mOut.map(mLength);
-            mMapKeyAhead = true;
             break;
           default:
             raiseError(illegalminor);
@@ -820,41 +841,51 @@ namespace satag
           // BREAK
           if (mStack.size() > 0)
           {
-            auto& o = mStack.back();
-            mState = o.mState;
-            switch (mState)
+            stackitem o = mStack.back();
+            if (o.numItems != kIndefinite)
+            {
+              raiseError(unexpectedbreak);
+              break;
+            }
+            switch (o.mState)
             {
               case kReadString:
               case kReadBinary:
-                assert(mIndefiniteString || mIndefiniteBytes);
-                flushBuffer();
-                mOut.breakend(true, mStack.size() == 1);
-                countItem();
+                mStack.pop_back();
+                // the last chunk is empty and complete
+                if (o.mState == kReadBinary)
+                {
+                  mOut.bytes(mBuffer, 0, true);
+                }
+                else
+                {
+                  mOut.string((const char*)mBuffer, 0, true);
+                }
                 mIndefiniteString = false;
                 mIndefiniteBytes = false;
-                mState = kSigma;
+                mOut.breakend(true, mStack.empty());
+                countItem();
                 break;
               case kReadArray:
-                mOut.breakend(true, mStack.size() == 1);
+                mStack.pop_back();
+                mOut.breakend(true, mStack.empty());
                 countItem();
-                mState = kSigma;
                 break;
               case kReadMap:
-                if (mMapKeyAhead)
+                if (!o.keyAhead)
                 {
                   raiseError(unevenmap);
                 }
                 else
                 {
-                  mOut.breakend(true, mStack.size() == 1);
+                  mStack.pop_back();
+                  mOut.breakend(true, mStack.empty());
                   countItem();
-                  mState = kSigma;
                 }
                 break;
               default:
                 raiseError(unexpectedbreak);
             }
-            mStack.pop_back();
           }
           else
           {
@@ -897,10 +928,10 @@ namespace satag
     {
       bool result = false;
 
-      // check, if the buffer exceeds
-      if (mCollected > 0)
+      while (len > 0)
       {
-        if (len + mCollected > mBufferLen)
+        // a full buffer goes out as a partial item
+        if (mCollected == mBufferLen)
         {
           if (mState == kReadBinary)
           {
@@ -912,33 +943,27 @@ namespace satag
           }
           mCollected = 0;
         }
-        // the buffer is clear now
+        size_t n = std::min(len, mBufferLen - mCollected);
+        memcpy(mBuffer + mCollected, mem, n);
+        mCollected += n;
+        mCollectedTotal += n;
+        mem += n;
+        len -= n;
       }
-
-      memcpy(mBuffer + mCollected, mem, len);
-      mCollected += len;
-      mCollectedTotal += len;
       assert(mCollectedTotal <= mLength);
       if (mCollectedTotal == mLength)
       {
         if (mState == kReadBinary)
         {
-          mOut.bytes(mBuffer, mCollected, !mIndefiniteString);
-          if (!mIndefiniteString)
-          {
-            countItem();
-          }
-          result = true;
+          mOut.bytes(mBuffer, mCollected, !mIndefiniteBytes);
         }
         else
         {
           mOut.string((const char*)mBuffer, mCollected, !mIndefiniteString);
-          if (!mIndefiniteBytes)
-          {
-            countItem();
-          }
-          result = true;
         }
+        // a chunk of an indefinite string counts for nothing, see countItem()
+        countItem();
+        result = true;
         mCollected = 0;
         mCollectedTotal = 0;
       }
@@ -983,10 +1008,10 @@ namespace satag
             }
             break;
           case kReadMap:
-            if (mMapKeyAhead)
+            if (o.keyAhead)
             {
               // the key doesn't count alone, a value must follow
-              mMapKeyAhead = false;
+              o.keyAhead = false;
             }
             else
             {
@@ -1004,13 +1029,13 @@ namespace satag
                 }
                 else
                 {
-                  mMapKeyAhead = true;
+                  o.keyAhead = true;
                 }
               }
               else
               {
                 // expecting another Key (or break)
-                mMapKeyAhead = true;
+                o.keyAhead = true;
               }
             }
             break;
@@ -1074,7 +1099,7 @@ namespace satag
       uint8_t major = (value < 0) ? 0x20 : 0x00;
       if (value < 0)
       {
-        value = -(value - 1);
+        value = -(value + 1);
       }
       if (value < 24)
       {
@@ -1128,9 +1153,10 @@ namespace satag
 
     void encoder::int64n(uint64_t value)
     {
+      // value is the magnitude as passed by the decoder, CBOR stores -1-n
       uint8_t mem[10];
       mem[0] = 0x20 | 27; // 001 11011
-      write8(mem + 1, value);
+      write8(mem + 1, value - 1);
       mOut(mem, 9);
     }
 
@@ -1203,7 +1229,7 @@ namespace satag
     void encoder::float32(float value)
     {
       uint32_t p;
-      *(float*)(&p) = value;
+      memcpy(&p, &value, sizeof(p));
       uint8_t mem[5];
       mem[0] = 0xfa;
       mem[1] = (p >> 24) & 0xff;
@@ -1216,9 +1242,9 @@ namespace satag
     void encoder::float64(double value)
     {
       uint64_t p;
-      *(double*)(&p) = value;
+      memcpy(&p, &value, sizeof(p));
       uint8_t mem[9];
-      mem[0] = 0xfa;
+      mem[0] = 0xfb;
       mem[1] = (p >> 56) & 0xff;
       mem[2] = (p >> 48) & 0xff;
       mem[3] = (p >> 40) & 0xff;
@@ -1264,7 +1290,7 @@ namespace satag
     void encoder::map(uint64_t nums)
     {
       uint8_t mem[10];
-      auto len = writeMajor(mem, 4, nums);
+      auto len = writeMajor(mem, 5, nums);
       mOut(mem, len);
     }
 
@@ -1275,7 +1301,7 @@ namespace satag
       {
         // begin indefinite
         mInDefiniteString = true;
-        mem[0] = 0x6f;
+        mem[0] = 0x7f;
         mOut(mem, 1);
       }
       else
@@ -1294,7 +1320,7 @@ namespace satag
       {
         // begin indefinite
         mInDefiniteBytes = true;
-        mem[0] = 0x4f;
+        mem[0] = 0x5f;
         mOut(mem, 1);
       }
       else
@@ -1331,7 +1357,7 @@ namespace satag
       major <<= 5;
       if (length == kIndefinite)
       {
-        mem[0] = major | 0xF;
+        mem[0] = major | 0x1F;
         return 1;
       }
       if (length < 24)
@@ -1372,5 +1398,263 @@ namespace satag
         }
       }
     }
+
+    // ----------------------------------------------------------------------------
+
+    /*
+      itemSize walks the heads only, strings are skipped by their length. levels keeps
+      the items still expected in the open definite containers, indefinite ones wait
+      for their break.
+    */
+    size_t itemSize(const uint8_t* mem, size_t len)
+    {
+      struct level
+      {
+        uint64_t left;          // items still to come, kIndefinite until the break
+      };
+      level levels[kMaxItemDepth];
+      size_t depth = 0;
+      size_t pos = 0;
+      for (;;)
+      {
+        if (pos >= len)
+        {
+          return 0;
+        }
+        uint8_t head = mem[pos++];
+        int major = head >> 5;
+        int minor = head & 0x1f;
+        bool complete = true;   // the item is complete with its head (and string bytes)
+        if (head == 0xff)
+        {
+          if ((depth == 0) || (levels[depth - 1].left != kIndefinite))
+          {
+            return kInvalidItem;
+          }
+          --depth;
+        }
+        else
+        {
+          uint64_t value = minor;
+          if ((minor >= 24) && (minor <= 27))
+          {
+            size_t n = (size_t)1 << (minor - 24);
+            if (len - pos < n)
+            {
+              return 0;
+            }
+            value = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+              value = (value << 8) | mem[pos++];
+            }
+          }
+          else if (minor == 31)
+          {
+            if ((major < 2) || (major > 5))
+            {
+              return kInvalidItem;
+            }
+            value = kIndefinite;
+          }
+          else if (minor > 27)
+          {
+            return kInvalidItem;
+          }
+          switch (major)
+          {
+            case 2:
+            case 3:
+            case 4:
+            case 5:
+              if (value == kIndefinite)
+              {
+                complete = false;
+              }
+              else if (major <= 3)
+              {
+                if (len - pos < value)
+                {
+                  return 0;
+                }
+                pos += (size_t)value;
+              }
+              else
+              {
+                if ((major == 5) && (value > (kIndefinite - 1) / 2))
+                {
+                  return kInvalidItem;
+                }
+                value *= (major == 5) ? 2 : 1;
+                complete = (value == 0);
+              }
+              if (!complete)
+              {
+                if (depth == kMaxItemDepth)
+                {
+                  return kInvalidItem;
+                }
+                levels[depth++].left = value;
+              }
+              break;
+            case 6:
+              complete = false;   // the tagged item follows
+              break;
+            default:
+              break;
+          }
+        }
+        // a complete item counts in its container, which may be complete then too
+        while (complete)
+        {
+          if (depth == 0)
+          {
+            return pos;
+          }
+          level& l = levels[depth - 1];
+          if (l.left == kIndefinite)
+          {
+            break;
+          }
+          if (--l.left == 0)
+          {
+            --depth;
+          }
+          else
+          {
+            break;
+          }
+        }
+      }
+    }
+
+    // ----------------------------------------------------------------------------
+
+    sequencewriter::sequencewriter(producer fun)
+      : mProducer(fun)
+      , mEncoder([this](const uint8_t* mem, size_t len) { emit(mem, len); })
+    {
+    }
+
+    void sequencewriter::emit(const uint8_t* mem, size_t len)
+    {
+      size_t n = std::min(len, mRoom);
+      if (n > 0)
+      {
+        memcpy(mDest, mem, n);
+        mDest += n;
+        mRoom -= n;
+      }
+      if (n < len)
+      {
+        mPending.insert(mPending.end(), mem + n, mem + len);
+      }
+    }
+
+    /*
+      read returns the number of bytes written to dest, 0 only at the end
+    */
+    size_t sequencewriter::read(uint8_t* dest, size_t len)
+    {
+      mDest = dest;
+      mRoom = len;
+      if (mPendingPos < mPending.size())
+      {
+        size_t n = std::min(len, mPending.size() - mPendingPos);
+        memcpy(mDest, mPending.data() + mPendingPos, n);
+        mDest += n;
+        mRoom -= n;
+        mPendingPos += n;
+      }
+      if (mPendingPos == mPending.size())
+      {
+        mPending.clear();
+        mPendingPos = 0;
+      }
+      while ((mRoom > 0) && !mEnded)
+      {
+        if (mProducer(mEncoder))
+        {
+          ++mItems;
+        }
+        else
+        {
+          mEnded = true;
+        }
+      }
+      size_t written = len - mRoom;
+      mDest = nullptr;
+      mRoom = 0;
+      mBytes += written;
+      return written;
+    }
+
+    // has the signature of a CURLOPT_READFUNCTION, self is the sequencewriter
+    size_t sequencewriter::curlRead(char* buffer, size_t size, size_t nitems, void* self)
+    {
+      return static_cast<sequencewriter*>(self)->read((uint8_t*)buffer, size * nitems);
+    }
+
+    // ----------------------------------------------------------------------------
+
+    /*
+      split hands the complete items at the start of mem to the consumer and returns
+      the bytes used, kInvalidItem after an error
+    */
+    size_t sequencereader::split(const uint8_t* mem, size_t len)
+    {
+      size_t used = 0;
+      while (used < len)
+      {
+        size_t n = itemSize(mem + used, len - used);
+        if (n == 0)
+        {
+          break;
+        }
+        if ((n == kInvalidItem) || !mConsumer(mem + used, n))
+        {
+          return kInvalidItem;
+        }
+        ++mItems;
+        used += n;
+      }
+      return used;
+    }
+
+    bool sequencereader::feed(const uint8_t* mem, size_t len)
+    {
+      if (mFailed)
+      {
+        return false;
+      }
+      if (!mBuffer.empty())
+      {
+        // the cut item is completed first, then the rest is split in place
+        mBuffer.insert(mBuffer.end(), mem, mem + len);
+        size_t n = itemSize(mBuffer.data(), mBuffer.size());
+        if (n == 0)
+        {
+          return true;
+        }
+        if ((n == kInvalidItem) || !mConsumer(mBuffer.data(), n))
+        {
+          mFailed = true;
+          return false;
+        }
+        ++mItems;
+        size_t fromInput = n - (mBuffer.size() - len);
+        mBuffer.clear();
+        mem += fromInput;
+        len -= fromInput;
+      }
+      size_t used = split(mem, len);
+      if (used == kInvalidItem)
+      {
+        mFailed = true;
+        return false;
+      }
+      mBuffer.assign(mem + used, mem + len);
+      return true;
+    }
   }
 }
@@ -26,6 +26,7 @@
 
 */
 
+#pragma once
 
 #include <cstdint>
 #include <cinttypes>
@@ -110,6 +111,7 @@ namespace satag
       {}
       state_t mState;
       uint64_t numItems;
+      bool keyAhead = true;           // maps: the next item is a key (first item of a pair)
     };
 
     const uint64_t kIndefinite = 0xffffffffffffffff;
@@ -138,7 +140,6 @@ namespace satag
       error mErrorcode = none;
       bool mIndefiniteString = false; // true, if chunks are being read for indefinite text string
       bool mIndefiniteBytes = false;  // true, if chunks are being read for indefinite byte string
-      bool mMapKeyAhead = false;      // true, if a MAP is being read and we are expecting a key (first item of a pair)
       const uint8_t* mMem = nullptr;  // pointer to the current position in the streaming block
       std::vector<stackitem> mStack;
       size_t mBufferLen = 0;          // size of the intermediate buffer
@@ -148,6 +149,7 @@ namespace satag
 
       void raiseError(error err);     // set state machine to an error, notify the event listener and store the error code
       void readPositiveOrNegativeInt(int minor);
+      void emitInteger(uint64_t value);
       void readStringOrByteItem(int minor);
       void readArray(int minor);
       void readMap(int minor);
@@ -275,5 +277,73 @@ namespace satag
       }
     };
 
+    /*
+      CBOR Sequences (RFC 8742) are items written one after another without an enclosing
+      array, the sender needs no count up front and the receiver can use every item as
+      soon as it is complete.
+
+      itemSize returns the size of the complete item at the start of mem, 0 if more
+      bytes are needed, or kInvalidItem if it isn't CBOR.
+    */
+    const size_t kInvalidItem = SIZE_MAX;
+    const size_t kMaxItemDepth = 256;     // nesting deeper than this is taken as invalid
+    size_t itemSize(const uint8_t* mem, size_t len);
+
+    /*
+      sequencewriter is the pulling end of a sequence: read() fills the buffer of the
+      transport, the producer is asked for the next item only while there is room and
+      returns false when there are no more. The bytes of an item which didn't fit are
+      kept for the next read(), so the memory used doesn't depend on the length of the
+      sequence.
+
+        sequencewriter w([&](encoder& e) { if (!next(row)) return false; e.int32(row.value); return true; });
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, sequencewriter::curlRead);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &w);
+    */
+    class sequencewriter
+    {
+    public:
+      typedef std::function<bool(encoder& out)> producer;
+      explicit sequencewriter(producer fun);
+      size_t read(uint8_t* dest, size_t len);
+      static size_t curlRead(char* buffer, size_t size, size_t nitems, void* self);
+      bool done() const { return mEnded && (mPendingPos == mPending.size()); }
+      uint64_t items() const { return mItems; }
+      uint64_t bytes() const { return mBytes; }
+    private:
+      void emit(const uint8_t* mem, size_t len);
+      producer mProducer;
+      encoder mEncoder;                 // writes to mDest, what doesn't fit to mPending
+      uint8_t* mDest = nullptr;         // the buffer being filled by read()
+      size_t mRoom = 0;                 // bytes left in mDest
+      std::vector<uint8_t> mPending;    // the rest of the last item
+      size_t mPendingPos = 0;           // bytes of mPending already read
+      bool mEnded = false;              // the producer has no more items
+      uint64_t mItems = 0;
+      uint64_t mBytes = 0;
+    };
+
+    /*
+      sequencereader splits a sequence arriving in pieces of any size into its items.
+      Complete items are handed to the consumer straight from the input, only the
+      start of an item which is cut by the end of a piece is copied.
+    */
+    class sequencereader
+    {
+    public:
+      typedef std::function<bool(const uint8_t* item, size_t len)> consumer;
+      explicit sequencereader(consumer fun) : mConsumer(fun) {}
+      // false if the input isn't CBOR or the consumer returned false
+      bool feed(const uint8_t* mem, size_t len);
+      size_t pending() const { return mBuffer.size(); }   // bytes of an incomplete item
+      uint64_t items() const { return mItems; }
+    private:
+      size_t split(const uint8_t* mem, size_t len);
+      consumer mConsumer;
+      std::vector<uint8_t> mBuffer;     // the incomplete item at the end of the last piece
+      bool mFailed = false;
+      uint64_t mItems = 0;
+    };
+
   }
 }
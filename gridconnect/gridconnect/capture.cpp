@@ -0,0 +1,308 @@
+/*
+  capture
+
+  ring buffers for high-frequency waveforms around grid events
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "capture.h"
+#include "columnar.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      using namespace satag::util;
+
+      static metrics::counter& gTriggers = metrics::registry::instance().getCounter("capture.triggers");
+      static metrics::counter& gMissed = metrics::registry::instance().getCounter("capture.missed");
+      static metrics::counter& gWindows = metrics::registry::instance().getCounter("capture.windows");
+      static metrics::counter& gDropped = metrics::registry::instance().getCounter("capture.dropped");
+      static metrics::counter& gBytes = metrics::registry::instance().getCounter("capture.bytes");
+
+      capturering::capturering(int device, int entity, size_t pre, size_t post)
+        : mDevice(device)
+        , mEntity(entity)
+        , mPre(pre)
+        , mPost(std::max<size_t>(post, 1))
+      {
+        // twice the window, rounded up to a power of two
+        uint64_t capacity = 2;
+        while (capacity < 2 * (mPre + mPost))
+        {
+          capacity <<= 1;
+        }
+        mMask = capacity - 1;
+        mTimes.reset(new std::atomic<int64_t>[capacity]);
+        mValues.reset(new std::atomic<int32_t>[capacity]);
+        for (uint64_t i = 0; i < capacity; ++i)
+        {
+          mTimes[i].store(0, std::memory_order_relaxed);
+          mValues[i].store(0, std::memory_order_relaxed);
+        }
+      }
+
+      /*
+        setThreshold lets the producer trigger when the value crosses level upwards
+        (rising) or downwards. It is set before the producer starts.
+      */
+      void capturering::setThreshold(int level, bool rising)
+      {
+        mThreshold = true;
+        mLevel = level;
+        mRising = rising;
+      }
+
+      /*
+        trigger freezes the window around the next sample, from any thread. It is false
+        while the window of an earlier trigger wasn't taken yet.
+      */
+      bool capturering::trigger()
+      {
+        return arm(mHead.load(std::memory_order_acquire));
+      }
+
+      bool capturering::arm(uint64_t index)
+      {
+        uint64_t idle = kIdle;
+        if (mTrigger.compare_exchange_strong(idle, index, std::memory_order_acq_rel))
+        {
+          gTriggers.add();
+          return true;
+        }
+        gMissed.add();
+        return false;
+      }
+
+      /*
+        take copies the frozen window once its post samples are in and arms the ring
+        again. The part the producer overwrote during the copy is cut off the front.
+      */
+      bool capturering::take(capturewindow& w)
+      {
+        uint64_t t = mTrigger.load(std::memory_order_acquire);
+        if (t == kIdle)
+        {
+          return false;
+        }
+        uint64_t head = mHead.load(std::memory_order_acquire);
+        if (head < t + mPost)
+        {
+          return false;
+        }
+        const uint64_t capacity = mMask + 1;
+        uint64_t first = (t > mPre) ? t - mPre : 0;
+        uint64_t end = t + mPost;
+        if ((head > capacity) && (first < head - capacity))
+        {
+          first = head - capacity;
+        }
+        if (first >= end)
+        {
+          // overwritten as a whole
+          gDropped.add(end - ((t > mPre) ? t - mPre : 0));
+          mTrigger.store(kIdle, std::memory_order_release);
+          return false;
+        }
+        w.device = mDevice;
+        w.entity = mEntity;
+        w.samples.clear();
+        w.samples.reserve((size_t)(end - first));
+        sample s;
+        s.device = mDevice;
+        s.entity = mEntity;
+        for (uint64_t i = first; i < end; ++i)
+        {
+          s.sampletime = mTimes[i & mMask].load(std::memory_order_relaxed);
+          s.value = mValues[i & mMask].load(std::memory_order_relaxed);
+          w.samples.push_back(s);
+        }
+        // the slots of index i are only being written once the head has reached i + capacity
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = mHead.load(std::memory_order_relaxed);
+        uint64_t valid = (after + 1 > capacity) ? after + 1 - capacity : 0;
+        if (valid > first)
+        {
+          size_t lost = (size_t)std::min<uint64_t>(valid - first, w.samples.size());
+          w.samples.erase(w.samples.begin(), w.samples.begin() + lost);
+          gDropped.add(lost);
+          first += lost;
+        }
+        w.triggertime = w.samples.empty() ? 0 : w.samples[(size_t)((t >= first) ? t - first : 0)].sampletime;
+        mTrigger.store(kIdle, std::memory_order_release);
+        return !w.samples.empty();
+      }
+
+      // ----------------------------------------------------------------------------
+
+      capturebuffer::capturebuffer(size_t pre, size_t post)
+        : mPre(pre)
+        , mPost(post)
+      {
+      }
+
+      capturering& capturebuffer::add(int device, int entity)
+      {
+        capturering* r = find(device, entity);
+        if (!r)
+        {
+          mRings.emplace_back(new capturering(device, entity, mPre, mPost));
+          r = mRings.back().get();
+        }
+        return *r;
+      }
+
+      capturering* capturebuffer::find(int device, int entity)
+      {
+        for (auto& r : mRings)
+        {
+          if ((r->device() == device) && (r->entity() == entity))
+          {
+            return r.get();
+          }
+        }
+        return nullptr;
+      }
+
+      void capturebuffer::triggerAll()
+      {
+        for (auto& r : mRings)
+        {
+          r->trigger();
+        }
+      }
+
+      /*
+        collect appends the windows which are complete, it is called from one thread
+      */
+      size_t capturebuffer::collect(std::vector<capturewindow>& out)
+      {
+        size_t n = 0;
+        capturewindow w;
+        for (auto& r : mRings)
+        {
+          if (r->take(w))
+          {
+            out.push_back(std::move(w));
+            w = capturewindow();
+            ++n;
+          }
+        }
+        return n;
+      }
+
+      /*
+        persist stores the complete windows, one row of Captures each
+      */
+      bool capturebuffer::persist(store& s, size_t* windows)
+      {
+        contentencoding encoding = encodingAvailable(deflate) ? deflate : identity;
+        mWindows.clear();
+        collect(mWindows);
+        bool result = true;
+        for (const auto& w : mWindows)
+        {
+          capturerecord c;
+          bool ok = pack(w, c, encoding) && s.saveCapture(c);
+          if (ok)
+          {
+            gWindows.add();
+            gBytes.add(c.data.size());
+          }
+          result &= ok;
+        }
+        if (windows)
+        {
+          *windows = mWindows.size();
+        }
+        return result;
+      }
+
+      /*
+        pack encodes a window as a columnar batch of one series and compresses it
+      */
+      bool capturebuffer::pack(const capturewindow& w, capturerecord& c, contentencoding encoding)
+      {
+        if (w.samples.empty())
+        {
+          return false;
+        }
+        std::vector<uint8_t> batch;
+        cbor::encoder out([&batch](const uint8_t* mem, size_t len) { batch.insert(batch.end(), mem, mem + len); });
+        columnarencoder columns;
+        columns.encode(out, w.samples.data(), w.samples.size());
+
+        size_t pos = 0;
+        compressingreader z([&](uint8_t* dest, size_t len)
+        {
+          size_t n = std::min(len, batch.size() - pos);
+          std::copy(batch.begin() + pos, batch.begin() + pos + n, dest);
+          pos += n;
+          return n;
+        }, encoding);
+        c.data.clear();
+        uint8_t buffer[16384];
+        size_t n;
+        while ((n = z.read(buffer, sizeof(buffer))) > 0)
+        {
+          c.data.insert(c.data.end(), buffer, buffer + n);
+        }
+        c.device = w.device;
+        c.entity = w.entity;
+        c.triggertime = w.triggertime;
+        c.starttime = w.samples.front().sampletime;
+        c.endtime = w.samples.back().sampletime;
+        c.samples = (int64_t)w.samples.size();
+        c.encoding = encodingName(encoding);
+        return !z.failed();
+      }
+
+      /*
+        unpack is the reverse of pack, e.g. for a row read with store::readCaptures
+      */
+      bool capturebuffer::unpack(const capturerecord& c, capturewindow& w)
+      {
+        contentencoding encoding;
+        if (!parseEncoding(c.encoding.c_str(), encoding))
+        {
+          return false;
+        }
+        w.device = c.device;
+        w.entity = c.entity;
+        w.triggertime = c.triggertime;
+        w.samples.clear();
+        columnarreader reader(w.samples);
+        cbor::decoder d(reader, 256);
+        decompressor z(encoding, [&d](const uint8_t* mem, size_t len) { return d.parse(mem, len); });
+        return z.feed(c.data.data(), c.data.size()) && d.ok() && (reader.batches() == 1) && (reader.invalid() == 0)
+          && (w.samples.size() == (size_t)c.samples);
+      }
+    }
+  }
+}
@@ -0,0 +1,154 @@
+/*
+  capture
+
+  ring buffers for high-frequency waveforms around grid events
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "storage.h"
+#include "compress.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      /*
+        a capturewindow is a frozen waveform: the samples of one channel before and
+        after a trigger, in time order
+      */
+      struct capturewindow
+      {
+        int device = 0;
+        int entity = 0;
+        int64_t triggertime = 0;        // time of the first sample after the trigger
+        std::vector<sample> samples;
+      };
+
+      /*
+        capturering keeps the last samples of one (device, entity) channel, e.g. a
+        kHz waveform of the DSP, in a ring of fixed size. push() is for one producer
+        thread and costs two relaxed stores and a release store, there is no lock and
+        no allocation. A trigger freezes the window of pre samples before and post
+        samples after it, the collector takes it with take() once the post samples
+        are in, and the ring is armed again.
+
+          capturering& ring = captures.add(7, 12);
+          ring.setThreshold(-2300, false);    // trigger when the value falls to -2300
+          ...
+          ring.push(time, value);             // the producer, at the sampling rate
+
+        The ring holds twice the window, so the producer keeps writing while the
+        collector copies. A collector slower than that loses the overwritten part
+        (capture.dropped), the copy is checked against the producer position after
+        it was made, the way a seqlock is read.
+      */
+      class capturering
+      {
+      public:
+        static const uint64_t kIdle = UINT64_MAX;   // no trigger pending
+
+        capturering(int device, int entity, size_t pre, size_t post);
+        capturering(const capturering&) = delete;
+        capturering& operator=(const capturering&) = delete;
+        int device() const { return mDevice; }
+        int entity() const { return mEntity; }
+        size_t capacity() const { return (size_t)mMask + 1; }
+        uint64_t written() const { return mHead.load(std::memory_order_acquire); }
+        void setThreshold(int level, bool rising);
+        void push(int64_t time, int value)
+        {
+          uint64_t h = mHead.load(std::memory_order_relaxed);
+          // a collector which sees this write sees the position before it, too
+          std::atomic_thread_fence(std::memory_order_release);
+          mTimes[h & mMask].store(time, std::memory_order_relaxed);
+          mValues[h & mMask].store(value, std::memory_order_relaxed);
+          mHead.store(h + 1, std::memory_order_release);
+          if (mThreshold && (h > 0) && (mRising ? ((mLast < mLevel) && (value >= mLevel)) : ((mLast > mLevel) && (value <= mLevel))))
+          {
+            arm(h);
+          }
+          mLast = value;
+        }
+        bool trigger();
+        bool take(capturewindow& w);
+      private:
+        bool arm(uint64_t index);
+        int mDevice;
+        int mEntity;
+        uint64_t mPre;                  // samples before the trigger
+        uint64_t mPost;                 // samples from the trigger on
+        uint64_t mMask;                 // capacity - 1, a power of two
+        std::unique_ptr<std::atomic<int64_t>[]> mTimes;
+        std::unique_ptr<std::atomic<int32_t>[]> mValues;
+        std::atomic<uint64_t> mHead{ 0 };         // samples pushed so far
+        std::atomic<uint64_t> mTrigger{ kIdle };  // index of the first sample after the trigger
+        bool mThreshold = false;        // the producer triggers on the level
+        bool mRising = true;            // ... when it is crossed upwards, or downwards
+        int mLevel = 0;
+        int mLast = 0;                  // the previous value, of the producer
+      };
+
+      /*
+        capturebuffer holds the rings of all channels and turns their frozen windows
+        into rows of Captures: each window is a columnar batch of one series (see
+        columnar.h), compressed with deflate if it is compiled in.
+
+          capturebuffer captures(2000, 2000);  // 2 s before and after at 1 kHz
+          capturering& u1 = captures.add(7, 12);
+          ...
+          captures.triggerAll();               // e.g. on a grid event from the server
+          pool.every(std::chrono::seconds(1), [&]() { captures.persist(store); });
+
+        add() is called before the producers start, the rings don't move afterwards.
+      */
+      class capturebuffer
+      {
+      public:
+        capturebuffer(size_t pre, size_t post);
+        capturering& add(int device, int entity);
+        capturering* find(int device, int entity);
+        size_t channels() const { return mRings.size(); }
+        void triggerAll();
+        size_t collect(std::vector<capturewindow>& out);
+        bool persist(store& s, size_t* windows = nullptr);
+        static bool pack(const capturewindow& w, capturerecord& c, util::contentencoding encoding);
+        static bool unpack(const capturerecord& c, capturewindow& w);
+      private:
+        size_t mPre;
+        size_t mPost;
+        std::vector<std::unique_ptr<capturering>> mRings;
+        std::vector<capturewindow> mWindows;  // reused by persist
+      };
+    }
+  }
+}
@@ -0,0 +1,374 @@
+/*
+  columnar
+
+  columnar upload batches with typed arrays (RFC 8746)
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "columnar.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      void columnarencoder::encode(cbor::listener& out, const sample* samples, size_t count)
+      {
+        // stable, the rows of a series stay in upload (sampletime) order
+        auto before = [samples](uint32_t a, uint32_t b)
+        {
+          const sample& sa = samples[a];
+          const sample& sb = samples[b];
+          return (sa.device != sb.device) ? (sa.device < sb.device) : (sa.entity < sb.entity);
+        };
+        auto same = [samples](uint32_t a, uint32_t b)
+        {
+          return (samples[a].device == samples[b].device) && (samples[a].entity == samples[b].entity);
+        };
+        mOrder.resize(count);
+        std::iota(mOrder.begin(), mOrder.end(), 0);
+        std::stable_sort(mOrder.begin(), mOrder.end(), before);
+        size_t series = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+          series += ((i == 0) || !same(mOrder[i - 1], mOrder[i])) ? 1 : 0;
+        }
+
+        out.array(series);
+        for (size_t i = 0; i < count;)
+        {
+          const sample& first = samples[mOrder[i]];
+          size_t j = i + 1;
+          while ((j < count) && same(mOrder[i], mOrder[j]))
+          {
+            ++j;
+          }
+          int64_t step = (j > i + 1) ? samples[mOrder[i + 1]].sampletime - first.sampletime : 0;
+          int64_t t = first.sampletime - step;
+          int64_t v = 0;
+          mTimes.clear();
+          mValues.clear();
+          for (size_t k = i; k < j; ++k)
+          {
+            const sample& s = samples[mOrder[k]];
+            mTimes.push_back(s.sampletime - t - step);
+            mValues.push_back((int64_t)s.value - v);
+            t = s.sampletime;
+            v = s.value;
+          }
+          out.array(6);
+          out.int32(first.device);
+          out.int32(first.entity);
+          out.int64(first.sampletime);
+          out.int64(step);
+          column(out, mTimes);
+          column(out, mValues);
+          i = j;
+        }
+      }
+
+      /*
+        column writes a typed array of the narrowest signed width, little endian
+        whatever the host is
+      */
+      void columnarencoder::column(cbor::listener& out, const std::vector<int64_t>& values)
+      {
+        int64_t low = 0;
+        int64_t high = 0;
+        for (int64_t v : values)
+        {
+          low = std::min(low, v);
+          high = std::max(high, v);
+        }
+        size_t width = 8;
+        uint64_t tag = kTagSint64LE;
+        if ((low >= INT8_MIN) && (high <= INT8_MAX))
+        {
+          width = 1;
+          tag = kTagSint8;
+        }
+        else if ((low >= INT16_MIN) && (high <= INT16_MAX))
+        {
+          width = 2;
+          tag = kTagSint16LE;
+        }
+        else if ((low >= INT32_MIN) && (high <= INT32_MAX))
+        {
+          width = 4;
+          tag = kTagSint32LE;
+        }
+        mBytes.resize(values.size() * width);
+        uint8_t* p = mBytes.data();
+        for (int64_t v : values)
+        {
+          uint64_t u = (uint64_t)v;
+          for (size_t b = 0; b < width; ++b)
+          {
+            *p++ = (uint8_t)(u >> (8 * b));
+          }
+        }
+        out.tag(tag);
+        out.bytes(mBytes.data(), mBytes.size(), true);
+      }
+
+      // ----------------------------------------------------------------------------
+
+      void columnarreader::array(uint64_t nums)
+      {
+        mTag = 0;
+        if (mSkip > 0)
+        {
+          ++mSkip;
+        }
+        else if (mDepth < 2)
+        {
+          if (++mDepth == 2)
+          {
+            mField = kDevice;
+            mBad = false;
+            mTimes.clear();
+            mValues.clear();
+          }
+        }
+        else
+        {
+          // a nested array isn't part of a series
+          mBad = true;
+          mSkip = 1;
+        }
+      }
+
+      void columnarreader::map(uint64_t nums)
+      {
+        mTag = 0;
+        if (mSkip == 0)
+        {
+          other();
+        }
+        ++mSkip;
+      }
+
+      void columnarreader::breakend(bool wasIndefinite, bool stackempty)
+      {
+        if (mChunked)
+        {
+          mChunked = false;   // the end of an indefinite byte string, the column is done
+        }
+        else if (mSkip > 0)
+        {
+          --mSkip;
+        }
+        else if (mDepth == 2)
+        {
+          finishSeries();
+          mDepth = 1;
+        }
+        else if (mDepth == 1)
+        {
+          mDepth = 0;
+          ++mBatches;
+        }
+      }
+
+      void columnarreader::scalar(int64_t value)
+      {
+        if (mSkip > 0)
+        {
+          return;
+        }
+        if ((mDepth == 2) && (mField < kTimes))
+        {
+          mSeries[mField++] = value;
+          mTag = 0;
+          return;
+        }
+        other();
+      }
+
+      /*
+        something unexpected: at the top or in a batch it is an invalid item of its own,
+        in a series it spoils the series
+      */
+      void columnarreader::other()
+      {
+        mTag = 0;
+        if (mSkip > 0)
+        {
+          return;
+        }
+        if (mDepth == 2)
+        {
+          mBad = true;
+          ++mField;
+        }
+        else
+        {
+          ++mInvalid;
+        }
+      }
+
+      void columnarreader::bytesahead(uint64_t len)
+      {
+        if ((mSkip > 0) || (mDepth != 2) || ((mField != kTimes) && (mField != kValues)))
+        {
+          if (len == cbor::kIndefinite)
+          {
+            if (mSkip == 0)
+            {
+              other();
+            }
+            ++mSkip;    // the chunks end with a break
+          }
+          return;
+        }
+        mColumnTag = mTag;
+        mTag = 0;
+        mBytes.clear();
+        mCollecting = true;
+        mChunked = (len == cbor::kIndefinite);
+      }
+
+      void columnarreader::bytes(const uint8_t* mem, size_t len, bool complete)
+      {
+        bool wanted = (mSkip == 0) && (mDepth == 2) && ((mField == kTimes) || (mField == kValues));
+        if (!mCollecting && !wanted)
+        {
+          if (complete && (mSkip == 0))
+          {
+            other();
+          }
+          return;
+        }
+        if (!mCollecting)
+        {
+          // short byte strings come in one piece without an announcement
+          mColumnTag = mTag;
+          mTag = 0;
+          mBytes.clear();
+          mCollecting = true;
+        }
+        mBytes.insert(mBytes.end(), mem, mem + len);
+        if (complete)
+        {
+          mCollecting = false;
+          if (!column((mField == kTimes) ? mTimes : mValues))
+          {
+            mBad = true;
+          }
+          ++mField;
+        }
+      }
+
+      /*
+        column reads the collected typed array, the unsigned ones are taken as well
+      */
+      bool columnarreader::column(std::vector<int64_t>& out)
+      {
+        size_t width = 0;
+        bool sign = true;
+        switch (mColumnTag)
+        {
+          case kTagSint8:
+            width = 1;
+            break;
+          case kTagSint16LE:
+            width = 2;
+            break;
+          case kTagSint32LE:
+            width = 4;
+            break;
+          case kTagSint64LE:
+            width = 8;
+            break;
+          case 64:    // uint8
+            width = 1;
+            sign = false;
+            break;
+          case 69:    // uint16 little endian
+            width = 2;
+            sign = false;
+            break;
+          case 70:    // uint32 little endian
+            width = 4;
+            sign = false;
+            break;
+          case 71:    // uint64 little endian
+            width = 8;
+            sign = false;
+            break;
+          default:
+            return false;
+        }
+        if (mBytes.size() % width)
+        {
+          return false;
+        }
+        out.resize(mBytes.size() / width);
+        const uint8_t* p = mBytes.data();
+        for (auto& v : out)
+        {
+          uint64_t u = 0;
+          for (size_t b = 0; b < width; ++b)
+          {
+            u |= (uint64_t)p[b] << (8 * b);
+          }
+          if (sign && (width < 8) && (u >> (8 * width - 1)))
+          {
+            u |= ~(uint64_t)0 << (8 * width);   // sign extension
+          }
+          v = (int64_t)u;
+          p += width;
+        }
+        return true;
+      }
+
+      void columnarreader::finishSeries()
+      {
+        if (mBad || (mField != kFields) || (mTimes.size() != mValues.size()))
+        {
+          ++mInvalid;
+          return;
+        }
+        int64_t step = mSeries[kStep];
+        int64_t t = mSeries[kBaseTime] - step;
+        int64_t v = 0;
+        for (size_t i = 0; i < mTimes.size(); ++i)
+        {
+          t += step + mTimes[i];
+          v += mValues[i];
+          sample s;
+          s.device = (int)mSeries[kDevice];
+          s.entity = (int)mSeries[kEntity];
+          s.value = (int)v;
+          s.sampletime = t;
+          mOut.push_back(s);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,149 @@
+/*
+  columnar
+
+  columnar upload batches with typed arrays (RFC 8746)
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "c++bor.h"
+#include "storage.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      /*
+        a columnar batch carries the samples of an upload grouped by (device, entity):
+
+          batch   = [ series, ... ]
+          series  = [ device, entity, basetime, step, times, values ]
+
+        times and values are typed arrays (RFC 8746), a tagged byte string of little
+        endian signed integers of the narrowest width which holds the column:
+
+          tag 72 sint8, tag 77 sint16, tag 78 sint32, tag 79 sint64
+
+        basetime is the time of the first sample and step the interval to the second one.
+        times holds the differences of the intervals from step, t[i] - t[i-1] - step with
+        t[-1] = basetime - step, so regular sampling is a column of zeros and jitter
+        stays small. values holds the first differences with v[-1] = 0.
+        The ids and keys of the rows are written once per series instead of once
+        per sample.
+      */
+      const uint64_t kTagSint8 = 72;
+      const uint64_t kTagSint16LE = 77;
+      const uint64_t kTagSint32LE = 78;
+      const uint64_t kTagSint64LE = 79;
+
+      /*
+        columnarencoder writes batches, it keeps its buffers between them
+      */
+      class columnarencoder
+      {
+      public:
+        void encode(cbor::listener& out, const sample* samples, size_t count);
+      private:
+        void column(cbor::listener& out, const std::vector<int64_t>& values);
+        std::vector<uint32_t> mOrder;       // the rows sorted by (device, entity)
+        std::vector<int64_t> mTimes;
+        std::vector<int64_t> mValues;
+        std::vector<uint8_t> mBytes;        // the typed array being written
+      };
+
+      /*
+        columnarreader turns decoded batches back into samples, a series at a time in
+        (device, entity) order. Anything which isn't a batch counts as invalid.
+
+          std::vector<sample> rows;
+          columnarreader r(rows);
+          cbor::decoder d(r, 256);
+          d.parse(mem, len);
+      */
+      class columnarreader : public cbor::listener
+      {
+      public:
+        explicit columnarreader(std::vector<sample>& out) : mOut(out) {}
+        size_t batches() const { return mBatches; }
+        size_t invalid() const { return mInvalid; }
+
+        void int32(int32_t value) override { scalar(value); }
+        void int64(int64_t value) override { scalar(value); }
+        void int64p(uint64_t value) override { other(); }
+        void int64n(uint64_t value) override { other(); }
+        void string(const char* value, size_t len, bool complete) override { other(); }
+        void bytes(const uint8_t* mem, size_t len, bool complete) override;
+        void float16(float value) override { other(); }
+        void float32(float value) override { other(); }
+        void float64(double value) override { other(); }
+        void boolean(bool value) override { other(); }
+        void null() override { other(); }
+        void tag(uint64_t tag) override { mTag = tag; }
+        void array(uint64_t nums) override;
+        void map(uint64_t nums) override;
+        void stringahead(uint64_t len) override { other(); }
+        void bytesahead(uint64_t len) override;
+        void breakend(bool wasIndefinite, bool stackempty) override;
+        void time(const char* value) override { other(); }
+        void time(int64_t value) override { other(); }
+      private:
+        enum field : int_fast16_t
+        {
+          kDevice = 0,
+          kEntity,
+          kBaseTime,
+          kStep,
+          kTimes,
+          kValues,
+          kFields,
+        };
+        void scalar(int64_t value);
+        void other();
+        bool column(std::vector<int64_t>& out);
+        void finishSeries();
+        std::vector<sample>& mOut;      // decoded samples are appended here
+        int mDepth = 0;                 // 1 inside a batch, 2 inside a series
+        int mField = kDevice;           // the next field of the series
+        bool mBad = false;              // the current series is malformed
+        int mSkip = 0;                  // open containers being skipped
+        bool mCollecting = false;       // a typed array is being collected
+        bool mChunked = false;          // ... from an indefinite byte string
+        uint64_t mTag = 0;              // the tag of the next item
+        uint64_t mColumnTag = 0;        // the tag of the byte string being collected
+        int64_t mSeries[4] = { 0, 0, 0, 0 };  // device, entity, basetime, step
+        std::vector<uint8_t> mBytes;    // the typed array being collected
+        std::vector<int64_t> mTimes;
+        std::vector<int64_t> mValues;
+        size_t mBatches = 0;
+        size_t mInvalid = 0;
+      };
+    }
+  }
+}
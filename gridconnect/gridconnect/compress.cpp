@@ -0,0 +1,454 @@
+/*
+  compress
+
+  streaming compression of the upload bodies (deflate, zstd)
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "compress.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifndef SATAG_ZLIB
+#define SATAG_ZLIB 0
+#endif
+#ifndef SATAG_ZSTD
+#define SATAG_ZSTD 0
+#endif
+
+#if SATAG_ZLIB
+#include <zlib.h>
+#endif
+#if SATAG_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+namespace satag
+{
+  namespace util
+  {
+    const char* encodingName(contentencoding encoding)
+    {
+      switch (encoding)
+      {
+        case deflate:
+          return "deflate";
+        case zstd:
+          return "zstd";
+        default:
+          return "identity";
+      }
+    }
+
+    bool parseEncoding(const char* name, contentencoding& encoding)
+    {
+      for (contentencoding e : { identity, deflate, zstd })
+      {
+        if (strcmp(name, encodingName(e)) == 0)
+        {
+          encoding = e;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool encodingAvailable(contentencoding encoding)
+    {
+      switch (encoding)
+      {
+        case identity:
+          return true;
+        case deflate:
+          return SATAG_ZLIB != 0;
+        case zstd:
+          return SATAG_ZSTD != 0;
+      }
+      return false;
+    }
+
+    /*
+      chooseEncoding picks from an Accept-Encoding list like "zstd, deflate;q=0.5": the
+      preferred encoding if it is listed, else the best one listed which is compiled in.
+      The q-values are not ranked, q=0 excludes an encoding.
+    */
+    contentencoding chooseEncoding(const char* acceptEncoding, contentencoding preferred)
+    {
+      bool accepted[3] = { true, false, false };
+      std::string list = acceptEncoding ? acceptEncoding : "";
+      size_t pos = 0;
+      while (pos < list.size())
+      {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+        {
+          end = list.size();
+        }
+        std::string item = list.substr(pos, end - pos);
+        pos = end + 1;
+        size_t semicolon = item.find(';');
+        std::string params = (semicolon == std::string::npos) ? std::string() : item.substr(semicolon + 1);
+        item = item.substr(0, semicolon);
+        item.erase(std::remove_if(item.begin(), item.end(), [](char c) { return isspace((unsigned char)c) != 0; }), item.end());
+        params.erase(std::remove_if(params.begin(), params.end(), [](char c) { return isspace((unsigned char)c) != 0; }), params.end());
+        bool excluded = (params.compare(0, 2, "q=") == 0) && (atof(params.c_str() + 2) == 0);
+        contentencoding e;
+        if (parseEncoding(item.c_str(), e))
+        {
+          accepted[e] = !excluded;
+        }
+      }
+      if (accepted[preferred] && encodingAvailable(preferred))
+      {
+        return preferred;
+      }
+      for (contentencoding e : { zstd, deflate })
+      {
+        if (accepted[e] && encodingAvailable(e))
+        {
+          return e;
+        }
+      }
+      return identity;
+    }
+
+    /*
+      trainDictionary needs a few hundred bodies, the dictionary then holds the parts
+      they have in common, the map heads and keys, the ids and the upper bytes of the
+      timestamps
+    */
+    bool trainDictionary(const std::vector<std::vector<uint8_t>>& bodies, size_t capacity, std::vector<uint8_t>& dictionary)
+    {
+#if SATAG_ZSTD
+      std::vector<uint8_t> joined;
+      std::vector<size_t> sizes;
+      for (auto& b : bodies)
+      {
+        joined.insert(joined.end(), b.begin(), b.end());
+        sizes.push_back(b.size());
+      }
+      dictionary.resize(capacity);
+      size_t n = ZDICT_trainFromBuffer(dictionary.data(), capacity, joined.data(), sizes.data(), (unsigned)sizes.size());
+      if (ZDICT_isError(n))
+      {
+        dictionary.clear();
+        return false;
+      }
+      dictionary.resize(n);
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    // ----------------------------------------------------------------------------
+
+    struct compressingreader::codec
+    {
+#if SATAG_ZLIB
+      z_stream z;
+      bool deflating = false;
+#endif
+#if SATAG_ZSTD
+      ZSTD_CCtx* cctx = nullptr;
+#endif
+      ~codec()
+      {
+#if SATAG_ZLIB
+        if (deflating)
+        {
+          deflateEnd(&z);
+        }
+#endif
+#if SATAG_ZSTD
+        ZSTD_freeCCtx(cctx);
+#endif
+      }
+    };
+
+    compressingreader::compressingreader(source in, contentencoding encoding, int level, const std::vector<uint8_t>* dictionary)
+      : mIn(in)
+      , mEncoding(encoding)
+      , mCodec(new codec())
+    {
+      mFailed = !encodingAvailable(encoding);
+      if (!mFailed && (encoding != identity))
+      {
+        mInput.resize(kBuffer);
+      }
+#if SATAG_ZLIB
+      if (encoding == deflate)
+      {
+        memset(&mCodec->z, 0, sizeof(mCodec->z));
+        mCodec->deflating = (deflateInit(&mCodec->z, (level == kDefaultLevel) ? Z_DEFAULT_COMPRESSION : level) == Z_OK);
+        if (mCodec->deflating && dictionary && !dictionary->empty())
+        {
+          deflateSetDictionary(&mCodec->z, dictionary->data(), (uInt)dictionary->size());
+        }
+        mFailed = !mCodec->deflating;
+      }
+#endif
+#if SATAG_ZSTD
+      if (encoding == zstd)
+      {
+        mCodec->cctx = ZSTD_createCCtx();
+        mFailed = (mCodec->cctx == nullptr);
+        if (!mFailed && (level != kDefaultLevel))
+        {
+          mFailed = ZSTD_isError(ZSTD_CCtx_setParameter(mCodec->cctx, ZSTD_c_compressionLevel, level));
+        }
+        if (!mFailed && dictionary && !dictionary->empty())
+        {
+          mFailed = ZSTD_isError(ZSTD_CCtx_loadDictionary(mCodec->cctx, dictionary->data(), dictionary->size()));
+        }
+      }
+#endif
+    }
+
+    compressingreader::~compressingreader()
+    {
+    }
+
+    // has the signature of a CURLOPT_READFUNCTION, self is the compressingreader
+    size_t compressingreader::curlRead(char* buffer, size_t size, size_t nitems, void* self)
+    {
+      return static_cast<compressingreader*>(self)->read((uint8_t*)buffer, size * nitems);
+    }
+
+    bool compressingreader::refill()
+    {
+      mInputPos = 0;
+      mInputLen = mIn(mInput.data(), mInput.size());
+      mInputEnded = (mInputLen == 0);
+      mBytesIn += mInputLen;
+      return !mInputEnded;
+    }
+
+    /*
+      read returns the number of bytes written to dest, 0 at the end of the body. It
+      pulls from the source until dest is full or the compressed stream is finished.
+    */
+    size_t compressingreader::read(uint8_t* dest, size_t len)
+    {
+      if (mFinished || mFailed || (len == 0))
+      {
+        return 0;
+      }
+      size_t produced = 0;
+      if (mEncoding == identity)
+      {
+        produced = mIn(dest, len);
+        mBytesIn += produced;
+        mFinished = (produced == 0);
+      }
+#if SATAG_ZLIB
+      if (mEncoding == deflate)
+      {
+        z_stream& z = mCodec->z;
+        z.next_out = dest;
+        z.avail_out = (uInt)std::min(len, (size_t)UINT32_MAX);
+        uInt room = z.avail_out;
+        while ((z.avail_out > 0) && !mFinished)
+        {
+          if ((mInputPos == mInputLen) && !mInputEnded)
+          {
+            refill();
+          }
+          z.next_in = mInput.data() + mInputPos;
+          z.avail_in = (uInt)(mInputLen - mInputPos);
+          int rc = ::deflate(&z, mInputEnded ? Z_FINISH : Z_NO_FLUSH);
+          mInputPos = mInputLen - z.avail_in;
+          if (rc == Z_STREAM_END)
+          {
+            mFinished = true;
+          }
+          else if ((rc != Z_OK) && (rc != Z_BUF_ERROR))
+          {
+            mFailed = true;
+            break;
+          }
+        }
+        produced = room - z.avail_out;
+      }
+#endif
+#if SATAG_ZSTD
+      if (mEncoding == zstd)
+      {
+        ZSTD_outBuffer out = { dest, len, 0 };
+        while ((out.pos < out.size) && !mFinished)
+        {
+          if ((mInputPos == mInputLen) && !mInputEnded)
+          {
+            refill();
+          }
+          ZSTD_inBuffer in = { mInput.data() + mInputPos, mInputLen - mInputPos, 0 };
+          size_t rc = ZSTD_compressStream2(mCodec->cctx, &out, &in, mInputEnded ? ZSTD_e_end : ZSTD_e_continue);
+          mInputPos += in.pos;
+          if (ZSTD_isError(rc))
+          {
+            mFailed = true;
+            break;
+          }
+          mFinished = mInputEnded && (rc == 0);
+        }
+        produced = out.pos;
+      }
+#endif
+      mBytesOut += produced;
+      return produced;
+    }
+
+    // ----------------------------------------------------------------------------
+
+    struct decompressor::codec
+    {
+#if SATAG_ZLIB
+      z_stream z;
+      bool inflating = false;
+#endif
+#if SATAG_ZSTD
+      ZSTD_DCtx* dctx = nullptr;
+#endif
+      const std::vector<uint8_t>* dictionary = nullptr;
+      ~codec()
+      {
+#if SATAG_ZLIB
+        if (inflating)
+        {
+          inflateEnd(&z);
+        }
+#endif
+#if SATAG_ZSTD
+        ZSTD_freeDCtx(dctx);
+#endif
+      }
+    };
+
+    decompressor::decompressor(contentencoding encoding, sink fun, const std::vector<uint8_t>* dictionary)
+      : mEncoding(encoding)
+      , mOut(fun)
+      , mCodec(new codec())
+      , mBuffer(compressingreader::kBuffer)
+    {
+      mFailed = !encodingAvailable(encoding);
+      mCodec->dictionary = dictionary;
+#if SATAG_ZLIB
+      if (encoding == deflate)
+      {
+        memset(&mCodec->z, 0, sizeof(mCodec->z));
+        mCodec->inflating = (inflateInit(&mCodec->z) == Z_OK);
+        mFailed = !mCodec->inflating;
+      }
+#endif
+#if SATAG_ZSTD
+      if (encoding == zstd)
+      {
+        mCodec->dctx = ZSTD_createDCtx();
+        mFailed = (mCodec->dctx == nullptr);
+        if (!mFailed && dictionary && !dictionary->empty())
+        {
+          mFailed = ZSTD_isError(ZSTD_DCtx_loadDictionary(mCodec->dctx, dictionary->data(), dictionary->size()));
+        }
+      }
+#endif
+    }
+
+    decompressor::~decompressor()
+    {
+    }
+
+    bool decompressor::feed(const uint8_t* mem, size_t len)
+    {
+      if (mFailed)
+      {
+        return false;
+      }
+      if (mEncoding == identity)
+      {
+        mFailed = !mOut(mem, len);
+      }
+#if SATAG_ZLIB
+      if (mEncoding == deflate)
+      {
+        z_stream& z = mCodec->z;
+        z.next_in = (Bytef*)mem;
+        z.avail_in = (uInt)len;
+        do
+        {
+          z.next_out = mBuffer.data();
+          z.avail_out = (uInt)mBuffer.size();
+          int rc = inflate(&z, Z_NO_FLUSH);
+          if ((rc == Z_NEED_DICT) && mCodec->dictionary)
+          {
+            rc = inflateSetDictionary(&z, mCodec->dictionary->data(), (uInt)mCodec->dictionary->size());
+          }
+          size_t n = mBuffer.size() - z.avail_out;
+          if ((n > 0) && !mOut(mBuffer.data(), n))
+          {
+            mFailed = true;
+          }
+          if (rc == Z_STREAM_END)
+          {
+            mFinished = true;
+            break;
+          }
+          if ((rc != Z_OK) && (rc != Z_BUF_ERROR))
+          {
+            mFailed = true;
+          }
+        } while (!mFailed && ((z.avail_in > 0) || (z.avail_out == 0)));
+      }
+#endif
+#if SATAG_ZSTD
+      if (mEncoding == zstd)
+      {
+        ZSTD_inBuffer in = { mem, len, 0 };
+        bool full = true;
+        while (!mFailed && ((in.pos < in.size) || full))
+        {
+          ZSTD_outBuffer out = { mBuffer.data(), mBuffer.size(), 0 };
+          size_t rc = ZSTD_decompressStream(mCodec->dctx, &out, &in);
+          if (ZSTD_isError(rc))
+          {
+            mFailed = true;
+            break;
+          }
+          if ((out.pos > 0) && !mOut(mBuffer.data(), out.pos))
+          {
+            mFailed = true;
+          }
+          mFinished = (rc == 0);
+          full = (out.pos == out.size);
+        }
+      }
+#endif
+      return !mFailed;
+    }
+  }
+}
@@ -0,0 +1,128 @@
+/*
+  compress
+
+  streaming compression of the upload bodies (deflate, zstd)
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace satag
+{
+  namespace util
+  {
+    /*
+      the Content-Encodings of a request body. deflate is the zlib format (RFC 1950) as
+      HTTP uses it, zstd (RFC 8878) may use a dictionary trained on our bodies, the
+      dictionary id in the frame tells the server which one.
+    */
+    enum contentencoding : int_fast16_t
+    {
+      identity = 0,
+      deflate,
+      zstd,
+    };
+
+    const char* encodingName(contentencoding encoding);
+    bool parseEncoding(const char* name, contentencoding& encoding);
+    bool encodingAvailable(contentencoding encoding);   // compiled in
+    // the encoding to use after the server listed what it accepts (RFC 7694)
+    contentencoding chooseEncoding(const char* acceptEncoding, contentencoding preferred);
+
+    const int kDefaultLevel = -1;       // the default level of the codec
+
+    // trains a zstd dictionary of at most capacity bytes on typical bodies, false without zstd
+    bool trainDictionary(const std::vector<std::vector<uint8_t>>& bodies, size_t capacity, std::vector<uint8_t>& dictionary);
+
+    /*
+      compressingreader sits between a pulled body and the transport: read() pulls from
+      the source and hands out the compressed bytes, so it can be used as a curl read
+      callback in front of an uploadstream.
+
+        uploadstream body(store, position);
+        compressingreader z([&](uint8_t* d, size_t n) { return body.read(d, n); }, deflate);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, compressingreader::curlRead);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &z);
+
+      Only one input and one output buffer (kBuffer) are kept, whatever the size of the
+      body. A codec error ends the body early and sets failed().
+    */
+    class compressingreader
+    {
+    public:
+      typedef std::function<size_t(uint8_t* dest, size_t len)> source;
+      static const size_t kBuffer = 65536;
+
+      compressingreader(source in, contentencoding encoding, int level = kDefaultLevel, const std::vector<uint8_t>* dictionary = nullptr);
+      ~compressingreader();
+      size_t read(uint8_t* dest, size_t len);
+      static size_t curlRead(char* buffer, size_t size, size_t nitems, void* self);
+      contentencoding encoding() const { return mEncoding; }
+      uint64_t bytesIn() const { return mBytesIn; }
+      uint64_t bytesOut() const { return mBytesOut; }
+      bool failed() const { return mFailed; }
+    private:
+      struct codec;                     // the zlib or zstd stream
+      bool refill();
+      source mIn;
+      contentencoding mEncoding;
+      std::unique_ptr<codec> mCodec;
+      std::vector<uint8_t> mInput;      // read from the source, not compressed yet
+      size_t mInputPos = 0;
+      size_t mInputLen = 0;
+      bool mInputEnded = false;         // the source returned 0
+      bool mFinished = false;           // the end of the compressed stream is written
+      bool mFailed = false;
+      uint64_t mBytesIn = 0;
+      uint64_t mBytesOut = 0;
+    };
+
+    /*
+      decompressor is the receiving side, e.g. a server stand-in, it decodes a body
+      arriving in pieces and hands the output to fun
+    */
+    class decompressor
+    {
+    public:
+      typedef std::function<bool(const uint8_t* mem, size_t len)> sink;
+      decompressor(contentencoding encoding, sink fun, const std::vector<uint8_t>* dictionary = nullptr);
+      ~decompressor();
+      bool feed(const uint8_t* mem, size_t len);
+      bool finished() const { return mFinished; }   // the end of the stream was seen
+    private:
+      struct codec;
+      contentencoding mEncoding;
+      sink mOut;
+      std::unique_ptr<codec> mCodec;
+      std::vector<uint8_t> mBuffer;
+      bool mFailed = false;
+      bool mFinished = false;
+    };
+  }
+}
@@ -32,9 +32,21 @@ The license above does not apply to and no license is granted for any Military U
 #include <iterator>
 #include <thread>
 #include <chrono>
+#include <cstring>
+#include <cstdlib>
 
 #include "c++bor.h"
 #include "storage.h"
+#include "shardedstore.h"
+#include "sampleclock.h"
+#include "runtime.h"
+#include "scheduler.h"
+#include "async.h"
+#include "ingest.h"
+#include "upload.h"
+#include "compress.h"
+#include "httpclient.h"
+#include "metrics.h"
 
 #include "curl/curl.h"
 
@@ -45,8 +57,270 @@ The license above does not apply to and no license is granted for any Military U
 #endif
 
 using namespace std;
+using satag::util::runtime;
+using satag::util::scheduler;
+using satag::util::canceltoken;
+using satag::util::contentencoding;
 
-static satag::energy::bx::store gStore;
+// one shard: the samples are queued and written in batches by tasks of the scheduler
+static satag::energy::bx::shardedstore gStore;
+
+#if SATAG_COROUTINES
+// command execution as one flow, it is suspended while it waits for the store
+static satag::util::task<void> executeCommands(satag::util::canceltoken token)
+{
+  while (!token.cancelled())
+  {
+    satag::energy::bx::command c = co_await gStore.nextCommand();
+    if (c.id == 0)
+    {
+      break;  // the store is closing
+    }
+    // actual execution
+    cout << "executing '" << c.text1 << "/" << c.text2 << "' on device: " << c.device << endl;
+    // log the event if it worked, then remove the command from the command queue
+    co_await gStore.logEventAsync(100, "NetIn", c.device, c.t1(), c.t2(), true);
+    co_await gStore.removeCommandAsync(c.id);
+  }
+}
+#else
+// executes what is queued
+static void runCommands()
+{
+  bool executed = true;
+  while (executed)
+  {
+    executed = gStore.runEvent([&](int device, const char* text1, const char* text2)
+    {
+      // actual execution
+      cout << "executing '" << text1 << "/" << text2 << "' on device: " << device << endl;
+      // log the event if it worked
+      gStore.logEvent(100, "NetIn", device, text1, text2, true);
+      return true;  // return true if execution took place to remove the command from the command queue
+    });
+  }
+}
+#endif
+
+/*
+  the Content-Encoding of the uploads: the preferred one is used until the server
+  answers 415 with the encodings it accepts (RFC 7694), then the best of those.
+  format is the layout of the sequence items, see --upload-format.
+*/
+struct uploadencoding
+{
+  satag::energy::bx::uploadformat format = satag::energy::bx::samplemaps;
+  contentencoding preferred = satag::util::encodingAvailable(satag::util::deflate) ? satag::util::deflate : satag::util::identity;
+  contentencoding current = preferred;
+  std::vector<uint8_t> dictionary;  // zstd dictionary, see --upload-dict
+};
+
+/*
+  one request of an upload round
+*/
+struct uploadtransfer
+{
+  satag::energy::bx::uploadbatch* batch = nullptr;
+  std::unique_ptr<satag::energy::bx::uploadbody> source;  // the body, read from the store
+  bool complete = false;            // the whole body went to the compressor
+  std::unique_ptr<satag::util::compressingreader> body;
+  satag::util::httprequest request;
+  std::chrono::steady_clock::time_point abortAt = std::chrono::steady_clock::time_point::max();
+};
+
+/*
+  abortOnCancel aborts a transfer once the shutdown began. A request which was sent
+  completely gets a few seconds for the response, the server most likely stored the
+  batch already and it would come again after the restart.
+*/
+static bool abortOnCancel(uploadtransfer& t, const canceltoken& token)
+{
+  const std::chrono::seconds kResponseGrace(3);
+  if (!token.cancelled())
+  {
+    return false;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (t.abortAt == std::chrono::steady_clock::time_point::max())
+  {
+    t.abortAt = t.complete ? now + kResponseGrace : now;
+  }
+  return now >= t.abortAt;
+}
+
+/*
+  uploadRound posts the batches of a round concurrently on the connections the client
+  keeps open, each one as a compressed CBOR sequence read from the store while it is
+  sent, and sets bytes, sent and seconds of every batch. After a 415 the encoding
+  changes to one the server takes and the batches which weren't sent go once more.
+*/
+static void uploadRound(satag::util::httpclient& client, const char* url, std::vector<satag::energy::bx::uploadbatch>& round,
+  uploadencoding& encoding, const canceltoken& token)
+{
+  for (int attempt = 0; attempt < 2; ++attempt)
+  {
+    std::vector<std::unique_ptr<uploadtransfer>> transfers;
+    std::vector<satag::util::httprequest*> requests;
+    for (auto& b : round)
+    {
+      if (b.sent)
+      {
+        continue;
+      }
+      auto t = std::make_unique<uploadtransfer>();
+      uploadtransfer* tp = t.get();
+      tp->batch = &b;
+      tp->source = std::make_unique<satag::energy::bx::uploadbody>(gStore.primary(), b);
+      tp->body = std::make_unique<satag::util::compressingreader>([tp](uint8_t* dest, size_t len)
+      {
+        size_t n = tp->source->read(dest, len);
+        tp->complete = tp->complete || (n == 0);
+        return n;
+      }, encoding.current, satag::util::kDefaultLevel, (encoding.current == satag::util::zstd) ? &encoding.dictionary : nullptr);
+      auto& r = tp->request;
+      r.url = url;
+      r.headers.push_back(string("Content-Type: ") + satag::energy::bx::uploadstream::kContentType);
+      if (encoding.current != satag::util::identity)
+      {
+        r.headers.push_back(string("Content-Encoding: ") + satag::util::encodingName(encoding.current));
+      }
+      r.body = [tp](uint8_t* dest, size_t len) { return tp->body->read(dest, len); };
+      r.abort = [tp, &token]() { return abortOnCancel(*tp, token); };
+      requests.push_back(&r);
+      transfers.push_back(std::move(t));
+    }
+    client.perform(requests);
+
+    const std::string* accepted = nullptr;
+    for (auto& t : transfers)
+    {
+      const auto& r = t->request;
+      t->batch->seconds = r.seconds;
+      t->batch->bytes = t->source->bytes();
+      t->batch->sent = r.ok() && !t->body->failed() && !t->source->failed();
+      if ((r.result == CURLE_OK) && (r.status == 415))
+      {
+        accepted = r.header("accept-encoding");
+      }
+      else if (!t->batch->sent && !token.cancelled())
+      {
+        cerr << "upload failed: " << r.error() << endl;
+      }
+    }
+    contentencoding next = accepted ? satag::util::chooseEncoding(accepted->c_str(), encoding.preferred) : encoding.current;
+    if (next == encoding.current)
+    {
+      return;
+    }
+    cout << "upload: the server doesn't take " << satag::util::encodingName(encoding.current)
+      << ", using " << satag::util::encodingName(next) << endl;
+    encoding.current = next;
+  }
+}
+
+/*
+  archiveUploaded moves the samples the server has into compressed blocks (see
+  bx::store::archiveUploaded), the upload worker runs it when it is caught up
+*/
+static void archiveUploaded(const satag::energy::bx::uploadscheduler& uploads)
+{
+  const size_t kArchiveBlock = 4096;    // samples of a (device, entity) pair per block
+  satag::energy::bx::archivestats stats;
+  if (!gStore.primary().archiveUploaded(uploads.uploadedThrough(), kArchiveBlock, stats))
+  {
+    cerr << "archive failed: " << gStore.primary().lastError() << endl;
+  }
+  else if (stats.rows > 0)
+  {
+    cout << "archive: " << stats.rows << " samples in " << stats.blocks << " blocks, "
+      << stats.ratio() << " times smaller" << endl;
+  }
+}
+
+/*
+  followCommands holds a GET on url open and queues the commands of the response as
+  they arrive (a CBOR sequence of command maps, see bx::commandreader). The server
+  may stream them in a response which doesn't end, or answer a long-poll once there
+  are commands, it is asked again right away. After a failure it waits 1, 2, 4 ...
+  up to 30 seconds.
+*/
+static void followCommands(satag::util::httpclient& client, const char* url, const canceltoken& token)
+{
+  satag::energy::bx::commandfeed feed([](const std::vector<satag::energy::bx::command>& batch)
+  {
+    return gStore.addCommands(batch);   // wakes the dispatcher once committed
+  });
+  satag::util::httprequest r;
+  r.url = url;
+  r.headers.push_back(string("Accept: ") + satag::energy::bx::uploadstream::kContentType);
+  r.response = [&r, &feed](const uint8_t* data, size_t len)
+  {
+    // an error page isn't decoded
+    return ((r.status >= 200) && (r.status < 300)) ? feed.parse(data, len) : true;
+  };
+  r.abort = [&token]() { return token.cancelled(); };
+  std::vector<satag::util::httprequest*> requests = { &r };
+  int backoff = 0;
+  while (!token.waitFor(std::chrono::seconds(backoff)))
+  {
+    feed.reset();
+    client.perform(requests);
+    if (r.ok())
+    {
+      backoff = 0;
+    }
+    else if (!token.cancelled())
+    {
+      cerr << "commands: " << r.error() << endl;
+      backoff = std::min(30, std::max(1, backoff * 2));
+    }
+  }
+}
+
+/*
+  trainUploadDictionary cuts the stored samples into bodies as the uploads would send
+  them and trains a zstd dictionary on them for --upload-dict
+*/
+static bool trainUploadDictionary(const char* path, satag::energy::bx::uploadformat format)
+{
+  const size_t kBodySamples = 1600;     // about ten seconds of a battery
+  const size_t kBodies = 1000;
+  std::vector<std::vector<uint8_t>> bodies;
+  int64_t position = 0;
+  bool done = false;
+  while ((bodies.size() < kBodies) && !done)
+  {
+    satag::energy::bx::uploadstream body(gStore.primary(), position, INT64_MAX, kBodySamples);
+    body.setFormat(format);
+    std::vector<uint8_t> b;
+    uint8_t buffer[16384];
+    size_t n;
+    while ((n = body.read(buffer, sizeof(buffer))) > 0)
+    {
+      b.insert(b.end(), buffer, buffer + n);
+    }
+    if (b.empty() || body.failed())
+    {
+      break;
+    }
+    bodies.push_back(b);
+    position = body.position();
+    done = body.done();
+  }
+  std::vector<uint8_t> dictionary;
+  if (!satag::util::trainDictionary(bodies, 16384, dictionary))
+  {
+    return false;
+  }
+  FILE* f = fopen(path, "wb");
+  bool ok = f && (fwrite(dictionary.data(), 1, dictionary.size(), f) == dictionary.size());
+  if (f)
+  {
+    fclose(f);
+  }
+  cout << "dictionary of " << dictionary.size() << " bytes from " << bodies.size() << " bodies" << endl;
+  return ok;
+}
 
 #if 0
 // this is for the curl check
@@ -71,6 +345,9 @@ size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream)
 
 int main(int argc, char *argv[], char *envp[])
 {
+  // before any thread is started, see runtime.h
+  runtime rt;
+
 #if 0
   // temporary tests regarding libcurl
   CURL *curl;
@@ -139,68 +416,312 @@ int main(int argc, char *argv[], char *envp[])
 
   cout << "batterx communication starting..." << endl;
 
+  // sample timestamps follow the wall clock without jumps back, see sampleclock.h
+  satag::util::sampleclock::start();
+
+  // --threads sizes the scheduler for the SoC, the default is one thread per core
+  // --profile collects statement timings and prints them and the metrics at the end
+  // --listen-unix PATH, --listen-tcp PORT accept CBOR sample streams from the DSP side
+  // --upload URL posts the new samples every --upload-every seconds (60), a backlog
+  //   with up to --upload-window requests in flight (4)
+  // --upload-encoding deflate|zstd|identity, --upload-dict FILE a zstd dictionary
+  // --upload-format maps|columnar the layout of the samples in the body
+  // --archive-every SECONDS moves the uploaded samples into compressed blocks (600, 0 keeps the rows)
+  // --upload-http2 multiplexes the requests, --upload-cainfo FILE the CA bundle of the server
+  // --commands URL receives the commands for ControlCommandsIn from a long-poll or stream
+  // --heartbeat (debugging) stores a fake sample every second
+  // --journal interval|always journals the samples ahead of SQLite, fdatasync every 20ms or per append
+  // --train-dict FILE trains that dictionary on the stored samples and exits
+  size_t threads = 0;
+  bool profiling = false;
+  bool heartbeat = false;
+  const char* listenUnix = nullptr;
+  int listenTcp = -1;
+  const char* uploadUrl = nullptr;
+  int uploadEvery = 60;
+  int archiveEvery = 600;
+  satag::energy::bx::uploadpolicy policy;
+  satag::util::httpsettings http;
+  uploadencoding encoding;
+  const char* trainDict = nullptr;
+  const char* commandsUrl = nullptr;
+  satag::energy::bx::journaling journal = satag::energy::bx::nojournal;
+  for (int i = 1; i < argc; ++i)
+  {
+    if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+    {
+      threads = (size_t)atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--profile") == 0)
+    {
+      profiling = true;
+    }
+    else if (strcmp(argv[i], "--heartbeat") == 0)
+    {
+      heartbeat = true;
+    }
+    else if ((strcmp(argv[i], "--listen-unix") == 0) && (i + 1 < argc))
+    {
+      listenUnix = argv[++i];
+    }
+    else if ((strcmp(argv[i], "--listen-tcp") == 0) && (i + 1 < argc))
+    {
+      listenTcp = atoi(argv[++i]);
+    }
+    else if ((strcmp(argv[i], "--upload") == 0) && (i + 1 < argc))
+    {
+      uploadUrl = argv[++i];
+    }
+    else if ((strcmp(argv[i], "--upload-every") == 0) && (i + 1 < argc))
+    {
+      uploadEvery = std::max(1, atoi(argv[++i]));
+    }
+    else if ((strcmp(argv[i], "--archive-every") == 0) && (i + 1 < argc))
+    {
+      archiveEvery = std::max(0, atoi(argv[++i]));
+    }
+    else if ((strcmp(argv[i], "--commands") == 0) && (i + 1 < argc))
+    {
+      commandsUrl = argv[++i];
+    }
+    else if ((strcmp(argv[i], "--journal") == 0) && (i + 1 < argc))
+    {
+      const char* sync = argv[++i];
+      if (strcmp(sync, "interval") == 0)
+      {
+        journal = satag::energy::bx::journaled;
+      }
+      else if (strcmp(sync, "always") == 0)
+      {
+        journal = satag::energy::bx::journalsynced;
+      }
+      else
+      {
+        cout << "journal sync " << sync << " isn't known, use interval or always" << endl;
+        return 2;
+      }
+    }
+    else if (strcmp(argv[i], "--upload-http2") == 0)
+    {
+      http.http2 = true;
+    }
+    else if ((strcmp(argv[i], "--upload-cainfo") == 0) && (i + 1 < argc))
+    {
+      http.caInfo = argv[++i];
+    }
+    else if ((strcmp(argv[i], "--upload-window") == 0) && (i + 1 < argc))
+    {
+      policy.maxWindow = (size_t)std::max(1, atoi(argv[++i]));
+    }
+    else if ((strcmp(argv[i], "--upload-encoding") == 0) && (i + 1 < argc))
+    {
+      if (!satag::util::parseEncoding(argv[++i], encoding.preferred) || !satag::util::encodingAvailable(encoding.preferred))
+      {
+        cout << "upload encoding " << argv[i] << " isn't available" << endl;
+        return 2;
+      }
+      encoding.current = encoding.preferred;
+    }
+    else if ((strcmp(argv[i], "--upload-format") == 0) && (i + 1 < argc))
+    {
+      ++i;
+      if (strcmp(argv[i], "columnar") == 0)
+      {
+        encoding.format = satag::energy::bx::columnarbatches;
+      }
+      else if (strcmp(argv[i], "maps") == 0)
+      {
+        encoding.format = satag::energy::bx::samplemaps;
+      }
+      else
+      {
+        cout << "upload format " << argv[i] << " isn't known, use maps or columnar" << endl;
+        return 2;
+      }
+    }
+    else if ((strcmp(argv[i], "--train-dict") == 0) && (i + 1 < argc))
+    {
+      trainDict = argv[++i];
+    }
+    else if ((strcmp(argv[i], "--upload-dict") == 0) && (i + 1 < argc))
+    {
+      FILE* f = fopen(argv[++i], "rb");
+      uint8_t buffer[4096];
+      size_t n;
+      while (f && ((n = fread(buffer, 1, sizeof(buffer), f)) > 0))
+      {
+        encoding.dictionary.insert(encoding.dictionary.end(), buffer, buffer + n);
+      }
+      if (!f)
+      {
+        cout << "can't read " << argv[i] << endl;
+        return 2;
+      }
+      fclose(f);
+    }
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  scheduler pool(threads);
+  pool.start();
+
   cout << "opening database...";
-  if (gStore.open("battery.sq3"))
+  if (gStore.open("battery.sq3", 1, satag::energy::bx::unpartitioned, &pool, journal))
   {
     cout << "done" << endl;
 
-    // vector container stores threads
-    vector<thread> workers;
+    if (trainDict)
+    {
+      bool trained = trainUploadDictionary(trainDict, encoding.format);
+      if (!trained)
+      {
+        cout << "no dictionary, zstd isn't compiled in or there are too few samples" << endl;
+      }
+      gStore.close();
+      pool.stop();
+      curl_global_cleanup();
+      satag::util::sampleclock::stop();
+      return trained ? 0 : 1;
+    }
 
-    workers.push_back(
-      thread([]()
+    if (profiling)
     {
-      cout << "starting battery watcher\n";
-      gStore.logDSPEvent(1, 1, 3);
-    }));
+      profiling = gStore.primary().setProfiling(true);
+    }
 
-    workers.push_back(
-      thread([]()
+    if (heartbeat)
     {
-      cout << "starting database logger\n";
-      gStore.logDSPEvent(1, 3, 7);
-      gStore.runEvent([&](int device, const char* text1, const char* text2)
+      // the battery interface isn't there yet, this is a fake sample for testing, it is uploaded like any other
+      cout << "starting battery heartbeat (device 1, entity 1)\n";
+      pool.every(std::chrono::seconds(1), []()
       {
-        // actual execution
-        cout << "executing '" << text1 << "/" << text2 << "' on device: " << device << endl;
-        // log the event if it worked
-        gStore.logEvent(100, "NetIn", device, text1, text2, true);
-        return true;  // return true if execution took place to remove the command from the command queue
+        gStore.logDSPEvent(1, 1, 3);
       });
+    }
 
-    }));
+    cout << "starting command execution\n";
+#if SATAG_COROUTINES
+    satag::util::spawn(pool, executeCommands(rt.token()));
+#else
+    // commands from --commands run right away, the poll finds those from elsewhere
+    gStore.onCommands([&pool]() { pool.submit(runCommands); });
+    pool.every(std::chrono::milliseconds(100), runCommands);
+#endif
 
-    workers.push_back(
-      thread([]()
+    // the HTTP loops of --commands and --upload run on workers of their own, not on the
+    // scheduler: a long-poll or a round of requests blocks in curl for seconds up to
+    // indefinitely, on a pool of one or two threads that would stall the command
+    // dispatch and the store writers (see scheduler.h). They only wait for the network,
+    // encoding and compression happen in the curl read callbacks as the bytes go out.
+    if (commandsUrl)
     {
-      cout << "starting command execution\n";
-      gStore.logDSPEvent(1, 3, 8);
-    }));
+      cout << "receiving commands from " << commandsUrl << endl;
+      rt.worker("commands", [commandsUrl, http](const canceltoken& token)
+      {
+        satag::util::httpclient client(http);
+        followCommands(client, commandsUrl, token);
+      });
+    }
 
-    // wait... this will be changed later, but for now we just need this
-    cout << "all threads started, press space to terminate\n";
+    // the samples decoded by the ingest server are queued to the store writers in batches
+    satag::energy::bx::ingestserver ingest([](const std::vector<satag::energy::bx::sample>& batch)
+    {
+      return gStore.logDSPEvents(batch);
+    });
+    if (listenUnix || (listenTcp >= 0))
+    {
+      bool listening = (!listenUnix || ingest.listenUnix(listenUnix)) && ((listenTcp < 0) || ingest.listenTcp("127.0.0.1", listenTcp));
+      if (listening && ingest.start(1))
+      {
+        cout << "ingest server listening" << (listenUnix ? string(" on ") + listenUnix : string())
+          << ((listenTcp >= 0) ? " on 127.0.0.1:" + to_string(ingest.tcpPort()) : string()) << endl;
+      }
+      else
+      {
+        cout << "ingest server failed to start" << endl;
+      }
+    }
 
-    do
+    if (uploadUrl)
     {
-      auto c = getc(stdin);
-      if (c == ' ')
-        break;
-    } while (true);
+      cout << "uploading to " << uploadUrl << " every " << uploadEvery << "s (" << satag::util::encodingName(encoding.preferred)
+        << ((encoding.format == satag::energy::bx::columnarbatches) ? ", columnar" : "") << ")\n";
+      policy.format = encoding.format;
+      rt.worker("upload", [uploadUrl, uploadEvery, archiveEvery, encoding, policy, http](const canceltoken& token)
+      {
+        // the connections stay open from one round to the next
+        satag::util::httpclient client(http);
+        // the positions are checkpointed in Settings, a restart resumes from there
+        satag::energy::bx::uploadscheduler uploads(gStore.primary(), policy);
+        if (!uploads.resume())
+        {
+          cout << "upload: no checkpoint, the stored samples go up as a backlog" << endl;
+        }
+        uploadencoding negotiated = encoding;
+        std::vector<satag::energy::bx::uploadbatch> round;
+        bool more = false;
+        auto archived = std::chrono::steady_clock::now();
+        // rounds follow each other while a backlog is left, otherwise every uploadEvery
+        while (more ? !token.cancelled() : !token.waitFor(std::chrono::seconds(uploadEvery)))
+        {
+          more = false;
+          if (uploads.plan(round) && !round.empty())
+          {
+            uploadRound(client, uploadUrl, round, negotiated, token);
+            more = uploads.complete(round);
+          }
+          // what the server has is archived between rounds, not while a backlog goes up
+          if (!more && (archiveEvery > 0) && (std::chrono::steady_clock::now() - archived >= std::chrono::seconds(archiveEvery)))
+          {
+            archiveUploaded(uploads);
+            archived = std::chrono::steady_clock::now();
+          }
+        }
+      });
+    }
 
-    cout << "waiting for threads to terminate..." << endl;
+    // first no new samples
+    rt.onShutdown("ingest server", [&ingest](runtime::deadline until)
+    {
+      ingest.stop();
+      return true;
+    });
 
-    for (auto& w : workers)
+    // no new periodic runs, the ones in progress finish
+    rt.onShutdown("scheduled tasks", [&pool](runtime::deadline until)
     {
-      w.join();
+      pool.cancelAll();
+      return pool.drain(until);
+    });
+
+    // then write what is still queued
+    rt.onShutdown("ingestion queue", [](runtime::deadline until)
+    {
+      return gStore.flush(until);
+    });
+
+    cout << "all tasks scheduled on " << pool.threadCount() << " threads, send SIGTERM or press ctrl-c to terminate\n";
+
+    int reason = rt.run(std::chrono::seconds(10));
+
+    cout << "terminated (" << ((reason > 0) ? "signal " + to_string(reason) : string("stop")) << ")" << endl;
+    if (profiling)
+    {
+      cout << gStore.primary().profileReport();
+      cout << satag::util::metrics::registry::instance().text();
     }
     cout << "closing database..." << endl;
 
+    // close writes anything the drain didn't get to within the deadline
     gStore.close();
   }
   else
   {
     cout << "failed" << endl;
   }
+  pool.stop();
+  curl_global_cleanup();
+  satag::util::sampleclock::stop();
 
 
 
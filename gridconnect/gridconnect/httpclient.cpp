@@ -0,0 +1,313 @@
+/*
+  httpclient
+
+  long-lived HTTP connections for the uploads: keep-alive, shared TLS sessions, HTTP/2
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "httpclient.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace satag
+{
+  namespace util
+  {
+    static metrics::counter& gConnects = metrics::registry::instance().getCounter("http.connects");
+    static metrics::counter& gHandshakes = metrics::registry::instance().getCounter("http.handshakes");
+    static metrics::histogram& gHandshakeTime = metrics::registry::instance().getHistogram("http.handshake");
+    static metrics::histogram& gTtfb = metrics::registry::instance().getHistogram("http.ttfb");
+
+    std::string httprequest::error() const
+    {
+      return (result != CURLE_OK) ? std::string(curl_easy_strerror(result)) : "HTTP " + std::to_string(status);
+    }
+
+    const std::string* httprequest::header(const char* name) const
+    {
+      for (const auto& h : responseHeaders)
+      {
+        if (h.first == name)
+        {
+          return &h.second;
+        }
+      }
+      return nullptr;
+    }
+
+    // ----------------------------------------------------------------------------
+
+    httpclient::httpclient(const httpsettings& s)
+      : mSettings(s)
+    {
+      mShare = curl_share_init();
+      if (mShare)
+      {
+        curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+      }
+      mMulti = curl_multi_init();
+      if (mMulti)
+      {
+        curl_multi_setopt(mMulti, CURLMOPT_PIPELINING, mSettings.http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+      }
+    }
+
+    httpclient::~httpclient()
+    {
+      // the handles go before the share they use
+      for (CURL* c : mIdle)
+      {
+        curl_easy_cleanup(c);
+      }
+      if (mMulti)
+      {
+        curl_multi_cleanup(mMulti);
+      }
+      if (mShare)
+      {
+        curl_share_cleanup(mShare);
+      }
+    }
+
+    /*
+      handle takes an easy handle from the pool or sets up a new one, the options which
+      are the same for every request are set only once
+    */
+    CURL* httpclient::handle()
+    {
+      if (!mIdle.empty())
+      {
+        CURL* c = mIdle.back();
+        mIdle.pop_back();
+        return c;
+      }
+      CURL* c = curl_easy_init();
+      if (!c)
+      {
+        return nullptr;
+      }
+      if (mShare)
+      {
+        curl_easy_setopt(c, CURLOPT_SHARE, mShare);
+      }
+      curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1L);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+      curl_easy_setopt(c, CURLOPT_HTTP_VERSION, mSettings.http2 ? (long)CURL_HTTP_VERSION_2TLS : (long)CURL_HTTP_VERSION_1_1);
+      if (mSettings.http2)
+      {
+        curl_easy_setopt(c, CURLOPT_PIPEWAIT, 1L);    // rather wait for the connection than open another one
+      }
+#else
+      curl_easy_setopt(c, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+#endif
+      curl_easy_setopt(c, CURLOPT_TCP_KEEPALIVE, 1L);
+      curl_easy_setopt(c, CURLOPT_TCP_KEEPIDLE, mSettings.keepAlive);
+      curl_easy_setopt(c, CURLOPT_TCP_KEEPINTVL, mSettings.keepAlive);
+      curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, mSettings.connectTimeout);
+      curl_easy_setopt(c, CURLOPT_SSL_VERIFYPEER, 1L);
+      curl_easy_setopt(c, CURLOPT_SSL_VERIFYHOST, 2L);
+      if (!mSettings.caInfo.empty())
+      {
+        curl_easy_setopt(c, CURLOPT_CAINFO, mSettings.caInfo.c_str());
+      }
+      curl_easy_setopt(c, CURLOPT_READFUNCTION, readBody);
+      curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, writeResponse);
+      curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, readHeader);
+      curl_easy_setopt(c, CURLOPT_NOPROGRESS, 0L);
+      curl_easy_setopt(c, CURLOPT_XFERINFOFUNCTION, progress);
+      return c;
+    }
+
+    /*
+      perform runs the requests concurrently and returns once all of them are done, the
+      results are in the requests. It is false if the transfers couldn't be started.
+    */
+    bool httpclient::perform(std::vector<httprequest*>& requests)
+    {
+      if (!mMulti)
+      {
+        return false;
+      }
+      std::vector<std::pair<CURL*, struct curl_slist*>> transfers;
+      bool result = true;
+      for (httprequest* r : requests)
+      {
+        r->result = CURLE_FAILED_INIT;
+        r->status = 0;
+        r->seconds = 0;
+        r->ttfb = 0;
+        r->started = std::chrono::steady_clock::now();
+        r->connected = false;
+        r->responseHeaders.clear();
+        CURL* c = handle();
+        if (!c)
+        {
+          result = false;
+          continue;
+        }
+        struct curl_slist* headers = nullptr;
+        for (const auto& h : r->headers)
+        {
+          headers = curl_slist_append(headers, h.c_str());
+        }
+        if (r->body)
+        {
+          headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+          headers = curl_slist_append(headers, "Expect:");   // no round trip for 100-continue
+          curl_easy_setopt(c, CURLOPT_POST, 1L);
+        }
+        else
+        {
+          curl_easy_setopt(c, CURLOPT_HTTPGET, 1L);
+        }
+        curl_easy_setopt(c, CURLOPT_URL, r->url.c_str());
+        curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(c, CURLOPT_READDATA, r);
+        curl_easy_setopt(c, CURLOPT_WRITEDATA, r);
+        curl_easy_setopt(c, CURLOPT_HEADERDATA, r);
+        curl_easy_setopt(c, CURLOPT_XFERINFODATA, r);
+        curl_easy_setopt(c, CURLOPT_PRIVATE, r);
+        curl_multi_add_handle(mMulti, c);
+        transfers.push_back(std::make_pair(c, headers));
+      }
+
+      int running = 1;
+      while ((running > 0) && (curl_multi_perform(mMulti, &running) == CURLM_OK))
+      {
+        if (running > 0)
+        {
+          curl_multi_wait(mMulti, nullptr, 0, 100, nullptr);
+        }
+      }
+      CURLMsg* msg;
+      int left = 0;
+      while ((msg = curl_multi_info_read(mMulti, &left)) != nullptr)
+      {
+        if (msg->msg != CURLMSG_DONE)
+        {
+          continue;
+        }
+        char* priv = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        httprequest* r = reinterpret_cast<httprequest*>(priv);
+        r->result = msg->data.result;
+        long connects = 0;
+        double connect = 0, appconnect = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &r->status);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &r->seconds);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_CONNECT_TIME, &connect);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_APPCONNECT_TIME, &appconnect);
+        r->connected = (connects > 0);
+        gConnects.add((uint64_t)connects);
+        if (r->connected && (appconnect > 0))
+        {
+          // a reused connection has no APPCONNECT time, a new one over TLS has
+          gHandshakes.add();
+          gHandshakeTime.record((uint64_t)(std::max(0.0, appconnect - connect) * 1e9));
+        }
+        if (r->ttfb > 0)
+        {
+          gTtfb.record((uint64_t)(r->ttfb * 1e9));
+        }
+      }
+      for (auto& t : transfers)
+      {
+        curl_multi_remove_handle(mMulti, t.first);
+        curl_slist_free_all(t.second);
+        curl_easy_setopt(t.first, CURLOPT_HTTPHEADER, nullptr);
+        mIdle.push_back(t.first);
+      }
+      return result;
+    }
+
+    // CURLOPT_READFUNCTION, the body is pulled from the request
+    size_t httpclient::readBody(char* buffer, size_t size, size_t nitems, void* request)
+    {
+      httprequest* r = static_cast<httprequest*>(request);
+      return r->body ? r->body((uint8_t*)buffer, size * nitems) : 0;
+    }
+
+    // CURLOPT_WRITEFUNCTION, a short count aborts the transfer
+    size_t httpclient::writeResponse(char* ptr, size_t size, size_t nmemb, void* request)
+    {
+      httprequest* r = static_cast<httprequest*>(request);
+      size_t len = size * nmemb;
+      if (r->response && !r->response((const uint8_t*)ptr, len))
+      {
+        return 0;
+      }
+      return len;
+    }
+
+    // collects the headers of the final response, the names in lower case
+    size_t httpclient::readHeader(char* buffer, size_t size, size_t nitems, void* request)
+    {
+      httprequest* r = static_cast<httprequest*>(request);
+      size_t len = size * nitems;
+      std::string line(buffer, len);
+      if (line.compare(0, 5, "HTTP/") == 0)
+      {
+        if (r->ttfb == 0)
+        {
+          // CURLINFO_STARTTRANSFER_TIME of a POST is when the body starts to go out
+          r->ttfb = std::chrono::duration<double>(std::chrono::steady_clock::now() - r->started).count();
+        }
+        r->responseHeaders.clear();   // an interim response came before
+        size_t space = line.find(' ');
+        r->status = (space != std::string::npos) ? atol(line.c_str() + space + 1) : 0;
+        return len;
+      }
+      size_t colon = line.find(':');
+      if (colon != std::string::npos)
+      {
+        std::string name = line.substr(0, colon);
+        for (auto& ch : name)
+        {
+          ch = (char)tolower((unsigned char)ch);
+        }
+        std::string value = line.substr(colon + 1);
+        value.erase(value.find_last_not_of(" \t\r\n") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        r->responseHeaders.push_back(std::make_pair(name, value));
+      }
+      return len;
+    }
+
+    // CURLOPT_XFERINFOFUNCTION, a non zero result aborts the transfer
+    int httpclient::progress(void* request, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+    {
+      httprequest* r = static_cast<httprequest*>(request);
+      return (r->abort && r->abort()) ? 1 : 0;
+    }
+  }
+}
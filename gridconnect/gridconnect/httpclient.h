@@ -0,0 +1,121 @@
+/*
+  httpclient
+
+  long-lived HTTP connections for the uploads: keep-alive, shared TLS sessions, HTTP/2
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "curl/curl.h"
+
+namespace satag
+{
+  namespace util
+  {
+    /*
+      an httprequest is a POST with a body which is pulled while it is sent (chunked),
+      or a GET without one. The response body goes to response as it arrives, which
+      suits a stream that doesn't end. perform() fills in the results.
+    */
+    struct httprequest
+    {
+      std::string url;
+      std::vector<std::string> headers;                   // "Name: value"
+      std::function<size_t(uint8_t* dest, size_t len)> body;  // 0 ends the body, none makes a GET
+      std::function<bool(const uint8_t* data, size_t len)> response;  // false aborts the transfer
+      std::function<bool()> abort;                        // polled, true aborts the transfer
+      // results
+      CURLcode result = CURLE_OK;
+      long status = 0;            // set with the status line, before the response body
+      double seconds = 0;         // request to the end of the response
+      double ttfb = 0;            // request to the first byte of the response
+      std::chrono::steady_clock::time_point started;
+      bool connected = false;     // a new connection was made for it
+      std::vector<std::pair<std::string, std::string>> responseHeaders;  // names in lower case
+      bool ok() const { return (result == CURLE_OK) && (status >= 200) && (status < 300); }
+      std::string error() const;
+      const std::string* header(const char* name) const;
+    };
+
+    struct httpsettings
+    {
+      bool http2 = false;             // HTTP/2 over TLS if the server offers it
+      std::string caInfo;             // CA bundle, empty for the system default
+      long connectTimeout = 30;       // seconds
+      long keepAlive = 30;            // seconds idle until the TCP keep-alive probes
+    };
+
+    /*
+      httpclient keeps its connections open between requests. The easy handles are
+      pooled and reused, a share handle holds the DNS cache, the TLS sessions and the
+      connections, so a request on a warm client costs neither a TCP nor a TLS handshake,
+      and a reconnect after the server closed the connection resumes the TLS session.
+      Idle connections are kept alive with TCP keep-alive probes.
+
+        httpclient client;                  // curl_global_init() was called before
+        httprequest r;
+        r.url = "https://example.com/samples";
+        r.body = [&](uint8_t* dest, size_t len) { return body.read(dest, len); };
+        std::vector<httprequest*> round = { &r };
+        client.perform(round);
+        if (r.ok()) ...
+
+      perform() runs its requests concurrently on one multi handle. With http2 they are
+      multiplexed on one connection if the server speaks HTTP/2 (ALPN), otherwise the
+      client falls back to HTTP/1.1 with a connection per request in flight.
+      The TLS verification stays on, caInfo names a CA bundle for private servers.
+
+      An httpclient is used by one thread. The metrics are http.connects (new
+      connections), http.handshakes (TLS handshakes), http.handshake (handshake time)
+      and http.ttfb (time to the first byte of the response), all in nanoseconds.
+    */
+    class httpclient
+    {
+    public:
+      explicit httpclient(const httpsettings& s = httpsettings());
+      ~httpclient();
+      httpclient(const httpclient&) = delete;
+      httpclient& operator=(const httpclient&) = delete;
+      bool perform(std::vector<httprequest*>& requests);
+    private:
+      CURL* handle();
+      static size_t readBody(char* buffer, size_t size, size_t nitems, void* request);
+      static size_t writeResponse(char* ptr, size_t size, size_t nmemb, void* request);
+      static size_t readHeader(char* buffer, size_t size, size_t nitems, void* request);
+      static int progress(void* request, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+      httpsettings mSettings;
+      CURLM* mMulti = nullptr;
+      CURLSH* mShare = nullptr;
+      std::vector<CURL*> mIdle;         // easy handles for the next requests
+    };
+  }
+}
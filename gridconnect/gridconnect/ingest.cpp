@@ -0,0 +1,885 @@
+/*
+  ingest
+
+  CBOR sample streams from the DSP side over TCP and Unix domain sockets
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "ingest.h"
+#include "metrics.h"
+
+#include <cstring>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <cerrno>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+#endif
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      using namespace satag::util;
+
+      static metrics::counter& gBytes = metrics::registry::instance().getCounter("ingest.bytes");
+      static metrics::counter& gMessages = metrics::registry::instance().getCounter("ingest.messages");
+      static metrics::counter& gInvalid = metrics::registry::instance().getCounter("ingest.invalid");
+      static metrics::counter& gErrors = metrics::registry::instance().getCounter("ingest.errors");
+      static metrics::histogram& gBatch = metrics::registry::instance().getHistogram("ingest.batch");
+      static metrics::counter& gCommands = metrics::registry::instance().getCounter("commands.received");
+      static metrics::counter& gInvalidCommands = metrics::registry::instance().getCounter("commands.invalid");
+      static metrics::histogram& gCommandBatch = metrics::registry::instance().getHistogram("commands.batch");
+
+      void samplereader::reset()
+      {
+        mStack.clear();
+        mText.clear();
+        mField = kNone;
+        mSeen = 0;
+        mTag = 0;
+      }
+
+      /*
+        a map or array inside a sample is skipped as a whole, it counts as one key or value
+      */
+      void samplereader::open(int kind)
+      {
+        bool skip = false;
+        if (!mStack.empty())
+        {
+          frame& top = mStack.back();
+          skip = top.skip || (top.kind != kArray);
+          if (!top.skip && (top.kind == kMap))
+          {
+            if (top.key)
+            {
+              mField = kNone;
+            }
+            top.key = !top.key;
+          }
+        }
+        if ((kind == kMap) && !skip)
+        {
+          mSample = sample();
+          mSeen = 0;
+          mField = kNone;
+        }
+        frame f;
+        f.kind = kind;
+        f.skip = skip;
+        f.key = true;
+        mStack.push_back(f);
+        mTag = 0;
+      }
+
+      void samplereader::stringahead(uint64_t len)
+      {
+        if (len == cbor::kIndefinite)
+        {
+          mText.clear();
+          open(kChunks);
+        }
+      }
+
+      void samplereader::bytesahead(uint64_t len)
+      {
+        if (len == cbor::kIndefinite)
+        {
+          open(kChunks);
+        }
+      }
+
+      void samplereader::string(const char * value, size_t len, bool complete)
+      {
+        if (!mStack.empty() && (mStack.back().kind == kChunks))
+        {
+          mText.append(value, len);   // ends with the break
+          return;
+        }
+        mText.append(value, len);
+        if (complete)
+        {
+          text();
+        }
+      }
+
+      void samplereader::bytes(const uint8_t * mem, size_t len, bool complete)
+      {
+        if (complete && (mStack.empty() || (mStack.back().kind != kChunks)))
+        {
+          other();
+        }
+      }
+
+      void samplereader::breakend(bool wasIndefinite, bool stackempty)
+      {
+        if (mStack.empty())
+        {
+          return;
+        }
+        frame f = mStack.back();
+        mStack.pop_back();
+        if (f.kind == kChunks)
+        {
+          // the indefinite string was counted as a key or value when it was opened
+          if (!mStack.empty() && !mStack.back().skip && (mStack.back().kind == kMap) && !mStack.back().key)
+          {
+            // it was the key, open() flipped to the value already
+            mStack.back().key = true;
+            text();
+          }
+          mText.clear();
+          return;
+        }
+        if ((f.kind == kMap) && !f.skip)
+        {
+          const int required = (1 << kDevice) | (1 << kEntity) | (1 << kValue);
+          if ((mSeen & required) == required)
+          {
+            if (!(mSeen & (1 << kTime)))
+            {
+              mSample.sampletime = store::now();
+            }
+            mOut.push_back(mSample);
+            ++mSamples;
+          }
+          else
+          {
+            ++mInvalid;
+            gInvalid.add();
+          }
+        }
+      }
+
+      void samplereader::scalar(int64_t value)
+      {
+        uint64_t tag = mTag;
+        mTag = 0;
+        if (mStack.empty())
+        {
+          return;
+        }
+        frame& top = mStack.back();
+        if (top.skip || (top.kind != kMap))
+        {
+          return;
+        }
+        if (top.key)
+        {
+          mField = ((value >= kDevice) && (value <= kTime)) ? (int)value : kNone;
+          top.key = false;
+          return;
+        }
+        if ((tag == 1) && (mField == kTime))
+        {
+          value *= kTicksPerSecond;   // epoch time in seconds
+        }
+        set(value);
+        top.key = true;
+      }
+
+      /*
+        a complete text item: a key names the field, a text value is skipped
+      */
+      void samplereader::text()
+      {
+        if (!mStack.empty())
+        {
+          frame& top = mStack.back();
+          if (!top.skip && (top.kind == kMap))
+          {
+            if (top.key)
+            {
+              const std::string& k = mText;
+              if ((k == "device") || (k == "d")) mField = kDevice;
+              else if ((k == "entity") || (k == "e")) mField = kEntity;
+              else if ((k == "value") || (k == "v")) mField = kValue;
+              else if ((k == "time") || (k == "t")) mField = kTime;
+              else mField = kNone;
+              top.key = false;
+            }
+            else
+            {
+              top.key = true;
+            }
+          }
+        }
+        mText.clear();
+        mTag = 0;
+      }
+
+      void samplereader::other()
+      {
+        mTag = 0;
+        if (!mStack.empty())
+        {
+          frame& top = mStack.back();
+          if (!top.skip && (top.kind == kMap))
+          {
+            if (top.key)
+            {
+              mField = kNone;
+            }
+            top.key = !top.key;
+          }
+        }
+      }
+
+      void samplereader::set(int64_t value)
+      {
+        switch (mField)
+        {
+          case kDevice:
+            mSample.device = (int)value;
+            break;
+          case kEntity:
+            mSample.entity = (int)value;
+            break;
+          case kValue:
+            mSample.value = (int)std::max<int64_t>(INT32_MIN, std::min<int64_t>(INT32_MAX, value));
+            break;
+          case kTime:
+            mSample.sampletime = value;
+            break;
+          default:
+            return;
+        }
+        mSeen |= (1 << mField);
+      }
+
+      // ----------------------------------------------------------------------------
+
+      void commandreader::reset()
+      {
+        mStack.clear();
+        mText.clear();
+        mField = kNone;
+        mSeen = 0;
+        mTag = 0;
+      }
+
+      void commandreader::open(int kind)
+      {
+        bool skip = false;
+        if (!mStack.empty())
+        {
+          frame& top = mStack.back();
+          skip = top.skip || (top.kind != kArray);
+          if (!top.skip && (top.kind == kMap))
+          {
+            if (top.key)
+            {
+              mField = kNone;
+            }
+            top.key = !top.key;
+          }
+        }
+        if ((kind == kMap) && !skip)
+        {
+          mCommand = command();
+          mSeen = 0;
+          mField = kNone;
+        }
+        frame f;
+        f.kind = kind;
+        f.skip = skip;
+        f.key = true;
+        mStack.push_back(f);
+        mTag = 0;
+      }
+
+      void commandreader::stringahead(uint64_t len)
+      {
+        if (len == cbor::kIndefinite)
+        {
+          mText.clear();
+          open(kChunks);
+        }
+      }
+
+      void commandreader::bytesahead(uint64_t len)
+      {
+        if (len == cbor::kIndefinite)
+        {
+          open(kChunks);
+        }
+      }
+
+      void commandreader::string(const char * value, size_t len, bool complete)
+      {
+        mText.append(value, len);
+        if (!complete || (!mStack.empty() && (mStack.back().kind == kChunks)))
+        {
+          return;   // more to come, a chunked text ends with the break
+        }
+        if (!mStack.empty() && !mStack.back().skip && (mStack.back().kind == kMap))
+        {
+          frame& top = mStack.back();
+          top.key = !top.key;
+          text(!top.key);
+        }
+        mText.clear();
+        mTag = 0;
+      }
+
+      void commandreader::bytes(const uint8_t * mem, size_t len, bool complete)
+      {
+        if (complete && (mStack.empty() || (mStack.back().kind != kChunks)))
+        {
+          other();
+        }
+      }
+
+      void commandreader::breakend(bool wasIndefinite, bool stackempty)
+      {
+        if (mStack.empty())
+        {
+          return;
+        }
+        frame f = mStack.back();
+        mStack.pop_back();
+        if (f.kind == kChunks)
+        {
+          // open() counted the string as a key or value already
+          if (!mStack.empty() && !mStack.back().skip && (mStack.back().kind == kMap))
+          {
+            text(!mStack.back().key);
+          }
+          mText.clear();
+          return;
+        }
+        if ((f.kind == kMap) && !f.skip)
+        {
+          const int texts = (1 << kText1) | (1 << kText2);
+          if ((mSeen & (1 << kDevice)) && (mSeen & texts))
+          {
+            if (!(mSeen & (1 << kTime)))
+            {
+              mCommand.exectime = store::now();
+            }
+            mOut.push_back(mCommand);
+            ++mCommands;
+            gCommands.add();
+          }
+          else
+          {
+            ++mInvalid;
+            gInvalidCommands.add();
+          }
+        }
+      }
+
+      void commandreader::scalar(int64_t value)
+      {
+        uint64_t tag = mTag;
+        mTag = 0;
+        if (mStack.empty())
+        {
+          return;
+        }
+        frame& top = mStack.back();
+        if (top.skip || (top.kind != kMap))
+        {
+          return;
+        }
+        if (top.key)
+        {
+          mField = ((value >= kDevice) && (value <= kTime)) ? (int)value : kNone;
+          top.key = false;
+          return;
+        }
+        top.key = true;
+        switch (mField)
+        {
+          case kDevice:
+            mCommand.device = (int)value;
+            break;
+          case kText1:
+          case kText2:
+            mText = std::to_string(value);
+            text(false);
+            mText.clear();
+            return;
+          case kTime:
+            mCommand.exectime = (tag == 1) ? value * kTicksPerSecond : value;
+            break;
+          default:
+            return;
+        }
+        mSeen |= (1 << mField);
+      }
+
+      /*
+        a complete text item, key tells if it is a key or a value
+      */
+      void commandreader::text(bool key)
+      {
+        if (key)
+        {
+          const std::string& k = mText;
+          if ((k == "device") || (k == "d")) mField = kDevice;
+          else if ((k == "text1") || (k == "a")) mField = kText1;
+          else if ((k == "text2") || (k == "b")) mField = kText2;
+          else if ((k == "time") || (k == "t")) mField = kTime;
+          else mField = kNone;
+        }
+        else if (mField == kText1)
+        {
+          mCommand.text1 = mText;
+          mCommand.null1 = false;
+          mSeen |= (1 << kText1);
+        }
+        else if (mField == kText2)
+        {
+          mCommand.text2 = mText;
+          mCommand.null2 = false;
+          mSeen |= (1 << kText2);
+        }
+      }
+
+      void commandreader::other()
+      {
+        mTag = 0;
+        if (!mStack.empty())
+        {
+          frame& top = mStack.back();
+          if (!top.skip && (top.kind == kMap))
+          {
+            if (top.key)
+            {
+              mField = kNone;
+            }
+            top.key = !top.key;
+          }
+        }
+      }
+
+      // ----------------------------------------------------------------------------
+
+      commandfeed::commandfeed(sink out)
+        : mSink(out)
+        , mReader(mBatch)
+        , mDecoder(mReader, kStringBuffer)
+      {
+      }
+
+      /*
+        parse decodes the next piece of the body, the commands it completes go to the
+        sink as one batch
+      */
+      bool commandfeed::parse(const uint8_t * data, size_t len)
+      {
+        if (mFailed)
+        {
+          return false;
+        }
+        mBatch.clear();
+        if (!mDecoder.parse(data, len))
+        {
+          gErrors.add();
+          mFailed = true;
+        }
+        if (!mBatch.empty())
+        {
+          gCommandBatch.record(mBatch.size());
+          if (!mSink(mBatch))
+          {
+            mFailed = true;
+          }
+        }
+        return !mFailed;
+      }
+
+      void commandfeed::reset()
+      {
+        mDecoder.reset();
+        mReader.reset();
+        mBatch.clear();
+        mFailed = false;
+      }
+
+      // ----------------------------------------------------------------------------
+
+      struct ingestserver::connection
+      {
+        connection(int socket, std::vector<sample>& out)
+          : fd(socket)
+          , reader(out)
+          , decoder(reader, kStringBuffer)
+        {}
+        int fd;
+        samplereader reader;
+        cbor::decoder decoder;
+      };
+
+      struct ingestserver::loop
+      {
+        int epoll = -1;
+        int wake = -1;                      // eventfd, written by stop()
+        std::thread thread;
+        std::vector<uint8_t> buffer;        // the read buffer, shared by the connections
+        std::vector<sample> batch;          // the samples decoded in this round
+        std::unordered_map<int, std::unique_ptr<connection>> connections;
+      };
+
+#ifdef __linux__
+      // epoll_event.data: the socket, and what it is in the upper half
+      static const uint64_t kConnectionEvent = 0;
+      static const uint64_t kListenerEvent = 1ull << 32;
+      static const uint64_t kWakeEvent = 2ull << 32;
+#endif
+
+      ingestserver::ingestserver(sink out)
+        : mSink(out)
+      {
+      }
+
+      ingestserver::~ingestserver()
+      {
+        stop();
+      }
+
+      bool ingestserver::listenTcp(const char * address, int port)
+      {
+#ifdef __linux__
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+        {
+          return false;
+        }
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+          return false;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        socklen_t len = sizeof(addr);
+        if ((bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) || (listen(fd, SOMAXCONN) != 0)
+          || (getsockname(fd, (sockaddr*)&addr, &len) != 0))
+        {
+          close(fd);
+          return false;
+        }
+        mTcpPort = ntohs(addr.sin_port);
+        mListeners.push_back(fd);
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      bool ingestserver::listenUnix(const char * path)
+      {
+#ifdef __linux__
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+          return false;
+        }
+        strcpy(addr.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+          return false;
+        }
+        unlink(path);   // left over from a crash
+        if ((bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) || (listen(fd, SOMAXCONN) != 0))
+        {
+          close(fd);
+          return false;
+        }
+        mUnixPath = path;
+        mListeners.push_back(fd);
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      /*
+        every loop waits on all listeners, EPOLLEXCLUSIVE wakes only one of them per
+        connection and the connection stays with the loop which accepted it
+      */
+      bool ingestserver::start(size_t loops)
+      {
+#ifdef __linux__
+        if (isRunning() || mListeners.empty())
+        {
+          return false;
+        }
+        loops = std::max<size_t>(1, loops);
+        bool result = true;
+        for (size_t i = 0; result && (i < loops); ++i)
+        {
+          std::unique_ptr<loop> l(new loop());
+          l->buffer.resize(kReadBuffer);
+          l->batch.reserve(kMaxBatch);
+          l->epoll = epoll_create1(EPOLL_CLOEXEC);
+          l->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+          result = (l->epoll >= 0) && (l->wake >= 0);
+          epoll_event ev;
+          memset(&ev, 0, sizeof(ev));
+          if (result)
+          {
+            ev.events = EPOLLIN;
+            ev.data.u64 = kWakeEvent | (uint32_t)l->wake;
+            result = (epoll_ctl(l->epoll, EPOLL_CTL_ADD, l->wake, &ev) == 0);
+          }
+          for (int fd : mListeners)
+          {
+            if (result)
+            {
+              ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+              ev.data.u64 = kListenerEvent | (uint32_t)fd;
+              result = (epoll_ctl(l->epoll, EPOLL_CTL_ADD, fd, &ev) == 0);
+            }
+          }
+          mLoops.push_back(std::move(l));
+        }
+        if (!result)
+        {
+          stop();
+          return false;
+        }
+        for (auto& l : mLoops)
+        {
+          loop* p = l.get();
+          l->thread = std::thread([this, p]() { run(*p); });
+        }
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      /*
+        stop ends the loops, closes all connections and listeners. What was decoded
+        before is in the sink then.
+      */
+      void ingestserver::stop()
+      {
+#ifdef __linux__
+        for (auto& l : mLoops)
+        {
+          if (l->wake >= 0)
+          {
+            uint64_t one = 1;
+            ssize_t written = write(l->wake, &one, sizeof(one));
+            (void)written;
+          }
+        }
+        for (auto& l : mLoops)
+        {
+          if (l->thread.joinable())
+          {
+            l->thread.join();
+          }
+          for (auto& c : l->connections)
+          {
+            close(c.first);
+          }
+          if (l->wake >= 0)
+          {
+            close(l->wake);
+          }
+          if (l->epoll >= 0)
+          {
+            close(l->epoll);
+          }
+        }
+        mLoops.clear();
+        for (int fd : mListeners)
+        {
+          close(fd);
+        }
+        mListeners.clear();
+        if (!mUnixPath.empty())
+        {
+          unlink(mUnixPath.c_str());
+          mUnixPath.clear();
+        }
+#endif
+      }
+
+      void ingestserver::run(loop & l)
+      {
+#ifdef __linux__
+        const int kEvents = 64;
+        epoll_event events[kEvents];
+        bool stopping = false;
+        while (!stopping)
+        {
+          int n = epoll_wait(l.epoll, events, kEvents, -1);
+          if (n < 0)
+          {
+            if (errno == EINTR)
+            {
+              continue;
+            }
+            break;
+          }
+          for (int i = 0; i < n; ++i)
+          {
+            uint64_t kind = events[i].data.u64 & ~0xffffffffull;
+            int fd = (int)(uint32_t)events[i].data.u64;
+            if (kind == kWakeEvent)
+            {
+              stopping = true;
+            }
+            else if (kind == kListenerEvent)
+            {
+              accept(l, fd);
+            }
+            else
+            {
+              auto it = l.connections.find(fd);
+              if ((it != l.connections.end()) && !receive(l, *it->second))
+              {
+                drop(l, it->second.get());
+              }
+            }
+          }
+          flush(l);
+        }
+#endif
+      }
+
+      bool ingestserver::accept(loop & l, int listener)
+      {
+#ifdef __linux__
+        while (true)
+        {
+          int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd < 0)
+          {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+          }
+          epoll_event ev;
+          memset(&ev, 0, sizeof(ev));
+          ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+          ev.data.u64 = kConnectionEvent | (uint32_t)fd;
+          l.connections[fd].reset(new connection(fd, l.batch));
+          if (epoll_ctl(l.epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+          {
+            drop(l, l.connections[fd].get());
+            continue;
+          }
+          ++mConnections;
+          // data may have arrived before the socket was in the set
+          if (!receive(l, *l.connections[fd]))
+          {
+            drop(l, l.connections[fd].get());
+          }
+        }
+#else
+        return false;
+#endif
+      }
+
+      /*
+        edge triggered: read until the socket is empty, everything read goes straight
+        into the decoder. Returns false if the connection is to be closed.
+      */
+      bool ingestserver::receive(loop & l, connection & c)
+      {
+#ifdef __linux__
+        while (true)
+        {
+          ssize_t n = read(c.fd, l.buffer.data(), l.buffer.size());
+          if (n > 0)
+          {
+            gBytes.add((uint64_t)n);
+            if (!c.decoder.parse(l.buffer.data(), (size_t)n))
+            {
+              gErrors.add();
+              return false;
+            }
+            if (l.batch.size() >= kMaxBatch)
+            {
+              flush(l);
+            }
+            continue;
+          }
+          if (n == 0)
+          {
+            return false;
+          }
+          if (errno == EINTR)
+          {
+            continue;
+          }
+          return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        }
+#else
+        return false;
+#endif
+      }
+
+      void ingestserver::flush(loop & l)
+      {
+        if (l.batch.empty())
+        {
+          return;
+        }
+        gBatch.record(l.batch.size());
+        gMessages.add(l.batch.size());
+        mMessages += l.batch.size();
+        if (!mSink(l.batch))
+        {
+          gErrors.add();
+        }
+        l.batch.clear();
+      }
+
+      void ingestserver::drop(loop & l, connection * c)
+      {
+#ifdef __linux__
+        int fd = c->fd;
+        epoll_ctl(l.epoll, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        l.connections.erase(fd);
+#endif
+      }
+    }
+  }
+}
@@ -0,0 +1,284 @@
+/*
+  ingest
+
+  CBOR sample streams from the DSP side over TCP and Unix domain sockets
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "c++bor.h"
+#include "storage.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      /*
+        samplereader turns a decoded CBOR stream into samples. A sample is a map
+
+          { "device": 7, "entity": 12, "value": -2300, "time": 1480000000000000 }
+
+        the keys may be shortened to "d", "e", "v", "t" or given as the integers 1 to 4.
+        time is optional (microseconds since the epoch, or a tag 1 epoch time in seconds),
+        without it the sample is stamped when it is decoded. The maps may come one after
+        another or inside arrays, anything else in the stream is skipped.
+      */
+      class samplereader : public cbor::listener
+      {
+      public:
+        explicit samplereader(std::vector<sample>& out) : mOut(out) {}
+        size_t samples() const { return mSamples; }
+        size_t invalid() const { return mInvalid; }
+        void reset();
+
+        void int32(int32_t value) override { scalar(value); }
+        void int64(int64_t value) override { scalar(value); }
+        void int64p(uint64_t value) override { scalar(INT64_MAX); }
+        void int64n(uint64_t value) override { scalar(INT64_MIN); }
+        void string(const char* value, size_t len, bool complete) override;
+        void bytes(const uint8_t* mem, size_t len, bool complete) override;
+        void float16(float value) override { scalar((int64_t)std::llround(value)); }
+        void float32(float value) override { scalar((int64_t)std::llround(value)); }
+        void float64(double value) override { scalar((int64_t)std::llround(value)); }
+        void boolean(bool value) override { scalar(value ? 1 : 0); }
+        void null() override { other(); }
+        void tag(uint64_t tag) override { mTag = tag; }
+        void array(uint64_t nums) override { open(kArray); }
+        void map(uint64_t nums) override { open(kMap); }
+        void stringahead(uint64_t len) override;
+        void bytesahead(uint64_t len) override;
+        void breakend(bool wasIndefinite, bool stackempty) override;
+        void time(const char* value) override { other(); }
+        void time(int64_t value) override { scalar(value * kTicksPerSecond); }
+      private:
+        enum field : int_fast16_t
+        {
+          kNone = 0,
+          kDevice,
+          kEntity,
+          kValue,
+          kTime,
+        };
+        enum framekind : int_fast16_t
+        {
+          kArray = 0,
+          kMap,
+          kChunks,            // an indefinite text or byte string
+        };
+        struct frame
+        {
+          int kind;
+          bool skip;          // the contents don't matter, e.g. a map inside a sample
+          bool key;           // the next item is a key
+        };
+        void scalar(int64_t value);
+        void text();
+        void other();
+        void open(int kind);
+        void set(int64_t value);
+        std::vector<sample>& mOut;    // decoded samples are appended here
+        std::vector<frame> mStack;    // the open maps and arrays
+        std::string mText;            // a text item collected from chunks
+        int mField = kNone;           // the field the next value goes to
+        int mSeen = 0;                // bits of the fields set in the current map
+        uint64_t mTag = 0;            // the tag of the next item
+        sample mSample;               // the sample being read
+        size_t mSamples = 0;          // complete samples
+        size_t mInvalid = 0;          // maps without device, entity or value
+      };
+
+      /*
+        commandreader turns a decoded CBOR stream into commands for ControlCommandsIn.
+        A command is a map
+
+          { "device": 7, "text1": "charge", "text2": "2000", "time": 1480000000000000 }
+
+        with the short keys "d", "a", "b", "t" or the integers 1 to 4. The texts may be
+        missing or null, a map without a device or without any text is invalid. time
+        becomes the exectime (microseconds, or a tag 1 epoch time in seconds), without
+        it the command is stamped when it is decoded. Like the samples, the commands
+        may come one after another or inside arrays.
+      */
+      class commandreader : public cbor::listener
+      {
+      public:
+        explicit commandreader(std::vector<command>& out) : mOut(out) {}
+        size_t commands() const { return mCommands; }
+        size_t invalid() const { return mInvalid; }
+        void reset();
+
+        void int32(int32_t value) override { scalar(value); }
+        void int64(int64_t value) override { scalar(value); }
+        void int64p(uint64_t value) override { scalar(INT64_MAX); }
+        void int64n(uint64_t value) override { scalar(INT64_MIN); }
+        void string(const char* value, size_t len, bool complete) override;
+        void bytes(const uint8_t* mem, size_t len, bool complete) override;
+        void float16(float value) override { scalar((int64_t)std::llround(value)); }
+        void float32(float value) override { scalar((int64_t)std::llround(value)); }
+        void float64(double value) override { scalar((int64_t)std::llround(value)); }
+        void boolean(bool value) override { scalar(value ? 1 : 0); }
+        void null() override { other(); }
+        void tag(uint64_t tag) override { mTag = tag; }
+        void array(uint64_t nums) override { open(kArray); }
+        void map(uint64_t nums) override { open(kMap); }
+        void stringahead(uint64_t len) override;
+        void bytesahead(uint64_t len) override;
+        void breakend(bool wasIndefinite, bool stackempty) override;
+        void time(const char* value) override { other(); }
+        void time(int64_t value) override { scalar(value * kTicksPerSecond); }
+      private:
+        enum field : int_fast16_t
+        {
+          kNone = 0,
+          kDevice,
+          kText1,
+          kText2,
+          kTime,
+        };
+        enum framekind : int_fast16_t
+        {
+          kArray = 0,
+          kMap,
+          kChunks,            // an indefinite text or byte string
+        };
+        struct frame
+        {
+          int kind;
+          bool skip;          // the contents don't matter, e.g. a map inside a command
+          bool key;           // the next item is a key
+        };
+        void scalar(int64_t value);
+        void text(bool key);
+        void other();
+        void open(int kind);
+        std::vector<command>& mOut;   // decoded commands are appended here
+        std::vector<frame> mStack;    // the open maps and arrays
+        std::string mText;            // a text item collected from chunks
+        int mField = kNone;           // the field the next value goes to
+        int mSeen = 0;                // bits of the fields set in the current map
+        uint64_t mTag = 0;            // the tag of the next item
+        command mCommand;             // the command being read
+        size_t mCommands = 0;         // complete commands
+        size_t mInvalid = 0;          // maps without device or texts
+      };
+
+      /*
+        commandfeed decodes a response body which arrives in pieces, e.g. a long-poll
+        or a chunked stream of commands, and hands the commands completed by each piece
+        to the sink as one batch:
+
+          commandfeed feed([&](const std::vector<command>& batch) { return store.addCommands(batch); });
+          request.response = [&](const uint8_t* data, size_t len) { return feed.parse(data, len); };
+
+        parse is false once the body isn't CBOR or the sink failed, reset() starts over
+        with the next response.
+      */
+      class commandfeed
+      {
+      public:
+        typedef std::function<bool(const std::vector<command>& batch)> sink;
+        static const size_t kStringBuffer = 4096;   // decoder buffer, the texts may be longer than keys
+
+        explicit commandfeed(sink out);
+        bool parse(const uint8_t* data, size_t len);
+        void reset();
+        size_t commands() const { return mReader.commands(); }
+        size_t invalid() const { return mReader.invalid(); }
+      private:
+        sink mSink;
+        std::vector<command> mBatch;  // the commands of the current piece
+        commandreader mReader;
+        cbor::decoder mDecoder;
+        bool mFailed = false;         // the decoder or the sink failed, until reset()
+      };
+
+      /*
+        ingestserver accepts stream connections on local TCP ports and Unix domain
+        sockets and feeds what it receives straight into a cbor::decoder per connection,
+        the decoder keeps its state across partial reads.
+
+          ingestserver server([&](const std::vector<sample>& batch) { return store.logDSPEvents(batch); });
+          server.listenUnix("/run/gridconnect/ingest.sock");
+          server.listenTcp("127.0.0.1", 4711);
+          server.start(2);          // two event loops
+          ...
+          server.stop();
+
+        Each event loop waits on an epoll set with edge-triggered sockets and reads until
+        EAGAIN into a buffer of its own, which is reused for every connection. The samples
+        decoded in one round of events go to the sink as one batch (at most kMaxBatch),
+        a shardedstore as the sink queues them to its writers without blocking the loop.
+        A connection which sends something that isn't CBOR is closed.
+
+        Only available on Linux, start() fails elsewhere.
+      */
+      class ingestserver
+      {
+      public:
+        typedef std::function<bool(const std::vector<sample>& batch)> sink;
+        static const size_t kReadBuffer = 65536;    // bytes read per call
+        static const size_t kMaxBatch = 4096;       // samples per sink call
+        static const size_t kStringBuffer = 256;    // decoder buffer, keys are short
+
+        explicit ingestserver(sink out);
+        ~ingestserver();
+        bool listenTcp(const char* address, int port);
+        bool listenUnix(const char* path);
+        int tcpPort() const { return mTcpPort; }
+        bool start(size_t loops = 1);
+        void stop();
+        bool isRunning() const { return !mLoops.empty(); }
+        uint64_t connections() const { return mConnections.load(); }
+        uint64_t messages() const { return mMessages.load(); }
+      private:
+        struct connection;
+        struct loop;
+        void run(loop& l);
+        bool accept(loop& l, int listener);
+        bool receive(loop& l, connection& c);
+        void flush(loop& l);
+        void drop(loop& l, connection* c);
+        sink mSink;
+        std::vector<int> mListeners;            // listening sockets
+        std::string mUnixPath;                  // removed again by stop()
+        int mTcpPort = 0;                       // the bound port, for listenTcp(..., 0)
+        std::vector<std::unique_ptr<loop>> mLoops;
+        std::atomic<uint64_t> mConnections{ 0 };  // accepted so far
+        std::atomic<uint64_t> mMessages{ 0 };     // samples handed to the sink
+      };
+    }
+  }
+}
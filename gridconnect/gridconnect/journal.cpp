@@ -0,0 +1,473 @@
+/*
+  journal
+
+  crash-safe append-only journal of the samples ahead of SQLite
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "journal.h"
+#include "c++bor.h"
+#include "ingest.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      using namespace satag::util;
+
+      static metrics::counter& gAppends = metrics::registry::instance().getCounter("journal.appends");
+      static metrics::counter& gBytes = metrics::registry::instance().getCounter("journal.bytes");
+      static metrics::counter& gTruncates = metrics::registry::instance().getCounter("journal.truncates");
+      static metrics::counter& gTorn = metrics::registry::instance().getCounter("journal.torn");
+      static metrics::histogram& gSyncTime = metrics::registry::instance().getHistogram("journal.sync");
+
+      // the file is read in pieces of this size
+      static const size_t kReadChunk = 65536;
+
+      constexpr std::chrono::milliseconds journal::kJournalSync;
+
+      namespace internal
+      {
+        static int openFile(const char* path, bool create)
+        {
+#ifdef _WIN32
+          return _open(path, _O_RDWR | _O_BINARY | _O_NOINHERIT | (create ? _O_CREAT : 0), _S_IREAD | _S_IWRITE);
+#else
+          return ::open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+#endif
+        }
+
+        static void closeFile(int fd)
+        {
+#ifdef _WIN32
+          _close(fd);
+#else
+          ::close(fd);
+#endif
+        }
+
+        static bool seekTo(int fd, uint64_t pos)
+        {
+#ifdef _WIN32
+          return _lseeki64(fd, (__int64)pos, SEEK_SET) == (__int64)pos;
+#else
+          return lseek(fd, (off_t)pos, SEEK_SET) == (off_t)pos;
+#endif
+        }
+
+        // the number of bytes read, 0 at the end, -1 on an error
+        static long long readSome(int fd, uint8_t* mem, size_t len)
+        {
+#ifdef _WIN32
+          return _read(fd, mem, (unsigned)len);
+#else
+          ssize_t n;
+          do
+          {
+            n = ::read(fd, mem, len);
+          } while ((n < 0) && (errno == EINTR));
+          return n;
+#endif
+        }
+
+        static bool writeAll(int fd, const uint8_t* mem, size_t len)
+        {
+          while (len > 0)
+          {
+#ifdef _WIN32
+            int n = _write(fd, mem, (unsigned)len);
+#else
+            ssize_t n = ::write(fd, mem, len);
+            if ((n < 0) && (errno == EINTR))
+            {
+              continue;
+            }
+#endif
+            if (n <= 0)
+            {
+              return false;
+            }
+            mem += n;
+            len -= (size_t)n;
+          }
+          return true;
+        }
+
+        static bool truncateFile(int fd, uint64_t size)
+        {
+#ifdef _WIN32
+          return _chsize_s(fd, (__int64)size) == 0;
+#else
+          return ftruncate(fd, (off_t)size) == 0;
+#endif
+        }
+
+        // only the data and the size have to reach the disk, not the times of the file
+        static bool syncData(int fd)
+        {
+#if defined(_WIN32)
+          return _commit(fd) == 0;
+#elif defined(__APPLE__)
+          return fsync(fd) == 0;
+#else
+          return fdatasync(fd) == 0;
+#endif
+        }
+
+        // reads the head of a CBOR item of the given major type
+        static bool head(const uint8_t*& p, const uint8_t* end, int major, uint64_t& value)
+        {
+          if ((p >= end) || ((*p >> 5) != major))
+          {
+            return false;
+          }
+          int minor = *p++ & 0x1f;
+          if (minor < 24)
+          {
+            value = (uint64_t)minor;
+            return true;
+          }
+          size_t n = (minor == 24) ? 1 : (minor == 25) ? 2 : (minor == 26) ? 4 : (minor == 27) ? 8 : 0;
+          if ((n == 0) || ((size_t)(end - p) < n))
+          {
+            return false;
+          }
+          value = 0;
+          while (n--)
+          {
+            value = (value << 8) | *p++;
+          }
+          return true;
+        }
+
+        static uint32_t recordCrc(uint64_t seq, const uint8_t* payload, size_t len)
+        {
+          uint8_t be[8];
+          for (int i = 7; i >= 0; --i)
+          {
+            be[i] = (uint8_t)(seq & 0xff);
+            seq >>= 8;
+          }
+          return journal::crc32(payload, len, journal::crc32(be, sizeof(be)));
+        }
+      }
+
+      journal::journal()
+      {
+      }
+
+      journal::~journal()
+      {
+        close();
+      }
+
+      /*
+        open opens (with a mode other than nojournal creates) the journal, checks its
+        records and cuts off a torn tail, so the next append follows the last complete
+        record. applied is the sequence number the database has, the next record gets a
+        higher one even if the journal is empty. With nojournal a missing file isn't an
+        error, open() is false then and there is nothing to replay.
+      */
+      bool journal::open(const char* path, int64_t applied, journaling mode)
+      {
+        close();
+        mPath = path;
+        mMode = mode;
+        mFd = internal::openFile(path, mode != nojournal);
+        if (mFd < 0)
+        {
+          return false;
+        }
+        uint64_t end = 0;
+        mLast = 0;
+        if (!scan(nullptr, end))
+        {
+          close();
+          return false;
+        }
+        // anything after the last complete record was a write cut short by a crash
+        uint8_t probe[1];
+        bool torn = internal::seekTo(mFd, end) && (internal::readSome(mFd, probe, sizeof(probe)) > 0);
+        if (torn)
+        {
+          gTorn.add();
+        }
+        if (mLast <= applied)
+        {
+          // the database has all of it, the sequence goes on from there
+          end = 0;
+        }
+        if ((torn || (end == 0)) && (!internal::truncateFile(mFd, end) || !internal::syncData(mFd)))
+        {
+          close();
+          return false;
+        }
+        mSize = end;
+        mLast = std::max(mLast, applied);
+        mDirty = false;
+        mSynced = std::chrono::steady_clock::now();
+        if (!internal::seekTo(mFd, mSize))
+        {
+          close();
+          return false;
+        }
+        return true;
+      }
+
+      /*
+        close syncs what was appended, the file stays
+      */
+      void journal::close()
+      {
+        if (mFd >= 0)
+        {
+          sync();
+          internal::closeFile(mFd);
+          mFd = -1;
+        }
+        mSize = 0;
+        mDirty = false;
+      }
+
+      /*
+        replay hands the records with a sequence number after the given one to fun in
+        order, it stops early if fun returns false
+      */
+      bool journal::replay(int64_t after, std::function<bool(int64_t seq, const std::vector<sample>& samples)> fun)
+      {
+        std::vector<sample> samples;
+        samplereader reader(samples);
+        uint64_t end = 0;
+        bool result = scan([&](int64_t seq, const uint8_t* payload, size_t len)
+        {
+          if (seq <= after)
+          {
+            return true;
+          }
+          samples.clear();
+          reader.reset();
+          cbor::decoder d(reader, 64);
+          d.parse(payload, len);
+          return fun(seq, samples);
+        }, end);
+        // appends continue at the end
+        return internal::seekTo(mFd, mSize) && result;
+      }
+
+      /*
+        append writes the samples as one record and returns its sequence number. With
+        journalsynced the record is on disk when append returns, with journaled it is
+        synced together with the records of the next kJournalSync. A failed write is cut
+        off again, the journal stays as it was.
+      */
+      bool journal::append(const sample* samples, size_t count, int64_t& seq)
+      {
+        if (mFd < 0)
+        {
+          return false;
+        }
+        mPayload.clear();
+        {
+          cbor::encoder out([this](const uint8_t* mem, size_t len) { mPayload.insert(mPayload.end(), mem, mem + len); });
+          for (const sample* s = samples; s != samples + count; ++s)
+          {
+            out.map(4);
+            out.int32(1);
+            out.int32(s->device);
+            out.int32(2);
+            out.int32(s->entity);
+            out.int32(3);
+            out.int32(s->value);
+            out.int32(4);
+            out.int64(s->sampletime);
+          }
+        }
+        int64_t next = mLast + 1;
+        mRecord.clear();
+        {
+          cbor::encoder out([this](const uint8_t* mem, size_t len) { mRecord.insert(mRecord.end(), mem, mem + len); });
+          out.array(3);
+          out.int64(next);
+          out.int64(internal::recordCrc((uint64_t)next, mPayload.data(), mPayload.size()));
+          out.bytes(mPayload.data(), mPayload.size(), true);
+        }
+        if (!internal::writeAll(mFd, mRecord.data(), mRecord.size()))
+        {
+          internal::truncateFile(mFd, mSize);
+          internal::seekTo(mFd, mSize);
+          return false;
+        }
+        mLast = next;
+        mSize += mRecord.size();
+        mDirty = true;
+        gAppends.add();
+        gBytes.add(mRecord.size());
+        seq = next;
+        if ((mMode == journalsynced) || (std::chrono::steady_clock::now() - mSynced >= kJournalSync))
+        {
+          return sync();
+        }
+        return true;
+      }
+
+      bool journal::sync()
+      {
+        if (!mDirty || (mFd < 0))
+        {
+          return true;
+        }
+        metrics::stopwatch watch(gSyncTime);
+        if (!internal::syncData(mFd))
+        {
+          return false;
+        }
+        mDirty = false;
+        mSynced = std::chrono::steady_clock::now();
+        return true;
+      }
+
+      /*
+        truncate empties the journal once everything in it is applied. The truncation
+        itself isn't synced: records which come back after a crash have sequence numbers
+        the database already has, and the first of them ends the scan anyway.
+      */
+      bool journal::truncate()
+      {
+        if (mFd < 0)
+        {
+          return false;
+        }
+        if (mSize == 0)
+        {
+          return true;
+        }
+        if (!internal::truncateFile(mFd, 0) || !internal::seekTo(mFd, 0))
+        {
+          return false;
+        }
+        mSize = 0;
+        gTruncates.add();
+        return true;
+      }
+
+      /*
+        the CRC-32 of zlib and PNG, crc continues a previous one
+      */
+      uint32_t journal::crc32(const uint8_t * mem, size_t len, uint32_t crc)
+      {
+        static const std::array<uint32_t, 256> table = []()
+        {
+          std::array<uint32_t, 256> t;
+          for (uint32_t i = 0; i < 256; ++i)
+          {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+            {
+              c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+            }
+            t[i] = c;
+          }
+          return t;
+        }();
+        crc = ~crc;
+        while (len--)
+        {
+          crc = table[(crc ^ *mem++) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+      }
+
+      /*
+        scan reads the records from the start and gives their payloads to fun. It stops
+        at the first record which is incomplete, doesn't check out or doesn't continue
+        the sequence, end is the end of the record before. mLast becomes the sequence
+        number of the last good record.
+      */
+      bool journal::scan(std::function<bool(int64_t seq, const uint8_t* payload, size_t len)> fun, uint64_t& end)
+      {
+        end = 0;
+        if (!internal::seekTo(mFd, 0))
+        {
+          return false;
+        }
+        int64_t last = 0;
+        cbor::sequencereader records([&](const uint8_t* item, size_t len)
+        {
+          const uint8_t* p = item;
+          const uint8_t* itemEnd = item + len;
+          uint64_t n = 0;
+          uint64_t seq = 0;
+          uint64_t crc = 0;
+          uint64_t size = 0;
+          if (!internal::head(p, itemEnd, 4, n) || (n != 3)
+            || !internal::head(p, itemEnd, 0, seq) || !internal::head(p, itemEnd, 0, crc)
+            || !internal::head(p, itemEnd, 2, size) || ((uint64_t)(itemEnd - p) != size)
+            || (seq > (uint64_t)INT64_MAX) || ((last != 0) && ((int64_t)seq != last + 1))
+            || (internal::recordCrc(seq, p, (size_t)size) != (uint32_t)crc))
+          {
+            return false;
+          }
+          if (fun && !fun((int64_t)seq, p, (size_t)size))
+          {
+            return false;
+          }
+          last = (int64_t)seq;
+          end += len;
+          return true;
+        });
+        std::vector<uint8_t> chunk(kReadChunk);
+        while (true)
+        {
+          long long n = internal::readSome(mFd, chunk.data(), chunk.size());
+          if (n < 0)
+          {
+            return false;
+          }
+          if ((n == 0) || !records.feed(chunk.data(), (size_t)n))
+          {
+            break;
+          }
+        }
+        mLast = std::max(mLast, last);
+        return true;
+      }
+    }
+  }
+}
@@ -0,0 +1,113 @@
+/*
+  journal
+
+  crash-safe append-only journal of the samples ahead of SQLite
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      struct sample;
+
+      // how the samples get to disk
+      enum journaling : int_fast16_t
+      {
+        nojournal = 0,      // straight into SQLite, committed before logDSPEvents returns
+        journaled,          // appended to the journal, fdatasync at most every kJournalSync
+        journalsynced,      // appended to the journal, fdatasync before logDSPEvents returns
+      };
+
+      /*
+        journal is the append-only file in front of the database. Every append is one
+        record, a CBOR sequence item
+
+          [seq, crc32, h'...']
+
+        with the samples as maps {1: device, 2: entity, 3: value, 4: sampletime} in the
+        byte string (the map format of the uploads) and the CRC-32 over the sequence number
+        (8 bytes big endian) and these bytes. The sequence numbers grow by one per record.
+
+        The records are written one after another, so a sample is durable at the cost
+        of a sequential write instead of a SQLite commit. Who applies them to the
+        database stores the last sequence number applied in the same transaction and
+        truncates the journal once it is caught up. After a crash open() finds the end
+        of the last complete record: a torn or corrupt record and everything after it is
+        cut off, and replay() hands out the records after the applied sequence number.
+
+          journal j;
+          j.open("battery.sq3.jnl", applied, journaled);
+          j.replay(applied, [&](int64_t seq, const std::vector<sample>& samples) { ... });
+          int64_t seq;
+          j.append(samples.data(), samples.size(), seq);
+          ...
+          j.truncate();     // everything up to j.last() is in the database
+      */
+      class journal
+      {
+      public:
+        static constexpr std::chrono::milliseconds kJournalSync{ 20 };   // journaled: the longest a record stays unsynced while appending
+
+        journal();
+        ~journal();
+        journal(const journal&) = delete;
+        journal& operator=(const journal&) = delete;
+        bool open(const char* path, int64_t applied, journaling mode);
+        void close();
+        bool isOpen() const { return mFd >= 0; }
+        journaling mode() const { return mMode; }
+        bool replay(int64_t after, std::function<bool(int64_t seq, const std::vector<sample>& samples)> fun);
+        bool append(const sample* samples, size_t count, int64_t& seq);
+        bool sync();
+        bool truncate();
+        int64_t last() const { return mLast; }
+        uint64_t size() const { return mSize; }
+        const std::string& path() const { return mPath; }
+        static uint32_t crc32(const uint8_t* mem, size_t len, uint32_t crc = 0);
+      private:
+        bool scan(std::function<bool(int64_t seq, const uint8_t* payload, size_t len)> fun, uint64_t& end);
+        std::string mPath;
+        int mFd = -1;                     // the file, -1 if not open
+        journaling mMode = nojournal;
+        int64_t mLast = 0;                // sequence number of the last record
+        uint64_t mSize = 0;               // end of the last complete record
+        bool mDirty = false;              // appended since the last fdatasync
+        std::chrono::steady_clock::time_point mSynced;   // time of the last fdatasync
+        std::vector<uint8_t> mPayload;    // reused by append()
+        std::vector<uint8_t> mRecord;     // reused by append()
+      };
+    }
+  }
+}
@@ -0,0 +1,270 @@
+/*
+  metrics
+
+  lock-free counters and latency histograms for the gridconnector
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "metrics.h"
+
+#include <cstring>
+#include <cstdio>
+
+namespace satag
+{
+  namespace util
+  {
+    namespace metrics
+    {
+      size_t slot()
+      {
+        static std::atomic<size_t> next{ 0 };
+        thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % kSlots;
+        return mine;
+      }
+
+      uint64_t counter::value() const
+      {
+        uint64_t result = 0;
+        for (auto& c : mSlots)
+        {
+          result += c.value.load(std::memory_order_relaxed);
+        }
+        return result;
+      }
+
+      // ----------------------------------------------------------------------------
+
+      /*
+        values below kSubBuckets have a bucket each, above the bucket is made of the
+        position of the highest bit and the kSubBits bits below it
+      */
+      int histogram::bucketOf(uint64_t value)
+      {
+        if (value < (uint64_t)kSubBuckets)
+        {
+          return (int)value;
+        }
+        int msb = 63;
+        while (!(value & (1ULL << msb)))
+        {
+          --msb;
+        }
+        int shift = msb - kSubBits;
+        int sub = (int)((value >> shift) & (kSubBuckets - 1));
+        return (shift + 1) * kSubBuckets + sub;
+      }
+
+      // the highest value of a bucket
+      uint64_t histogram::bucketValue(int bucket)
+      {
+        if (bucket < kSubBuckets)
+        {
+          return (uint64_t)bucket;
+        }
+        int shift = bucket / kSubBuckets - 1;
+        uint64_t sub = (uint64_t)(bucket % kSubBuckets);
+        uint64_t low = ((uint64_t)kSubBuckets + sub) << shift;
+        return low + ((1ULL << shift) - 1);
+      }
+
+      void histogram::record(uint64_t value)
+      {
+        auto& c = mSlots[slot()];
+        c.buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        c.sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = c.max.load(std::memory_order_relaxed);
+        while ((value > max) && !c.max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        {
+        }
+        c.count.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      /*
+        take sums up the slots. The writers keep going, so the count is taken from the
+        buckets to keep percentiles consistent.
+      */
+      void histogram::take(snapshot & s) const
+      {
+        s = snapshot();
+        for (auto& c : mSlots)
+        {
+          for (int b = 0; b < kBuckets; ++b)
+          {
+            uint64_t n = c.buckets[b].load(std::memory_order_relaxed);
+            s.buckets[b] += n;
+            s.count += n;
+          }
+          s.sum += c.sum.load(std::memory_order_relaxed);
+          uint64_t max = c.max.load(std::memory_order_relaxed);
+          if (max > s.max)
+          {
+            s.max = max;
+          }
+        }
+      }
+
+      uint64_t histogram::snapshot::percentile(double p) const
+      {
+        if (count == 0)
+        {
+          return 0;
+        }
+        uint64_t rank = (uint64_t)(p / 100.0 * (double)count + 0.5);
+        if (rank < 1)
+        {
+          rank = 1;
+        }
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; ++b)
+        {
+          seen += buckets[b];
+          if (seen >= rank)
+          {
+            uint64_t v = bucketValue(b);
+            return (v < max) ? v : max;
+          }
+        }
+        return max;
+      }
+
+      /*
+        subtract turns a snapshot into the values recorded since an earlier one, the
+        maximum can't be taken back and stays the maximum since start
+      */
+      void histogram::snapshot::subtract(const snapshot & earlier)
+      {
+        count = 0;
+        for (int b = 0; b < kBuckets; ++b)
+        {
+          buckets[b] -= earlier.buckets[b];
+          count += buckets[b];
+        }
+        sum -= earlier.sum;
+      }
+
+      // ----------------------------------------------------------------------------
+
+      registry & registry::instance()
+      {
+        static registry r;
+        return r;
+      }
+
+      counter & registry::getCounter(const char * name)
+      {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto& c = mCounters[name];
+        if (!c)
+        {
+          c.reset(new counter());
+        }
+        return *c;
+      }
+
+      histogram & registry::getHistogram(const char * name)
+      {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto& h = mHistograms[name];
+        if (!h)
+        {
+          h.reset(new histogram());
+        }
+        return *h;
+      }
+
+      /*
+        snapshot writes all metrics as one CBOR map:
+
+          { "counters": { name: value, ... },
+            "histograms": { name: { "count", "sum", "mean", "p50", "p90", "p99", "max" }, ... } }
+      */
+      void registry::snapshot(satag::cbor::listener & out) const
+      {
+        auto key = [&](const char* s)
+        {
+          out.string(s, strlen(s), true);
+        };
+        std::lock_guard<std::mutex> lock(mLock);
+        out.map(2);
+        key("counters");
+        out.map(mCounters.size());
+        for (auto& c : mCounters)
+        {
+          key(c.first.c_str());
+          out.int64((int64_t)c.second->value());
+        }
+        key("histograms");
+        out.map(mHistograms.size());
+        std::unique_ptr<histogram::snapshot> s(new histogram::snapshot());
+        for (auto& h : mHistograms)
+        {
+          h.second->take(*s);
+          key(h.first.c_str());
+          out.map(7);
+          key("count");
+          out.int64((int64_t)s->count);
+          key("sum");
+          out.int64((int64_t)s->sum);
+          key("mean");
+          out.float64(s->mean());
+          key("p50");
+          out.int64((int64_t)s->percentile(50));
+          key("p90");
+          out.int64((int64_t)s->percentile(90));
+          key("p99");
+          out.int64((int64_t)s->percentile(99));
+          key("max");
+          out.int64((int64_t)s->max);
+        }
+      }
+
+      /*
+        text renders the metrics one per line, e.g. for a log file or the console
+      */
+      std::string registry::text() const
+      {
+        std::string result;
+        char line[512];
+        std::lock_guard<std::mutex> lock(mLock);
+        for (auto& c : mCounters)
+        {
+          snprintf(line, sizeof(line), "%s %llu\n", c.first.c_str(), (unsigned long long)c.second->value());
+          result += line;
+        }
+        std::unique_ptr<histogram::snapshot> s(new histogram::snapshot());
+        for (auto& h : mHistograms)
+        {
+          h.second->take(*s);
+          snprintf(line, sizeof(line), "%s count=%llu mean=%.1f p50=%llu p90=%llu p99=%llu max=%llu\n",
+            h.first.c_str(), (unsigned long long)s->count, s->mean(),
+            (unsigned long long)s->percentile(50), (unsigned long long)s->percentile(90),
+            (unsigned long long)s->percentile(99), (unsigned long long)s->max);
+          result += line;
+        }
+        return result;
+      }
+    }
+  }
+}
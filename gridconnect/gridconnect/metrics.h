@@ -0,0 +1,180 @@
+/*
+  metrics
+
+  lock-free counters and latency histograms for the gridconnector
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "c++bor.h"
+
+namespace satag
+{
+  namespace util
+  {
+    namespace metrics
+    {
+      // number of slots the writers are spread over, a thread always uses the same slot
+      const size_t kSlots = 8;
+
+      // the slot of the calling thread
+      size_t slot();
+
+      /*
+        a counter is a set of cache line sized atomics, one per slot, so threads
+        counting concurrently don't share a cache line. Reading sums up the slots.
+      */
+      class counter
+      {
+      public:
+        void add(uint64_t n = 1) { mSlots[slot()].value.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t value() const;
+      private:
+        struct alignas(64) cell
+        {
+          std::atomic<uint64_t> value{ 0 };
+        };
+        cell mSlots[kSlots];
+      };
+
+      /*
+        histogram records values (e.g. nanoseconds) in log-linear buckets like HdrHistogram:
+        every power of two is split into kSubBuckets buckets, which gives a relative error
+        below 1/kSubBuckets. Recording is one relaxed atomic increment per bucket and sum.
+      */
+      class histogram
+      {
+      public:
+        static const int kSubBits = 4;
+        static const int kSubBuckets = 1 << kSubBits;
+        static const int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+        /*
+          a consistent copy of the histogram, taken without stopping the writers
+        */
+        struct snapshot
+        {
+          uint64_t count = 0;
+          uint64_t sum = 0;
+          uint64_t max = 0;
+          uint64_t buckets[kBuckets] = {};
+          uint64_t percentile(double p) const;
+          double mean() const { return count ? (double)sum / (double)count : 0.0; }
+          void subtract(const snapshot& earlier);
+        };
+
+        void record(uint64_t value);
+        void take(snapshot& s) const;
+        static int bucketOf(uint64_t value);
+        static uint64_t bucketValue(int bucket);
+      private:
+        struct alignas(64) cell
+        {
+          std::atomic<uint64_t> count{ 0 };
+          std::atomic<uint64_t> sum{ 0 };
+          std::atomic<uint64_t> max{ 0 };
+          std::atomic<uint64_t> buckets[kBuckets];
+          cell() { for (auto& b : buckets) b.store(0, std::memory_order_relaxed); }
+        };
+        cell mSlots[kSlots];
+      };
+
+      /*
+        the registry owns all named metrics. Looking up a name takes a lock, so users keep
+        the returned reference (it stays valid for the lifetime of the process).
+
+          static auto& commits = registry::instance().getHistogram("db.commit");
+          commits.record(ns);
+      */
+      class registry
+      {
+      public:
+        static registry& instance();
+        counter& getCounter(const char* name);
+        histogram& getHistogram(const char* name);
+        void snapshot(satag::cbor::listener& out) const;
+        std::string text() const;
+      private:
+        registry() {}
+        mutable std::mutex mLock;
+        std::map<std::string, std::unique_ptr<counter>> mCounters;
+        std::map<std::string, std::unique_ptr<histogram>> mHistograms;
+      };
+
+      /*
+        stopwatch records the nanoseconds between construction and destruction (or stop())
+      */
+      class stopwatch
+      {
+      public:
+        explicit stopwatch(histogram& h)
+          : mHistogram(&h)
+          , mStart(std::chrono::steady_clock::now())
+        {}
+        ~stopwatch() { stop(); }
+        void stop()
+        {
+          if (mHistogram)
+          {
+            mHistogram->record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - mStart).count());
+            mHistogram = nullptr;
+          }
+        }
+      private:
+        histogram* mHistogram;
+        std::chrono::steady_clock::time_point mStart;
+      };
+
+      /*
+        timedlock is a lock_guard which records how long it waited for the mutex
+      */
+      template<class M>
+      class timedlock
+      {
+      public:
+        timedlock(M& m, histogram& wait)
+          : mMutex(m)
+        {
+          stopwatch w(wait);
+          mMutex.lock();
+        }
+        ~timedlock() { mMutex.unlock(); }
+        timedlock(const timedlock&) = delete;
+        timedlock& operator=(const timedlock&) = delete;
+      private:
+        M& mMutex;
+      };
+    }
+  }
+}
@@ -0,0 +1,450 @@
+/*
+  replay
+
+  bulk import of CBOR capture files pulled from the DSP
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "replay.h"
+#include "ingest.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace satag
+{
+  namespace util
+  {
+    bool mappedfile::open(const char* path)
+    {
+      close();
+#ifdef _WIN32
+      HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+      {
+        return false;
+      }
+      mFile = file;
+      LARGE_INTEGER size;
+      if (!GetFileSizeEx(file, &size))
+      {
+        close();
+        return false;
+      }
+      mSize = (size_t)size.QuadPart;
+      if (mSize == 0)
+      {
+        return true;    // an empty file can't be mapped, there is nothing to read anyway
+      }
+      mMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mMapping)
+      {
+        mData = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+      }
+#else
+      mFd = ::open(path, O_RDONLY | O_CLOEXEC);
+      if (mFd < 0)
+      {
+        return false;
+      }
+      struct stat st;
+      if (fstat(mFd, &st) != 0)
+      {
+        close();
+        return false;
+      }
+      mSize = (size_t)st.st_size;
+      if (mSize == 0)
+      {
+        return true;
+      }
+      void* data = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+      if (data != MAP_FAILED)
+      {
+        mData = (const uint8_t*)data;
+        madvise(data, mSize, MADV_SEQUENTIAL);
+      }
+#endif
+      if (!mData)
+      {
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    void mappedfile::close()
+    {
+#ifdef _WIN32
+      if (mData)
+      {
+        UnmapViewOfFile(mData);
+      }
+      if (mMapping)
+      {
+        CloseHandle(mMapping);
+      }
+      if (mFile)
+      {
+        CloseHandle(mFile);
+      }
+      mMapping = nullptr;
+      mFile = nullptr;
+#else
+      if (mData)
+      {
+        munmap((void*)mData, mSize);
+      }
+      if (mFd >= 0)
+      {
+        ::close(mFd);
+      }
+      mFd = -1;
+#endif
+      mData = nullptr;
+      mSize = 0;
+    }
+
+#ifdef _WIN32
+    void mappedfile::willNeed(size_t offset, size_t len) const
+    {
+      if (mData && (offset < mSize))
+      {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = (PVOID)(mData + offset);
+        range.NumberOfBytes = std::min(len, mSize - offset);
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+      }
+    }
+
+    void mappedfile::release(size_t offset, size_t len) const
+    {
+      // the working set is trimmed by the system
+    }
+#else
+    // madvise wants page aligned ranges, the range is widened to whole pages
+    static void advise(const uint8_t* data, size_t size, size_t offset, size_t len, int advice)
+    {
+      if (data && (offset < size))
+      {
+        static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t end = std::min(size, offset + len);
+        size_t start = offset - (offset % page);
+        madvise((void*)(data + start), end - start, advice);
+      }
+    }
+
+    void mappedfile::willNeed(size_t offset, size_t len) const
+    {
+      advise(mData, mSize, offset, len, MADV_WILLNEED);
+    }
+
+    void mappedfile::release(size_t offset, size_t len) const
+    {
+      advise(mData, mSize, offset, len, MADV_DONTNEED);
+    }
+#endif
+  }
+
+  namespace energy
+  {
+    namespace bx
+    {
+      using namespace satag::util;
+
+      static metrics::counter& gBytes = metrics::registry::instance().getCounter("import.bytes");
+      static metrics::counter& gSamples = metrics::registry::instance().getCounter("import.samples");
+      static metrics::counter& gRejoined = metrics::registry::instance().getCounter("import.rejoined");
+
+      static const size_t kStringBuffer = 256;    // text values longer than this are collected in pieces
+
+      struct importer::cursor
+      {
+        std::vector<sample> out;
+        samplereader reader{ out };
+        cbor::decoder decoder{ reader, kStringBuffer };
+        bool failed = false;
+
+        void parse(const uint8_t* mem, size_t len)
+        {
+          failed = failed || !decoder.parse(mem, len);
+        }
+      };
+
+      importer::importer(store& target, size_t threads)
+        : mStore(target)
+        , mThreads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+      {
+      }
+
+      importer::~importer()
+      {
+      }
+
+      bool importer::importFile(const char* path, importstats& stats)
+      {
+        mappedfile file;
+        if (!file.open(path))
+        {
+          return false;
+        }
+        return run(file.data(), file.size(), &file, stats);
+      }
+
+      bool importer::importMemory(const uint8_t* mem, size_t len, importstats& stats)
+      {
+        return run(mem, len, nullptr, stats);
+      }
+
+      /*
+        split cuts the capture into pieces of about size bytes, a cut is moved to the
+        next self-describe tag within another size bytes if there is one
+      */
+      std::vector<importer::piece> importer::split(const uint8_t* mem, size_t len, size_t size)
+      {
+        static const uint8_t kTag[] = { 0xd9, 0xd9, 0xf7 };
+        std::vector<piece> pieces;
+        size_t begin = 0;
+        bool tagged = true;
+        while (begin < len)
+        {
+          piece p;
+          p.begin = begin;
+          p.tagged = tagged;
+          if (len - begin <= size)
+          {
+            p.end = len;
+          }
+          else
+          {
+            p.end = begin + size;
+            tagged = false;
+            size_t limit = std::min(len, p.end + size);
+            const uint8_t* at = mem + p.end;
+            while ((at = (const uint8_t*)memchr(at, kTag[0], mem + limit - at)) != nullptr)
+            {
+              if ((at + sizeof(kTag) <= mem + len) && (memcmp(at, kTag, sizeof(kTag)) == 0))
+              {
+                p.end = at - mem;
+                tagged = true;
+                break;
+              }
+              ++at;
+            }
+          }
+          pieces.push_back(p);
+          begin = p.end;
+        }
+        return pieces;
+      }
+
+      /*
+        decode decodes the pieces of a group, the tagged ones in parallel. Then the
+        results are taken in order: the result of a tagged piece counts if the decoder
+        before it ended on an item boundary, else that decoder continues with the piece.
+      */
+      bool importer::decode(const uint8_t* mem, const std::vector<piece>& pieces, group& g, importstats& stats)
+      {
+        auto started = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<cursor>> own(g.last - g.first);
+        for (size_t i = g.first; i < g.last; ++i)
+        {
+          if (pieces[i].tagged)
+          {
+            own[i - g.first].reset(new cursor());
+          }
+        }
+        std::atomic<size_t> next{ 0 };
+        auto worker = [&]()
+        {
+          size_t i;
+          while ((i = next++) < own.size())
+          {
+            if (own[i])
+            {
+              const piece& p = pieces[g.first + i];
+              own[i]->parse(mem + p.begin, p.end - p.begin);
+            }
+          }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < std::min(mThreads, own.size()); ++t)
+        {
+          threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& t : threads)
+        {
+          t.join();
+        }
+
+        auto take = [&](cursor& c)
+        {
+          g.samples.insert(g.samples.end(), c.out.begin(), c.out.end());
+          c.out.clear();
+        };
+        for (size_t i = g.first; g.ok && (i < g.last); ++i)
+        {
+          const piece& p = pieces[i];
+          std::unique_ptr<cursor>& mine = own[i - g.first];
+          if (mine && (!mCarry || mCarry->decoder.ok()))
+          {
+            if (mCarry)
+            {
+              take(*mCarry);
+              stats.invalid += mCarry->reader.invalid();
+            }
+            mCarry = std::move(mine);
+          }
+          else
+          {
+            if (mine)
+            {
+              ++stats.rejoined;
+              gRejoined.add(1);
+            }
+            mCarry->parse(mem + p.begin, p.end - p.begin);
+          }
+          if (mCarry->failed)
+          {
+            stats.errorAt = p.begin;
+            stats.corrupt = true;
+            g.ok = false;
+          }
+        }
+        take(*mCarry);
+        if (!std::is_sorted(g.samples.begin(), g.samples.end(), [](const sample& a, const sample& b) { return a.sampletime < b.sampletime; }))
+        {
+          std::stable_sort(g.samples.begin(), g.samples.end(), [](const sample& a, const sample& b) { return a.sampletime < b.sampletime; });
+        }
+        stats.decodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return g.ok;
+      }
+
+      bool importer::write(const group& g, importstats& stats)
+      {
+        auto started = std::chrono::steady_clock::now();
+        bool result = true;
+        for (size_t i = 0; result && (i < g.samples.size()); i += mBatch)
+        {
+          size_t count = std::min(mBatch, g.samples.size() - i);
+          result = mStore.logDSPEvents(g.samples.data() + i, count);
+          if (result)
+          {
+            stats.samples += count;
+            ++stats.transactions;
+            gSamples.add(count);
+          }
+        }
+        stats.writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return result;
+      }
+
+      /*
+        run splits the capture, decodes it group by group and writes each group while
+        the next one is decoded. It stops at the first decode or store error, the groups
+        before are written by then. The pages of a mapped file are read ahead one group
+        in advance and dropped once the group is written.
+      */
+      bool importer::run(const uint8_t* mem, size_t len, const util::mappedfile* file, importstats& stats)
+      {
+        std::vector<piece> pieces = split(mem, len, mPiece);
+        stats.pieces += pieces.size();
+        mCarry.reset();
+        if (pieces.empty())
+        {
+          return true;
+        }
+        auto range = [&](size_t first, size_t last, size_t& begin, size_t& end)
+        {
+          begin = pieces[first].begin;
+          end = pieces[last - 1].end;
+        };
+
+        // a group keeps every decoder busy, two of them are in memory at any time
+        size_t perGroup = mThreads * 2;
+        group current;
+        current.last = std::min(perGroup, pieces.size());
+        bool result = decode(mem, pieces, current, stats);
+        while (result)
+        {
+          group following;
+          following.first = current.last;
+          following.last = std::min(following.first + perGroup, pieces.size());
+          std::thread decoder;
+          size_t begin, end;
+          if (following.first < following.last)
+          {
+            if (file && (following.last < pieces.size()))
+            {
+              range(following.last, std::min(following.last + perGroup, pieces.size()), begin, end);
+              file->willNeed(begin, end - begin);
+            }
+            decoder = std::thread([&]() { decode(mem, pieces, following, stats); });
+          }
+          result = write(current, stats);
+          if (decoder.joinable())
+          {
+            decoder.join();
+          }
+          range(current.first, current.last, begin, end);
+          if (result)
+          {
+            stats.bytes += end - begin;
+            gBytes.add(end - begin);
+          }
+          if (file)
+          {
+            file->release(begin, end - begin);
+          }
+          if (following.first == following.last)
+          {
+            break;
+          }
+          result = result && following.ok;
+          current = std::move(following);
+        }
+        if (result && mCarry)
+        {
+          stats.invalid += mCarry->reader.invalid();
+          stats.truncated = !mCarry->decoder.ok();
+        }
+        mCarry.reset();
+        return result;
+      }
+    }
+  }
+}
@@ -0,0 +1,149 @@
+/*
+  replay
+
+  bulk import of CBOR capture files pulled from the DSP
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "storage.h"
+
+namespace satag
+{
+  namespace util
+  {
+    /*
+      mappedfile maps a whole file read-only, the pages are read by the kernel as they
+      are touched. willNeed() starts the read ahead of a range, release() drops the
+      pages of a range which has been used, so a big file doesn't stay resident.
+    */
+    class mappedfile
+    {
+    public:
+      mappedfile() {}
+      ~mappedfile() { close(); }
+      mappedfile(const mappedfile&) = delete;
+      mappedfile& operator=(const mappedfile&) = delete;
+      bool open(const char* path);
+      void close();
+      const uint8_t* data() const { return mData; }
+      size_t size() const { return mSize; }
+      void willNeed(size_t offset, size_t len) const;
+      void release(size_t offset, size_t len) const;
+    private:
+      const uint8_t* mData = nullptr;   // start of the mapping
+      size_t mSize = 0;                 // size of the file
+#ifdef _WIN32
+      void* mFile = nullptr;            // file handle
+      void* mMapping = nullptr;         // file mapping handle
+#else
+      int mFd = -1;
+#endif
+    };
+  }
+
+  namespace energy
+  {
+    namespace bx
+    {
+      struct importstats
+      {
+        uint64_t bytes = 0;         // bytes of the capture decoded
+        uint64_t samples = 0;       // samples written to the store
+        uint64_t invalid = 0;       // maps which weren't samples
+        uint64_t pieces = 0;        // pieces the capture was split into
+        uint64_t rejoined = 0;      // pieces which were decoded in sequence with the one before
+        uint64_t transactions = 0;
+        uint64_t errorAt = 0;       // offset of the piece with the decode error
+        bool corrupt = false;       // a decode error stopped the import
+        bool truncated = false;     // the capture ends inside an item
+        double decodeSeconds = 0;   // splitting, decoding and sorting
+        double writeSeconds = 0;    // waiting for the store
+      };
+
+      /*
+        importer writes CBOR capture files (samples as read by samplereader) into the
+        store in big transactions.
+
+          importer imp(store, 4);     // four decoders
+          importstats stats;
+          imp.importFile("capture-0815.cbor", stats);
+
+        The capture is mapped and cut into pieces of about kPiece bytes, each cut is
+        moved forward to the next self-describe tag (d9 d9 f7) the DSP puts in front of
+        every frame. The pieces are decoded in parallel straight from the mapping, a
+        group of them at a time, and the samples of a group are written in timestamp
+        order while the next group is decoded.
+
+        A tag found by the byte search may as well be part of a value. A cut is only
+        taken as an item boundary if the decoder of the piece before it ends there with
+        nothing open, otherwise that decoder simply continues into the next piece and
+        the parallel result is thrown away. A capture without tags is decoded this way
+        from start to end.
+      */
+      class importer
+      {
+      public:
+        static const size_t kPiece = 4 << 20;     // bytes per piece
+        static const size_t kBatch = 100000;      // samples per transaction
+
+        explicit importer(store& target, size_t threads = 0);
+        ~importer();
+        void setPiece(size_t bytes) { mPiece = bytes; }
+        void setBatch(size_t rows) { mBatch = rows; }
+        bool importFile(const char* path, importstats& stats);
+        bool importMemory(const uint8_t* mem, size_t len, importstats& stats);
+      private:
+        struct piece
+        {
+          size_t begin;
+          size_t end;
+          bool tagged;          // starts at a self-describe tag (or at the start of the capture)
+        };
+        struct cursor;          // a decoder and the samples it produced
+        struct group
+        {
+          size_t first = 0;     // the pieces [first, last)
+          size_t last = 0;
+          std::vector<sample> samples;
+          bool ok = true;
+        };
+        static std::vector<piece> split(const uint8_t* mem, size_t len, size_t size);
+        bool decode(const uint8_t* mem, const std::vector<piece>& pieces, group& g, importstats& stats);
+        bool write(const group& g, importstats& stats);
+        bool run(const uint8_t* mem, size_t len, const util::mappedfile* file, importstats& stats);
+        store& mStore;
+        size_t mThreads;                    // decoders running in parallel
+        size_t mPiece = kPiece;
+        size_t mBatch = kBatch;
+        std::unique_ptr<cursor> mCarry;     // the decoder of the last piece taken
+      };
+    }
+  }
+}
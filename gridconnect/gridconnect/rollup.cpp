@@ -0,0 +1,276 @@
+/*
+  rollup
+
+  incremental min/max/avg/last aggregation of samples into fixed time windows
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "rollup.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      // 1 minute and 15 minutes, in sampletime units (microseconds)
+      const int64_t rollup::kResolutions[rollup::kLevels] = { 60 * 1000000LL, 900 * 1000000LL };
+
+      void rollupwindow::add(int value, int64_t sampletime)
+      {
+        if (samples == 0)
+        {
+          minvalue = value;
+          maxvalue = value;
+        }
+        else
+        {
+          if (value < minvalue) minvalue = value;
+          if (value > maxvalue) maxvalue = value;
+        }
+        sumvalue += value;
+        ++samples;
+        if ((samples == 1) || (sampletime >= lasttime))
+        {
+          lastvalue = value;
+          lasttime = sampletime;
+        }
+      }
+
+      void rollupwindow::merge(const rollupwindow & other)
+      {
+        if (other.samples == 0)
+        {
+          return;
+        }
+        if (samples == 0)
+        {
+          *this = other;
+          return;
+        }
+        if (other.minvalue < minvalue) minvalue = other.minvalue;
+        if (other.maxvalue > maxvalue) maxvalue = other.maxvalue;
+        sumvalue += other.sumvalue;
+        samples += other.samples;
+        if (other.lasttime >= lasttime)
+        {
+          lastvalue = other.lastvalue;
+          lasttime = other.lasttime;
+        }
+      }
+
+      /*
+        add updates the open windows of the pair. A sample older than the open window
+        (e.g. from an import) goes to a late window, the late samples of a window are
+        merged into the stored window when it is written.
+      */
+      void rollup::add(int device, int entity, int value, int64_t sampletime, std::vector<rollupwindow>& closed)
+      {
+        uint64_t k = key(device, entity);
+        save(k);
+        auto& ws = mOpen[k];
+        for (int level = 0; level < kLevels; ++level)
+        {
+          int64_t start = windowStart(sampletime, level);
+          auto& w = ws.w[level];
+          if (ws.open[level] && (w.starttime != start))
+          {
+            if (start < w.starttime)
+            {
+              auto& late = mLate[level][std::make_pair(k, start)];
+              if (late.samples == 0)
+              {
+                late.device = device;
+                late.entity = entity;
+                late.level = level;
+                late.starttime = start;
+              }
+              late.add(value, sampletime);
+              continue;
+            }
+            closed.push_back(w);
+            ws.open[level] = false;
+          }
+          if (!ws.open[level])
+          {
+            w = rollupwindow();
+            w.device = device;
+            w.entity = entity;
+            w.level = level;
+            w.starttime = start;
+            ws.open[level] = true;
+          }
+          w.add(value, sampletime);
+        }
+      }
+
+      /*
+        closeBefore closes all windows which end at or before time, so pairs which
+        stopped sending still get their last window written. It sweeps at most once
+        per smallest resolution.
+      */
+      void rollup::closeBefore(int64_t time, std::vector<rollupwindow>& closed)
+      {
+        closeLate(closed);
+        int64_t sweep = windowStart(time, 0);
+        if (sweep <= mSwept)
+        {
+          return;
+        }
+        mSwept = sweep;
+        for (auto& it : mOpen)
+        {
+          auto& ws = it.second;
+          for (int level = 0; level < kLevels; ++level)
+          {
+            if (ws.open[level] && (ws.w[level].starttime + kResolutions[level] <= time))
+            {
+              save(it.first);
+              closed.push_back(ws.w[level]);
+              ws.open[level] = false;
+            }
+          }
+        }
+      }
+
+      void rollup::closeAll(std::vector<rollupwindow>& closed)
+      {
+        closeLate(closed);
+        for (auto& it : mOpen)
+        {
+          auto& ws = it.second;
+          for (int level = 0; level < kLevels; ++level)
+          {
+            if (ws.open[level])
+            {
+              closed.push_back(ws.w[level]);
+              ws.open[level] = false;
+            }
+          }
+        }
+        mOpen.clear();
+        mSwept = INT64_MIN;
+        mUndo.clear();
+        mTracking = false;
+      }
+
+      bool rollup::openWindow(int device, int entity, int level, rollupwindow & window) const
+      {
+        auto it = mOpen.find(key(device, entity));
+        if ((it != mOpen.end()) && it->second.open[level])
+        {
+          window = it->second.w[level];
+          return true;
+        }
+        return false;
+      }
+
+      /*
+        begin starts to save the pairs before their first change, until commit() or
+        rollback()
+      */
+      void rollup::begin()
+      {
+        mUndo.clear();
+        mSweptBefore = mSwept;
+        mTracking = true;
+      }
+
+      void rollup::commit()
+      {
+        mUndo.clear();
+        mTracking = false;
+      }
+
+      /*
+        rollback puts the pairs changed since begin() back, the windows closed since
+        are closed again by the samples written again
+      */
+      void rollup::rollback()
+      {
+        if (!mTracking)
+        {
+          return;
+        }
+        for (auto& it : mUndo)
+        {
+          if (it.second.existed)
+          {
+            mOpen[it.first] = it.second.ws;
+          }
+          else
+          {
+            mOpen.erase(it.first);
+          }
+        }
+        mSwept = mSweptBefore;
+        mUndo.clear();
+        mTracking = false;
+        for (auto& late : mLate)
+        {
+          late.clear();
+        }
+      }
+
+      // the late windows are closed as they are, they only hold late samples
+      void rollup::closeLate(std::vector<rollupwindow>& closed)
+      {
+        for (auto& late : mLate)
+        {
+          for (auto& it : late)
+          {
+            closed.push_back(it.second);
+          }
+          late.clear();
+        }
+      }
+
+      void rollup::save(uint64_t k)
+      {
+        if (!mTracking || (mUndo.find(k) != mUndo.end()))
+        {
+          return;
+        }
+        saved& s = mUndo[k];
+        auto it = mOpen.find(k);
+        if (it != mOpen.end())
+        {
+          s.ws = it->second;
+          s.existed = true;
+        }
+      }
+
+      int64_t rollup::windowStart(int64_t sampletime, int level)
+      {
+        int64_t length = kResolutions[level];
+        int64_t start = sampletime / length;
+        if ((sampletime % length) < 0)
+        {
+          --start;
+        }
+        return start * length;
+      }
+    }
+  }
+}
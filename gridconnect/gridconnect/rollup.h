@@ -0,0 +1,122 @@
+/*
+  rollup
+
+  incremental min/max/avg/last aggregation of samples into fixed time windows
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <utility>
+#include <vector>
+#include <unordered_map>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      /*
+        a rollupwindow aggregates the samples of one (device, entity) pair
+        with starttime <= sampletime < starttime + resolution
+      */
+      struct rollupwindow
+      {
+        int device = 0;
+        int entity = 0;
+        int level = 0;              // index into rollup::kResolutions
+        int64_t starttime = 0;
+        int minvalue = 0;
+        int maxvalue = 0;
+        int64_t sumvalue = 0;
+        int64_t samples = 0;
+        int lastvalue = 0;
+        int64_t lasttime = 0;       // sampletime of lastvalue
+        double average() const { return samples ? (double)sumvalue / (double)samples : 0.0; }
+        void add(int value, int64_t sampletime);
+        void merge(const rollupwindow& other);
+      };
+
+      /*
+        rollup keeps the open window of every (device, entity) pair per resolution.
+        Adding a sample beyond the end of an open window closes it, closed windows are
+        collected by the caller and written to the rollup tables. Samples older than the
+        open window are summed up per window until the next closeBefore() or closeAll(),
+        so a batch of late samples closes one window per (device, entity, level, window)
+        and not one per sample.
+
+        The windows follow the transaction of the samples: between begin() and commit()
+        the state of a pair is saved before its first change, rollback() puts it back,
+        so a batch which is written again after a failed commit isn't counted twice and
+        the windows it closed are closed again. Its late windows are dropped.
+
+          mRollup.begin();
+          // insert the samples, mRollup.add() each, write the closed windows
+          if (mDB.commit())
+            mRollup.commit();
+          else
+            mRollup.rollback();
+      */
+      class rollup
+      {
+      public:
+        static const int kLevels = 2;
+        static const int64_t kResolutions[kLevels];   // window length in microseconds per level
+
+        void add(int device, int entity, int value, int64_t sampletime, std::vector<rollupwindow>& closed);
+        void closeBefore(int64_t time, std::vector<rollupwindow>& closed);
+        void closeAll(std::vector<rollupwindow>& closed);
+        bool openWindow(int device, int entity, int level, rollupwindow& window) const;
+        void begin();
+        void commit();
+        void rollback();
+        static int64_t windowStart(int64_t sampletime, int level);
+      private:
+        struct windows
+        {
+          rollupwindow w[kLevels];
+          bool open[kLevels] = {};
+        };
+        struct saved
+        {
+          windows ws;
+          bool existed = false;                       // the pair had an entry in mOpen
+        };
+        static uint64_t key(int device, int entity) { return ((uint64_t)(uint32_t)device << 32) | (uint32_t)entity; }
+        void save(uint64_t k);
+        void closeLate(std::vector<rollupwindow>& closed);
+        std::unordered_map<uint64_t, windows> mOpen;  // open windows by (device, entity)
+        std::map<std::pair<uint64_t, int64_t>, rollupwindow> mLate[kLevels];  // late samples by (device, entity) and window start
+        int64_t mSwept = INT64_MIN;                   // time of the last closeBefore sweep
+        bool mTracking = false;                       // within begin() and commit()
+        std::unordered_map<uint64_t, saved> mUndo;    // the pairs before the transaction
+        int64_t mSweptBefore = INT64_MIN;             // mSwept before the transaction
+      };
+    }
+  }
+}
@@ -0,0 +1,375 @@
+/*
+  runtime
+
+  long-lived worker loops, signal handling and an orderly shutdown
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "runtime.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/signalfd.h>
+#define SATAG_SIGNALFD 1
+#endif
+#endif
+
+#ifndef SATAG_SIGNALFD
+#define SATAG_SIGNALFD 0
+#endif
+
+namespace satag
+{
+  namespace util
+  {
+    namespace internal
+    {
+      // the runtime which receives the signals, there is one per process
+      static std::atomic<runtime*> gRuntime{ nullptr };
+
+#if defined(_WIN32)
+      static BOOL WINAPI onConsoleEvent(DWORD type)
+      {
+        runtime* r = gRuntime.load();
+        if (r)
+        {
+          r->stop();
+          return TRUE;
+        }
+        return FALSE;
+      }
+#elif !SATAG_SIGNALFD
+      // write end of the self-pipe, the handler may only use async-signal-safe calls
+      static int gSignalPipe = -1;
+
+      static void onSignal(int signal)
+      {
+        int saved = errno;
+        unsigned char c = (unsigned char)signal;
+        ssize_t written = write(gSignalPipe, &c, 1);
+        (void)written;
+        errno = saved;
+      }
+#endif
+
+#ifndef _WIN32
+      static void nonblocking(int fd)
+      {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+#endif
+    }
+
+    bool canceltoken::waitFor(std::chrono::milliseconds duration) const
+    {
+      std::unique_lock<std::mutex> lock(mState->lock);
+      return mState->wakeup.wait_for(lock, duration, [this]() { return cancelled(); });
+    }
+
+    void canceltoken::cancel()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mState->lock);
+        mState->cancelled.store(true, std::memory_order_release);
+      }
+      mState->wakeup.notify_all();
+    }
+
+    // ----------------------------------------------------------------------------
+
+    /*
+      the signals are set up here, so the runtime has to be created before any other
+      thread: with signalfd SIGINT/SIGTERM are blocked and the threads started later
+      inherit the mask, so only the event loop sees them.
+    */
+    runtime::runtime()
+    {
+      internal::gRuntime = this;
+#ifdef _WIN32
+      SetConsoleCtrlHandler(internal::onConsoleEvent, TRUE);
+#else
+      signal(SIGPIPE, SIG_IGN);   // a closed socket shows up as an error instead
+      if (pipe(mWakeFd) == 0)
+      {
+        internal::nonblocking(mWakeFd[0]);
+        internal::nonblocking(mWakeFd[1]);
+      }
+#if SATAG_SIGNALFD
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGINT);
+      sigaddset(&set, SIGTERM);
+      // a shell starts background jobs with SIGINT ignored, ignored signals never reach the signalfd
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      pthread_sigmask(SIG_BLOCK, &set, nullptr);
+      mSignalFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+#else
+      int fds[2];
+      if (pipe(fds) == 0)
+      {
+        internal::nonblocking(fds[0]);
+        internal::nonblocking(fds[1]);
+        mSignalFd = fds[0];
+        internal::gSignalPipe = fds[1];
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = internal::onSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+      }
+#endif
+#endif
+    }
+
+    runtime::~runtime()
+    {
+      mToken.cancel();
+      for (auto& w : mWorkers)
+      {
+        if (w.thread.joinable())
+        {
+          w.thread.join();
+        }
+      }
+#ifdef _WIN32
+      SetConsoleCtrlHandler(internal::onConsoleEvent, FALSE);
+#else
+#if SATAG_SIGNALFD
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGINT);
+      sigaddset(&set, SIGTERM);
+      pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+#else
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      if (internal::gSignalPipe >= 0)
+      {
+        close(internal::gSignalPipe);
+        internal::gSignalPipe = -1;
+      }
+#endif
+      if (mSignalFd >= 0)
+      {
+        close(mSignalFd);
+      }
+      for (int fd : mWakeFd)
+      {
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+      }
+#endif
+      internal::gRuntime = nullptr;
+    }
+
+    /*
+      worker starts a long-lived loop in a thread of its own. It has to return soon
+      after the token was cancelled.
+    */
+    void runtime::worker(const char * name, std::function<void(const canceltoken&)> fun)
+    {
+      canceltoken token = mToken;
+      workerthread w;
+      w.name = name;
+      w.thread = std::thread([fun, token]()
+      {
+        fun(token);
+      });
+      mWorkers.push_back(std::move(w));
+    }
+
+    /*
+      every runs fun on the event loop thread, it should be short
+    */
+    void runtime::every(std::chrono::milliseconds interval, std::function<void()> fun)
+    {
+      timer t;
+      t.interval = interval;
+      t.next = std::chrono::steady_clock::now() + interval;
+      t.fun = fun;
+      mTimers.push_back(t);
+    }
+
+    void runtime::onShutdown(const char * name, std::function<bool(deadline)> drain)
+    {
+      drainstep d;
+      d.name = name;
+      d.fun = drain;
+      mDrain.push_back(d);
+    }
+
+    /*
+      run is the event loop, it returns the signal which ended it (-1 after stop())
+      once the workers are joined and the drain steps are done
+    */
+    int runtime::run(std::chrono::milliseconds drainTime)
+    {
+      int reason = 0;
+      while (reason == 0)
+      {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + std::chrono::seconds(1);
+        for (auto& t : mTimers)
+        {
+          next = std::min(next, t.next);
+        }
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(next - now);
+        reason = wait(std::max(timeout, std::chrono::milliseconds(0)));
+        if (reason == 0)
+        {
+          now = std::chrono::steady_clock::now();
+          for (auto& t : mTimers)
+          {
+            if (now >= t.next)
+            {
+              t.fun();
+              t.next += t.interval;
+              if (t.next < now)
+              {
+                t.next = now + t.interval;  // don't catch up after a stall
+              }
+            }
+          }
+        }
+      }
+      mSignal = reason;
+
+      auto until = std::chrono::steady_clock::now() + drainTime;
+      mToken.cancel();
+      for (auto& w : mWorkers)
+      {
+        if (w.thread.joinable())
+        {
+          w.thread.join();
+        }
+      }
+      mWorkers.clear();
+      drain(until);
+      return reason;
+    }
+
+    /*
+      stop ends run() like a signal, it can be called from any thread
+    */
+    void runtime::stop()
+    {
+#ifdef _WIN32
+      {
+        std::lock_guard<std::mutex> lock(mLock);
+        mSignal = -1;
+      }
+      mWakeup.notify_all();
+#else
+      unsigned char c = 0;
+      ssize_t written = write(mWakeFd[1], &c, 1);
+      (void)written;
+#endif
+    }
+
+    /*
+      wait returns the signal number, -1 for stop() or 0 on timeout
+    */
+    int runtime::wait(std::chrono::milliseconds timeout)
+    {
+#ifdef _WIN32
+      std::unique_lock<std::mutex> lock(mLock);
+      mWakeup.wait_for(lock, timeout, [this]() { return mSignal != 0; });
+      return mSignal;
+#else
+      struct pollfd fds[2];
+      fds[0].fd = mSignalFd;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      fds[1].fd = mWakeFd[0];
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+      int n = poll(fds, 2, (int)timeout.count());
+      if (n <= 0)
+      {
+        return 0;   // timeout or EINTR
+      }
+      if (fds[0].revents & POLLIN)
+      {
+#if SATAG_SIGNALFD
+        struct signalfd_siginfo info;
+        if (read(mSignalFd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+        {
+          return (int)info.ssi_signo;
+        }
+#else
+        unsigned char c = 0;
+        if (read(mSignalFd, &c, 1) == 1)
+        {
+          return (int)c;
+        }
+#endif
+      }
+      if (fds[1].revents & POLLIN)
+      {
+        unsigned char buffer[16];
+        while (read(mWakeFd[0], buffer, sizeof(buffer)) > 0)
+        {
+        }
+        return -1;
+      }
+      return 0;
+#endif
+    }
+
+    /*
+      drain runs the shutdown steps in order, each one gets the same deadline
+    */
+    bool runtime::drain(deadline until)
+    {
+      bool result = true;
+      for (auto& d : mDrain)
+      {
+        if (!d.fun(until))
+        {
+          std::cerr << "shutdown: " << d.name << " not drained in time" << std::endl;
+          result = false;
+        }
+      }
+      return result;
+    }
+  }
+}
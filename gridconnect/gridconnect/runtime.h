@@ -0,0 +1,132 @@
+/*
+  runtime
+
+  long-lived worker loops, signal handling and an orderly shutdown
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace satag
+{
+  namespace util
+  {
+    namespace internal
+    {
+      struct cancelstate
+      {
+        std::atomic<bool> cancelled{ false };
+        std::mutex lock;
+        std::condition_variable wakeup;
+      };
+    }
+
+    /*
+      a canceltoken is handed to the workers, they check it between their steps and
+      use waitFor() instead of sleeping, so a shutdown wakes them up immediately.
+    */
+    class canceltoken
+    {
+    public:
+      canceltoken() : mState(std::make_shared<internal::cancelstate>()) {}
+      bool cancelled() const { return mState->cancelled.load(std::memory_order_acquire); }
+      // waits for the duration, returns true if the token was cancelled meanwhile
+      bool waitFor(std::chrono::milliseconds duration) const;
+      void cancel();
+    private:
+      std::shared_ptr<internal::cancelstate> mState;
+    };
+
+    /*
+      runtime runs the gateway: worker loops in threads of their own, periodic tasks on
+      the event loop and a shutdown sequence.
+
+        runtime rt;               // first thing in main, before any thread is started
+        rt.worker("watcher", [](const canceltoken& t) { while (!t.waitFor(1s)) poll(); });
+        rt.every(60s, [] { housekeeping(); });
+        rt.onShutdown("store", [](deadline d) { return store.flush(d); });
+        rt.run(10s);              // returns after SIGINT/SIGTERM (or stop()) and the drain
+        store.close();
+
+      The event loop waits on a signalfd (Linux), a self-pipe (other POSIX systems) or
+      the console control handler (Windows). On shutdown the workers are cancelled and
+      joined, then the drain steps run in the order they were added, all of them within
+      the deadline given to run().
+    */
+    class runtime
+    {
+    public:
+      typedef std::chrono::steady_clock::time_point deadline;
+
+      runtime();
+      ~runtime();
+      void worker(const char* name, std::function<void(const canceltoken&)> fun);
+      void every(std::chrono::milliseconds interval, std::function<void()> fun);
+      void onShutdown(const char* name, std::function<bool(deadline)> drain);
+      int run(std::chrono::milliseconds drainTime);
+      void stop();
+      const canceltoken& token() const { return mToken; }
+      bool stopping() const { return mToken.cancelled(); }
+    protected:
+      int wait(std::chrono::milliseconds timeout);
+      bool drain(deadline until);
+    private:
+      struct workerthread
+      {
+        std::string name;
+        std::thread thread;
+      };
+      struct timer
+      {
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point next;
+        std::function<void()> fun;
+      };
+      struct drainstep
+      {
+        std::string name;
+        std::function<bool(deadline)> fun;
+      };
+      canceltoken mToken;                   // cancelled when the shutdown begins
+      std::vector<workerthread> mWorkers;   // long-lived worker loops
+      std::vector<timer> mTimers;           // periodic tasks run by the event loop
+      std::vector<drainstep> mDrain;        // shutdown steps, in order
+      int mSignalFd = -1;                   // signalfd or read end of the self-pipe
+      int mWakeFd[2] = { -1, -1 };          // pipe for stop()
+      std::atomic<int> mSignal{ 0 };        // the signal which ended run(), -1 for stop()
+      std::mutex mLock;                     // used on systems without file descriptors
+      std::condition_variable mWakeup;
+    };
+  }
+}
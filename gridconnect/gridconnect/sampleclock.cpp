@@ -0,0 +1,187 @@
+/*
+  sampleclock
+
+  a cheap, monotonic microsecond clock for sample timestamps
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "sampleclock.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace satag
+{
+  namespace util
+  {
+    namespace internal
+    {
+      inline int64_t steadyMicros()
+      {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+      }
+
+      inline int64_t systemMicros()
+      {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+      }
+
+      /*
+        the shared state of the clock, created on first use
+      */
+      struct clockstate
+      {
+        clockstate()
+          : offset(systemMicros() - steadyMicros())
+          , target(offset.load())
+        {}
+        std::atomic<int64_t> offset;      // wall clock - steady clock, as used by now()
+        std::atomic<int64_t> target;      // the offset measured at the last resync
+        std::atomic<bool> running{ false };
+        std::thread syncer;
+        std::mutex lock;                  // protects syncer start/stop
+        std::condition_variable wakeup;
+        bool stop = false;
+      };
+
+      clockstate& state()
+      {
+        static clockstate s;
+        return s;
+      }
+
+      // the last time handed out per thread keeps now() monotonic while the offset is slewed
+      thread_local int64_t tLast = INT64_MIN;
+    }
+
+    int64_t sampleclock::now()
+    {
+      int64_t t = internal::steadyMicros() + internal::state().offset.load(std::memory_order_relaxed);
+      if (t < internal::tLast)
+      {
+        t = internal::tLast;
+      }
+      internal::tLast = t;
+      return t;
+    }
+
+    /*
+      start runs the thread which measures the offset to the wall clock every
+      syncMicros and moves the offset of now() towards it
+    */
+    bool sampleclock::start(int64_t syncMicros)
+    {
+      auto& s = internal::state();
+      std::lock_guard<std::mutex> lock(s.lock);
+      if (s.running)
+      {
+        return false;
+      }
+      resync();
+      s.offset = s.target.load();
+      s.stop = false;
+      s.running = true;
+      s.syncer = std::thread([syncMicros]()
+      {
+        auto& s = internal::state();
+        int64_t lastSync = internal::steadyMicros();
+        std::unique_lock<std::mutex> lock(s.lock);
+        while (!s.wakeup.wait_for(lock, std::chrono::microseconds(syncMicros), [&s]() { return s.stop; }))
+        {
+          int64_t steady = internal::steadyMicros();
+          resync();
+          // slew towards the target, but never by more than kSlewPpm of the time since the last sync
+          int64_t offset = s.offset.load();
+          int64_t diff = s.target.load() - offset;
+          int64_t maxstep = (steady - lastSync) * kSlewPpm / kMicrosPerSecond;
+          if (diff > kStepLimit)
+          {
+            offset += diff;   // the wall clock was set forward, e.g. at the first NTP sync
+          }
+          else if (diff > maxstep)
+          {
+            offset += maxstep;
+          }
+          else if (diff < -maxstep)
+          {
+            offset -= maxstep;
+          }
+          else
+          {
+            offset += diff;
+          }
+          s.offset = offset;
+          lastSync = steady;
+        }
+      });
+      return true;
+    }
+
+    void sampleclock::stop()
+    {
+      auto& s = internal::state();
+      std::thread syncer;
+      {
+        std::lock_guard<std::mutex> lock(s.lock);
+        if (!s.running)
+        {
+          return;
+        }
+        s.stop = true;
+        syncer.swap(s.syncer);
+      }
+      s.wakeup.notify_all();
+      syncer.join();
+      s.running = false;
+    }
+
+    bool sampleclock::isRunning()
+    {
+      return internal::state().running;
+    }
+
+    /*
+      resync measures the current offset between wall clock and steady clock,
+      the sync thread moves the offset used by now() towards it
+    */
+    void sampleclock::resync()
+    {
+      internal::state().target = internal::systemMicros() - internal::steadyMicros();
+    }
+
+    /*
+      offsetError is the difference between the wall clock and now() in microseconds
+    */
+    int64_t sampleclock::offsetError()
+    {
+      auto& s = internal::state();
+      return s.target.load() - s.offset.load();
+    }
+  }
+}
@@ -0,0 +1,66 @@
+/*
+  sampleclock
+
+  a cheap, monotonic microsecond clock for sample timestamps
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace satag
+{
+  namespace util
+  {
+    /*
+      sampleclock delivers microseconds since the unix epoch. The time is taken from
+      std::chrono::steady_clock plus an offset to the wall clock, so NTP adjustments
+      can't reorder samples: a thread measures the offset every syncMicros (100ms) and
+      slews it at most kSlewPpm of the time passed, only jumps larger than kStepLimit
+      forward are applied at once.
+
+      now() costs one steady_clock read and one atomic load. Without a running sync
+      thread it doesn't follow the wall clock after the first call.
+
+        sampleclock::start();               // once, at startup
+        int64_t t = sampleclock::now();     // in the hot path
+        sampleclock::stop();                // at shutdown
+    */
+    class sampleclock
+    {
+    public:
+      static const int64_t kMicrosPerSecond = 1000000;
+      static const int64_t kSlewPpm = 500;                    // max. correction rate of the offset
+      static const int64_t kStepLimit = kMicrosPerSecond;     // forward differences above are stepped
+
+      static int64_t now();
+      static bool start(int64_t syncMicros = kMicrosPerSecond / 10);
+      static void stop();
+      static bool isRunning();
+      static void resync();
+      static int64_t offsetError();
+    };
+  }
+}
@@ -0,0 +1,406 @@
+/*
+  scheduler
+
+  work-stealing thread pool with a timer wheel for periodic jobs
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "scheduler.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+namespace satag
+{
+  namespace util
+  {
+    static metrics::counter& gTasks = metrics::registry::instance().getCounter("scheduler.tasks");
+    static metrics::counter& gSteals = metrics::registry::instance().getCounter("scheduler.steals");
+    static metrics::counter& gTimers = metrics::registry::instance().getCounter("scheduler.timers");
+
+    // the scheduler and the index of the worker running on this thread
+    static thread_local scheduler* tScheduler = nullptr;
+    static thread_local size_t tWorker = 0;
+
+    constexpr std::chrono::milliseconds scheduler::kTick;
+
+    scheduler::scheduler(size_t threads)
+      : mThreads(threads)
+      , mWheel(kSlots)
+    {
+      if (mThreads == 0)
+      {
+        mThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+      }
+    }
+
+    scheduler::~scheduler()
+    {
+      stop();
+    }
+
+    /*
+      starts the workers and the timer thread, timers armed before are kept
+    */
+    bool scheduler::start()
+    {
+      if (isRunning())
+      {
+        return false;
+      }
+      mStop = false;
+      mTimerStop = false;
+      mWorkers.clear();
+      for (size_t i = 0; i < mThreads; ++i)
+      {
+        mWorkers.emplace_back(new worker());
+      }
+      mRunning = true;
+      for (size_t i = 0; i < mThreads; ++i)
+      {
+        mWorkers[i]->thread = std::thread([this, i]() { work(i); });
+      }
+      mTimerThread = std::thread([this]() { timers(); });
+      return true;
+    }
+
+    /*
+      stop cancels the timers, lets the workers finish everything queued and joins them.
+      Tasks which slipped in while the workers terminated run on the calling thread.
+    */
+    void scheduler::stop()
+    {
+      if (!isRunning())
+      {
+        return;
+      }
+      cancelAll();
+      {
+        std::lock_guard<std::mutex> lock(mTimerLock);
+        mTimerStop = true;
+      }
+      mTimerWake.notify_all();
+      if (mTimerThread.joinable())
+      {
+        mTimerThread.join();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mIdleLock);
+        mStop = true;
+      }
+      mWork.notify_all();
+      for (auto& w : mWorkers)
+      {
+        if (w->thread.joinable())
+        {
+          w->thread.join();
+        }
+      }
+      mRunning = false;
+      task t;
+      while (take(0, t))
+      {
+        t();
+        mActive.fetch_sub(1);
+      }
+      mWorkers.clear();
+    }
+
+    /*
+      a task submitted from a worker stays with that worker unless another one steals it
+    */
+    bool scheduler::submit(task t)
+    {
+      return push(std::move(t), true);
+    }
+
+    /*
+      defer queues the task at the other end of the deque: the worker runs it after
+      the tasks it has queued already, so e.g. a writer task sees all the writes those
+      produce. An idle worker steals it first.
+    */
+    bool scheduler::defer(task t)
+    {
+      return push(std::move(t), false);
+    }
+
+    bool scheduler::push(task t, bool back)
+    {
+      if (!isRunning())
+      {
+        return false;
+      }
+      size_t index = (tScheduler == this) ? tWorker : (mNext.fetch_add(1, std::memory_order_relaxed) % mThreads);
+      {
+        worker& w = *mWorkers[index];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (back)
+        {
+          w.tasks.push_back(std::move(t));
+        }
+        else
+        {
+          w.tasks.push_front(std::move(t));
+        }
+        mQueued.fetch_add(1);
+      }
+      // taking the lock makes sure a worker about to sleep sees the task
+      {
+        std::lock_guard<std::mutex> lock(mIdleLock);
+      }
+      mWork.notify_one();
+      return true;
+    }
+
+    scheduler::timerid scheduler::after(std::chrono::milliseconds delay, task t)
+    {
+      std::lock_guard<std::mutex> lock(mTimerLock);
+      timerid id = mNextTimer++;
+      mTimers.insert(id);
+      arm(id, delay, std::chrono::milliseconds(0), std::move(t));
+      return id;
+    }
+
+    scheduler::timerid scheduler::every(std::chrono::milliseconds interval, task t)
+    {
+      std::lock_guard<std::mutex> lock(mTimerLock);
+      timerid id = mNextTimer++;
+      mTimers.insert(id);
+      arm(id, interval, std::max(interval, kTick), std::move(t));
+      return id;
+    }
+
+    /*
+      a cancelled timer doesn't fire anymore, a run already in progress finishes
+    */
+    bool scheduler::cancel(timerid id)
+    {
+      std::lock_guard<std::mutex> lock(mTimerLock);
+      return mTimers.erase(id) > 0;
+    }
+
+    void scheduler::cancelAll()
+    {
+      std::lock_guard<std::mutex> lock(mTimerLock);
+      mTimers.clear();
+      for (auto& slot : mWheel)
+      {
+        slot.clear();
+      }
+    }
+
+    /*
+      drain waits until no task is queued or running, timers may still add new ones
+    */
+    bool scheduler::drain(deadline until)
+    {
+      std::unique_lock<std::mutex> lock(mIdleLock);
+      auto idle = [this]() { return (mQueued.load() == 0) && (mActive.load() == 0); };
+      if (until == deadline::max())
+      {
+        mIdle.wait(lock, idle);
+        return true;
+      }
+      return mIdle.wait_until(lock, until, idle);
+    }
+
+    scheduler * scheduler::current()
+    {
+      return tScheduler;
+    }
+
+    void scheduler::work(size_t index)
+    {
+      tScheduler = this;
+      tWorker = index;
+      task t;
+      while (true)
+      {
+        if (take(index, t))
+        {
+          t();
+          t = nullptr;
+          gTasks.add();
+          if ((mActive.fetch_sub(1) == 1) && (mQueued.load() == 0))
+          {
+            std::lock_guard<std::mutex> lock(mIdleLock);
+            mIdle.notify_all();
+          }
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(mIdleLock);
+        if (mQueued.load() == 0)
+        {
+          if (mStop)
+          {
+            break;
+          }
+          mWork.wait(lock, [this]() { return mStop || (mQueued.load() > 0); });
+        }
+      }
+      tScheduler = nullptr;
+    }
+
+    /*
+      take pops the newest task of the own deque or steals the oldest task of another.
+      The task counts as active before it is no longer queued, drain() never sees a gap.
+    */
+    bool scheduler::take(size_t index, task& t)
+    {
+      {
+        worker& w = *mWorkers[index];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (!w.tasks.empty())
+        {
+          t = std::move(w.tasks.back());
+          w.tasks.pop_back();
+          mActive.fetch_add(1);
+          mQueued.fetch_sub(1);
+          return true;
+        }
+      }
+      for (size_t i = 1; i < mWorkers.size(); ++i)
+      {
+        worker& victim = *mWorkers[(index + i) % mWorkers.size()];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.tasks.empty())
+        {
+          t = std::move(victim.tasks.front());
+          victim.tasks.pop_front();
+          mActive.fetch_add(1);
+          mQueued.fetch_sub(1);
+          gSteals.add();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /*
+      the timer thread advances the wheel one slot per kTick, after a stall it catches up
+      slot by slot. The due tasks are submitted outside of the lock.
+    */
+    void scheduler::timers()
+    {
+      std::vector<timerentry> due;
+      std::unique_lock<std::mutex> lock(mTimerLock);
+      auto begin = std::chrono::steady_clock::now();
+      uint64_t base = mTicks;
+      while (!mTimerStop)
+      {
+        auto next = begin + kTick * (mTicks - base + 1);
+        if (mTimerWake.wait_until(lock, next, [this]() { return mTimerStop; }))
+        {
+          break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (begin + kTick * (mTicks - base + 1) <= now)
+        {
+          ++mTicks;
+          tick(due);
+        }
+        if (!due.empty())
+        {
+          lock.unlock();
+          for (auto& e : due)
+          {
+            fire(e);
+          }
+          due.clear();
+          lock.lock();
+        }
+      }
+    }
+
+    /*
+      tick collects the due entries of the current slot, the others wait another turn
+    */
+    void scheduler::tick(std::vector<timerentry>& due)
+    {
+      auto& slot = mWheel[mTicks % kSlots];
+      size_t kept = 0;
+      for (size_t i = 0; i < slot.size(); ++i)
+      {
+        timerentry& e = slot[i];
+        if (mTimers.count(e.id) == 0)
+        {
+          continue;   // cancelled
+        }
+        if (e.rounds > 0)
+        {
+          --e.rounds;
+          if (kept != i)
+          {
+            slot[kept] = std::move(e);
+          }
+          ++kept;
+          continue;
+        }
+        if (e.interval.count() == 0)
+        {
+          mTimers.erase(e.id);
+        }
+        due.push_back(std::move(e));
+      }
+      slot.resize(kept);
+    }
+
+    /*
+      arm puts the timer into the slot delay ticks ahead, mTimerLock is held
+    */
+    void scheduler::arm(timerid id, std::chrono::milliseconds delay, std::chrono::milliseconds interval, task t)
+    {
+      uint64_t ticks = (uint64_t)std::max<int64_t>(1, (delay.count() + kTick.count() - 1) / kTick.count());
+      timerentry e;
+      e.id = id;
+      e.rounds = (ticks - 1) / kSlots;
+      e.interval = interval;
+      e.fun = std::move(t);
+      mWheel[(mTicks + ticks) % kSlots].push_back(std::move(e));
+    }
+
+    /*
+      a periodic timer is rearmed after the run, unless it was cancelled meanwhile
+    */
+    void scheduler::fire(const timerentry& e)
+    {
+      gTimers.add();
+      timerid id = e.id;
+      std::chrono::milliseconds interval = e.interval;
+      task fun = e.fun;
+      submit([this, id, interval, fun]()
+      {
+        fun();
+        if (interval.count() > 0)
+        {
+          std::lock_guard<std::mutex> lock(mTimerLock);
+          if (!mTimerStop && mTimers.count(id))
+          {
+            arm(id, interval, interval, fun);
+          }
+        }
+      });
+    }
+  }
+}
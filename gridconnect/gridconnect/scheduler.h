@@ -0,0 +1,137 @@
+/*
+  scheduler
+
+  work-stealing thread pool with a timer wheel for periodic jobs
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace satag
+{
+  namespace util
+  {
+    /*
+      scheduler runs short tasks on a fixed number of threads instead of a thread per
+      subsystem, so the gateway can be sized for the SoC it runs on.
+
+        scheduler pool(2);                          // 0 = one thread per core
+        pool.start();
+        pool.submit([] { compress(); });
+        pool.defer([] { writeBatch(); });            // after the tasks already queued here
+        auto id = pool.every(100ms, [] { pollCommands(); });
+        pool.after(5s, [] { checkpoint(); });
+        pool.cancel(id);
+        pool.stop();                                // runs what is queued, then joins
+
+      Every worker has a deque of its own: tasks submitted from a worker go to the back
+      of its deque and it takes them from there (the most recent task is still in the
+      cache), idle workers steal from the front of the other deques. Tasks submitted from
+      other threads are spread round-robin.
+
+      Timers live in a hashed timer wheel with kSlots slots of kTick each, a timer thread
+      advances it and submits the due tasks. A periodic task is rearmed when it finished,
+      so it never runs twice at the same time and doesn't pile up after a stall.
+
+      Tasks shouldn't block for long: a task waiting for another task can stall the pool
+      if all workers are waiting.
+    */
+    class scheduler
+    {
+    public:
+      typedef std::function<void()> task;
+      typedef uint64_t timerid;
+      typedef std::chrono::steady_clock::time_point deadline;
+
+      static const size_t kSlots = 512;                         // slots of the timer wheel
+      static constexpr std::chrono::milliseconds kTick{ 10 };   // resolution of the timers
+
+      explicit scheduler(size_t threads = 0);
+      ~scheduler();
+      bool start();
+      void stop();
+      bool isRunning() const { return mRunning.load(std::memory_order_acquire); }
+      size_t threadCount() const { return mThreads; }
+      bool submit(task t);
+      bool defer(task t);
+      timerid after(std::chrono::milliseconds delay, task t);
+      timerid every(std::chrono::milliseconds interval, task t);
+      bool cancel(timerid id);
+      void cancelAll();
+      bool drain(deadline until);
+      static scheduler* current();
+    private:
+      struct worker
+      {
+        std::mutex lock;          // protects tasks
+        std::deque<task> tasks;   // own tasks at the back, stolen from the front
+        std::thread thread;
+      };
+      struct timerentry
+      {
+        timerid id;
+        uint64_t rounds;                      // full turns of the wheel before it is due
+        std::chrono::milliseconds interval;   // 0 for a one-shot timer
+        task fun;
+      };
+      bool push(task t, bool back);
+      void work(size_t index);
+      bool take(size_t index, task& t);
+      void timers();
+      void tick(std::vector<timerentry>& due);
+      void arm(timerid id, std::chrono::milliseconds delay, std::chrono::milliseconds interval, task t);
+      void fire(const timerentry& e);
+      size_t mThreads;                                // number of workers
+      std::vector<std::unique_ptr<worker>> mWorkers;
+      std::atomic<size_t> mNext{ 0 };                 // round-robin for external submits
+      std::atomic<size_t> mQueued{ 0 };               // tasks in all deques
+      std::atomic<size_t> mActive{ 0 };               // tasks being executed
+      std::atomic<bool> mRunning{ false };            // submit() is accepted
+      bool mStop = false;                             // the workers should terminate when idle
+      std::mutex mIdleLock;                           // protects mStop, used for the sleeping workers
+      std::condition_variable mWork;                  // signals the sleeping workers
+      std::condition_variable mIdle;                  // signals drain()
+      std::mutex mTimerLock;                          // protects the timer wheel
+      std::condition_variable mTimerWake;             // signals the timer thread to terminate
+      std::vector<std::vector<timerentry>> mWheel;    // kSlots slots
+      std::unordered_set<timerid> mTimers;            // armed timers, cancel removes the id
+      uint64_t mTicks = 0;                            // ticks done since start()
+      timerid mNextTimer = 1;
+      bool mTimerStop = false;
+      std::thread mTimerThread;
+    };
+  }
+}
@@ -0,0 +1,870 @@
+/*
+  shardedstore
+
+  bx::shardedstore spreads the battery datastore over several sqlite files, one per
+  shard, so multiple battery devices don't serialize on a single database file
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "shardedstore.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      // rows fetched per shard and round trip while merging
+      static const size_t kMergePage = 256;
+
+      // microseconds from queueing a sample until its batch is committed
+      static metrics::histogram& gLatency = metrics::registry::instance().getHistogram("shard.latency");
+      // microseconds from the exectime of a command until the dispatcher has it
+      static metrics::histogram& gCommandLatency = metrics::registry::instance().getHistogram("commands.latency");
+
+      shardedstore::shardedstore()
+      {
+      }
+
+      shardedstore::~shardedstore()
+      {
+        close();
+      }
+
+      /*
+        opens (and creates) the shard databases and starts their writer threads, or with
+        a scheduler lets its workers do the writing. With a single shard the source is used as is.
+      */
+      bool shardedstore::open(const char* source, size_t shards, partitioning mode, util::scheduler* pool, journaling journal)
+      {
+        close();
+#if SATAG_COROUTINES
+        {
+          std::lock_guard<std::mutex> lock(mWaitLock);
+          mClosing = false;
+        }
+#endif
+        if (shards < 1)
+        {
+          shards = 1;
+        }
+        if (shards > kMaxShards)
+        {
+          shards = kMaxShards;
+        }
+        bool result = true;
+        for (size_t i = 0; result && (i < shards); ++i)
+        {
+          std::unique_ptr<shard> s(new shard());
+          s->mPool = pool;
+          result = s->mStore.open(shardName(source, i, shards).c_str(), mode, journal);
+          if (result)
+          {
+            s->start();
+            mShards.push_back(std::move(s));
+          }
+        }
+        if (!result)
+        {
+          close();
+        }
+        return isOpen();
+      }
+
+      /*
+        close writes everything still queued, stops the writer threads and closes the databases
+      */
+      void shardedstore::close()
+      {
+        for (auto& s : mShards)
+        {
+          s->stop();
+        }
+#if SATAG_COROUTINES
+        // the waiting nextCommand()s are detached and their timers cancelled while the
+        // shards are still there, a poll which starts later completes without them
+        std::map<uint64_t, waiter> waiting;
+        {
+          std::unique_lock<std::mutex> lock(mWaitLock);
+          mClosing = true;
+          mPolled.wait(lock, [this]() { return mPolling == 0; });
+          waiting.swap(mWaiting);
+        }
+        for (auto& w : waiting)
+        {
+          if (w.second.poll != 0)
+          {
+            w.second.timer->cancel(w.second.poll);
+          }
+          w.second.c->complete(command());   // the store is closing
+        }
+#endif
+        for (auto& s : mShards)
+        {
+          s->mStore.close();
+        }
+        mShards.clear();
+      }
+
+      /*
+        the device ids are small consecutive numbers, so they are mixed before taking the modulo
+      */
+      size_t shardedstore::shardOf(int device) const
+      {
+        uint32_t h = (uint32_t)device * 2654435761u;
+        h ^= h >> 16;
+        return h % mShards.size();
+      }
+
+      bool shardedstore::logDSPEvent(int device, int entity, int value)
+      {
+        sample s;
+        s.device = device;
+        s.entity = entity;
+        s.value = value;
+        s.sampletime = store::now();
+        return mShards[shardOf(device)]->enqueue(s);
+      }
+
+      bool shardedstore::logDSPEvents(const std::vector<sample>& samples)
+      {
+        bool result = true;
+        if (mShards[0]->mStore.journalMode() != nojournal)
+        {
+          // one journal record per shard
+          if (mShards.size() == 1)
+          {
+            return mShards[0]->journal(samples.data(), samples.size());
+          }
+          std::vector<std::vector<sample>> parts(mShards.size());
+          for (auto& s : samples)
+          {
+            parts[shardOf(s.device)].push_back(s);
+          }
+          for (size_t i = 0; i < parts.size(); ++i)
+          {
+            result &= parts[i].empty() || mShards[i]->journal(parts[i].data(), parts[i].size());
+          }
+          return result;
+        }
+        for (auto& s : samples)
+        {
+          result &= mShards[shardOf(s.device)]->enqueue(s);
+        }
+        return result;
+      }
+
+      bool shardedstore::logState(int device, int entity, const char * text1, const char * text2)
+      {
+        // the texts must survive until the writer gets to them
+        std::string t1(text1 ? text1 : "");
+        std::string t2(text2 ? text2 : "");
+        bool n1 = (text1 == nullptr);
+        bool n2 = (text2 == nullptr);
+        return mShards[shardOf(device)]->enqueue([=](store& s)
+        {
+          return s.logState(device, entity, n1 ? nullptr : t1.c_str(), n2 ? nullptr : t2.c_str());
+        });
+      }
+
+      /*
+        settings are written synchronously, so a getSetting right after setSetting sees the
+        new value. getSetting reads the cache of the shard.
+      */
+      bool shardedstore::setSetting(int device, int entity, int value)
+      {
+        return mShards[shardOf(device)]->mStore.setSetting(device, entity, value);
+      }
+
+      int shardedstore::getSetting(int device, int entity)
+      {
+        return mShards[shardOf(device)]->mStore.getSetting(device, entity);
+      }
+
+      /*
+        saveSettings writes the settings of each shard in one transaction of that shard
+      */
+      bool shardedstore::saveSettings(const std::vector<setting>& settings)
+      {
+        if (mShards.size() == 1)
+        {
+          return mShards[0]->mStore.saveSettings(settings);
+        }
+        std::vector<std::vector<setting>> parts(mShards.size());
+        for (auto& s : settings)
+        {
+          parts[shardOf(s.device)].push_back(s);
+        }
+        bool result = true;
+        for (size_t i = 0; i < parts.size(); ++i)
+        {
+          result &= parts[i].empty() || mShards[i]->mStore.saveSettings(parts[i]);
+        }
+        return result;
+      }
+
+      /*
+        settings is the snapshot of the shard which has the settings of device
+      */
+      std::shared_ptr<const settingsmap> shardedstore::settings(int device) const
+      {
+        return mShards[shardOf(device)]->mStore.settings();
+      }
+
+      /*
+        fun is told about the changes in every shard, on the thread which saved them
+      */
+      void shardedstore::onSettingsChanged(std::function<void(const std::vector<setting>& changed)> fun)
+      {
+        for (auto& s : mShards)
+        {
+          s->mStore.onSettingsChanged(fun);
+        }
+      }
+
+      bool shardedstore::logEvent(int eventid, const char * source, int device, const char * text1, const char * text2, bool success)
+      {
+        return primary().logEvent(eventid, source, device, text1, text2, success);
+      }
+
+      bool shardedstore::runEvent(std::function<bool(int device, const char*text1, const char*text2)> fun)
+      {
+        return primary().runEvent(fun);
+      }
+
+      /*
+        addCommands queues the commands in one transaction of the primary shard, the
+        dispatcher is woken once they are committed instead of at its next poll
+      */
+      bool shardedstore::addCommands(const std::vector<command>& commands)
+      {
+        if (mShards.empty())
+        {
+          return false;
+        }
+        std::vector<command> copy(commands);
+        return mShards[0]->enqueue([this, copy](store& s)
+        {
+          bool ok = s.addCommands(copy);
+          if (ok)
+          {
+            commandsAdded();
+          }
+          return ok;
+        });
+      }
+
+      void shardedstore::commandsAdded()
+      {
+#if SATAG_COROUTINES
+        resumeWaiting(0);
+#endif
+        if (mCommandsAdded)
+        {
+          mCommandsAdded();
+        }
+      }
+
+      /*
+        readSamples iterates the samples of all shards with from <= sampletime < to in
+        (sampletime, shard, id) order. Each shard is read page by page with its own cursor,
+        and the pages are merged, so memory stays bounded by shards * kMergePage.
+        The iteration stops early if fun returns false.
+      */
+      bool shardedstore::readSamples(int64_t from, int64_t to, std::function<bool(const sample&)> fun)
+      {
+        struct source
+        {
+          samplecursor cursor;
+          std::vector<sample> page;
+          size_t pos = 0;
+        };
+        std::vector<source> sources(mShards.size());
+        // refills the page of shard i, returns false if the shard is exhausted
+        auto fill = [&](size_t i, bool& ok) -> bool
+        {
+          auto& src = sources[i];
+          src.page.clear();
+          src.pos = 0;
+          if (!src.cursor.done)
+          {
+            ok &= mShards[i]->mStore.readSamples(from, to, src.cursor, kMergePage, [&](const sample& s)
+            {
+              src.page.push_back(s);
+            });
+          }
+          return !src.page.empty();
+        };
+        // min-heap of shard indices ordered by their current sample
+        auto later = [&](size_t a, size_t b)
+        {
+          auto& sa = sources[a].page[sources[a].pos];
+          auto& sb = sources[b].page[sources[b].pos];
+          if (sa.sampletime != sb.sampletime)
+          {
+            return sa.sampletime > sb.sampletime;
+          }
+          return a > b;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+        bool result = true;
+        for (size_t i = 0; i < sources.size(); ++i)
+        {
+          if (fill(i, result))
+          {
+            heap.push(i);
+          }
+        }
+        while (!heap.empty())
+        {
+          size_t i = heap.top();
+          heap.pop();
+          auto& src = sources[i];
+          if (!fun(src.page[src.pos]))
+          {
+            break;
+          }
+          if ((++src.pos < src.page.size()) || fill(i, result))
+          {
+            heap.push(i);
+          }
+        }
+        return result;
+      }
+
+      /*
+        dropPartitionsBefore applies the retention to every shard
+      */
+      bool shardedstore::dropPartitionsBefore(int64_t time)
+      {
+        bool result = true;
+        for (auto& s : mShards)
+        {
+          result &= s->mStore.dropPartitionsBefore(time);
+        }
+        return result;
+      }
+
+      /*
+        flush waits until all shards have written their queues
+      */
+      bool shardedstore::flush()
+      {
+        return flush(std::chrono::steady_clock::time_point::max());
+      }
+
+      /*
+        flush with a deadline returns false if the queues weren't written in time, the
+        samples stay queued and close() still writes them
+      */
+      bool shardedstore::flush(std::chrono::steady_clock::time_point deadline)
+      {
+        bool result = true;
+        for (auto& s : mShards)
+        {
+          result &= s->flush(deadline);
+        }
+        return result;
+      }
+
+      size_t shardedstore::pending() const
+      {
+        size_t result = 0;
+        for (auto& s : mShards)
+        {
+          std::lock_guard<std::mutex> lock(s->mQueueLock);
+          result += s->mSamples.size() + s->mOps.size() + s->mJournaled;
+        }
+        return result;
+      }
+
+      size_t shardedstore::failed() const
+      {
+        size_t result = 0;
+        for (auto& s : mShards)
+        {
+          std::lock_guard<std::mutex> lock(s->mQueueLock);
+          result += s->mFailed;
+        }
+        return result;
+      }
+
+#if SATAG_COROUTINES
+      constexpr std::chrono::milliseconds shardedstore::kCommandPoll;
+
+      /*
+        the async variants queue the write like the others and complete once the
+        writer of the shard is through with it
+      */
+      util::completion<bool> shardedstore::logDSPEventAsync(int device, int entity, int value)
+      {
+        return util::completion<bool>([this, device, entity, value](util::completion<bool>& c)
+        {
+          sample s;
+          s.device = device;
+          s.entity = entity;
+          s.value = value;
+          s.sampletime = store::now();
+          if (!mShards[shardOf(device)]->enqueue(s, [&c](bool ok) { c.complete(ok); }))
+          {
+            c.complete(false);
+          }
+        });
+      }
+
+      util::completion<bool> shardedstore::logEventAsync(int eventid, const char * source, int device, const char * text1, const char * text2, bool success)
+      {
+        // the texts are copied once, the lambdas share them
+        auto e = std::make_shared<event>();
+        e->eventid = eventid;
+        e->source = source ? source : "";
+        e->null1 = (text1 == nullptr);
+        e->null2 = (text2 == nullptr);
+        e->text1 = e->null1 ? "" : text1;
+        e->text2 = e->null2 ? "" : text2;
+        return util::completion<bool>([=, this](util::completion<bool>& c)
+        {
+          bool queued = mShards[0]->enqueue([=, &c](store& s)
+          {
+            bool ok = s.logEvent(e->eventid, e->source.c_str(), device, e->null1 ? nullptr : e->text1.c_str(), e->null2 ? nullptr : e->text2.c_str(), success);
+            c.complete(ok);
+            return ok;
+          });
+          if (!queued)
+          {
+            c.complete(false);
+          }
+        });
+      }
+
+      /*
+        nextCommand completes with the oldest command once there is one. A command from
+        addCommands resumes every waiting nextCommand right away, the queue is checked
+        every kCommandPoll on the scheduler of the caller (or the one of the store) for
+        commands from elsewhere. close() completes the waiting ones with an empty command.
+        Without a scheduler the result is an empty command (id 0) if nothing is queued.
+        The command stays queued until removeCommandAsync.
+      */
+      util::completion<command> shardedstore::nextCommand()
+      {
+        return util::completion<command>([this](util::completion<command>& c)
+        {
+          pollCommand(c);
+        });
+      }
+
+      void shardedstore::pollCommand(util::completion<command>& c)
+      {
+        {
+          std::lock_guard<std::mutex> lock(mWaitLock);
+          if (!mClosing)
+          {
+            ++mPolling;
+          }
+          else
+          {
+            c.complete(command());
+            return;
+          }
+        }
+        bool queued = mShards[0]->enqueue([this, &c](store& s)
+        {
+          command cmd;
+          bool ok = s.nextCommand(cmd);
+          util::scheduler* timer = c.executor() ? c.executor() : mShards[0]->mPool;
+          if (!ok || (cmd.id != 0) || !timer || !timer->isRunning())
+          {
+            if (cmd.id != 0)
+            {
+              gCommandLatency.record((uint64_t)std::max<int64_t>(0, store::now() - cmd.exectime));
+            }
+            c.complete(std::move(cmd));
+            return ok;
+          }
+          // the writer of shard 0 runs this and addCommands one after the other, a
+          // command committed after the check finds c waiting
+          uint64_t wait;
+          {
+            std::lock_guard<std::mutex> lock(mWaitLock);
+            wait = ++mWaits;
+            mWaiting[wait] = waiter{ &c, timer, 0 };
+          }
+          auto poll = timer->after(kCommandPoll, [this, wait]() { resumeWaiting(wait); });
+          std::lock_guard<std::mutex> lock(mWaitLock);
+          auto w = mWaiting.find(wait);
+          if (w != mWaiting.end())
+          {
+            w->second.poll = poll;
+          }
+          return true;
+        });
+        {
+          std::lock_guard<std::mutex> lock(mWaitLock);
+          --mPolling;
+        }
+        mPolled.notify_all();
+        if (!queued)
+        {
+          c.complete(command());
+        }
+      }
+
+      /*
+        resumeWaiting checks the queue again for the waiting nextCommands, wait is the
+        one a poll timer was set for, 0 for all of them (their timers are cancelled)
+      */
+      void shardedstore::resumeWaiting(uint64_t wait)
+      {
+        std::vector<waiter> ready;
+        {
+          std::lock_guard<std::mutex> lock(mWaitLock);
+          if (wait == 0)
+          {
+            for (auto& w : mWaiting)
+            {
+              ready.push_back(w.second);
+            }
+            mWaiting.clear();
+          }
+          else
+          {
+            auto w = mWaiting.find(wait);
+            if (w != mWaiting.end())
+            {
+              ready.push_back(w->second);
+              mWaiting.erase(w);
+            }
+          }
+        }
+        for (auto& w : ready)
+        {
+          if ((wait == 0) && (w.poll != 0))
+          {
+            w.timer->cancel(w.poll);
+          }
+          pollCommand(*w.c);
+        }
+      }
+
+      util::completion<bool> shardedstore::removeCommandAsync(int64_t id)
+      {
+        return util::completion<bool>([this, id](util::completion<bool>& c)
+        {
+          bool queued = mShards[0]->enqueue([id, &c](store& s)
+          {
+            bool ok = s.removeCommand(id);
+            c.complete(ok);
+            return ok;
+          });
+          if (!queued)
+          {
+            c.complete(false);
+          }
+        });
+      }
+#endif
+
+      /*
+        "battery.sq3" becomes "battery.<index>.sq3", a name without extension gets ".<index>" appended
+      */
+      std::string shardedstore::shardName(const char * source, size_t index, size_t shards)
+      {
+        std::string name(source);
+        if (shards > 1)
+        {
+          auto dot = name.find_last_of('.');
+          auto slash = name.find_last_of("/\\");
+          std::string tag(".");
+          tag += std::to_string(index);
+          if ((dot == std::string::npos) || ((slash != std::string::npos) && (dot < slash)))
+          {
+            name += tag;
+          }
+          else
+          {
+            name.insert(dot, tag);
+          }
+        }
+        return name;
+      }
+
+      // ----------------------------------------------------------------------------
+
+      void shardedstore::shard::start()
+      {
+        mStop = false;
+        if (!mPool)
+        {
+          mWriter = std::thread([this]() { run(); });
+        }
+      }
+
+      /*
+        with a scheduler stop waits for the task in flight and writes the rest itself
+      */
+      void shardedstore::shard::stop()
+      {
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        mStop = true;
+        if (mPool)
+        {
+          mIdle.notify_all();
+          mIdle.wait(lock, [this]() { return !mBusy && !mScheduled; });
+          while (queued())
+          {
+            write(lock);
+          }
+          return;
+        }
+        lock.unlock();
+        mWork.notify_all();
+        if (mWriter.joinable())
+        {
+          mWriter.join();
+        }
+      }
+
+      /*
+        the writer thread waits for work and writes until it is stopped and drained
+      */
+      void shardedstore::shard::run()
+      {
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        while (true)
+        {
+          mWork.wait(lock, [this]() { return mStop || queued(); });
+          if (!queued())
+          {
+            break; // stopped and drained
+          }
+          write(lock);
+        }
+      }
+
+      /*
+        the writer task of a shard writes one batch and submits itself again if more
+        was queued meanwhile, so a busy shard doesn't hold on to a worker
+      */
+      void shardedstore::shard::drain()
+      {
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        mScheduled = false;
+        if (queued())
+        {
+          write(lock);
+        }
+        schedule(lock);
+        mIdle.notify_all();
+      }
+
+      /*
+        schedule submits the writer task unless one is queued or running. If the
+        scheduler doesn't take it anymore, the caller writes the queue itself.
+      */
+      void shardedstore::shard::schedule(std::unique_lock<std::mutex>& lock)
+      {
+        if (mScheduled || mBusy || !queued())
+        {
+          return;
+        }
+        mScheduled = true;
+        // deferred, the producers already queued on this worker add to the batch first
+        if (!mPool->defer([this]() { drain(); }))
+        {
+          mScheduled = false;
+          while (queued())
+          {
+            write(lock);
+          }
+        }
+      }
+
+      /*
+        write takes everything queued at once and writes the samples as one batch,
+        followed by the other operations in the order they were queued. The lock is
+        released while writing. Journaled samples are applied from the journal.
+      */
+      void shardedstore::shard::write(std::unique_lock<std::mutex>& lock)
+      {
+        std::vector<sample> samples;
+        std::vector<std::function<bool(store&)>> ops;
+        std::vector<std::function<void(bool)>> done;
+        samples.swap(mSamples);
+        ops.swap(mOps);
+        done.swap(mDone);
+        size_t journaled = mJournaled;
+        mJournaled = 0;
+        mBusy = true;
+        lock.unlock();
+        // space is available again
+        mIdle.notify_all();
+
+        size_t failed = 0;
+        bool written = true;
+        if ((journaled > 0) && !mStore.applyJournal())
+        {
+          // they stay journaled, the next apply or open() writes them
+          failed += journaled;
+        }
+        if (!samples.empty())
+        {
+          written = mStore.logDSPEvents(samples);
+          if (written)
+          {
+            // sample to disk latency, the sample time is stamped when the sample is queued
+            int64_t now = store::now();
+            for (auto& s : samples)
+            {
+              gLatency.record((uint64_t)std::max<int64_t>(0, now - s.sampletime));
+            }
+          }
+          else
+          {
+            failed += samples.size();
+          }
+        }
+        for (auto& d : done)
+        {
+          d(written);
+        }
+        for (auto& op : ops)
+        {
+          if (!op(mStore))
+          {
+            ++failed;
+          }
+        }
+
+        lock.lock();
+        mFailed += failed;
+        mBusy = false;
+        mIdle.notify_all();
+      }
+
+      bool shardedstore::shard::enqueue(const sample & s, std::function<void(bool)> done)
+      {
+        if (mStore.journalMode() != nojournal)
+        {
+          return journal(&s, 1, std::move(done));
+        }
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        // backpressure: the producer waits until the writer took the queue
+        mIdle.wait(lock, [this]() { return mStop || (mSamples.size() < kMaxPending); });
+        if (mStop)
+        {
+          return false;
+        }
+        mSamples.push_back(s);
+        if (done)
+        {
+          mDone.push_back(std::move(done));
+        }
+        if (mPool)
+        {
+          schedule(lock);
+          return true;
+        }
+        lock.unlock();
+        mWork.notify_one();
+        return true;
+      }
+
+      bool shardedstore::shard::enqueue(std::function<bool(store&)> op)
+      {
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        if (mStop)
+        {
+          return false;
+        }
+        mOps.push_back(std::move(op));
+        if (mPool)
+        {
+          schedule(lock);
+          return true;
+        }
+        lock.unlock();
+        mWork.notify_one();
+        return true;
+      }
+
+      /*
+        journal appends the samples to the journal of the store (done is told once they
+        are), then the writer is woken to apply them. Like enqueue, it returns false
+        without calling done if the samples aren't taken, the caller reports that. The producers wait while kMaxPending
+        journaled samples aren't applied yet, like they wait for the queue.
+      */
+      bool shardedstore::shard::journal(const sample* samples, size_t count, std::function<void(bool)> done)
+      {
+        {
+          std::unique_lock<std::mutex> lock(mQueueLock);
+          mIdle.wait(lock, [this]() { return mStop || (mJournaled < kMaxPending); });
+          if (mStop)
+          {
+            return false;
+          }
+        }
+        if (!mStore.logDSPEvents(samples, count))
+        {
+          std::lock_guard<std::mutex> lock(mQueueLock);
+          mFailed += count;
+          return false;
+        }
+        if (done)
+        {
+          done(true);
+        }
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        mJournaled += count;
+        if (mPool)
+        {
+          schedule(lock);
+          return true;
+        }
+        lock.unlock();
+        mWork.notify_one();
+        return true;
+      }
+
+      bool shardedstore::shard::flush(std::chrono::steady_clock::time_point deadline)
+      {
+        std::unique_lock<std::mutex> lock(mQueueLock);
+        size_t failed = mFailed;
+        auto drained = [this]() { return !mBusy && !queued(); };
+        if (deadline == std::chrono::steady_clock::time_point::max())
+        {
+          mIdle.wait(lock, drained);
+        }
+        else if (!mIdle.wait_until(lock, deadline, drained))
+        {
+          return false;
+        }
+        return (mFailed == failed);
+      }
+    }
+  }
+}
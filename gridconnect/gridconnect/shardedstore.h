@@ -0,0 +1,182 @@
+/*
+  shardedstore
+
+  bx::shardedstore spreads the battery datastore over several sqlite files, one per
+  shard, so multiple battery devices don't serialize on a single database file
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <condition_variable>
+
+#include "storage.h"
+#include "scheduler.h"
+#include "async.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      /*
+        shardedstore routes samples, states and settings by a hash of the device
+        to one of N stores ("battery.sq3" becomes "battery.0.sq3", "battery.1.sq3", ...).
+        Each shard has its own writer thread which writes the queued samples in batches,
+        so the write throughput scales with the number of files and cores. Given a scheduler
+        the shards have no threads of their own, a writer task is submitted whenever
+        something is queued and at most one of them runs per shard.
+
+        The event log and the command queue live in the primary shard (shard 0).
+        addCommands queues commands there and, once they are committed, wakes the
+        dispatcher: a nextCommand() waiting for the queue and the onCommands callback.
+
+        examples:
+
+          shardedstore s;
+          s.open("battery.sq3", 4);
+          s.logDSPEvent(7, 1, 42);    // queued, written by the writer of shard 7 % 4
+          s.flush();                  // wait until everything queued is written
+          s.readSamples(0, INT64_MAX, [](const sample& s) { return true; });   // merged from all shards
+
+          s.open("battery.sq3", 4, unpartitioned, &pool);   // written by the workers of pool
+
+        With journaling the samples are appended to the journal of their shard before
+        logDSPEvent(s) returns (the async variant completes then) instead of waiting in
+        memory, the writer applies everything journaled since its last run in one
+        transaction. The transactions get larger the busier the shard is.
+
+          s.open("battery.sq3", 4, unpartitioned, &pool, journaled);
+
+        With C++20 the writes can be awaited in a coroutine instead, the flow is suspended
+        until the writer committed them and continues on the scheduler it was running on:
+
+          task<void> execute(shardedstore& s)
+          {
+            command c = co_await s.nextCommand();          // waits for a command
+            ...
+            co_await s.logEventAsync(100, "NetIn", c.device, c.t1(), c.t2(), true);
+            co_await s.removeCommandAsync(c.id);
+          }
+      */
+      class shardedstore
+      {
+      public:
+        static const size_t kMaxShards = 64;      // upper limit for the number of shards
+        static const size_t kMaxPending = 65536;  // queued samples per shard before logDSPEvent blocks
+        static constexpr std::chrono::milliseconds kCommandPoll{ 100 };  // nextCommand checks the queue this often
+
+        shardedstore();
+        ~shardedstore();
+        bool open(const char* source, size_t shards, partitioning mode = unpartitioned, util::scheduler* pool = nullptr, journaling journal = nojournal);
+        void close();
+        bool isOpen() const { return !mShards.empty(); }
+        size_t shardCount() const { return mShards.size(); }
+        size_t shardOf(int device) const;
+        store& primary() { return mShards[0]->mStore; }
+        bool logDSPEvent(int device, int entity, int value);
+        bool logDSPEvents(const std::vector<sample>& samples);
+        bool logState(int device, int entity, const char* text1, const char* text2);
+        bool setSetting(int device, int entity, int value);
+        int getSetting(int device, int entity);
+        bool saveSettings(const std::vector<setting>& settings);
+        std::shared_ptr<const settingsmap> settings(int device) const;
+        void onSettingsChanged(std::function<void(const std::vector<setting>& changed)> fun);
+        bool logEvent(int eventid, const char * source, int device, const char* text1, const char* text2, bool success);
+        bool runEvent(std::function<bool(int device, const char* text1, const char* text2)> fun);
+        bool addCommands(const std::vector<command>& commands);
+        void onCommands(std::function<void()> fun) { mCommandsAdded = fun; }
+        bool readSamples(int64_t from, int64_t to, std::function<bool(const sample&)> fun);
+        bool dropPartitionsBefore(int64_t time);
+        bool flush();
+        bool flush(std::chrono::steady_clock::time_point deadline);
+        size_t pending() const;
+        size_t failed() const;
+        static std::string shardName(const char* source, size_t index, size_t shards);
+#if SATAG_COROUTINES
+        util::completion<bool> logDSPEventAsync(int device, int entity, int value);
+        util::completion<bool> logEventAsync(int eventid, const char* source, int device, const char* text1, const char* text2, bool success);
+        util::completion<command> nextCommand();
+        util::completion<bool> removeCommandAsync(int64_t id);
+#endif
+      private:
+        class shard
+        {
+        public:
+          shard() {}
+          void start();
+          void stop();
+          void run();
+          void drain();
+          void schedule(std::unique_lock<std::mutex>& lock);
+          void write(std::unique_lock<std::mutex>& lock);
+          bool enqueue(const sample& s, std::function<void(bool)> done = nullptr);
+          bool enqueue(std::function<bool(store&)> op);
+          bool journal(const sample* samples, size_t count, std::function<void(bool)> done = nullptr);
+          bool queued() const { return !mSamples.empty() || !mOps.empty() || (mJournaled > 0); }
+          bool flush(std::chrono::steady_clock::time_point deadline);
+          store mStore;                               // the database of this shard
+          std::thread mWriter;                        // the writer thread, if there is no scheduler
+          util::scheduler* mPool = nullptr;           // runs the writer tasks instead
+          mutable std::mutex mQueueLock;              // protects everything below
+          std::condition_variable mWork;              // signals the writer thread
+          std::condition_variable mIdle;              // signals producers and flush()
+          std::vector<sample> mSamples;               // samples waiting for the writer
+          std::vector<std::function<bool(store&)>> mOps; // other writes waiting for the writer
+          std::vector<std::function<void(bool)>> mDone;  // told the result of the next sample batch
+          size_t mJournaled = 0;                      // journaled samples the writer hasn't applied yet
+          bool mBusy = false;                         // the writer is writing a batch
+          bool mScheduled = false;                    // a writer task is submitted
+          bool mStop = false;                         // the writer should terminate
+          size_t mFailed = 0;                         // number of samples/ops which couldn't be written
+        };
+        void commandsAdded();
+#if SATAG_COROUTINES
+        struct waiter
+        {
+          util::completion<command>* c;         // the suspended nextCommand()
+          util::scheduler* timer;               // runs its poll timer
+          util::scheduler::timerid poll;        // the poll timer, 0 until it is armed
+        };
+        void pollCommand(util::completion<command>& c);
+        void resumeWaiting(uint64_t wait);
+        std::mutex mWaitLock;                               // protects the members below
+        std::condition_variable mPolled;                    // signals close() that mPolling dropped
+        std::map<uint64_t, waiter> mWaiting;                // the nextCommand()s waiting for the queue, by wait
+        uint64_t mWaits = 0;                                // counts the waits, tells the poll timers apart
+        size_t mPolling = 0;                                // pollCommand calls using the shards right now
+        bool mClosing = false;                              // close() took the waiters, polls complete empty
+#endif
+        std::vector<std::unique_ptr<shard>> mShards;
+        std::function<void()> mCommandsAdded;       // runs on the writer of shard 0 after addCommands
+      };
+    }
+  }
+}
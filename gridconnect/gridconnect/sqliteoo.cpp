@@ -28,6 +28,22 @@ The license above does not apply to and no license is granted for any Military U
 */
 
 #include "sqliteoo.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+// sqlite3_trace_v2 reports the statement with its run time, older versions only have sqlite3_profile
+#if SQLITE_VERSION_NUMBER >= 3014000
+#define SATAG_SQLITE_TRACE_V2 1
+#else
+#define SATAG_SQLITE_TRACE_V2 0
+#endif
 
 /* your lack of comments is disturbing :) */
 
@@ -35,6 +51,176 @@ namespace satag
 {
   namespace util
   {
+    // instrumentation, see metrics.h
+    static metrics::histogram& gRunTime = metrics::registry::instance().getHistogram("db.run");
+    static metrics::histogram& gCommitTime = metrics::registry::instance().getHistogram("db.commit");
+    static metrics::counter& gErrors = metrics::registry::instance().getCounter("db.errors");
+
+    /*
+      the profiler aggregates the statements of one db by normalized SQL text. The
+      raw texts only cache the normalization, they are dropped once there are
+      kMaxTexts of them, e.g. with a statement text per partition table.
+
+      query::run times its statements itself, as the time SQLite reports has only
+      millisecond resolution on some platforms. The SQLite hook picks up the other
+      statements, i.e. those of db::execute. Only sqlite3_trace_v2 passes the statement
+      handle, with the older sqlite3_profile these come without the counters.
+    */
+    class profiler
+    {
+    public:
+      static const size_t kMaxTexts = 1024;
+      void record(const char* sql, uint64_t nanos, uint64_t rows, sqlite3_stmt* stmt);
+      void reset();
+      void get(std::function<void(const statementprofile&)> fun) const;
+      static std::string normalize(const char* sql);
+    private:
+      mutable std::mutex mLock;
+      std::unordered_map<std::string, statementprofile*> mByText;  // raw SQL text -> entry
+      std::map<std::string, statementprofile> mEntries;            // entries by normalized SQL
+    };
+
+    // set while query::run steps a statement, so the hook doesn't count it twice
+    static thread_local bool tInRun = false;
+
+#if SATAG_SQLITE_TRACE_V2
+    static int traceCallback(unsigned type, void* context, void* p, void* x)
+    {
+      if ((SQLITE_TRACE_PROFILE == type) && !tInRun)
+      {
+        auto stmt = (sqlite3_stmt*)p;
+        ((profiler*)context)->record(sqlite3_sql(stmt), (uint64_t)*(sqlite3_int64*)x, 0, stmt);
+      }
+      return 0;
+    }
+#else
+    static void profileCallback(void* context, const char* sql, sqlite3_uint64 nanos)
+    {
+      if (!tInRun)
+      {
+        ((profiler*)context)->record(sql, (uint64_t)nanos, 0, nullptr);
+      }
+    }
+#endif
+
+    void profiler::record(const char * sql, uint64_t nanos, uint64_t rows, sqlite3_stmt * stmt)
+    {
+      if (!sql)
+      {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mLock);
+      auto it = mByText.find(sql);
+      if (it == mByText.end())
+      {
+        if (mByText.size() >= kMaxTexts)
+        {
+          mByText.clear();
+        }
+        auto text = normalize(sql);
+        statementprofile* entry = &mEntries[text];
+        entry->sql = text;
+        it = mByText.emplace(sql, entry).first;
+      }
+      statementprofile* e = it->second;
+      ++e->calls;
+      e->nanos += nanos;
+      e->maxnanos = std::max(e->maxnanos, nanos);
+      e->rows += rows;
+      if (stmt)
+      {
+        // read and reset, so the counters are those of this run
+        e->fullscansteps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        e->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+        e->autoindex += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+        e->vmsteps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+      }
+    }
+
+    void profiler::reset()
+    {
+      std::lock_guard<std::mutex> lock(mLock);
+      mByText.clear();
+      mEntries.clear();
+    }
+
+    void profiler::get(std::function<void(const statementprofile&)> fun) const
+    {
+      std::lock_guard<std::mutex> lock(mLock);
+      for (auto& e : mEntries)
+      {
+        fun(e.second);
+      }
+    }
+
+    /*
+      normalize folds whitespace and comments and replaces string and number literals
+      by '?', so statements which differ only in literals share an entry. Parameters
+      like ?1 and digits inside identifiers are kept, but digits after an underscore
+      are replaced as well, so the statements of all partitions (CollectedData_20240101)
+      share one entry too.
+    */
+    std::string profiler::normalize(const char * sql)
+    {
+      std::string result;
+      bool space = false;
+      const char* p = sql;
+      while (*p)
+      {
+        char c = *p;
+        if (isspace((unsigned char)c))
+        {
+          space = true;
+          ++p;
+          continue;
+        }
+        if ((c == '-') && (p[1] == '-'))
+        {
+          while (*p && (*p != '\n'))
+          {
+            ++p;
+          }
+          space = true;
+          continue;
+        }
+        if (space && !result.empty())
+        {
+          result += ' ';
+        }
+        space = false;
+        char prev = result.empty() ? ' ' : result.back();
+        if (c == '\'')
+        {
+          ++p;
+          while (*p && !((*p == '\'') && (p[1] != '\'')))
+          {
+            p += (*p == '\'') ? 2 : 1;
+          }
+          if (*p)
+          {
+            ++p;
+          }
+          result += '?';
+        }
+        else if (isdigit((unsigned char)c) && !isalnum((unsigned char)prev) && (prev != '?') && (prev != ':') && (prev != '@') && (prev != '$'))
+        {
+          while (isalnum((unsigned char)*p) || (*p == '.'))
+          {
+            ++p;
+          }
+          result += '?';
+        }
+        else
+        {
+          result += c;
+          ++p;
+        }
+      }
+      return result;
+    }
+
+    // ----------------------------------------------------------------------------
+
     db::db()
     {
     }
@@ -66,6 +252,7 @@ namespace satag
 
     void db::close()
     {
+      setProfiling(false);
       if (isOpen())
       {
         if (mOwned)
@@ -120,14 +307,22 @@ namespace satag
 
     bool query::run(std::function<void(query& row)> fun)
     {
+      metrics::stopwatch watch(gRunTime);
       bool result = true;
       int r = SQLITE_ERROR;
+      uint64_t rows = 0;
+      profiler* prof = mDB ? mDB->mProfiler.get() : nullptr;
+      auto start = std::chrono::steady_clock::now();
+      bool outer = tInRun;    // a run nested in the row callback of another one
+      tInRun = outer || (prof != nullptr);
       if (fun)
       {
         do {
           r = sqlite3_step(mStatement);
+          ++mRow;
           if (SQLITE_ROW == r)
           {
+            ++rows;
             fun(*this);
           }
           else
@@ -141,9 +336,23 @@ namespace satag
         do {
           r = sqlite3_step(mStatement);
           result = (SQLITE_DONE == r);
+          if (SQLITE_ROW == r)
+          {
+            ++rows;
+          }
         } while (SQLITE_ROW == r);
       }
+      if (!result)
+      {
+        gErrors.add();
+      }
+      if (prof)
+      {
+        uint64_t nanos = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        prof->record(sqlite3_sql(mStatement), nanos, rows, mStatement);
+      }
       reset();
+      tInRun = outer;
       return result;
     }
 
@@ -171,6 +380,10 @@ namespace satag
     bool db::execute(const char * sql)
     {
       int result = sqlite3_exec(mDB, sql, nullptr, nullptr, nullptr);
+      if (SQLITE_OK != result)
+      {
+        gErrors.add();
+      }
       return (SQLITE_OK == result);
     }
 
@@ -181,6 +394,8 @@ namespace satag
 
     bool db::commit()
     {
+      // this includes the fsync with synchronous=FULL
+      metrics::stopwatch watch(gCommitTime);
       return execute("COMMIT TRANSACTION;");
     }
 
@@ -189,6 +404,95 @@ namespace satag
       return execute("ROLLBACK TRANSACTION");
     }
 
+    /*
+      setProfiling installs or removes the profiling hook. Profiling is off by default,
+      enabling it again starts with an empty profile.
+    */
+    bool db::setProfiling(bool enable)
+    {
+      if (!isOpen())
+      {
+        return false;
+      }
+      if (enable == isProfiling())
+      {
+        return true;
+      }
+      if (enable)
+      {
+        mProfiler.reset(new profiler());
+#if SATAG_SQLITE_TRACE_V2
+        sqlite3_trace_v2(mDB, SQLITE_TRACE_PROFILE, traceCallback, mProfiler.get());
+#else
+        sqlite3_profile(mDB, profileCallback, mProfiler.get());
+#endif
+      }
+      else
+      {
+#if SATAG_SQLITE_TRACE_V2
+        sqlite3_trace_v2(mDB, 0, nullptr, nullptr);
+#else
+        sqlite3_profile(mDB, nullptr, nullptr);
+#endif
+        mProfiler.reset();
+      }
+      return true;
+    }
+
+    void db::resetProfile()
+    {
+      if (mProfiler)
+      {
+        mProfiler->reset();
+      }
+    }
+
+    void db::getProfile(std::function<void(const statementprofile&)> fun) const
+    {
+      if (mProfiler)
+      {
+        mProfiler->get(fun);
+      }
+    }
+
+    /*
+      profileReport lists the top statements by total time, e.g.
+
+           calls   total ms     avg us     max us       rows  fullscan  sort autoidx    vmsteps  sql
+             412     18.361     44.566    301.220        412     24308   412       0      98881  select id,device,...
+    */
+    std::string db::profileReport(size_t top) const
+    {
+      std::vector<statementprofile> entries;
+      getProfile([&](const statementprofile& p)
+      {
+        entries.push_back(p);
+      });
+      std::sort(entries.begin(), entries.end(), [](const statementprofile& a, const statementprofile& b)
+      {
+        return a.nanos > b.nanos;
+      });
+      if (entries.size() > top)
+      {
+        entries.resize(top);
+      }
+      char line[256];
+      snprintf(line, sizeof(line), "%8s %10s %10s %10s %10s %9s %5s %7s %10s  %s\n",
+        "calls", "total ms", "avg us", "max us", "rows", "fullscan", "sort", "autoidx", "vmsteps", "sql");
+      std::string result = line;
+      for (auto& e : entries)
+      {
+        snprintf(line, sizeof(line), "%8llu %10.3f %10.3f %10.3f %10llu %9llu %5llu %7llu %10llu  ",
+          (unsigned long long)e.calls, e.nanos / 1e6, e.calls ? e.nanos / 1e3 / e.calls : 0.0, e.maxnanos / 1e3,
+          (unsigned long long)e.rows, (unsigned long long)e.fullscansteps, (unsigned long long)e.sorts,
+          (unsigned long long)e.autoindex, (unsigned long long)e.vmsteps);
+        result += line;
+        result += e.sql;
+        result += '\n';
+      }
+      return result;
+    }
+
     field::operator const int() const
     {
       return sqlite3_column_int(_q, _i);
@@ -219,6 +523,50 @@ namespace satag
       return blob(sqlite3_column_blob(_q, _i), sqlite3_column_bytes(_q, _i));
     }
 
+    /*
+      the length comes after the text, sqlite3_column_bytes would convert it otherwise
+    */
+    textview field::text() const
+    {
+      textview v;
+      const char* p = (const char*)sqlite3_column_text(_q, _i);
+      v.mNull = (p == nullptr);
+      if (p)
+      {
+        v.mText = std::string_view(p, (size_t)sqlite3_column_bytes(_q, _i));
+      }
+#ifndef NDEBUG
+      v.mQuery = &_q;
+      v.mRow = _q.row();
+#endif
+      return v;
+    }
+
+    // ----------------------------------------------------------------------------
+
+    /*
+      a view without data binds NULL, an empty one the empty text
+    */
+    void binding::text(std::string_view s, lifetime l)
+    {
+      if (!s.data())
+      {
+        sqlite3_bind_null(_q, _i);
+        return;
+      }
+      sqlite3_bind_text(_q, _i, s.data(), (int)s.size(), (l == copied) ? SQLITE_TRANSIENT : SQLITE_STATIC);
+    }
+
+    void binding::text(const char* s, lifetime l)
+    {
+      sqlite3_bind_text(_q, _i, s, -1, (l == copied) ? SQLITE_TRANSIENT : SQLITE_STATIC);
+    }
+
+    void binding::bytes(const blob& b, lifetime l)
+    {
+      sqlite3_bind_blob(_q, _i, b, (int)b.size(), (l == copied) ? SQLITE_TRANSIENT : SQLITE_STATIC);
+    }
+
 
   }
 }
\ No newline at end of file
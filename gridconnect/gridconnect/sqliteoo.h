@@ -26,7 +26,14 @@
 
 */
 
+#pragma once
+
+#include <cassert>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "sqlite3.h"
@@ -36,6 +43,24 @@ namespace satag
   namespace util
   {
     class query;
+    class profiler;
+
+    /*
+      statementprofile is what the profiler collected for one normalized SQL text,
+      times are in nanoseconds, the counters are those of sqlite3_stmt_status()
+    */
+    struct statementprofile
+    {
+      std::string sql;              // normalized, literals replaced by '?'
+      uint64_t calls = 0;
+      uint64_t nanos = 0;
+      uint64_t maxnanos = 0;
+      uint64_t rows = 0;            // result rows delivered by query::run
+      uint64_t fullscansteps = 0;   // SQLITE_STMTSTATUS_FULLSCAN_STEP
+      uint64_t sorts = 0;           // SQLITE_STMTSTATUS_SORT
+      uint64_t autoindex = 0;       // SQLITE_STMTSTATUS_AUTOINDEX
+      uint64_t vmsteps = 0;         // SQLITE_STMTSTATUS_VM_STEP
+    };
 
     /*
       the db class abstracts a database entity
@@ -60,13 +85,31 @@ namespace satag
       bool begin();
       bool commit();
       bool rollback();
+      bool setProfiling(bool enable);
+      bool isProfiling() const { return (mProfiler != nullptr); }
+      void resetProfile();
+      void getProfile(std::function<void(const statementprofile&)> fun) const;
+      std::string profileReport(size_t top = 20) const;
     protected:
       sqlite3* mDB = nullptr;
       bool mOwned = true;
+      std::unique_ptr<profiler> mProfiler;  // set while profiling is enabled
     };
 
     class field;
     class binding;
+    class textview;
+
+    /*
+      lifetime tells a binding whether SQLite may keep pointing to the bound memory
+      (SQLITE_STATIC) or has to copy it (SQLITE_TRANSIENT). Borrowed memory must stay
+      valid and unchanged until the statement ran, i.e. until run() returns.
+    */
+    enum lifetime : int_fast16_t
+    {
+      borrowed = 0,   // SQLITE_STATIC, no copy
+      copied,         // SQLITE_TRANSIENT, SQLite copies before bind returns
+    };
 
     /*
       the query class abstracts a statement/query for a database.
@@ -86,6 +129,15 @@ namespace satag
 
         you might derive from query, using specific member functions instead
         of the generic bind() call.
+
+        const char* and the views of a column point into the current row, they are
+        gone with the next step. textview checks that in debug builds:
+
+        q.run([&](query& row)
+        {
+          textview name = row[1].text();
+          names.emplace_back(name.str());   // fine, this row
+        });
     */
     class query
     {
@@ -98,19 +150,21 @@ namespace satag
       bool isPrepared() const { return (mStatement != nullptr); }
       inline operator sqlite3_stmt*() const { return mStatement; }
       inline operator sqlite3_stmt*() { return mStatement; }
-      bool reset() { return (SQLITE_OK == sqlite3_reset(mStatement)); }
+      bool reset() { ++mRow; return (SQLITE_OK == sqlite3_reset(mStatement)); }
       bool run(std::function<void(query& row)> fun = nullptr);
       field& operator[](int index);
       binding& bind(int index);
       int getError() const { return mLastResult; }
       const char* getErrorMessage() const { return sqlite3_errmsg(*mDB); }
       bool finalize();
+      uint64_t row() const { return mRow; }
     protected:
       db* mDB = nullptr;
       sqlite3_stmt* mStatement = nullptr;
       std::vector<field> mFields;
       std::vector<binding> mBindings;
       int mLastResult = SQLITE_OK;
+      uint64_t mRow = 0;              // counts the steps and resets, the generation of the column pointers
     };
 
     class blob
@@ -121,6 +175,10 @@ namespace satag
         : _ptr(ptr)
         , _size(size)
       {}
+      explicit blob(const std::vector<uint8_t>& v)
+        : _ptr(v.data())
+        , _size(v.size())
+      {}
       operator const void*() const { return _ptr; }
       operator const uint8_t*() const { return (const uint8_t*)_ptr; }
       size_t size() const { return _size; }
@@ -146,12 +204,42 @@ namespace satag
       operator const double() const;
       operator const sqlite3_value*() const;
       int Type() const { return sqlite3_column_type(_q, _i); }
+      bool isNull() const { return Type() == SQLITE_NULL; }
       operator const blob() const;
+      textview text() const;
     protected:
       query& _q;
       size_t _i;
     };
 
+    /*
+      textview is the text of a column with its length, a NULL is told apart from an
+      empty text. It points into the current row of the query and is only valid until
+      the next step, a debug build asserts that the row didn't change when it's read.
+      str() makes the copy which outlives the row.
+    */
+    class textview
+    {
+    public:
+      textview() {}
+      bool isNull() const { return mNull; }
+      std::string_view view() const { check(); return mText; }
+      operator std::string_view() const { return view(); }
+      std::string str() const { check(); return std::string(mText); }
+      void assignTo(std::string& s) const { check(); s.assign(mText.data(), mText.size()); }
+    private:
+      friend class field;
+#ifdef NDEBUG
+      void check() const {}
+#else
+      void check() const { assert(!mQuery || (mQuery->row() == mRow)); }
+      const query* mQuery = nullptr;  // the row the text belongs to
+      uint64_t mRow = 0;
+#endif
+      std::string_view mText;
+      bool mNull = true;
+    };
+
     /*
       the binding object is being used to manage parameter binding. Parameters
       are directly passed to the sqlite3_stmt object.
@@ -170,9 +258,15 @@ namespace satag
 //      void operator=(const time_t i) { sqlite3_bind_int64(_q, _i, (int64_t)i); }
       void operator=(const char* s) { sqlite3_bind_text(_q, _i, s, -1, SQLITE_STATIC); }
       void operator=(const std::string &s) { sqlite3_bind_text(_q, _i, s.c_str(), -1, SQLITE_STATIC); }
+      void operator=(std::string &&s) { text(s, copied); }   // a temporary is gone before run()
+      void operator=(std::string_view s) { text(s, borrowed); }
       void operator=(const sqlite3_value* val) { sqlite3_bind_value(_q, _i, val); }
       void operator=(const field &f) { sqlite3_bind_value(_q, _i, f); }
       void operator=(const blob &b) { sqlite3_bind_blob(_q, _i, b, (int) b.size(), SQLITE_STATIC); }
+      void text(std::string_view s, lifetime l);
+      void text(const char* s, lifetime l);
+      void bytes(const blob& b, lifetime l);
+      void null() { sqlite3_bind_null(_q, _i); }
     protected:
       query& _q;
       size_t _i;
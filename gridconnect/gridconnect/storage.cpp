@@ -34,6 +34,10 @@
 */
 
 #include "storage.h"
+#include "metrics.h"
+
+#include <cstdio>
+#include <algorithm>
 
 namespace satag
 {
@@ -41,6 +45,16 @@ namespace satag
   {
     namespace bx
     {
+      // instrumentation, see metrics.h
+      static metrics::histogram& gLockWait = metrics::registry::instance().getHistogram("store.lockwait");
+      static metrics::histogram& gBatchRows = metrics::registry::instance().getHistogram("store.batchrows");
+      static metrics::histogram& gBatchTime = metrics::registry::instance().getHistogram("store.batch");
+      static metrics::counter& gSamples = metrics::registry::instance().getCounter("store.samples");
+      static metrics::counter& gErrors = metrics::registry::instance().getCounter("store.errors");
+      static metrics::histogram& gJournalApplied = metrics::registry::instance().getHistogram("journal.apply");
+      static metrics::counter& gJournalReplayed = metrics::registry::instance().getCounter("journal.replayed");
+      static metrics::histogram& gCommandLatency = metrics::registry::instance().getHistogram("commands.latency");
+
       static const char* schema =
         // user schema version 1
         "PRAGMA USER_VERSION=1;"
@@ -98,6 +112,177 @@ namespace satag
         "CREATE UNIQUE INDEX `SettingsIndex` ON `Settings` (`device`, `entity`);"
         ;
 
+      static const char* schema2 =
+        // user schema version 2
+        "PRAGMA USER_VERSION=2;"
+        // -------- CollectedData is scanned by time for uploads and merged reads
+        "CREATE INDEX IF NOT EXISTS `CollectedDataTimeIndex` ON `CollectedData` (`sampletime`);"
+        ;
+
+      static const char* schema3 =
+        // user schema version 3
+        "PRAGMA USER_VERSION=3;"
+        // -------- CollectedDataPartitions is the catalogue of the time partitions of CollectedData
+        "CREATE TABLE IF NOT EXISTS CollectedDataPartitions ("
+        "`name`	TEXT NOT NULL PRIMARY KEY,"
+        "`starttime`	INTEGER NOT NULL,"
+        "`endtime`	INTEGER NOT NULL);"
+        ;
+
+      static const char* schema4 =
+        // user schema version 4
+        "PRAGMA USER_VERSION=4;"
+        // -------- ArchiveBlocks keeps uploaded samples as compressed columnar blocks (see archive.h)
+        "CREATE TABLE IF NOT EXISTS ArchiveBlocks ("
+        "`id`	INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+        "`device`	INTEGER NOT NULL,"
+        "`entity`	INTEGER NOT NULL,"
+        "`starttime`	INTEGER NOT NULL,"
+        "`endtime`	INTEGER NOT NULL,"
+        "`samples`	INTEGER NOT NULL,"
+        "`data`	BLOB NOT NULL);"
+        "CREATE INDEX IF NOT EXISTS `ArchiveBlocksIndex` ON `ArchiveBlocks` (`device`, `entity`, `starttime`);"
+        ;
+
+      static const char* schema5 =
+        // user schema version 5
+        "PRAGMA USER_VERSION=5;"
+        // -------- Rollup60/Rollup900 aggregate samples per (device, entity) into 1/15 minute windows
+        "CREATE TABLE IF NOT EXISTS Rollup60 ("
+        "`device`	INTEGER NOT NULL,"
+        "`entity`	INTEGER NOT NULL,"
+        "`starttime`	INTEGER NOT NULL,"
+        "`minvalue`	INTEGER NOT NULL,"
+        "`maxvalue`	INTEGER NOT NULL,"
+        "`sumvalue`	INTEGER NOT NULL,"
+        "`samples`	INTEGER NOT NULL,"
+        "`lastvalue`	INTEGER NOT NULL,"
+        "`lasttime`	INTEGER NOT NULL);"
+        "CREATE UNIQUE INDEX IF NOT EXISTS `Rollup60Index` ON `Rollup60` (`device`, `entity`, `starttime`);"
+        "CREATE TABLE IF NOT EXISTS Rollup900 ("
+        "`device`	INTEGER NOT NULL,"
+        "`entity`	INTEGER NOT NULL,"
+        "`starttime`	INTEGER NOT NULL,"
+        "`minvalue`	INTEGER NOT NULL,"
+        "`maxvalue`	INTEGER NOT NULL,"
+        "`sumvalue`	INTEGER NOT NULL,"
+        "`samples`	INTEGER NOT NULL,"
+        "`lastvalue`	INTEGER NOT NULL,"
+        "`lasttime`	INTEGER NOT NULL);"
+        "CREATE UNIQUE INDEX IF NOT EXISTS `Rollup900Index` ON `Rollup900` (`device`, `entity`, `starttime`);"
+        ;
+
+      static const char* schema6 =
+        // user schema version 6: all times are in microseconds (see convertToMicroseconds)
+        "PRAGMA USER_VERSION=6;"
+        ;
+      static const int kMicrosecondVersion = 6;
+
+      static const char* schema7 =
+        // user schema version 7: the texts of Eventlog and ControlStateOut are interned
+        "PRAGMA USER_VERSION=7;"
+        // -------- Strings holds each text once, the tables refer to it by id
+        "CREATE TABLE IF NOT EXISTS Strings ("
+        "`id`	INTEGER NOT NULL PRIMARY KEY,"
+        "`text`	TEXT NOT NULL UNIQUE);"
+        "INSERT OR IGNORE INTO Strings (text) SELECT source FROM Eventlog WHERE source IS NOT NULL;"
+        "INSERT OR IGNORE INTO Strings (text) SELECT text1 FROM Eventlog WHERE text1 IS NOT NULL;"
+        "INSERT OR IGNORE INTO Strings (text) SELECT text2 FROM Eventlog WHERE text2 IS NOT NULL;"
+        "INSERT OR IGNORE INTO Strings (text) SELECT text1 FROM ControlStateOut WHERE text1 IS NOT NULL;"
+        "INSERT OR IGNORE INTO Strings (text) SELECT text2 FROM ControlStateOut WHERE text2 IS NOT NULL;"
+        // -------- Eventlog is rebuilt with the ids, the row ids stay (the upload checkpoint refers to them)
+        "CREATE TABLE `EventlogInterned` ("
+        "`id`	INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+        "`eventid`	INTEGER NOT NULL,"
+        "`sourceid`	INTEGER NOT NULL,"
+        "`text1id`	INTEGER,"
+        "`text2id`	INTEGER,"
+        "`logtime`	INTEGER,"
+        "`uploaded` INTEGER"
+        " );"
+        "INSERT INTO EventlogInterned (id,eventid,sourceid,text1id,text2id,logtime,uploaded) "
+        "SELECT e.id,e.eventid,"
+        "(SELECT s.id FROM Strings s WHERE s.text=e.source),"
+        "(SELECT s.id FROM Strings s WHERE s.text=e.text1),"
+        "(SELECT s.id FROM Strings s WHERE s.text=e.text2),"
+        "e.logtime,e.uploaded FROM Eventlog e;"
+        "DROP TABLE Eventlog;"
+        "ALTER TABLE EventlogInterned RENAME TO Eventlog;"
+        "CREATE INDEX IF NOT EXISTS `EventlogSourceIndex` ON `Eventlog` (`sourceid`);"
+        // -------- ControlStateOut likewise
+        "CREATE TABLE ControlStateOutInterned ("
+        "`device` INTEGER NOT NULL,"
+        "`entity` INTEGER NOT NULL,"
+        "`text1id` INTEGER,"
+        "`text2id` INTEGER,"
+        "`logtime` INTEGER NOT NULL,"
+        "`uploaded` INTEGER NOT NULL);"
+        "INSERT INTO ControlStateOutInterned (device,entity,text1id,text2id,logtime,uploaded) "
+        "SELECT c.device,c.entity,"
+        "(SELECT s.id FROM Strings s WHERE s.text=c.text1),"
+        "(SELECT s.id FROM Strings s WHERE s.text=c.text2),"
+        "c.logtime,c.uploaded FROM ControlStateOut c;"
+        "DROP TABLE ControlStateOut;"
+        "ALTER TABLE ControlStateOutInterned RENAME TO ControlStateOut;"
+        "CREATE UNIQUE INDEX `ControlStateOutIndex` ON `ControlStateOut` (`device` ,`entity` );"
+        // -------- the views show the texts, for the readers of the old layout
+        "CREATE VIEW IF NOT EXISTS EventlogText AS "
+        "SELECT e.id,e.eventid,s.text AS source,t1.text AS text1,t2.text AS text2,e.logtime,e.uploaded FROM Eventlog e "
+        "LEFT JOIN Strings s ON s.id=e.sourceid LEFT JOIN Strings t1 ON t1.id=e.text1id LEFT JOIN Strings t2 ON t2.id=e.text2id;"
+        "CREATE VIEW IF NOT EXISTS ControlStateOutText AS "
+        "SELECT c.device,c.entity,t1.text AS text1,t2.text AS text2,c.logtime,c.uploaded FROM ControlStateOut c "
+        "LEFT JOIN Strings t1 ON t1.id=c.text1id LEFT JOIN Strings t2 ON t2.id=c.text2id;"
+        ;
+      static const int kInternVersion = 7;
+
+      static const char* schema8 =
+        // user schema version 8
+        "PRAGMA USER_VERSION=8;"
+        // -------- Captures keeps triggered high-frequency windows as compressed columnar batches (see capture.h)
+        "CREATE TABLE IF NOT EXISTS Captures ("
+        "`id`	INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+        "`device`	INTEGER NOT NULL,"
+        "`entity`	INTEGER NOT NULL,"
+        "`triggertime`	INTEGER NOT NULL,"
+        "`starttime`	INTEGER NOT NULL,"
+        "`endtime`	INTEGER NOT NULL,"
+        "`samples`	INTEGER NOT NULL,"
+        "`encoding`	TEXT NOT NULL,"
+        "`data`	BLOB NOT NULL);"
+        "CREATE INDEX IF NOT EXISTS `CapturesIndex` ON `Captures` (`device`, `entity`, `triggertime`);"
+        ;
+
+      static const char* schema9 =
+        // user schema version 9: the sample ids are unique across the partitions (see renumberPartitions)
+        "PRAGMA USER_VERSION=9;"
+        ;
+      static const int kUniqueIdVersion = 9;
+
+      // the interned texts cached per direction, the caches start over when they get larger
+      static const size_t kMaxInterned = 4096;
+
+      // samples per transaction when open() replays the journal
+      static const size_t kReplayBatch = 65536;
+
+      // a partition has the same layout as CollectedData, %s is the partition name
+      static const char* partitionSchema =
+        "CREATE TABLE IF NOT EXISTS `%s` ("
+        "`id`	INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT UNIQUE,"
+        "`device`	INTEGER NOT NULL,"
+        "`entity`	INTEGER NOT NULL,"
+        "`entityvalue`	INTEGER NOT NULL,"
+        "`sampletime`	INTEGER NOT NULL,"
+        "`uploadtime`	INTEGER"
+        ");"
+        "CREATE INDEX IF NOT EXISTS `%s_TimeIndex` ON `%s` (`sampletime`);"
+        "INSERT OR IGNORE INTO CollectedDataPartitions (name,starttime,endtime) "
+        "values ('%s',%lld,%lld);"
+        ;
+
+      // migrations[v] upgrades a database with user_version v to v+1
+      static const char* migrations[] = { schema, schema2, schema3, schema4, schema5, schema6, schema7, schema8, schema9 };
+      static const int kSchemaVersion = sizeof(migrations) / sizeof(migrations[0]);
+
       store::store()
       {
       }
@@ -107,34 +292,49 @@ namespace satag
         close();
       }
 
-      bool store::open(const char* source)
+      bool store::open(const char* source, partitioning mode, journaling journal)
       {
         bool result = false;
         close();
+        mPartitioning = mode;
         mDB.open(source, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX);
         if (mDB.isOpen())
         {
           mDB.execute("PRAGMA synchronous=FULL;");
+          // commands are inserted by other connections, wait for their locks instead of failing
+          sqlite3_busy_timeout(mDB, kBusyTimeout);
           int version = 0;
           if (query(mDB, "pragma user_version;").run([&](query& row)
           {
             version = row[0];
           }))
           {
-            if (version < 1)
-            {
-              bool result = true;
-              result &= createSchema();
-            }
-            else
+            result = true;
+            if (version < kSchemaVersion)
             {
-              result = true;
+              result &= createSchema(version);
             }
           }
           if (result)
           {
             result = createQueries();
           }
+          if (result)
+          {
+            result = loadPartitions();
+          }
+          if (result)
+          {
+            result = reloadSettings();
+          }
+          if (result)
+          {
+            result = loadSampleId();
+          }
+          if (result)
+          {
+            result = replayJournal(source, journal);
+          }
           if (!result)
           {
             close();
@@ -145,8 +345,65 @@ namespace satag
 
       void store::close()
       {
+        if (mJournal.isOpen() && mDB.isOpen())
+        {
+          // what isn't applied now is replayed by the next open()
+          applyJournal();
+        }
+        mJournal.close();
+        mJournalTail.clear();
+        mJournalBatch.clear();
+        if (mDB.isOpen() && mInsertRollup[0].isPrepared())
+        {
+          // write the open rollup windows, they are merged with the windows after a restart
+          metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+          mRollup.closeAll(mClosedWindows);
+          if (mDB.begin())
+          {
+            if (flushRollups())
+            {
+              mDB.commit();
+            }
+            else
+            {
+              mDB.rollback();
+            }
+          }
+        }
+        mClosedWindows.clear();
+        for (int level = 0; level < rollup::kLevels; ++level)
+        {
+          mUpdateRollup[level].finalize();
+          mInsertRollup[level].finalize();
+          mReadRollup[level].finalize();
+        }
         mInsertToLog.finalize();
         mInsertToCurrent.finalize();
+        mGetNetCommand.finalize();
+        mDeleteControlCommand.finalize();
+        mInsertCommand.finalize();
+        mInsertToEventLog.finalize();
+        mInsertToStateLog.finalize();
+        mSaveSetting.finalize();
+        mReadEvents.finalize();
+        mMarkEvents.finalize();
+        mReadSourceEvents.finalize();
+        mFindString.finalize();
+        mInsertString.finalize();
+        mResolveString.finalize();
+        forgetInterned();
+        mReadSamples.finalize();
+        mReadSamplesById.finalize();
+        mInsertArchiveBlock.finalize();
+        mReadArchive.finalize();
+        mInsertCapture.finalize();
+        mReadCaptures.finalize();
+        mInsertToPartition.reset();
+        mPartitions.clear();
+        {
+          std::lock_guard<std::mutex> lock(mSettingsLock);
+          mSettings.reset();
+        }
         mDB.close();
       }
 
@@ -156,197 +413,1858 @@ namespace satag
       */
       bool store::logDSPEvent(int device, int entity, int value)
       {
-        std::lock_guard<std::mutex> lock(mLock);
+        if (mJournal.isOpen())
+        {
+          sample s;
+          s.device = device;
+          s.entity = entity;
+          s.value = value;
+          s.sampletime = now();
+          return journalSamples(&s, 1);
+        }
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
         bool result = true;
 
+        mRollup.begin();
         result = mDB.begin(); // begin transaction
         if (result)
         {
-          mInsertToLog.bind(1) = device;
-          mInsertToLog.bind(2) = entity;
-          mInsertToLog.bind(3) = value;
-          mInsertToLog.bind(4) = now();
-          result &= mInsertToLog.run();
+          int64_t sampletime = now();
+          result &= insertSample(device, entity, value, sampletime);
+          mRollup.closeBefore(sampletime, mClosedWindows);
+          result = result && flushRollups();
         }
         if (result)
         {
-          mInsertToCurrent.bind(1) = device;
-          mInsertToCurrent.bind(2) = entity;
-          mInsertToCurrent.bind(3) = value;
-          mInsertToCurrent.bind(4) = now();
-          result &= mInsertToCurrent.run();
-        }
-        if (!result)
-        {
-          mDB.getErrorMessage();
+          result = mDB.commit();
         }
         if (result)
         {
-          mDB.commit();
+          mRollup.commit();
+          gSamples.add();
         }
         else
         {
-          mDB.rollback();
-          // TODO: log an error about the impossibility to write data
+          rollbackSamples();
         }
         return result;
       }
 
-      bool store::runEvent(std::function<bool(int device, const char*text1, const char*text2)> fun)
+      /*
+        logDSPEvents writes a batch of samples within one transaction, the sampletime
+        of each sample is taken as is. Either all samples are written or none.
+        With journaling the batch is one record of the journal instead.
+      */
+      bool store::logDSPEvents(const std::vector<sample>& samples)
       {
-        bool result = false;
-        mGetNetCommand.run([&](query &row)
+        return logDSPEvents(samples.data(), samples.size());
+      }
+
+      bool store::logDSPEvents(const sample* samples, size_t count)
+      {
+        if (mJournal.isOpen())
         {
-          result = fun(row[1], row[2], row[3]);
-          if (result)
-          {
-            mDeleteControlCommand.bind(1) = row[0];
-            mDeleteControlCommand.run();
-          }
+          return journalSamples(samples, count);
         }
-        );
-        return result;
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        return writeSamples(samples, count, 0);
       }
 
-      bool store::logEvent(int eventid, const char * source, int device, const char * text1, const char * text2, bool success)
+      /*
+        writeSamples is the transaction of logDSPEvents, the caller holds mLock. applied
+        is the journal record the samples end with, 0 if they don't come from the journal.
+      */
+      bool store::writeSamples(const sample* samples, size_t count, int64_t applied)
       {
-        std::lock_guard<std::mutex> lock(mLock);
-        
+        metrics::stopwatch watch(gBatchTime);
         bool result = true;
 
+        gBatchRows.record(count);
+        mRollup.begin();
         result = mDB.begin(); // begin transaction
+        int64_t newest = INT64_MIN;
+        for (const sample* it = samples; result && (it != samples + count); ++it)
+        {
+          result &= insertSample(it->device, it->entity, it->value, it->sampletime);
+          newest = std::max(newest, it->sampletime);
+        }
         if (result)
         {
-          mInsertToEventLog.bind(1) = device;
-          mInsertToEventLog.bind(2) = source;
-          mInsertToEventLog.bind(3) = text1;
-          mInsertToEventLog.bind(4) = text2;
-          mInsertToEventLog.bind(5) = now();
-          result &= mInsertToEventLog.run();
+          // closed windows go into the same transaction as the samples
+          mRollup.closeBefore(newest, mClosedWindows);
+          result = flushRollups();
         }
-        if (!result)
+        setting position;
+        position.entity = kJournalEntity;
+        position.value = applied;
+        if (result && (applied > 0))
+        {
+          // the position in the journal commits with the samples
+          mSaveSetting.bind(1) = position.device;
+          mSaveSetting.bind(2) = position.entity;
+          mSaveSetting.bind(3) = position.value;
+          result = mSaveSetting.run();
+        }
+        if (result)
         {
-          mDB.getErrorMessage();
+          result = mDB.commit();
+        }
+        if (result && (applied > 0))
+        {
+          cacheSettings(&position, 1, nullptr);
         }
         if (result)
         {
-          mDB.commit();
+          mRollup.commit();
+          gSamples.add(count);
         }
         else
         {
-          mDB.rollback();
-          // TODO: log an error about the impossibility to write data
+          rollbackSamples();
         }
- 
         return result;
+      }
 
+      /*
+        journalSamples appends the samples to the journal and keeps them for applyJournal()
+      */
+      bool store::journalSamples(const sample* samples, size_t count)
+      {
+        if (count == 0)
+        {
+          return true;
+        }
+        std::lock_guard<std::mutex> lock(mJournalLock);
+        int64_t seq = 0;
+        if (!mJournal.append(samples, count, seq))
+        {
+          mLastError = "journal: cannot append to " + mJournal.path();
+          gErrors.add();
+          return false;
+        }
+        mJournalTail.insert(mJournalTail.end(), samples, samples + count);
+        mJournalSeq = seq;
+        return true;
       }
 
-      bool store::logState(int device, int entity, const char * text1, const char * text2)
+      /*
+        applyJournal writes the journaled samples to the database in one transaction
+        and empties the journal if nothing was appended meanwhile. The appends go on
+        while it writes, the next call takes what came in. If the transaction fails the
+        samples stay for the next one.
+      */
+      bool store::applyJournal()
       {
-        mInsertToStateLog.bind(1) = device;
-        mInsertToStateLog.bind(2) = entity;
-        mInsertToStateLog.bind(3) = text1;
-        mInsertToStateLog.bind(4) = text2;
-        mInsertToStateLog.bind(5) = now();
-        return mInsertToStateLog.run();
+        std::lock_guard<std::mutex> apply(mApplyLock);
+        int64_t seq;
+        {
+          std::lock_guard<std::mutex> lock(mJournalLock);
+          if (mJournalTail.empty())
+          {
+            return true;
+          }
+          mJournalBatch.clear();
+          mJournalBatch.swap(mJournalTail);
+          seq = mJournalSeq;
+          mJournal.sync();
+        }
+        bool result;
+        {
+          metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+          result = writeSamples(mJournalBatch.data(), mJournalBatch.size(), seq);
+        }
+        std::lock_guard<std::mutex> lock(mJournalLock);
+        if (!result)
+        {
+          mJournalBatch.insert(mJournalBatch.end(), mJournalTail.begin(), mJournalTail.end());
+          mJournalBatch.swap(mJournalTail);
+          return false;
+        }
+        gJournalApplied.record(mJournalBatch.size());
+        if (mJournal.last() == seq)
+        {
+          mJournal.truncate();
+        }
+        return true;
       }
 
-      bool store::setSetting(int device, int entity, int value)
+      size_t store::journalPending() const
       {
-        mSetSetting.bind(1) = device;
-        mSetSetting.bind(2) = entity;
-        mSetSetting.bind(3) = value;
-        return mSetSetting.run();
+        std::lock_guard<std::mutex> lock(mJournalLock);
+        return mJournalTail.size();
       }
 
-      int store::getSetting(int device, int entity)
+      /*
+        "battery.sq3" keeps its journal in "battery.sq3.jnl"
+      */
+      std::string store::journalName(const char* source)
+      {
+        return std::string(source) + ".jnl";
+      }
+
+      /*
+        replayJournal writes the records after the last one applied in transactions of
+        about kReplayBatch samples. Without journaling an existing journal is replayed
+        and removed.
+      */
+      bool store::replayJournal(const char* source, journaling mode)
       {
-        int result = 0;
-        mGetSetting.bind(1) = device;
-        mGetSetting.bind(2) = entity;
-        mGetSetting.run([&](query& row)
+        int64_t applied = 0;
+        loadSetting(0, kJournalEntity, applied);
+        std::string name = journalName(source);
+        if (!mJournal.open(name.c_str(), applied, mode))
         {
-          result = row[0];
-        });
+          if (mode == nojournal)
+          {
+            return true;    // there is none
+          }
+          mLastError = "journal: cannot open " + name;
+          return false;
+        }
+        std::vector<sample> batch;
+        int64_t last = applied;
+        bool result = true;
+        auto write = [&]()
+        {
+          metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+          result = writeSamples(batch.data(), batch.size(), last);
+          gJournalReplayed.add(batch.size());
+          batch.clear();
+          return result;
+        };
+        result = mJournal.replay(applied, [&](int64_t seq, const std::vector<sample>& samples)
+        {
+          batch.insert(batch.end(), samples.begin(), samples.end());
+          last = seq;
+          return (batch.size() < kReplayBatch) || write();
+        }) && result;
+        if (result && !batch.empty())
+        {
+          result = write();
+        }
+        if (result)
+        {
+          result = mJournal.truncate();
+        }
+        if (mode == nojournal)
+        {
+          mJournal.close();
+          if (result)
+          {
+            std::remove(name.c_str());
+          }
+        }
         return result;
       }
 
       /*
-      creates the database schema and sets the pragma user version
+        readSamples reads up to limit rows of CollectedData with from <= sampletime < to,
+        ordered by (sampletime, id), starting after the position of the cursor.
+        The cursor is advanced to the last row read and marked done at the end of the range.
+
+        With partitioning only the partitions overlapping the range are read. Rows which
+        are still in CollectedData itself are treated as older than the first partition.
       */
-      bool store::createSchema()
+      bool store::readSamples(int64_t from, int64_t to, samplecursor& cursor, size_t limit, std::function<void(const sample&)> fun)
       {
-        bool result = false;
-        if (mDB.isOpen())
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        size_t rows = 0;
+        bool result = true;
+        if ((mPartitioning == unpartitioned) || mPartitions.empty())
         {
-          result = mDB.execute(schema);
-          if (!result)
+          result = readTable(mReadSamples, from, to, cursor, limit, rows, fun);
+        }
+        else
+        {
+          int64_t first = mPartitions.begin()->first;
+          if (from < first)
           {
-            // TODO: log this
-            mDB.getErrorMessage();
-            close();
+            result = readTable(mReadSamples, from, std::min(to, first), cursor, limit, rows, fun);
+          }
+          for (auto it = mPartitions.begin(); result && (rows < limit) && (it != mPartitions.end()); ++it)
+          {
+            auto& p = it->second;
+            if ((p.endtime > from) && (p.starttime < to) && (p.endtime > cursor.sampletime))
+            {
+              if (!p.read)
+              {
+                char sql[256];
+                snprintf(sql, sizeof(sql),
+                  "select id,device,entity,entityvalue,sampletime from `%s` "
+                  "where sampletime>=?1 and sampletime<?2 and (sampletime>?3 or (sampletime=?3 and id>?4)) "
+                  "order by sampletime,id limit ?5;", p.name.c_str());
+                p.read = std::make_shared<query>(mDB, sql);
+              }
+              result = p.read->isPrepared() && readTable(*p.read, std::max(from, p.starttime), std::min(to, p.endtime), cursor, limit, rows, fun);
+            }
           }
         }
+        cursor.done = (rows < limit) || !result;
         return result;
       }
 
       /*
-      createQueries prepares the statements to be used with logging activities
+        readSamplesById reads up to limit samples with after < id <= through in the order
+        of their ids, that is in the order they were written. A sample written late with an
+        older sampletime still comes after those written before it.
+
+        The ids are unique across CollectedData and its partitions, each table which may
+        hold such ids is read and the rows are merged.
       */
-      bool store::createQueries()
+      bool store::readSamplesById(int64_t after, int64_t through, size_t limit, std::function<void(const sample&)> fun)
       {
-        bool result = true;
-        result &= mInsertToLog.prepare(mDB,
-          "insert into CollectedData (device,entity,entityvalue,sampletime,uploadtime)"
-          "values (?1,?2,?3,?4,0);"
-          );
-        if (result)
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        std::vector<sample> rows;
+        bool result = readTableById(mReadSamplesById, after, through, limit, rows);
+        for (auto it = mPartitions.begin(); result && (it != mPartitions.end()); ++it)
         {
-          result = mInsertToCurrent.prepare(mDB,
-            "insert or replace into CurrentState (device,entity,entityvalue,sampletime)"
-            "values (?1,?2,?3,?4);"
-            );
+          auto& p = it->second;
+          if (p.maxid > after)
+          {
+            if (!p.readById)
+            {
+              char sql[256];
+              snprintf(sql, sizeof(sql),
+                "select id,device,entity,entityvalue,sampletime from `%s` "
+                "where id>?1 and id<=?2 order by id limit ?3;", p.name.c_str());
+              p.readById = std::make_shared<query>(mDB, sql);
+            }
+            result = p.readById->isPrepared() && readTableById(*p.readById, after, through, limit, rows);
+          }
         }
         if (result)
         {
-          result = mGetNetCommand.prepare(mDB,
-            "select id,device,text1,text2 from ControlCommandsIn order by exectime asc limit 0,1");
+          std::sort(rows.begin(), rows.end(), [](const sample& a, const sample& b)
+          {
+            return a.id < b.id;
+          });
+          if (rows.size() > limit)
+          {
+            rows.resize(limit);
+          }
+          for (auto& sample : rows)
+          {
+            fun(sample);
+          }
         }
+        return result;
+      }
+
+      /*
+        lastSampleId is the id of the last sample written, the samples written later have
+        higher ids
+      */
+      int64_t store::lastSampleId()
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        return mLastSampleId;
+      }
+
+      /*
+        runEvent hands the oldest command to fun and removes it if fun returns true.
+        fun runs without mLock, so it can log to the store; mCommandLock keeps two
+        callers from getting the same command.
+      */
+      bool store::runEvent(std::function<bool(int device, const char*text1, const char*text2)> fun)
+      {
+        std::lock_guard<std::mutex> commandLock(mCommandLock);
+        command c;
+        bool result = nextCommand(c) && (c.id != 0);
         if (result)
         {
-          result = mDeleteControlCommand.prepare(mDB,
-            "delete from ControlCommandsIn where id=?1");
+          gCommandLatency.record((uint64_t)std::max<int64_t>(0, now() - c.exectime));
+          result = fun(c.device, c.t1(), c.t2());
         }
         if (result)
         {
-          result = mInsertToEventLog.prepare(mDB,
-            "insert into Eventlog (eventid,source,text1,text2,logtime,uploaded) values "
-            "(?1,?2,?3,?4,?5,0);");
+          removeCommand(c.id);
         }
-        if (result)
+        return result;
+      }
+
+      /*
+        nextCommand reads the oldest command without removing it, c.id is 0 if the
+        queue is empty. The command is removed with removeCommand once it was executed.
+      */
+      bool store::nextCommand(command & c)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        c = command();
+        return mGetNetCommand.run([&](query &row)
         {
-          result = mInsertToStateLog.prepare(mDB,
-            "insert into ControlStateOut (device,entity,text1,text2,logtime,uploaded) values "
-            "(?1,?2,?3,?4,?5,0);");
+          c.id = row[0];
+          c.device = row[1];
+          const char* t1 = row[2];
+          const char* t2 = row[3];
+          c.null1 = (t1 == nullptr);
+          c.null2 = (t2 == nullptr);
+          c.text1 = c.null1 ? "" : t1;
+          c.text2 = c.null2 ? "" : t2;
+          c.exectime = row[4];
+        });
+      }
+
+      bool store::removeCommand(int64_t id)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        mDeleteControlCommand.bind(1) = id;
+        return mDeleteControlCommand.run();
+      }
+
+      /*
+        addCommands queues the commands in one transaction, like the server side would.
+        An exectime of 0 is the time of the insert.
+      */
+      bool store::addCommands(const std::vector<command>& commands)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        int64_t t = now();
+        bool result = mDB.begin();
+        for (auto it = commands.begin(); result && (it != commands.end()); ++it)
+        {
+          mInsertCommand.bind(1) = it->device;
+          mInsertCommand.bind(2) = it->t1();
+          mInsertCommand.bind(3) = it->t2();
+          mInsertCommand.bind(4) = (it->exectime != 0) ? it->exectime : t;
+          result = mInsertCommand.run();
         }
         if (result)
         {
-          result = mSetSetting.prepare(mDB,
-            "update Settings set entityvalue=?3 where device=?1 and entity=?2;");
+          result = mDB.commit();
         }
-        if (result)
+        if (!result)
         {
-          result = mGetSetting.prepare(mDB,
-            "select entityvalue from Settings where device=?1 and entity=?2 limit 0,1;");
+          noteError();
+          mDB.rollback();
         }
         return result;
       }
-      time_t store::now() const
+
+      bool store::logEvent(int eventid, const char * source, int device, const char * text1, const char * text2, bool success)
       {
-        auto now = chrono::system_clock::now();
-        time_t n = chrono::system_clock::to_time_t(now);
-        return n;
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        
+        bool result = true;
+
+        result = mDB.begin(); // begin transaction
+        if (result)
+        {
+          // a new text goes to Strings in the same transaction
+          mInsertToEventLog.bind(1) = eventid;
+          result = bindInterned(mInsertToEventLog, 2, source ? source : "")
+            && bindInterned(mInsertToEventLog, 3, text1)
+            && bindInterned(mInsertToEventLog, 4, text2);
+          mInsertToEventLog.bind(5) = now();
+          result = result && mInsertToEventLog.run();
+        }
+        if (result)
+        {
+          result = mDB.commit();
+        }
+        if (!result)
+        {
+          noteError();
+          mDB.rollback();
+          forgetInterned();   // the ids of this transaction are gone
+        }
+ 
+        return result;
+
+      }
+
+      bool store::logState(int device, int entity, const char * text1, const char * text2)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        mInsertToStateLog.bind(1) = device;
+        mInsertToStateLog.bind(2) = entity;
+        mInsertToStateLog.bind(5) = now();
+        return bindInterned(mInsertToStateLog, 3, text1) && bindInterned(mInsertToStateLog, 4, text2)
+          && mInsertToStateLog.run();
+      }
+
+      /*
+        setSetting inserts the setting or changes its value
+      */
+      bool store::setSetting(int device, int entity, int value)
+      {
+        std::vector<setting> settings(1);
+        settings[0].device = device;
+        settings[0].entity = entity;
+        settings[0].value = value;
+        return saveSettings(settings);
+      }
+
+      /*
+        getSetting reads the cache, 0 if there is no such setting
+      */
+      int store::getSetting(int device, int entity)
+      {
+        auto snapshot = settings();
+        return snapshot ? (int)snapshot->get(device, entity) : 0;
+      }
+
+      /*
+        saveSettings inserts or replaces the settings in one transaction, the values are
+        64 bit, e.g. the checkpoint of the uploads. Once committed the cache is replaced
+        and the listeners get the settings whose value changed.
+      */
+      bool store::saveSettings(const std::vector<setting>& settings)
+      {
+        std::vector<setting> changed;
+        {
+          metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+          bool result = mDB.begin();
+          for (auto it = settings.begin(); result && (it != settings.end()); ++it)
+          {
+            mSaveSetting.bind(1) = it->device;
+            mSaveSetting.bind(2) = it->entity;
+            mSaveSetting.bind(3) = it->value;
+            result = mSaveSetting.run();
+          }
+          if (result)
+          {
+            result = mDB.commit();
+          }
+          if (!result)
+          {
+            noteError();
+            mDB.rollback();
+            return false;
+          }
+          // still under mLock, so the caches are replaced in the order of the commits
+          cacheSettings(settings.data(), settings.size(), &changed);
+        }
+        if (!changed.empty())
+        {
+          notifySettings(changed);
+        }
+        return true;
+      }
+
+      /*
+        loadSetting is false if the setting doesn't exist, value is left alone then
+      */
+      bool store::loadSetting(int device, int entity, int64_t& value)
+      {
+        auto snapshot = settings();
+        return snapshot && snapshot->find(device, entity, value);
+      }
+
+      /*
+        settings returns the current snapshot, it stays valid and unchanged for as
+        long as it is held. nullptr if the store isn't open.
+      */
+      std::shared_ptr<const settingsmap> store::settings() const
+      {
+        std::lock_guard<std::mutex> lock(mSettingsLock);
+        return mSettings;
+      }
+
+      /*
+        reloadSettings reads Settings into a new cache, e.g. after another connection
+        wrote to it. The listeners aren't told.
+      */
+      bool store::reloadSettings()
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        auto loaded = std::make_shared<settingsmap>();
+        bool result = query(mDB, "select device,entity,entityvalue from Settings;").run([&](query& row)
+        {
+          int device = row[0];
+          int entity = row[1];
+          int64_t value = row[2];
+          loaded->mValues[settingsmap::key(device, entity)] = value;
+        });
+        if (result)
+        {
+          std::lock_guard<std::mutex> guard(mSettingsLock);
+          mSettings = loaded;
+        }
+        return result;
+      }
+
+      /*
+        fun runs on the thread which saved the settings, after the commit, the cache
+        has the new values by then
+      */
+      void store::onSettingsChanged(std::function<void(const std::vector<setting>& changed)> fun)
+      {
+        std::lock_guard<std::mutex> lock(mSettingsLock);
+        mSettingsListeners.push_back(fun);
+      }
+
+      /*
+        cacheSettings replaces the cache by a copy with the settings written, changed
+        gets the ones which are new or have another value. The caller holds mLock.
+      */
+      void store::cacheSettings(const setting* settings, size_t count, std::vector<setting>* changed)
+      {
+        auto current = this->settings();
+        auto next = current ? std::make_shared<settingsmap>(*current) : std::make_shared<settingsmap>();
+        for (const setting* it = settings; it != settings + count; ++it)
+        {
+          auto inserted = next->mValues.insert(std::make_pair(settingsmap::key(it->device, it->entity), it->value));
+          if (inserted.second || (inserted.first->second != it->value))
+          {
+            inserted.first->second = it->value;
+            if (changed)
+            {
+              changed->push_back(*it);
+            }
+          }
+        }
+        std::lock_guard<std::mutex> lock(mSettingsLock);
+        mSettings = next;
+      }
+
+      void store::notifySettings(const std::vector<setting>& changed)
+      {
+        std::vector<std::function<void(const std::vector<setting>&)>> listeners;
+        {
+          std::lock_guard<std::mutex> lock(mSettingsLock);
+          listeners = mSettingsListeners;
+        }
+        for (auto& fun : listeners)
+        {
+          fun(changed);
+        }
+      }
+
+      bool settingsmap::find(int device, int entity, int64_t& value) const
+      {
+        auto it = mValues.find(key(device, entity));
+        if (it == mValues.end())
+        {
+          return false;
+        }
+        value = it->second;
+        return true;
+      }
+
+      int64_t settingsmap::get(int device, int entity, int64_t fallback) const
+      {
+        find(device, entity, fallback);
+        return fallback;
+      }
+
+      void settingsmap::forEach(std::function<void(const setting&)> fun) const
+      {
+        setting s;
+        for (auto& v : mValues)
+        {
+          s.device = (int)(uint32_t)(v.first >> 32);
+          s.entity = (int)(uint32_t)v.first;
+          s.value = v.second;
+          fun(s);
+        }
+      }
+
+      /*
+        readEvents reads up to limit rows of Eventlog with an id after the given one,
+        ordered by id. fun gets the same event for every row, its strings keep their
+        capacity, so a scan allocates only when a text is longer than the ones before.
+      */
+      bool store::readEvents(int64_t after, size_t limit, std::function<void(const event&)> fun)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        mReadEvents.bind(1) = after;
+        mReadEvents.bind(2) = (int64_t)limit;
+        return readEvents(mReadEvents, fun);
+      }
+
+      /*
+        the same for the events of one source, which are found by the id of its text
+      */
+      bool store::readEvents(const char* source, int64_t after, size_t limit, std::function<void(const event&)> fun)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        int64_t id = 0;
+        bool found = false;
+        auto cached = mStringIds.find(source ? source : "");
+        if (cached != mStringIds.end())
+        {
+          id = cached->second;
+          found = true;
+        }
+        else
+        {
+          mFindString.bind(1) = source ? source : "";
+          mFindString.run([&](query& row)
+          {
+            id = row[0];
+            found = true;
+          });
+        }
+        if (!found)
+        {
+          return true;    // never logged
+        }
+        mReadSourceEvents.bind(1) = id;
+        mReadSourceEvents.bind(2) = after;
+        mReadSourceEvents.bind(3) = (int64_t)limit;
+        return readEvents(mReadSourceEvents, fun);
+      }
+
+      // the rows are (id, eventid, sourceid, text1id, text2id, logtime), mLock is held
+      bool store::readEvents(query& q, std::function<void(const event&)>& fun)
+      {
+        event e;
+        return q.run([&](query& row)
+        {
+          e.id = row[0];
+          e.eventid = row[1];
+          // each text is taken before the next resolve, which may empty the cache
+          const std::string* text = resolve(row[2]);
+          e.source.assign(text ? *text : std::string());
+          text = row[3].isNull() ? nullptr : resolve(row[3]);
+          e.null1 = (text == nullptr);
+          e.text1.assign(text ? *text : std::string());
+          text = row[4].isNull() ? nullptr : resolve(row[4]);
+          e.null2 = (text == nullptr);
+          e.text2.assign(text ? *text : std::string());
+          e.logtime = row[5];
+          fun(e);
+        });
+      }
+
+      /*
+        intern gives the id of text in Strings, which is added if it's new. Most texts
+        repeat ("NetIn", the command names), they are found in the cache. mLock is held.
+      */
+      bool store::intern(const char* text, int64_t& id)
+      {
+        auto cached = mStringIds.find(text);
+        if (cached != mStringIds.end())
+        {
+          id = cached->second;
+          return true;
+        }
+        bool found = false;
+        mFindString.bind(1) = text;
+        bool result = mFindString.run([&](query& row)
+        {
+          id = row[0];
+          found = true;
+        });
+        if (result && !found)
+        {
+          mInsertString.bind(1) = text;
+          result = mInsertString.run();
+          id = sqlite3_last_insert_rowid(mDB);
+        }
+        if (result)
+        {
+          if (mStringIds.size() >= kMaxInterned)
+          {
+            mStringIds.clear();
+          }
+          mStringIds.emplace(text, id);
+        }
+        return result;
+      }
+
+      // binds the id of text, or NULL without a text
+      bool store::bindInterned(query& q, int index, const char* text)
+      {
+        if (!text)
+        {
+          q.bind(index).null();
+          return true;
+        }
+        int64_t id = 0;
+        if (!intern(text, id))
+        {
+          return false;
+        }
+        q.bind(index) = id;
+        return true;
+      }
+
+      /*
+        resolve looks up the text of an id, through the cache. The pointer is valid
+        until the next call, nullptr if there is no such id. mLock is held.
+      */
+      const std::string* store::resolve(int64_t id)
+      {
+        auto cached = mStringTexts.find(id);
+        if (cached != mStringTexts.end())
+        {
+          return &cached->second;
+        }
+        std::string text;
+        bool found = false;
+        mResolveString.bind(1) = id;
+        mResolveString.run([&](query& row)
+        {
+          row[0].text().assignTo(text);
+          found = true;
+        });
+        if (!found)
+        {
+          return nullptr;
+        }
+        if (mStringTexts.size() >= kMaxInterned)
+        {
+          mStringTexts.clear();
+        }
+        return &mStringTexts.emplace(id, std::move(text)).first->second;
+      }
+
+      void store::forgetInterned()
+      {
+        mStringIds.clear();
+        mStringTexts.clear();
+      }
+
+      /*
+        markEventsUploaded flags the events up to and including last as uploaded
+      */
+      bool store::markEventsUploaded(int64_t last)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        mMarkEvents.bind(1) = last;
+        return mMarkEvents.run();
+      }
+
+      /*
+      creates the database schema or upgrades it from version to the current user version
+      */
+      bool store::createSchema(int version)
+      {
+        bool result = false;
+        if (mDB.isOpen())
+        {
+          result = true;
+          for (int v = version; result && (v < kSchemaVersion); ++v)
+          {
+            // existing data has second timestamps
+            bool convert = (v + 1 == kMicrosecondVersion) && (version > 0);
+            // existing partitions count their ids each on its own
+            bool renumber = (v + 1 == kUniqueIdVersion) && (version > 0);
+            if (convert || renumber || (v + 1 == kInternVersion))
+            {
+              // the tables are rewritten, all or nothing
+              result = mDB.begin();
+              if (result)
+              {
+                result = (!convert || convertToMicroseconds()) && (!renumber || renumberPartitions()) && mDB.execute(migrations[v]);
+                if (result)
+                {
+                  result = mDB.commit();
+                }
+                else
+                {
+                  mDB.rollback();
+                }
+              }
+            }
+            else
+            {
+              result = mDB.execute(migrations[v]);
+            }
+          }
+          if (!result)
+          {
+            noteError();
+            close();
+          }
+        }
+        return result;
+      }
+
+      /*
+      createQueries prepares the statements to be used with logging activities
+      */
+      bool store::createQueries()
+      {
+        bool result = true;
+        result &= mInsertToLog.prepare(mDB,
+          "insert into CollectedData (id,device,entity,entityvalue,sampletime,uploadtime)"
+          "values (?5,?1,?2,?3,?4,0);"
+          );
+        if (result)
+        {
+          result = mInsertToCurrent.prepare(mDB,
+            "insert or replace into CurrentState (device,entity,entityvalue,sampletime)"
+            "values (?1,?2,?3,?4);"
+            );
+        }
+        if (result)
+        {
+          result = mGetNetCommand.prepare(mDB,
+            "select id,device,text1,text2,exectime from ControlCommandsIn order by exectime asc limit 0,1");
+        }
+        if (result)
+        {
+          result = mDeleteControlCommand.prepare(mDB,
+            "delete from ControlCommandsIn where id=?1");
+        }
+        if (result)
+        {
+          result = mInsertCommand.prepare(mDB,
+            "insert into ControlCommandsIn (device,text1,text2,exectime) values (?1,?2,?3,?4);");
+        }
+        if (result)
+        {
+          result = mInsertToEventLog.prepare(mDB,
+            "insert into Eventlog (eventid,sourceid,text1id,text2id,logtime,uploaded) values "
+            "(?1,?2,?3,?4,?5,0);");
+        }
+        if (result)
+        {
+          result = mInsertToStateLog.prepare(mDB,
+            "insert into ControlStateOut (device,entity,text1id,text2id,logtime,uploaded) values "
+            "(?1,?2,?3,?4,?5,0);");
+        }
+        if (result)
+        {
+          result = mSaveSetting.prepare(mDB,
+            "insert or replace into Settings (device,entity,entityvalue) values (?1,?2,?3);");
+        }
+        if (result)
+        {
+          result = mReadEvents.prepare(mDB,
+            "select id,eventid,sourceid,text1id,text2id,logtime from Eventlog where id>?1 order by id limit ?2;");
+        }
+        if (result)
+        {
+          result = mReadSourceEvents.prepare(mDB,
+            "select id,eventid,sourceid,text1id,text2id,logtime from Eventlog where sourceid=?1 and id>?2 order by id limit ?3;");
+        }
+        if (result)
+        {
+          result = mFindString.prepare(mDB,
+            "select id from Strings where text=?1;");
+        }
+        if (result)
+        {
+          result = mInsertString.prepare(mDB,
+            "insert into Strings (text) values (?1);");
+        }
+        if (result)
+        {
+          result = mResolveString.prepare(mDB,
+            "select text from Strings where id=?1;");
+        }
+        if (result)
+        {
+          result = mMarkEvents.prepare(mDB,
+            "update Eventlog set uploaded=1 where id<=?1 and uploaded=0;");
+        }
+        if (result)
+        {
+          result = mReadSamples.prepare(mDB,
+            "select id,device,entity,entityvalue,sampletime from CollectedData "
+            "where sampletime>=?1 and sampletime<?2 and (sampletime>?3 or (sampletime=?3 and id>?4)) "
+            "order by sampletime,id limit ?5;");
+        }
+        if (result)
+        {
+          result = mReadSamplesById.prepare(mDB,
+            "select id,device,entity,entityvalue,sampletime from CollectedData "
+            "where id>?1 and id<=?2 order by id limit ?3;");
+        }
+        for (int level = 0; result && (level < rollup::kLevels); ++level)
+        {
+          char sql[512];
+          int resolution = (int)(rollup::kResolutions[level] / kTicksPerSecond);
+          snprintf(sql, sizeof(sql),
+            "update `Rollup%d` set minvalue=min(minvalue,?4),maxvalue=max(maxvalue,?5),"
+            "sumvalue=sumvalue+?6,samples=samples+?7,"
+            "lastvalue=case when ?9>=lasttime then ?8 else lastvalue end,lasttime=max(lasttime,?9) "
+            "where device=?1 and entity=?2 and starttime=?3;", resolution);
+          result = mUpdateRollup[level].prepare(mDB, sql);
+          if (result)
+          {
+            snprintf(sql, sizeof(sql),
+              "insert into `Rollup%d` (device,entity,starttime,minvalue,maxvalue,sumvalue,samples,lastvalue,lasttime) "
+              "values (?1,?2,?3,?4,?5,?6,?7,?8,?9);", resolution);
+            result = mInsertRollup[level].prepare(mDB, sql);
+          }
+          if (result)
+          {
+            snprintf(sql, sizeof(sql),
+              "select starttime,minvalue,maxvalue,sumvalue,samples,lastvalue,lasttime from `Rollup%d` "
+              "where device=?1 and entity=?2 and starttime>=?3 and starttime<?4 order by starttime;", resolution);
+            result = mReadRollup[level].prepare(mDB, sql);
+          }
+        }
+        if (result)
+        {
+          result = mInsertArchiveBlock.prepare(mDB,
+            "insert into ArchiveBlocks (device,entity,starttime,endtime,samples,data) "
+            "values (?1,?2,?3,?4,?5,?6);");
+        }
+        if (result)
+        {
+          result = mReadArchive.prepare(mDB,
+            "select data from ArchiveBlocks "
+            "where device=?1 and entity=?2 and endtime>=?3 and starttime<?4 order by starttime,endtime;");
+        }
+        if (result)
+        {
+          result = mInsertCapture.prepare(mDB,
+            "insert into Captures (device,entity,triggertime,starttime,endtime,samples,encoding,data) "
+            "values (?1,?2,?3,?4,?5,?6,?7,?8);");
+        }
+        if (result)
+        {
+          result = mReadCaptures.prepare(mDB,
+            "select id,triggertime,starttime,endtime,samples,encoding,data from Captures "
+            "where device=?1 and entity=?2 and triggertime>=?3 and triggertime<?4 order by triggertime;");
+        }
+        return result;
+      }
+
+      /*
+        insertSample writes one sample to CollectedData and CurrentState, the caller
+        holds mLock and owns the transaction
+      */
+      bool store::insertSample(int device, int entity, int value, int64_t sampletime)
+      {
+        bool result = true;
+        query* insert = &mInsertToLog;
+        if (mPartitioning != unpartitioned)
+        {
+          insert = partitionInsert(sampletime);
+          result = (insert != nullptr);
+        }
+        if (result)
+        {
+          // the id is handed out here so it's unique across the partitions, an id lost
+          // with a rollback leaves a gap which doesn't matter
+          int64_t id = mLastSampleId + 1;
+          insert->bind(1) = device;
+          insert->bind(2) = entity;
+          insert->bind(3) = value;
+          insert->bind(4) = sampletime;
+          insert->bind(5) = id;
+          result &= insert->run();
+          if (result)
+          {
+            mLastSampleId = id;
+            if (insert == mInsertToPartition.get())
+            {
+              auto& p = mPartitions[mInsertPartitionStart];
+              p.maxid = std::max(p.maxid, id);
+            }
+          }
+        }
+        if (result)
+        {
+          mInsertToCurrent.bind(1) = device;
+          mInsertToCurrent.bind(2) = entity;
+          mInsertToCurrent.bind(3) = value;
+          mInsertToCurrent.bind(4) = sampletime;
+          result &= mInsertToCurrent.run();
+        }
+        if (result)
+        {
+          mRollup.add(device, entity, value, sampletime, mClosedWindows);
+        }
+        return result;
+      }
+      /*
+        dropPartitionsBefore removes all partitions which end at or before time. Dropping a
+        table only moves its pages to the freelist, so there is no large DELETE and the
+        file doesn't grow as the freed pages are reused by newer partitions.
+      */
+      bool store::dropPartitionsBefore(int64_t time)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        bool result = mDB.begin();
+        auto it = mPartitions.begin();
+        while (result && (it != mPartitions.end()) && (it->second.endtime <= time))
+        {
+          auto& p = it->second;
+          if (mInsertToPartition && (mInsertPartitionStart == p.starttime))
+          {
+            // a table can't be dropped while a statement on it is alive
+            mInsertToPartition.reset();
+          }
+          p.read.reset();
+          p.readById.reset();
+          char sql[256];
+          snprintf(sql, sizeof(sql),
+            "DROP TABLE IF EXISTS `%s`;"
+            "DELETE FROM CollectedDataPartitions WHERE name='%s';",
+            p.name.c_str(), p.name.c_str());
+          result = mDB.execute(sql);
+          ++it;
+        }
+        if (result)
+        {
+          // archived samples follow the same retention
+          query drop(mDB, "delete from ArchiveBlocks where endtime<?1;");
+          drop.bind(1) = time;
+          result = drop.run();
+        }
+        setting last;
+        last.entity = kSampleIdEntity;
+        last.value = mLastSampleId;
+        if (result)
+        {
+          // the ids of the dropped tables must not come again (see loadSampleId)
+          mSaveSetting.bind(1) = last.device;
+          mSaveSetting.bind(2) = last.entity;
+          mSaveSetting.bind(3) = last.value;
+          result = mSaveSetting.run();
+        }
+        if (result)
+        {
+          result = mDB.commit();
+        }
+        else
+        {
+          noteError();
+          mDB.rollback();
+        }
+        if (result)
+        {
+          cacheSettings(&last, 1, nullptr);
+          mPartitions.erase(mPartitions.begin(), it);
+        }
+        else
+        {
+          // the catalogue is the truth, reread it
+          loadPartitions();
+        }
+        return result;
+      }
+
+      bool store::listPartitions(std::function<void(const char* name, int64_t starttime, int64_t endtime)> fun)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        for (auto& p : mPartitions)
+        {
+          fun(p.second.name.c_str(), p.second.starttime, p.second.endtime);
+        }
+        return true;
+      }
+
+      /*
+        archiveUploaded moves the uploaded samples of CollectedData and its partitions
+        into ArchiveBlocks, with up to blocksize samples per block. The uploads are
+        checkpointed as sample ids and not marked in the rows, through is the id up to
+        which the server has all samples (uploadscheduler::uploadedThrough). A sample
+        which came in late stays a row until the server has it, whatever its sampletime,
+        and then goes into the blocks of its time range. Every table is archived in its
+        own transaction.
+      */
+      bool store::archiveUploaded(int64_t through, size_t blocksize, archivestats& stats)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        bool result = archiveTable("CollectedData", through, blocksize, stats);
+        for (auto it = mPartitions.begin(); result && (it != mPartitions.end()); ++it)
+        {
+          result = archiveTable(it->second.name, through, blocksize, stats);
+        }
+        return result;
+      }
+
+      /*
+        readArchive streams the archived samples of one (device, entity) pair with
+        from <= sampletime < to in sampletime order. The iteration stops if fun returns false.
+      */
+      bool store::readArchive(int device, int entity, int64_t from, int64_t to, std::function<bool(const sample&)> fun)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        bool more = true;
+        bool decoded = true;
+        mReadArchive.bind(1) = device;
+        mReadArchive.bind(2) = entity;
+        mReadArchive.bind(3) = from;
+        mReadArchive.bind(4) = to;
+        bool result = mReadArchive.run([&](query& row)
+        {
+          blob data = row[0];
+          blockdecoder d(data, data.size());
+          sample s;
+          s.device = device;
+          s.entity = entity;
+          while (more && d.next(s.sampletime, s.value))
+          {
+            if ((s.sampletime >= from) && (s.sampletime < to))
+            {
+              more = fun(s);
+            }
+          }
+          decoded &= d.ok();
+        });
+        return result && decoded;
+      }
+
+      /*
+        saveCapture stores a capture window as one row, c.id is set to its rowid
+      */
+      bool store::saveCapture(capturerecord& c)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        mInsertCapture.bind(1) = c.device;
+        mInsertCapture.bind(2) = c.entity;
+        mInsertCapture.bind(3) = c.triggertime;
+        mInsertCapture.bind(4) = c.starttime;
+        mInsertCapture.bind(5) = c.endtime;
+        mInsertCapture.bind(6) = c.samples;
+        mInsertCapture.bind(7) = c.encoding;
+        mInsertCapture.bind(8) = blob(c.data);
+        bool result = mInsertCapture.run();
+        if (result)
+        {
+          c.id = sqlite3_last_insert_rowid(mDB);
+        }
+        else
+        {
+          noteError();
+        }
+        return result;
+      }
+
+      /*
+        readCaptures reads the captures of one (device, entity) channel triggered in
+        from..to, in trigger order. The iteration stops if fun returns false.
+      */
+      bool store::readCaptures(int device, int entity, int64_t from, int64_t to, std::function<bool(const capturerecord&)> fun)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        bool more = true;
+        capturerecord c;
+        c.device = device;
+        c.entity = entity;
+        mReadCaptures.bind(1) = device;
+        mReadCaptures.bind(2) = entity;
+        mReadCaptures.bind(3) = from;
+        mReadCaptures.bind(4) = to;
+        return mReadCaptures.run([&](query& row)
+        {
+          if (!more)
+          {
+            return;
+          }
+          c.id = row[0];
+          c.triggertime = row[1];
+          c.starttime = row[2];
+          c.endtime = row[3];
+          c.samples = row[4];
+          row[5].text().assignTo(c.encoding);
+          blob data = row[6];
+          c.data.assign((const uint8_t*)data, (const uint8_t*)data + data.size());
+          more = fun(c);
+        });
+      }
+
+      /*
+        readRollup reads the windows of one (device, entity) pair overlapping from..to.
+        It takes the finest resolution with at most maxpoints windows in the range, or the
+        coarsest one if none fits. The open window is included, so the latest data shows up
+        before its window is closed. The iteration stops if fun returns false.
+      */
+      bool store::readRollup(int device, int entity, int64_t from, int64_t to, size_t maxpoints, std::function<bool(const rollupwindow&)> fun)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        int level = 0;
+        while ((level < rollup::kLevels - 1) && ((uint64_t)((to - from) / rollup::kResolutions[level]) > maxpoints))
+        {
+          ++level;
+        }
+        rollupwindow open;
+        bool hasOpen = mRollup.openWindow(device, entity, level, open)
+          && (open.starttime + rollup::kResolutions[level] > from) && (open.starttime < to);
+        bool more = true;
+        auto& q = mReadRollup[level];
+        q.bind(1) = device;
+        q.bind(2) = entity;
+        q.bind(3) = rollup::windowStart(from, level);
+        q.bind(4) = to;
+        bool result = q.run([&](query& row)
+        {
+          if (more)
+          {
+            rollupwindow w;
+            w.device = device;
+            w.entity = entity;
+            w.level = level;
+            w.starttime = row[0];
+            w.minvalue = row[1];
+            w.maxvalue = row[2];
+            w.sumvalue = row[3];
+            w.samples = row[4];
+            w.lastvalue = row[5];
+            w.lasttime = row[6];
+            if (hasOpen && (open.starttime == w.starttime))
+            {
+              // written at close and continued after the restart
+              w.merge(open);
+              hasOpen = false;
+            }
+            more = fun(w);
+          }
+        });
+        if (result && more && hasOpen)
+        {
+          fun(open);
+        }
+        return result;
+      }
+
+      /*
+        flushRollups merges the closed windows into the rollup tables. The caller holds
+        mLock and owns the transaction.
+      */
+      bool store::flushRollups()
+      {
+        bool result = true;
+        for (auto it = mClosedWindows.begin(); result && (it != mClosedWindows.end()); ++it)
+        {
+          auto& w = *it;
+          for (int step = 0; step < 2; ++step)
+          {
+            // first try to merge into an existing row, insert if there is none
+            auto& q = (step == 0) ? mUpdateRollup[w.level] : mInsertRollup[w.level];
+            q.bind(1) = w.device;
+            q.bind(2) = w.entity;
+            q.bind(3) = w.starttime;
+            q.bind(4) = w.minvalue;
+            q.bind(5) = w.maxvalue;
+            q.bind(6) = w.sumvalue;
+            q.bind(7) = w.samples;
+            q.bind(8) = w.lastvalue;
+            q.bind(9) = w.lasttime;
+            result = q.run();
+            if (!result || (sqlite3_changes(mDB) > 0))
+            {
+              break;
+            }
+          }
+        }
+        mClosedWindows.clear();
+        return result;
+      }
+
+      // number of bytes sqlite uses to store an integer in a record
+      static size_t recordIntSize(int64_t v)
+      {
+        if ((v == 0) || (v == 1)) return 0;
+        if ((v >= -128) && (v <= 127)) return 1;
+        if ((v >= -32768) && (v <= 32767)) return 2;
+        if ((v >= -8388608) && (v <= 8388607)) return 3;
+        if ((v >= INT32_MIN) && (v <= INT32_MAX)) return 4;
+        if ((v >= -140737488355328LL) && (v <= 140737488355327LL)) return 6;
+        return 8;
+      }
+
+      static size_t varintSize(uint64_t v)
+      {
+        size_t n = 1;
+        while (v >= 0x80)
+        {
+          v >>= 7;
+          ++n;
+        }
+        return n;
+      }
+
+      /*
+        estimated size of a CollectedData row: table cell (pointer, length, rowid, record
+        with a header of 7 bytes) plus the cell of the sampletime index
+      */
+      static size_t rowSize(int64_t id, int device, int entity, int value, int64_t sampletime, int64_t uploadtime)
+      {
+        size_t record = 7 + recordIntSize(device) + recordIntSize(entity) + recordIntSize(value)
+          + recordIntSize(sampletime) + recordIntSize(uploadtime);
+        size_t index = 3 + recordIntSize(sampletime) + recordIntSize(id);
+        return 2 + 1 + varintSize(id) + record + 2 + 1 + index;
+      }
+
+      /*
+        archiveTable encodes the rows of one table with id <= through, grouped by
+        (device, entity), and deletes them within the same transaction. A block which
+        overlaps older blocks of its pair is merged with them.
+      */
+      bool store::archiveTable(const std::string& table, int64_t through, size_t blocksize, archivestats& stats)
+      {
+        char sql[256];
+        snprintf(sql, sizeof(sql),
+          "select id,device,entity,entityvalue,sampletime,uploadtime from `%s` "
+          "where id<=?1 order by device,entity,sampletime,id;", table.c_str());
+        query select(mDB, sql);
+        query overlapping(mDB,
+          "select id,data from ArchiveBlocks "
+          "where device=?1 and entity=?2 and starttime<?4 and endtime>?3 order by starttime,endtime;");
+        query unlink(mDB, "delete from ArchiveBlocks where id=?1;");
+        if (!select.isPrepared() || !overlapping.isPrepared() || !unlink.isPrepared())
+        {
+          return false;
+        }
+        select.bind(1) = through;
+        bool result = mDB.begin();
+        if (result)
+        {
+          blockencoder encoder;
+          int device = 0;
+          int entity = 0;
+          size_t rows = 0;
+          std::vector<std::pair<int64_t, int>> block;   // (sampletime, value) of the next block
+          auto writeBlock = [&](const std::pair<int64_t, int>* first, size_t count) -> bool
+          {
+            encoder.reset();
+            for (const auto* it = first; it != first + count; ++it)
+            {
+              encoder.add(it->first, it->second);
+            }
+            auto& data = encoder.finish();
+            mInsertArchiveBlock.bind(1) = device;
+            mInsertArchiveBlock.bind(2) = entity;
+            mInsertArchiveBlock.bind(3) = encoder.firstTime();
+            mInsertArchiveBlock.bind(4) = encoder.lastTime();
+            mInsertArchiveBlock.bind(5) = (int64_t)encoder.count();
+            mInsertArchiveBlock.bind(6) = blob(data.data(), data.size());
+            stats.blocks++;
+            stats.blockbytes += data.size();
+            return mInsertArchiveBlock.run();
+          };
+          auto flushBlock = [&]() -> bool
+          {
+            bool ok = true;
+            if (!block.empty())
+            {
+              // samples uploaded late may fall into blocks archived before, those are merged
+              // in so the blocks of a pair don't overlap and readArchive stays in order
+              std::vector<std::pair<int64_t, int>> merged;
+              std::vector<int64_t> merges;
+              overlapping.bind(1) = device;
+              overlapping.bind(2) = entity;
+              overlapping.bind(3) = block.front().first;
+              overlapping.bind(4) = block.back().first;
+              ok = overlapping.run([&](query& row)
+              {
+                merges.push_back(row[0]);
+                blob data = row[1];
+                blockdecoder d(data, data.size());
+                std::pair<int64_t, int> s;
+                while (d.next(s.first, s.second))
+                {
+                  merged.push_back(s);
+                }
+                ok &= d.ok();
+              }) && ok;
+              for (auto it = merges.begin(); ok && (it != merges.end()); ++it)
+              {
+                unlink.bind(1) = *it;
+                ok = unlink.run();
+              }
+              if (!merges.empty())
+              {
+                merged.insert(merged.end(), block.begin(), block.end());
+                std::stable_sort(merged.begin(), merged.end(), [](const std::pair<int64_t, int>& a, const std::pair<int64_t, int>& b)
+                {
+                  return a.first < b.first;
+                });
+                block.swap(merged);
+              }
+              for (size_t i = 0; ok && (i < block.size()); i += blocksize)
+              {
+                ok = writeBlock(block.data() + i, std::min(blocksize, block.size() - i));
+              }
+              block.clear();
+            }
+            return ok;
+          };
+          result = select.run([&](query& row)
+          {
+            int64_t id = row[0];
+            int d = row[1];
+            int e = row[2];
+            int value = row[3];
+            int64_t sampletime = row[4];
+            int64_t uploadtime = row[5];
+            if ((d != device) || (e != entity) || (block.size() >= blocksize))
+            {
+              result &= flushBlock();
+              device = d;
+              entity = e;
+            }
+            block.emplace_back(sampletime, value);
+            stats.rowbytes += rowSize(id, d, e, value, sampletime, uploadtime);
+            ++rows;
+          }) && result;
+          result &= flushBlock();
+          if (result && (rows > 0))
+          {
+            snprintf(sql, sizeof(sql), "delete from `%s` where id<=?1;", table.c_str());
+            query erase(mDB, sql);
+            erase.bind(1) = through;
+            result = erase.run();
+          }
+          if (result)
+          {
+            result = mDB.commit();
+            stats.rows += rows;
+          }
+          else
+          {
+            noteError();
+            mDB.rollback();
+          }
+        }
+        return result;
+      }
+
+      /*
+        loadPartitions reads the partition catalogue
+      */
+      bool store::loadPartitions()
+      {
+        mPartitions.clear();
+        bool result = query(mDB, "select name,starttime,endtime from CollectedDataPartitions;").run([&](query& row)
+        {
+          partition p;
+          p.name = (const char*)row[0];
+          p.starttime = row[1];
+          p.endtime = row[2];
+          mPartitions[p.starttime] = p;
+        });
+        for (auto it = mPartitions.begin(); result && (it != mPartitions.end()); ++it)
+        {
+          char sql[256];
+          snprintf(sql, sizeof(sql), "select ifnull(max(id),0) from `%s`;", it->second.name.c_str());
+          result = query(mDB, sql).run([&](query& row)
+          {
+            it->second.maxid = row[0];
+          });
+        }
+        return result;
+      }
+
+      /*
+        loadSampleId finds the last sample id handed out. The tables may be empty or gone
+        with their samples archived or dropped, so sqlite_sequence and the id saved by
+        dropPartitionsBefore count as well.
+      */
+      bool store::loadSampleId()
+      {
+        int64_t last = 0;
+        bool result = query(mDB,
+          "select ifnull(max(seq),0) from sqlite_sequence "
+          "where name='CollectedData' or name in (select name from CollectedDataPartitions);").run([&](query& row)
+        {
+          last = row[0];
+        });
+        result = result && query(mDB, "select ifnull(max(id),0) from CollectedData;").run([&](query& row)
+        {
+          last = std::max(last, (int64_t)row[0]);
+        });
+        for (auto& p : mPartitions)
+        {
+          last = std::max(last, p.second.maxid);
+        }
+        int64_t saved = 0;
+        if (loadSetting(0, kSampleIdEntity, saved))
+        {
+          last = std::max(last, saved);
+        }
+        mLastSampleId = last;
+        return result;
+      }
+
+      /*
+        rollbackSamples rolls back a failed transaction of samples. A partition created
+        in it is gone again, so the catalogue is reread and the insert statement, which
+        may be for that partition, is dropped. The rollup windows go back to where they
+        were before the transaction, the windows closed in it weren't written.
+      */
+      void store::rollbackSamples()
+      {
+        noteError();
+        mDB.rollback();
+        mRollup.rollback();
+        mClosedWindows.clear();
+        if (mPartitioning != unpartitioned)
+        {
+          mInsertToPartition.reset();
+          loadPartitions();
+        }
+      }
+
+      /*
+        partitionInsert returns the insert statement for the partition of sampletime. The
+        partition is created on demand, within the transaction of the caller, see
+        rollbackSamples.
+      */
+      query* store::partitionInsert(int64_t sampletime)
+      {
+        int64_t start = partitionStart(sampletime, mPartitioning);
+        if (mInsertToPartition && (mInsertPartitionStart == start))
+        {
+          return mInsertToPartition.get();
+        }
+        mInsertToPartition.reset();
+        auto it = mPartitions.find(start);
+        if (it == mPartitions.end())
+        {
+          partition p;
+          p.name = partitionName(start, mPartitioning);
+          p.starttime = start;
+          p.endtime = partitionEnd(start, mPartitioning);
+          char sql[1024];
+          snprintf(sql, sizeof(sql), partitionSchema,
+            p.name.c_str(), p.name.c_str(), p.name.c_str(), p.name.c_str(),
+            (long long)p.starttime, (long long)p.endtime);
+          if (!mDB.execute(sql))
+          {
+            noteError();
+            return nullptr;
+          }
+          it = mPartitions.insert(std::make_pair(start, p)).first;
+        }
+        char sql[256];
+        snprintf(sql, sizeof(sql),
+          "insert into `%s` (id,device,entity,entityvalue,sampletime,uploadtime)"
+          "values (?5,?1,?2,?3,?4,0);", it->second.name.c_str());
+        std::unique_ptr<query> q(new query(mDB, sql));
+        if (!q->isPrepared())
+        {
+          return nullptr;
+        }
+        mInsertToPartition = std::move(q);
+        mInsertPartitionStart = start;
+        return mInsertToPartition.get();
+      }
+
+      /*
+        readTable runs a prepared scan over one table (see readSamples) and advances the cursor
+      */
+      bool store::readTable(query & q, int64_t from, int64_t to, samplecursor & cursor, size_t limit, size_t & rows, std::function<void(const sample&)>& fun)
+      {
+        q.bind(1) = from;
+        q.bind(2) = to;
+        q.bind(3) = cursor.sampletime;
+        q.bind(4) = cursor.id;
+        q.bind(5) = (int64_t)(limit - rows);
+        return q.run([&](query& row)
+        {
+          sample s;
+          s.id = row[0];
+          s.device = row[1];
+          s.entity = row[2];
+          s.value = row[3];
+          s.sampletime = row[4];
+          cursor.sampletime = s.sampletime;
+          cursor.id = s.id;
+          ++rows;
+          fun(s);
+        });
+      }
+
+      /*
+        readTableById runs a prepared scan by id over one table (see readSamplesById)
+      */
+      bool store::readTableById(query& q, int64_t after, int64_t through, size_t limit, std::vector<sample>& rows)
+      {
+        q.bind(1) = after;
+        q.bind(2) = through;
+        q.bind(3) = (int64_t)limit;
+        return q.run([&](query& row)
+        {
+          sample s;
+          s.id = row[0];
+          s.device = row[1];
+          s.entity = row[2];
+          s.value = row[3];
+          s.sampletime = row[4];
+          rows.push_back(s);
+        });
+      }
+
+      /*
+        renumberPartitions moves the ids of the partitions above those of CollectedData and
+        of the partitions before them, each partition counted its ids on its own before.
+        The ids keep their order within a table. The caller owns the transaction.
+      */
+      bool store::renumberPartitions()
+      {
+        char sql[512];
+        std::vector<std::string> tables;
+        int64_t last = 0;
+        bool result = query(mDB, "select ifnull(max(id),0) from CollectedData;").run([&](query& row)
+        {
+          last = row[0];
+        });
+        result = result && query(mDB, "select name from CollectedDataPartitions order by starttime;").run([&](query& row)
+        {
+          tables.push_back((const char*)row[0]);
+        });
+        for (auto it = tables.begin(); result && (it != tables.end()); ++it)
+        {
+          int64_t first = 0;
+          int64_t end = 0;
+          snprintf(sql, sizeof(sql), "select ifnull(min(id),0),ifnull(max(id),0) from `%s`;", it->c_str());
+          result = query(mDB, sql).run([&](query& row)
+          {
+            first = row[0];
+            end = row[1];
+          });
+          if (result && (end > 0) && (first <= last))
+          {
+            // through the negative ids, so no id collides with one not moved yet
+            int64_t offset = last - first + 1;
+            snprintf(sql, sizeof(sql), "update `%s` set id=-(id+%lld); update `%s` set id=-id;",
+              it->c_str(), (long long)offset, it->c_str());
+            result = mDB.execute(sql);
+            end += offset;
+          }
+          last = std::max(last, end);
+        }
+        return result;
+      }
+
+      /*
+        convertToMicroseconds scales all stored times from seconds to microseconds, including
+        the partitions and the timestamps inside the archive blocks. The caller owns the transaction.
+      */
+      bool store::convertToMicroseconds()
+      {
+        char sql[256];
+        std::vector<std::string> tables;
+        bool result = mDB.execute(
+          "update CollectedData set sampletime=sampletime*1000000;"
+          "update CurrentState set sampletime=sampletime*1000000;"
+          "update Eventlog set logtime=logtime*1000000;"
+          "update ControlStateOut set logtime=logtime*1000000;"
+          "update ControlCommandsIn set exectime=exectime*1000000;"
+          "update Rollup60 set starttime=starttime*1000000,lasttime=lasttime*1000000;"
+          "update Rollup900 set starttime=starttime*1000000,lasttime=lasttime*1000000;"
+          "update CollectedDataPartitions set starttime=starttime*1000000,endtime=endtime*1000000;");
+        result = result && query(mDB, "select name from CollectedDataPartitions;").run([&](query& row)
+        {
+          tables.push_back((const char*)row[0]);
+        });
+        for (auto it = tables.begin(); result && (it != tables.end()); ++it)
+        {
+          snprintf(sql, sizeof(sql), "update `%s` set sampletime=sampletime*1000000;", it->c_str());
+          result = mDB.execute(sql);
+        }
+        if (result)
+        {
+          query select(mDB, "select id,data from ArchiveBlocks;");
+          query update(mDB, "update ArchiveBlocks set starttime=?2,endtime=?3,data=?4 where id=?1;");
+          result = select.isPrepared() && update.isPrepared();
+          result = result && select.run([&](query& row)
+          {
+            blob data = row[1];
+            blockdecoder d(data, data.size());
+            blockencoder e;
+            int64_t time;
+            int value;
+            while (d.next(time, value))
+            {
+              e.add(time * kTicksPerSecond, value);
+            }
+            auto& converted = e.finish();
+            update.bind(1) = (int64_t)row[0];
+            update.bind(2) = e.firstTime();
+            update.bind(3) = e.lastTime();
+            update.bind(4) = blob(converted.data(), converted.size());
+            result &= d.ok() && update.run();
+          }) && result;
+        }
+        return result;
+      }
+
+      int64_t store::partitionStart(int64_t sampletime, partitioning mode)
+      {
+        int64_t length = partitionEnd(0, mode);
+        // floor division, so samples before 1970 land in the right partition
+        int64_t start = sampletime / length;
+        if ((sampletime % length) < 0)
+        {
+          --start;
+        }
+        return start * length;
+      }
+
+      int64_t store::partitionEnd(int64_t start, partitioning mode)
+      {
+        return start + ((mode == hourly) ? 3600 : 86400) * kTicksPerSecond;
+      }
+
+      /*
+        the partition name is CollectedData_YYYYMMDD for daily or CollectedData_YYYYMMDDHH
+        for hourly partitions, always in UTC
+      */
+      std::string store::partitionName(int64_t start, partitioning mode)
+      {
+        start = start / kTicksPerSecond;
+        int64_t days = start / 86400;
+        int64_t seconds = start % 86400;
+        if (seconds < 0)
+        {
+          seconds += 86400;
+          --days;
+        }
+        // days to the civil date, see http://howardhinnant.github.io/date_algorithms.html
+        int64_t z = days + 719468;
+        int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+        unsigned doe = (unsigned)(z - era * 146097);
+        unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        unsigned mp = (5 * doy + 2) / 153;
+        unsigned d = doy - (153 * mp + 2) / 5 + 1;
+        unsigned m = mp < 10 ? mp + 3 : mp - 9;
+        long long y = (long long)yoe + era * 400 + (m <= 2);
+        char name[64];
+        if (mode == hourly)
+        {
+          snprintf(name, sizeof(name), "CollectedData_%04lld%02u%02u%02u", y, m, d, (unsigned)(seconds / 3600));
+        }
+        else
+        {
+          snprintf(name, sizeof(name), "CollectedData_%04lld%02u%02u", y, m, d);
+        }
+        return name;
+      }
+
+      /*
+        noteError counts a failed store operation and keeps the sqlite error message,
+        the caller holds mLock
+      */
+      void store::noteError()
+      {
+        gErrors.add();
+        if (mDB.isOpen())
+        {
+          mLastError = mDB.getErrorMessage();
+        }
+      }
+
+      std::string store::lastError()
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        return mLastError;
+      }
+
+      /*
+        setProfiling turns the statement profiler of the database on or off, see
+        util::db::profileReport for the report
+      */
+      bool store::setProfiling(bool enable)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        return mDB.setProfiling(enable);
+      }
+
+      std::string store::profileReport(size_t top)
+      {
+        metrics::timedlock<std::mutex> lock(mLock, gLockWait);
+        return mDB.profileReport(top);
+      }
+
+      /*
+        now returns the sample time in microseconds since the unix epoch
+      */
+      int64_t store::now()
+      {
+        return sampleclock::now();
       }
     }
   }
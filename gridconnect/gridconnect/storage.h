@@ -27,11 +27,23 @@
 
 */
 
+#pragma once
+
+#include <cstdint>
 #include <functional>
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
 #include <mutex>
 #include <chrono>
+#include <unordered_map>
 
 #include "sqliteoo.h"
+#include "sampleclock.h"
+#include "archive.h"
+#include "rollup.h"
+#include "journal.h"
 
 namespace satag
 {
@@ -41,36 +53,278 @@ namespace satag
     {
       using namespace std;
       using namespace satag::util;
-      // classes
+
+      // all times in the store are microseconds since the unix epoch, see sampleclock
+      const int64_t kTicksPerSecond = sampleclock::kMicrosPerSecond;
+      const int kBusyTimeout = 5000;    // milliseconds to wait for a lock held by another connection
+
+      /*
+        a sample is one row of CollectedData
+      */
+      struct sample
+      {
+        int64_t id = 0;           // rowid in CollectedData or its partition, 0 if not stored yet
+        int device = 0;
+        int entity = 0;
+        int value = 0;
+        int64_t sampletime = 0;
+      };
+
+      /*
+        a command is one row of ControlCommandsIn, the texts may be NULL
+      */
+      struct command
+      {
+        int64_t id = 0;           // rowid in ControlCommandsIn, 0 if there was no command
+        int device = 0;
+        std::string text1;
+        std::string text2;
+        bool null1 = true;        // text1 is NULL
+        bool null2 = true;        // text2 is NULL
+        int64_t exectime = 0;     // commands run in the order of exectime
+        const char* t1() const { return null1 ? nullptr : text1.c_str(); }
+        const char* t2() const { return null2 ? nullptr : text2.c_str(); }
+      };
+
+      /*
+        an event is one row of Eventlog, the texts may be NULL
+      */
+      struct event
+      {
+        int64_t id = 0;           // rowid in Eventlog
+        int eventid = 0;
+        std::string source;
+        std::string text1;
+        std::string text2;
+        bool null1 = true;        // text1 is NULL
+        bool null2 = true;        // text2 is NULL
+        int64_t logtime = 0;
+      };
+
+      /*
+        a setting is one row of Settings
+      */
+      struct setting
+      {
+        int device = 0;
+        int entity = 0;
+        int64_t value = 0;
+      };
+
+      /*
+        settingsmap is a snapshot of Settings, it doesn't change once it was handed out.
+        A control loop takes one and reads from it without a lock or a query:
+
+          auto settings = s.settings();
+          int64_t limit = settings->get(7, 3, 4600);    // 4600 if there is no such row
+      */
+      class settingsmap
+      {
+      public:
+        bool find(int device, int entity, int64_t& value) const;
+        int64_t get(int device, int entity, int64_t fallback = 0) const;
+        size_t size() const { return mValues.size(); }
+        void forEach(std::function<void(const setting&)> fun) const;
+      private:
+        friend class store;
+        static uint64_t key(int device, int entity) { return ((uint64_t)(uint32_t)device << 32) | (uint32_t)entity; }
+        std::unordered_map<uint64_t, int64_t> mValues;    // by key(device, entity)
+      };
+
+      /*
+        a capturerecord is one row of Captures, a frozen waveform window of one
+        (device, entity) channel. data is the compressed columnar batch of its samples
+        in the named Content-Encoding, see capture.h.
+      */
+      struct capturerecord
+      {
+        int64_t id = 0;           // rowid in Captures
+        int device = 0;
+        int entity = 0;
+        int64_t triggertime = 0;
+        int64_t starttime = 0;    // first sample
+        int64_t endtime = 0;      // last sample
+        int64_t samples = 0;
+        std::string encoding;     // "identity", "deflate", "zstd"
+        std::vector<uint8_t> data;
+      };
+
+      /*
+        a samplecursor remembers the position of a keyset scan over CollectedData,
+        ordered by (sampletime, id). It is advanced by store::readSamples.
+      */
+      struct samplecursor
+      {
+        int64_t sampletime = INT64_MIN; // sampletime of the last row read
+        int64_t id = 0;                 // id of the last row read
+        bool done = false;              // true, if the range has been read completely
+      };
+
+      /*
+        partitioning selects how CollectedData is split into time based tables.
+        A partition is dropped as a whole, which keeps retention cheap.
+      */
+      enum partitioning : int_fast16_t
+      {
+        unpartitioned = 0,  // all samples go to CollectedData
+        daily,              // samples go to CollectedData_YYYYMMDD
+        hourly,             // samples go to CollectedData_YYYYMMDDHH
+      };
+
+      /*
+        store is the database of the gateway. With journaling the samples of
+        logDSPEvent(s) go to the journal (see journal.h) and stay in memory until
+        applyJournal() writes them to CollectedData in one transaction, which also
+        stores the sequence number of the last record in Settings (device 0, entity
+        kJournalEntity). open() replays the records after that number, also with
+        nojournal, and close() applies what is left.
+
+          store s;
+          s.open("battery.sq3", unpartitioned, journaled);   // journal in battery.sq3.jnl
+          s.logDSPEvents(samples);    // appended, a crash from here on doesn't lose them
+          s.applyJournal();           // e.g. from a background task
+
+        The ids of the samples are handed out by the store in the order they are
+        written, also across the partitions, so a scan by id (readSamplesById) sees the
+        samples in the order they came in whatever their sampletime. The uploads use it.
+
+        Settings is cached, open() loads it. getSetting, loadSetting and settings() read
+        the cache, setSetting and saveSettings insert or replace the rows in one
+        transaction, then replace the cache and tell the onSettingsChanged listeners
+        about the values which changed. Rows written by other connections show up
+        after reloadSettings().
+      */
       class store
       {
       public:
+        static const int kJournalEntity = 100;    // Settings (device 0) row of the last journal record applied
+        static const int kSampleIdEntity = 101;   // Settings (device 0) row of the last sample id, kept when partitions are dropped
+
         store();
         ~store();
-        bool open(const char* source);
+        bool open(const char* source, partitioning mode = unpartitioned, journaling journal = nojournal);
         void close();
         bool isOpen() const { return mDB.isOpen(); }
+        journaling journalMode() const { return mJournal.isOpen() ? mJournal.mode() : nojournal; }
+        bool applyJournal();
+        size_t journalPending() const;
+        static std::string journalName(const char* source);
         bool logDSPEvent(int device, int entity, int value);
+        bool logDSPEvents(const std::vector<sample>& samples);
+        bool logDSPEvents(const sample* samples, size_t count);
+        bool readSamples(int64_t from, int64_t to, samplecursor& cursor, size_t limit, std::function<void(const sample&)> fun);
+        bool readSamplesById(int64_t after, int64_t through, size_t limit, std::function<void(const sample&)> fun);
+        int64_t lastSampleId();
         bool runEvent(std::function<bool(int device, const char* text1, const char* text2)> fun);
+        bool nextCommand(command& c);
+        bool removeCommand(int64_t id);
+        bool addCommands(const std::vector<command>& commands);
         bool logEvent(int eventid,const char * source, int device,  const char* text1, const char* text2, bool success);
         bool logState(int eventid, int device, const char* text1, const char* text2);
         bool setSetting(int device, int entity, int value);
         int getSetting(int device, int entity);
+        bool saveSettings(const std::vector<setting>& settings);
+        bool loadSetting(int device, int entity, int64_t& value);
+        std::shared_ptr<const settingsmap> settings() const;
+        bool reloadSettings();
+        void onSettingsChanged(std::function<void(const std::vector<setting>& changed)> fun);
+        bool readEvents(int64_t after, size_t limit, std::function<void(const event&)> fun);
+        bool readEvents(const char* source, int64_t after, size_t limit, std::function<void(const event&)> fun);
+        bool markEventsUploaded(int64_t last);
+        bool dropPartitionsBefore(int64_t time);
+        bool listPartitions(std::function<void(const char* name, int64_t starttime, int64_t endtime)> fun);
+        bool archiveUploaded(int64_t through, size_t blocksize, archivestats& stats);
+        bool readArchive(int device, int entity, int64_t from, int64_t to, std::function<bool(const sample&)> fun);
+        bool readRollup(int device, int entity, int64_t from, int64_t to, size_t maxpoints, std::function<bool(const rollupwindow&)> fun);
+        bool saveCapture(capturerecord& c);
+        bool readCaptures(int device, int entity, int64_t from, int64_t to, std::function<bool(const capturerecord&)> fun);
+        std::string lastError();
+        bool setProfiling(bool enable);
+        std::string profileReport(size_t top = 20);
+        static int64_t now();
       protected:
-        bool createSchema();
+        void noteError();
+        bool createSchema(int version);
         bool createQueries();
-        time_t now() const; 
+        bool insertSample(int device, int entity, int value, int64_t sampletime);
+        bool writeSamples(const sample* samples, size_t count, int64_t applied);
+        bool journalSamples(const sample* samples, size_t count);
+        bool replayJournal(const char* source, journaling mode);
+        void cacheSettings(const setting* settings, size_t count, std::vector<setting>* changed);
+        void notifySettings(const std::vector<setting>& changed);
+        bool loadPartitions();
+        void rollbackSamples();
+        query* partitionInsert(int64_t sampletime);
+        bool flushRollups();
+        bool convertToMicroseconds();
+        bool renumberPartitions();
+        bool loadSampleId();
+        bool archiveTable(const std::string& table, int64_t through, size_t blocksize, archivestats& stats);
+        bool readTable(query& q, int64_t from, int64_t to, samplecursor& cursor, size_t limit, size_t& rows, std::function<void(const sample&)>& fun);
+        bool readTableById(query& q, int64_t after, int64_t through, size_t limit, std::vector<sample>& rows);
+        bool intern(const char* text, int64_t& id);
+        bool bindInterned(query& q, int index, const char* text);
+        const std::string* resolve(int64_t id);
+        bool readEvents(query& q, std::function<void(const event&)>& fun);
+        void forgetInterned();
+        static int64_t partitionStart(int64_t sampletime, partitioning mode);
+        static int64_t partitionEnd(int64_t start, partitioning mode);
+        static std::string partitionName(int64_t start, partitioning mode);
       private:
+        struct partition
+        {
+          std::string name;           // table name
+          int64_t starttime;          // first sampletime in this partition
+          int64_t endtime;            // first sampletime after this partition
+          std::shared_ptr<query> read;  // the scan of readSamples, prepared on first use
+          std::shared_ptr<query> readById;  // the scan of readSamplesById, prepared on first use
+          int64_t maxid = 0;          // the highest id in this partition, at least
+        };
         db mDB;                       // the database object
         query mInsertToLog;           // the statement to log data to CollectedData
         query mInsertToCurrent;       // the statement to log data to CurrentState
         query mGetNetCommand;         // the statement to retrieve a command for the battery
         query mDeleteControlCommand;  // removes a command from the ControlCommandsIn Table
+        query mInsertCommand;         // the statement to queue a command in ControlCommandsIn
         query mInsertToEventLog;      // the statement to insert into the event log
         query mInsertToStateLog;      // the statement to insert into the state log
-        query mSetSetting;            // the statement to save a setting
-        query mGetSetting;            // the statement to retrieve a setting
+        query mSaveSetting;           // the statement to insert or replace a setting
+        query mReadEvents;            // the statement to scan Eventlog by id
+        query mMarkEvents;            // the statement to flag uploaded events
+        query mReadSourceEvents;      // the statement to scan the Eventlog rows of one source
+        query mFindString;            // the statement to look up the id of an interned text
+        query mInsertString;          // the statement to add a text to Strings
+        query mResolveString;         // the statement to look up the text of an id
+        query mReadSamples;           // the statement to scan CollectedData by (sampletime, id)
+        query mReadSamplesById;       // the statement to scan CollectedData by id
+        query mInsertArchiveBlock;    // the statement to store an archive block
+        query mReadArchive;           // the statement to find the archive blocks of a range
+        query mInsertCapture;         // the statement to store a capture window
+        query mReadCaptures;          // the statement to find the captures of a range
+        query mUpdateRollup[rollup::kLevels];  // the statements to merge a closed window into a rollup table
+        query mInsertRollup[rollup::kLevels];  // the statements to add a closed window to a rollup table
+        query mReadRollup[rollup::kLevels];    // the statements to read a rollup table
+        rollup mRollup;                        // the open rollup windows
+        std::vector<rollupwindow> mClosedWindows;     // closed windows waiting for the transaction
+        partitioning mPartitioning = unpartitioned;   // how CollectedData is split
+        std::map<int64_t, partition> mPartitions;     // known partitions by starttime
+        std::unique_ptr<query> mInsertToPartition;    // the statement to log data to the current partition
+        int64_t mInsertPartitionStart = 0;            // starttime of the partition mInsertToPartition writes to
+        int64_t mLastSampleId = 0;                    // the id of the last sample written, the next one gets the one after
+        std::unordered_map<std::string, int64_t> mStringIds;    // cache of Strings, text -> id
+        std::unordered_map<int64_t, std::string> mStringTexts;  // cache of Strings, id -> text
+        journal mJournal;             // the journal of the samples, if journaling
+        std::vector<sample> mJournalTail;   // journaled samples which aren't applied yet
+        std::vector<sample> mJournalBatch;  // the samples applyJournal() is writing
+        int64_t mJournalSeq = 0;      // sequence number of the last record in mJournalTail
+        std::string mLastError;       // the message of the last failed operation
         mutex mLock;                  // lock to use prepared statements from multiple threads
+        mutex mCommandLock;           // one runEvent at a time
+        mutable mutex mJournalLock;   // protects mJournal and mJournalTail, appends don't wait for SQLite
+        mutex mApplyLock;             // one applyJournal at a time
+        std::shared_ptr<const settingsmap> mSettings;   // the cache of Settings, replaced as a whole
+        mutable mutex mSettingsLock;  // protects mSettings and mSettingsListeners
+        std::vector<std::function<void(const std::vector<setting>&)>> mSettingsListeners;  // told about changed settings
       };
     }
   }
@@ -0,0 +1,516 @@
+/*
+  upload
+
+  the bodies of the uploads to the server, streamed from the store
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#include "upload.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      using namespace satag::util;
+
+      static metrics::counter& gSamples = metrics::registry::instance().getCounter("upload.samples");
+      static metrics::counter& gBytes = metrics::registry::instance().getCounter("upload.bytes");
+      static metrics::counter& gBacklogs = metrics::registry::instance().getCounter("upload.backlogs");
+      static metrics::counter& gCongestion = metrics::registry::instance().getCounter("upload.congestion");
+      static metrics::histogram& gBatchSize = metrics::registry::instance().getHistogram("upload.batchsize");
+      static metrics::histogram& gRtt = metrics::registry::instance().getHistogram("upload.rtt");
+
+      const char* const uploadstream::kContentType = "application/cbor-seq";
+
+      uploadstream::uploadstream(store& source, int64_t after, int64_t through, uint64_t limit)
+        : mStore(source)
+        , mThrough(through)
+        , mLimit(limit)
+        , mRead(after)
+        , mSent(after)
+        , mWriter([this](cbor::encoder& out) { return next(out); })
+      {
+        mPage.reserve(kPage);
+      }
+
+      // has the signature of a CURLOPT_READFUNCTION, self is the uploadstream
+      size_t uploadstream::curlRead(char* buffer, size_t size, size_t nitems, void* self)
+      {
+        uploadstream* s = static_cast<uploadstream*>(self);
+        size_t n = s->read((uint8_t*)buffer, size * nitems);
+        gBytes.add(n);
+        return n;
+      }
+
+      /*
+        hasSamples reads the first page if needed, an upload without samples can be skipped
+      */
+      bool uploadstream::hasSamples()
+      {
+        return fill();
+      }
+
+      /*
+        fill reads the next page once the last one is used up, false if there are no
+        more samples
+      */
+      bool uploadstream::fill()
+      {
+        if (mPagePos < mPage.size())
+        {
+          return true;
+        }
+        mPage.clear();
+        mPagePos = 0;
+        if (mReadAll || mFailed || (mCount >= mLimit))
+        {
+          return false;
+        }
+        size_t page = (size_t)std::min<uint64_t>(kPage, mLimit - mCount);
+        if (!mStore.readSamplesById(mRead, mThrough, page, [this](const sample& s) { mPage.push_back(s); }))
+        {
+          mFailed = true;
+        }
+        mReadAll = (mPage.size() < page) || mFailed;
+        if (!mPage.empty())
+        {
+          mRead = mPage.back().id;
+        }
+        return !mPage.empty();
+      }
+
+      bool uploadstream::next(cbor::encoder& out)
+      {
+        if (mFormat == columnarbatches)
+        {
+          return nextBatch(out);
+        }
+        if (!fill())
+        {
+          return false;
+        }
+        const sample& s = mPage[mPagePos++];
+        ++mCount;
+        out.map(4);
+        out.int32(1);
+        out.int32(s.device);
+        out.int32(2);
+        out.int32(s.entity);
+        out.int32(3);
+        out.int32(s.value);
+        out.int32(4);
+        out.int64(s.sampletime);
+        sent(s);
+        gSamples.add(1);
+        return true;
+      }
+
+      /*
+        nextBatch takes up to kBatch samples from the pages and writes them as one
+        columnar batch
+      */
+      bool uploadstream::nextBatch(cbor::encoder& out)
+      {
+        mBatch.clear();
+        while ((mBatch.size() < kBatch) && fill())
+        {
+          size_t n = std::min(kBatch - mBatch.size(), mPage.size() - mPagePos);
+          mBatch.insert(mBatch.end(), mPage.begin() + mPagePos, mPage.begin() + mPagePos + n);
+          mPagePos += n;
+          mCount += n;
+        }
+        if (mBatch.empty())
+        {
+          return false;
+        }
+        mColumns.encode(out, mBatch.data(), mBatch.size());
+        sent(mBatch.back());
+        gSamples.add(mBatch.size());
+        return true;
+      }
+
+      void uploadstream::sent(const sample& s)
+      {
+        mSent = s.id;
+        mSentAll = (mReadAll || (mRead == mThrough)) && (mPagePos == mPage.size());
+      }
+
+      // ----------------------------------------------------------------------------
+
+      uploadbody::uploadbody(store& source, const uploadbatch& batch)
+        : mStore(source)
+        , mBatch(batch)
+        , mEventRead(batch.firstEvent)
+        , mEventWriter([this](cbor::encoder& out) { return nextEvent(out); })
+      {
+        if (batch.lane != eventlane)
+        {
+          mSamples.reset(new uploadstream(source, batch.start, batch.end));
+          mSamples->setFormat((uploadformat)batch.format);
+        }
+      }
+
+      size_t uploadbody::read(uint8_t* dest, size_t len)
+      {
+        return mSamples ? mSamples->read(dest, len) : mEventWriter.read(dest, len);
+      }
+
+      /*
+        nextEvent writes the next event of the batch, the events are read a page at a time
+      */
+      bool uploadbody::nextEvent(cbor::encoder& out)
+      {
+        if (mEventPos == mEvents.size())
+        {
+          mEvents.clear();
+          mEventPos = 0;
+          if (mFailed || (mEventRead >= mBatch.lastEvent))
+          {
+            return false;
+          }
+          if (!mStore.readEvents(mEventRead, uploadstream::kPage, [this](const event& e)
+          {
+            if (e.id <= mBatch.lastEvent)
+            {
+              mEvents.push_back(e);
+            }
+          }))
+          {
+            mFailed = true;
+          }
+          if (mEvents.empty())
+          {
+            return false;
+          }
+          mEventRead = mEvents.back().id;
+        }
+        const event& e = mEvents[mEventPos++];
+        auto key = [&out](const char* k) { out.string(k, strlen(k), true); };
+        out.map(5);
+        key("event");
+        out.int32(e.eventid);
+        key("source");
+        out.string(e.source.c_str(), e.source.size(), true);
+        key("text1");
+        e.null1 ? out.null() : out.string(e.text1.c_str(), e.text1.size(), true);
+        key("text2");
+        e.null2 ? out.null() : out.string(e.text2.c_str(), e.text2.size(), true);
+        key("time");
+        out.int64(e.logtime);
+        return true;
+      }
+
+      // ----------------------------------------------------------------------------
+
+      uploadscheduler::uploadscheduler(store& source, const uploadpolicy& policy)
+        : mStore(source)
+        , mPolicy(policy)
+        , mBatch(policy.minBatch)
+        , mThreshold(policy.maxBatch)
+        , mWindowCap(policy.maxWindow)
+      {
+        mPolicy.minBatch = std::max<size_t>(1, mPolicy.minBatch);
+        mPolicy.maxBatch = std::max(mPolicy.minBatch, mPolicy.maxBatch);
+        mPolicy.maxWindow = std::max<size_t>(1, mPolicy.maxWindow);
+        mBatch = mPolicy.minBatch;
+      }
+
+      /*
+        resume loads the checkpoint, false if there is none (the first run) and all
+        stored samples are going to be the backlog. The events of an older checkpoint
+        are resumed, its samples are uploaded again.
+      */
+      bool uploadscheduler::resume()
+      {
+        int64_t v[kFormat + 1] = {};
+        if (mStore.loadSetting(kSettingsDevice, kEventId, v[kEventId]))
+        {
+          mEventAcked = mEventRead = v[kEventId];
+        }
+        if (!mStore.loadSetting(kSettingsDevice, kFormat, v[kFormat]) || (v[kFormat] != kCheckpointFormat))
+        {
+          return false;
+        }
+        for (int key : { kLiveTime, kLiveId, kBacklogTo, kBacklogTime, kBacklogId })
+        {
+          if (!mStore.loadSetting(kSettingsDevice, key, v[key]))
+          {
+            return false;
+          }
+        }
+        mLive.acked = mLive.read = v[kLiveId];
+        mLive.ackedTime = v[kLiveTime];
+        mBacklog.to = v[kBacklogTo];
+        mBacklog.acked = mBacklog.read = v[kBacklogId];
+        mBacklog.ackedTime = v[kBacklogTime];
+        mBacklogActive = (mBacklog.to != INT64_MIN);
+        return true;
+      }
+
+      /*
+        plan reads the batches of the next round, it is empty if there is nothing to send
+      */
+      bool uploadscheduler::plan(std::vector<uploadbatch>& round)
+      {
+        round.clear();
+        int64_t boundary = store::now() - mPolicy.fresh;
+        if (!mBacklogActive && mLiveBehind && (mLive.ackedTime < boundary))
+        {
+          // what is stored goes to the backlog, the live lane continues with what comes in
+          int64_t last = mStore.lastSampleId();
+          mBacklog.to = last;
+          mBacklog.acked = mBacklog.read = mLive.acked;
+          mBacklog.ackedTime = mLive.ackedTime;
+          mBacklogActive = true;
+          mWindow = 1;
+          mWindowCap = mPolicy.maxWindow;
+          mWindowGrew = false;
+          mRate = 0;
+          mLive.acked = mLive.read = last;
+          mLive.ackedTime = store::now();
+          gBacklogs.add();
+        }
+        bool result = readEvents(round) && readSamples(mLive, livelane, round);
+        mLiveBehind = !round.empty() && (round.back().lane == livelane) && !round.back().last;
+        for (size_t i = 0; result && mBacklogActive && (i < mWindow); ++i)
+        {
+          size_t before = round.size();
+          result = readSamples(mBacklog, backloglane, round);
+          if (round.size() == before)
+          {
+            // an empty backlog ends here, one with batches in this round when they are taken
+            mBacklogActive = (i > 0);
+            break;
+          }
+        }
+        return result;
+      }
+
+      bool uploadscheduler::readEvents(std::vector<uploadbatch>& round)
+      {
+        uploadbatch b;
+        b.lane = eventlane;
+        b.firstEvent = mEventRead;
+        bool result = mStore.readEvents(mEventRead, mPolicy.eventBatch, [&b](const event& e)
+        {
+          b.lastEvent = e.id;
+          ++b.items;
+        });
+        if (result && (b.items > 0))
+        {
+          mEventRead = b.lastEvent;
+          round.push_back(b);
+        }
+        return result;
+      }
+
+      /*
+        readSamples plans the next batch of a lane, nothing if the lane is caught up. Only
+        the positions are read here, uploadbody reads the samples again while it is sent.
+      */
+      bool uploadscheduler::readSamples(lane& l, int kind, std::vector<uploadbatch>& round)
+      {
+        uploadbatch b;
+        b.lane = kind;
+        b.format = mPolicy.format;
+        b.start = l.read;
+        b.end = b.start;
+        while ((b.items < mBatch) && !b.last)
+        {
+          // a page at a time, the writers get the store in between
+          size_t page = (size_t)std::min<uint64_t>(uploadstream::kPage, mBatch - b.items);
+          size_t rows = 0;
+          if (!mStore.readSamplesById(b.end, l.to, page, [&](const sample& s)
+          {
+            b.end = s.id;
+            b.endTime = s.sampletime;
+            ++rows;
+          }))
+          {
+            return false;
+          }
+          b.items += rows;
+          b.last = (rows < page) || (b.end == l.to);
+        }
+        if (b.items > 0)
+        {
+          l.read = b.end;
+          gBatchSize.record(b.items);
+          round.push_back(b);
+        }
+        return true;
+      }
+
+      /*
+        complete takes the results of a round: the lanes advance over the batches the
+        server took up to the first one it didn't, the batch size and window adapt and
+        the checkpoint is saved. It is true if there is more to send right away.
+      */
+      bool uploadscheduler::complete(const std::vector<uploadbatch>& round)
+      {
+        bool failed[3] = { false, false, false };
+        int64_t events = mEventAcked;
+        for (const auto& b : round)
+        {
+          failed[b.lane] = failed[b.lane] || !b.sent;
+          if (failed[b.lane])
+          {
+            continue;
+          }
+          if (b.lane == eventlane)
+          {
+            mEventAcked = b.lastEvent;
+          }
+          else
+          {
+            lane& l = (b.lane == livelane) ? mLive : mBacklog;
+            l.acked = b.end;
+            l.ackedTime = b.endTime;
+            if ((b.lane == backloglane) && b.last)
+            {
+              mBacklogActive = false;   // read to its end, from now on it's all live
+            }
+          }
+        }
+        // failed lanes are read again from what the server has
+        mEventRead = mEventAcked;
+        mLive.read = mLive.acked;
+        mBacklog.read = mBacklog.acked;
+        if (!mBacklogActive)
+        {
+          mBacklog.to = INT64_MIN;
+        }
+        adapt(round);
+        bool saved = save();
+        if (saved && (mEventAcked != events))
+        {
+          // the flag is for other readers of Eventlog, the checkpoint is what counts here
+          saved = mStore.markEventsUploaded(mEventAcked);
+        }
+        bool more = mBacklogActive || mLiveBehind;
+        for (const auto& b : round)
+        {
+          more = more || ((b.lane == eventlane) && (b.items == mPolicy.eventBatch));
+        }
+        return saved && more && !(failed[eventlane] || failed[livelane] || failed[backloglane]);
+      }
+
+      /*
+        uploadedThrough is the acked position of the backlog while there is one, it lies
+        below the live lane, otherwise that of the live lane
+      */
+      int64_t uploadscheduler::uploadedThrough() const
+      {
+        return mBacklogActive ? mBacklog.acked : mLive.acked;
+      }
+
+      /*
+        adapt is the AIMD step, only rounds with samples tell something about the link
+      */
+      void uploadscheduler::adapt(const std::vector<uploadbatch>& round)
+      {
+        bool congested = false;
+        double slowest = 0;
+        uint64_t bytes = 0;
+        size_t backlogBatches = 0;
+        for (const auto& b : round)
+        {
+          congested = congested || !b.sent || (b.seconds * 1000.0 > (double)mPolicy.targetRtt.count());
+          slowest = std::max(slowest, b.seconds);
+          bytes += b.bytes;
+          backlogBatches += (b.lane == backloglane) ? 1 : 0;
+          if (b.sent)
+          {
+            gRtt.record((uint64_t)(b.seconds * 1e9));
+          }
+        }
+        if (congested)
+        {
+          gCongestion.add();
+          mThreshold = std::max(mPolicy.minBatch, mBatch / 2);
+          mBatch = mThreshold;
+          mWindow = std::max<size_t>(1, mWindow / 2);
+          mWindowGrew = false;
+          mRate = 0;
+          return;
+        }
+        if (backlogBatches == 0)
+        {
+          return;
+        }
+        if (mBatch < mPolicy.maxBatch)
+        {
+          mBatch = (mBatch < mThreshold) ? std::min(mBatch * 2, mThreshold) : (mBatch + mPolicy.minBatch);
+          mBatch = std::min(mBatch, mPolicy.maxBatch);
+          return;
+        }
+        if (backlogBatches < mWindow)
+        {
+          return;   // the end of the backlog, no measure of the window
+        }
+        double rate = bytes / std::max(slowest, 1e-3);
+        if (mWindowGrew && (rate < mRate * 1.1))
+        {
+          mWindowCap = --mWindow;   // more requests in parallel didn't help
+        }
+        else if (mWindow < std::min(mWindowCap, mPolicy.maxWindow))
+        {
+          ++mWindow;
+          mWindowGrew = true;
+          mRate = rate;
+          return;
+        }
+        mWindowGrew = false;
+        mRate = rate;
+      }
+
+      bool uploadscheduler::save()
+      {
+        std::vector<setting> settings;
+        auto add = [&settings](int key, int64_t value)
+        {
+          setting s;
+          s.device = kSettingsDevice;
+          s.entity = key;
+          s.value = value;
+          settings.push_back(s);
+        };
+        add(kLiveTime, mLive.ackedTime);
+        add(kLiveId, mLive.acked);
+        add(kBacklogTo, mBacklog.to);
+        add(kBacklogTime, mBacklog.ackedTime);
+        add(kBacklogId, mBacklog.acked);
+        add(kEventId, mEventAcked);
+        add(kFormat, kCheckpointFormat);
+        return mStore.saveSettings(settings);
+      }
+    }
+  }
+}
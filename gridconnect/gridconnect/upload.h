@@ -0,0 +1,285 @@
+/*
+  upload
+
+  the bodies of the uploads to the server, streamed from the store
+
+  Copyright (c)   (c) 2015,2016 tk@satware.com
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of this
+  software and associated documentation files (the "Software"), to deal in the Software
+  without restriction, including without limitation the rights to use, copy, modify,
+  merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to the following
+  conditions:
+
+  The above copyright notice and this permission notice shall be included in all copies
+  or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+  PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+  FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+  OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+
+  The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "c++bor.h"
+#include "columnar.h"
+#include "storage.h"
+
+namespace satag
+{
+  namespace energy
+  {
+    namespace bx
+    {
+      enum uploadformat : int_fast16_t
+      {
+        samplemaps = 0,     // a map per sample
+        columnarbatches,    // a columnar batch (see columnar.h) per kBatch samples
+      };
+
+      /*
+        uploadstream is the body of a sample upload, a CBOR sequence (application/cbor-seq)
+        with one map per sample in the layout samplereader reads:
+
+          { 1: device, 2: entity, 3: value, 4: sampletime }
+
+        The samples are read from the store a page at a time, only when the transport
+        asks for more bytes, so an upload of a backlog of days needs no more memory than
+        one of a minute. They come in the order of their ids (store::readSamplesById),
+        the order they were written, so a sample written late with an older sampletime
+        is sent with the next upload and not skipped.
+
+          uploadstream body(store, position);
+          curl_easy_setopt(curl, CURLOPT_READFUNCTION, uploadstream::curlRead);
+          curl_easy_setopt(curl, CURLOPT_READDATA, &body);
+          if ((curl_easy_perform(curl) == CURLE_OK) && !body.failed())
+            position = body.position();   // the next upload continues after the last sample sent
+
+        A store error ends the sequence early and sets failed(), the upload must not be
+        taken as complete then.
+
+        through ends the sequence with the sample of that id, the end of a batch
+        uploadscheduler planned.
+
+        With setFormat(columnarbatches) the items of the sequence are columnar batches of
+        up to kBatch samples instead, a fraction of the size before any compression. The
+        server tells them apart by the major type, a batch is an array.
+      */
+      class uploadstream
+      {
+      public:
+        static constexpr size_t kPage = 500;    // samples read from the store at a time
+        static constexpr size_t kBatch = 10000; // samples in a columnar batch at most
+        static const char* const kContentType;
+
+        uploadstream(store& source, int64_t after, int64_t through = INT64_MAX, uint64_t limit = UINT64_MAX);
+        size_t read(uint8_t* dest, size_t len) { return mWriter.read(dest, len); }
+        static size_t curlRead(char* buffer, size_t size, size_t nitems, void* self);
+        void setFormat(uploadformat format) { mFormat = format; }   // before the first read
+        bool hasSamples();
+        int64_t position() const { return mSent; }
+        bool done() const { return mSentAll; }
+        uint64_t samples() const { return mCount; }
+        uint64_t bytes() const { return mWriter.bytes(); }
+        bool failed() const { return mFailed; }
+      private:
+        bool fill();
+        bool next(cbor::encoder& out);
+        bool nextBatch(cbor::encoder& out);
+        void sent(const sample& s);
+        store& mStore;
+        int64_t mThrough;               // id of the last sample at most
+        uint64_t mLimit;                // samples at most
+        int64_t mRead;                  // id of the last sample read
+        bool mReadAll = false;          // the last page was short, there are no more samples
+        int64_t mSent;                  // id of the last sample encoded
+        bool mSentAll = false;          // the last sample there is was encoded
+        std::vector<sample> mPage;      // the samples read, not encoded yet
+        size_t mPagePos = 0;
+        uint64_t mCount = 0;            // samples taken from the pages
+        int mFormat = samplemaps;
+        std::vector<sample> mBatch;     // the samples of a columnar batch
+        columnarencoder mColumns;
+        bool mFailed = false;
+        cbor::sequencewriter mWriter;
+      };
+
+      /*
+        uploadpolicy are the bounds within which uploadscheduler adapts
+      */
+      struct uploadpolicy
+      {
+        size_t minBatch = 1000;         // samples per batch, the additive step as well
+        size_t maxBatch = 100000;
+        size_t maxWindow = 4;           // backlog batches in flight at most
+        size_t eventBatch = 1000;       // events per round at most
+        std::chrono::milliseconds targetRtt{ 5000 };  // a slower response counts as congestion
+        int64_t fresh = 300 * kTicksPerSecond;        // samples younger than this are live data
+        uploadformat format = samplemaps;
+      };
+
+      enum uploadlane : int_fast16_t
+      {
+        eventlane = 0,      // Eventlog rows
+        livelane,           // fresh samples
+        backloglane,        // samples which piled up during an outage
+      };
+
+      /*
+        an uploadbatch is one request of a round. It holds the range of ids it covers,
+        not the body, uploadbody reads that from the store while it is sent. The
+        transport fills in bytes, sent and seconds.
+      */
+      struct uploadbatch
+      {
+        int lane = livelane;
+        int format = samplemaps;        // the layout of the samples, see uploadformat
+        int64_t start = 0;              // the samples after this id
+        int64_t end = 0;                // up to the id of the last sample in the batch
+        int64_t endTime = INT64_MIN;    // the sampletime of that sample
+        bool last = false;              // the lane had no more samples
+        int64_t firstEvent = 0;         // the events after this id
+        int64_t lastEvent = 0;          // up to the id of the last event in the batch
+        uint64_t items = 0;             // samples or events planned
+        uint64_t bytes = 0;             // bytes of the body sent, not compressed
+        bool sent = false;              // the server took the batch
+        double seconds = 0;             // request to response
+      };
+
+      /*
+        uploadbody is the body of a planned batch, a CBOR sequence of the samples with
+        batch.start < id <= batch.end (see uploadstream) or of the events of the batch as maps
+        {event, source, text1, text2, time}. It is read from the store a page at a time
+        as the transport asks for bytes, a batch which failed is read again the same way.
+
+          uploadbody body(store, batch);
+          r.body = [&body](uint8_t* dest, size_t len) { return body.read(dest, len); };
+          client.perform(requests);
+          batch.sent = r.ok() && !body.failed();
+      */
+      class uploadbody
+      {
+      public:
+        uploadbody(store& source, const uploadbatch& batch);
+        size_t read(uint8_t* dest, size_t len);
+        bool failed() const { return mSamples ? mSamples->failed() : mFailed; }
+        uint64_t bytes() const { return mSamples ? mSamples->bytes() : mEventWriter.bytes(); }
+      private:
+        bool nextEvent(cbor::encoder& out);
+        store& mStore;
+        uploadbatch mBatch;
+        std::unique_ptr<uploadstream> mSamples;   // the samples of a sample batch
+        std::vector<event> mEvents;     // the page of events read, not encoded yet
+        size_t mEventPos = 0;
+        int64_t mEventRead;             // id of the last event read
+        bool mFailed = false;
+        cbor::sequencewriter mEventWriter;
+      };
+
+      /*
+        uploadscheduler plans the uploads in rounds of concurrent requests. Every round
+        carries the new Eventlog rows first, then one batch of fresh samples, then up to
+        window() batches of the backlog, so a backlog of days never delays live data.
+
+          uploadscheduler uploads(store);
+          uploads.resume();                     // the checkpoint of the last run
+          std::vector<uploadbatch> round;
+          while (uploads.plan(round) && !round.empty())
+          {
+            send(round);                        // concurrently with an uploadbody each, sets bytes, sent and seconds
+            if (!uploads.complete(round))
+              wait();                           // caught up, nothing left for now
+          }
+
+        The lanes run in the order of the sample ids, the order the samples were written
+        in (store::readSamplesById), so samples which come in late with an older
+        sampletime, from an import or with the time of the DSP, are uploaded as well.
+        When the live lane falls behind and the last sample it got through is older than
+        policy.fresh (an outage, an import, or the first run on a full database),
+        everything stored up to then becomes the backlog and the live lane continues with
+        the samples written after it.
+
+        The batch size and the window adapt AIMD style like a TCP congestion window: the
+        batch doubles up to a threshold and then grows by minBatch per round, a failed
+        request or a response slower than targetRtt halves it. Once batches are at their
+        maximum the window grows by one as long as that raises the throughput, a window
+        which doesn't pay off is taken back.
+
+        The positions of the lanes are sample ids, they are checkpointed in Settings
+        (device kSettingsDevice) in one transaction after every round, so a restart
+        resumes where the acknowledged uploads ended. A batch which failed is read
+        again in the next round, together with the ones after it in its lane: a server
+        may see a sample twice, but never misses one. A checkpoint of an older format
+        (sampletime cursors) isn't resumed, everything stored is the backlog then.
+
+        uploadedThrough() is the id up to which the server took every sample, the bound
+        for store::archiveUploaded.
+      */
+      class uploadscheduler
+      {
+      public:
+        static const int kSettingsDevice = 0;   // Settings rows of the gateway itself
+
+        explicit uploadscheduler(store& source, const uploadpolicy& policy = uploadpolicy());
+        bool resume();
+        bool plan(std::vector<uploadbatch>& round);
+        bool complete(const std::vector<uploadbatch>& round);
+        size_t batch() const { return mBatch; }
+        size_t window() const { return mWindow; }
+        bool backlog() const { return mBacklogActive; }
+        int64_t liveAcked() const { return mLive.acked; }
+        int64_t backlogAcked() const { return mBacklog.acked; }
+        int64_t uploadedThrough() const;
+      private:
+        static const int64_t kCheckpointFormat = 2;   // 1 had sampletime cursors and the keys 1 and 4
+        enum checkpoint : int_fast16_t
+        {
+          kLiveTime = 2,
+          kLiveId,
+          kBacklogTo = 5,
+          kBacklogTime,
+          kBacklogId,
+          kEventId,
+          kFormat,
+        };
+        struct lane
+        {
+          int64_t to = INT64_MAX;       // id of the last sample of the lane
+          int64_t read = 0;             // id of the last sample planned
+          int64_t acked = 0;            // id of the last sample the server took
+          int64_t ackedTime = INT64_MIN;  // its sampletime
+        };
+        bool readSamples(lane& l, int kind, std::vector<uploadbatch>& round);
+        bool readEvents(std::vector<uploadbatch>& round);
+        void adapt(const std::vector<uploadbatch>& round);
+        bool save();
+        store& mStore;
+        uploadpolicy mPolicy;
+        lane mLive;
+        lane mBacklog;
+        bool mBacklogActive = false;
+        bool mLiveBehind = true;        // the last live batch was full, or nothing is known yet
+        int64_t mEventRead = 0;         // id of the last event planned
+        int64_t mEventAcked = 0;        // id of the last event the server took
+        size_t mBatch;                  // samples per batch
+        size_t mThreshold;              // the batch grows additively above this
+        size_t mWindow = 1;             // backlog batches per round
+        size_t mWindowCap;              // a larger window didn't pay off
+        bool mWindowGrew = false;       // the window was raised after the last round
+        double mRate = 0;               // bytes per second of the last full round
+      };
+    }
+  }
+}
@@ -0,0 +1,147 @@
+/* import.cpp : bulk import of CBOR capture files into the store
+
+status: early stage prototyping - architectural decisions aren't finalized
+
+Copyright (c)   (c) 2015,2016 tk@satware.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this
+software and associated documentation files (the "Software"), to deal in the Software
+without restriction, including without limitation the rights to use, copy, modify,
+merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be included in all copies
+or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+/*
+  when a box has been offline the technicians pull the raw CBOR captures from the DSP
+  and import them here:
+
+    gridconnect-import --db battery.sq3 capture-1.cbor capture-2.cbor
+
+  The files are imported one after another, each one mapped and decoded in parallel
+  (--threads, default all cores) and written in timestamp order in transactions of
+  --batch samples. The database has to be closed by the gateway meanwhile.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "storage.h"
+#include "replay.h"
+#include "sampleclock.h"
+
+using namespace std;
+using namespace satag;
+
+namespace
+{
+  struct options
+  {
+    string db = "battery.sq3";
+    size_t threads = 0;               // 0 = all cores
+    size_t batch = energy::bx::importer::kBatch;
+    size_t piece = energy::bx::importer::kPiece;
+    energy::bx::partitioning mode = energy::bx::unpartitioned;
+    vector<string> files;
+  };
+
+  void usage(const char* name)
+  {
+    cerr << "usage: " << name << " [options] file...\n"
+      "  --db FILE          database (battery.sq3)\n"
+      "  --threads T        decoder threads (0 = all cores)\n"
+      "  --batch B          samples per transaction (100000)\n"
+      "  --piece KB         bytes decoded as one piece (4096)\n"
+      "  --partition P      none, daily or hourly (none), as the database was created\n";
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  options opt;
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    bool more = (i + 1 < argc);
+    if ((arg == "--db") && more) opt.db = argv[++i];
+    else if ((arg == "--threads") && more) opt.threads = (size_t)atoi(argv[++i]);
+    else if ((arg == "--batch") && more) opt.batch = (size_t)atoi(argv[++i]);
+    else if ((arg == "--piece") && more) opt.piece = (size_t)atoi(argv[++i]) * 1024;
+    else if ((arg == "--partition") && more)
+    {
+      string mode = argv[++i];
+      if (mode == "daily") opt.mode = energy::bx::daily;
+      else if (mode == "hourly") opt.mode = energy::bx::hourly;
+      else if (mode != "none")
+      {
+        usage(argv[0]);
+        return 2;
+      }
+    }
+    else if ((arg.size() > 1) && (arg[0] == '-'))
+    {
+      usage(argv[0]);
+      return 2;
+    }
+    else opt.files.push_back(arg);
+  }
+  if (opt.files.empty() || (opt.batch < 1) || (opt.piece < 1))
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  util::sampleclock::start();
+  energy::bx::store store;
+  bool ok = store.open(opt.db.c_str(), opt.mode);
+  if (!ok)
+  {
+    cerr << "can't open " << opt.db << endl;
+  }
+  energy::bx::importer importer(store, opt.threads);
+  importer.setBatch(opt.batch);
+  importer.setPiece(opt.piece);
+  for (size_t i = 0; ok && (i < opt.files.size()); ++i)
+  {
+    energy::bx::importstats stats;
+    ok = importer.importFile(opt.files[i].c_str(), stats);
+    printf("%s: %llu samples from %.1f MB in %llu transactions, decode %.2f s (%.0f MB/s), write %.2f s (%.0f samples/s)\n",
+      opt.files[i].c_str(), (unsigned long long)stats.samples, stats.bytes / 1e6, (unsigned long long)stats.transactions,
+      stats.decodeSeconds, (stats.decodeSeconds > 0) ? stats.bytes / 1e6 / stats.decodeSeconds : 0.0,
+      stats.writeSeconds, (stats.writeSeconds > 0) ? stats.samples / stats.writeSeconds : 0.0);
+    if (stats.invalid || stats.rejoined || stats.truncated)
+    {
+      printf("  %llu maps weren't samples, %llu of %llu pieces decoded in sequence%s\n",
+        (unsigned long long)stats.invalid, (unsigned long long)stats.rejoined, (unsigned long long)stats.pieces,
+        stats.truncated ? ", the file ends inside an item" : "");
+    }
+    if (!ok)
+    {
+      cerr << opt.files[i] << ": import failed";
+      if (stats.corrupt)
+      {
+        cerr << ", no valid CBOR in the piece at byte " << stats.errorAt;
+      }
+      cerr << endl;
+    }
+  }
+  store.close();
+  util::sampleclock::stop();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,635 @@
+/* loadgen.cpp : synthetic battery telemetry load against the store
+
+status: early stage prototyping - architectural decisions aren't finalized
+
+Copyright (c)   (c) 2015,2016 tk@satware.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this
+software and associated documentation files (the "Software"), to deal in the Software
+without restriction, including without limitation the rights to use, copy, modify,
+merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be included in all copies
+or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+
+The license above does not apply to and no license is granted for any Military Use.
+
+*/
+
+/*
+  the load generator answers "how many batteries can one box handle":
+
+    gridconnect-loadgen --devices 50 --entities 40 --rate 1 --seconds 30
+    gridconnect-loadgen --devices 10 --ramp --max-latency 500
+
+  Producer threads generate the samples of N devices with M entities each at a fixed
+  rate per entity, optionally with bursts, and write them in batches through the store
+  API (--shards 0 writes to bx::store directly, --shards K through shardedstore, whose
+  writers run on a scheduler with --pool P threads instead of threads of their own).
+  An injector puts commands into ControlCommandsIn from a connection of its own, like
+  the server side would, a dispatcher polls them with runEvent, and an uploader scans
+  the new samples like the upload does.
+
+  Pacing is done against a fixed tick schedule. Every sample carries the time it was
+  due, not the time it was written, so a producer falling behind shows up as latency
+  instead of being hidden. With --ramp the number of devices is doubled until the box
+  falls behind the schedule or the p99 latency exceeds --max-latency.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include "storage.h"
+#include "shardedstore.h"
+#include "sampleclock.h"
+#include "metrics.h"
+#include "scheduler.h"
+
+using namespace std;
+using namespace satag;
+using satag::util::metrics::histogram;
+
+namespace
+{
+  struct options
+  {
+    int devices = 10;
+    int entities = 40;
+    double rate = 1.0;            // samples per second and entity
+    double seconds = 10.0;
+    int threads = 4;
+    size_t batch = 100;           // samples per write call
+    int tickMillis = 10;          // pacing interval
+    double burstEvery = 0;        // seconds between bursts, 0 = none
+    double burstLength = 1.0;     // seconds
+    double burstFactor = 5.0;     // rate multiplier during a burst
+    double commands = 0;          // injected commands per second
+    int uploadMillis = 1000;      // interval of the upload scan, 0 = none
+    size_t shards = 0;            // 0 = bx::store directly
+    size_t pool = 0;              // scheduler threads for the shard writers, 0 = writer threads
+    string db = "loadgen.sq3";
+    bool keep = false;            // keep the database files
+    bool ramp = false;
+    double maxLatency = 1000;     // milliseconds, p99 limit for --ramp
+    string json;
+  };
+
+  struct report
+  {
+    int devices = 0;
+    double targetRate = 0;
+    double achievedRate = 0;
+    uint64_t samples = 0;
+    uint64_t failed = 0;
+    double seconds = 0;
+    std::unique_ptr<histogram::snapshot> latency{ new histogram::snapshot() };   // microseconds
+    std::unique_ptr<histogram::snapshot> queue{ new histogram::snapshot() };     // samples
+    std::unique_ptr<histogram::snapshot> commands{ new histogram::snapshot() };  // microseconds
+    uint64_t commandsSent = 0;
+    uint64_t commandsRun = 0;
+    uint64_t uploaded = 0;
+    std::unique_ptr<histogram::snapshot> upload{ new histogram::snapshot() };    // microseconds per scan
+    bool keptUp(const options& opt) const
+    {
+      return (failed == 0) && (achievedRate >= 0.98 * targetRate)
+        && (latency->percentile(99) <= (uint64_t)(opt.maxLatency * 1000));
+    }
+  };
+
+  typedef std::chrono::steady_clock clock_type;
+
+  /*
+    the store under test, either a single bx::store or a shardedstore
+  */
+  class target
+  {
+  public:
+    bool open(const options& opt)
+    {
+      remove(opt);
+      if (opt.shards > 0)
+      {
+        if (opt.pool > 0)
+        {
+          mPool.reset(new util::scheduler(opt.pool));
+          mPool->start();
+        }
+        return mSharded.open(opt.db.c_str(), opt.shards, energy::bx::unpartitioned, mPool.get());
+      }
+      return mStore.open(opt.db.c_str());
+    }
+    void close()
+    {
+      mSharded.close();
+      mStore.close();
+      mPool.reset();
+    }
+    void remove(const options& opt)
+    {
+      size_t n = opt.shards ? opt.shards : 1;
+      for (size_t i = 0; i < n; ++i)
+      {
+        std::remove(energy::bx::shardedstore::shardName(opt.db.c_str(), i, n).c_str());
+      }
+    }
+    string primaryFile(const options& opt) const
+    {
+      return energy::bx::shardedstore::shardName(opt.db.c_str(), 0, opt.shards ? opt.shards : 1);
+    }
+    bool sharded() const { return mSharded.isOpen(); }
+    bool write(const vector<energy::bx::sample>& samples)
+    {
+      return sharded() ? mSharded.logDSPEvents(samples) : mStore.logDSPEvents(samples);
+    }
+    bool runEvent(std::function<bool(int device, const char* text1, const char* text2)> fun)
+    {
+      return sharded() ? mSharded.runEvent(fun) : mStore.runEvent(fun);
+    }
+    size_t scan(int64_t from, int64_t to, int64_t& newest)
+    {
+      size_t rows = 0;
+      auto count = [&](const energy::bx::sample& s)
+      {
+        ++rows;
+        if (s.sampletime > newest)
+        {
+          newest = s.sampletime;
+        }
+        return true;
+      };
+      if (sharded())
+      {
+        mSharded.readSamples(from, to, count);
+      }
+      else
+      {
+        energy::bx::samplecursor cursor;
+        size_t got = 0;
+        do
+        {
+          got = 0;
+          mStore.readSamples(from, to, cursor, 1000, [&](const energy::bx::sample& s)
+          {
+            ++got;
+            count(s);
+          });
+        } while ((got > 0) && !cursor.done);
+      }
+      return rows;
+    }
+    size_t pending() const { return sharded() ? mSharded.pending() : 0; }
+    void flush()
+    {
+      if (sharded())
+      {
+        mSharded.flush();
+      }
+    }
+  private:
+    std::unique_ptr<util::scheduler> mPool;   // outlives the shards which submit to it
+    energy::bx::store mStore;
+    energy::bx::shardedstore mSharded;
+  };
+
+  /*
+    samples due at time t (seconds since start) for rate r, with bursts
+  */
+  double expected(const options& opt, double r, double t)
+  {
+    double burst = 0;
+    if (opt.burstEvery > 0)
+    {
+      double n = floor(t / opt.burstEvery);
+      burst = n * opt.burstLength + std::min(t - n * opt.burstEvery, opt.burstLength);
+    }
+    return r * (t + (opt.burstFactor - 1.0) * burst);
+  }
+
+  int64_t micros(clock_type::duration d)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  }
+
+  bool run(const options& opt, report& rep)
+  {
+    target t;
+    if (!t.open(opt))
+    {
+      cerr << "can't open " << opt.db << endl;
+      return false;
+    }
+    rep.devices = opt.devices;
+    // the average rate including the bursts
+    rep.targetRate = expected(opt, (double)opt.devices * opt.entities * opt.rate, opt.seconds) / opt.seconds;
+
+    histogram latency;      // sample to disk, direct mode
+    histogram queue;        // backlog of the producers / the shard queues
+    histogram commands;     // command insert to dispatch
+    histogram uploads;      // duration of one upload scan
+    auto& shardLatency = util::metrics::registry::instance().getHistogram("shard.latency");
+    std::unique_ptr<histogram::snapshot> shardBefore(new histogram::snapshot());
+    shardLatency.take(*shardBefore);
+
+    std::atomic<uint64_t> written{ 0 };
+    std::atomic<uint64_t> failed{ 0 };
+    std::atomic<bool> producing{ true };
+    std::atomic<bool> running{ true };
+    auto start = clock_type::now();
+    auto deadline = start + std::chrono::microseconds((int64_t)(opt.seconds * 1e6));
+    int64_t startTime = energy::bx::store::now();   // sample time of the start
+
+    // -------- producers, thread i owns the devices d with d % threads == i
+    vector<thread> producers;
+    int threads = std::max(1, std::min(opt.threads, opt.devices));
+    for (int i = 0; i < threads; ++i)
+    {
+      producers.push_back(thread([&, i]()
+      {
+        vector<std::pair<int, int>> channels;   // (device, entity)
+        for (int d = 1 + i; d <= opt.devices; d += threads)
+        {
+          for (int e = 1; e <= opt.entities; ++e)
+          {
+            channels.push_back(std::make_pair(d, e));
+          }
+        }
+        vector<int> values(channels.size(), 0);
+        std::mt19937 rng(1000 + i);
+        std::uniform_int_distribution<int> step(-20, 20);
+        double r = (double)channels.size() * opt.rate;
+        uint64_t emitted = 0;
+        size_t next = 0;
+        vector<energy::bx::sample> batch;
+        batch.reserve(opt.batch);
+        auto tick = std::chrono::milliseconds(opt.tickMillis);
+        for (int64_t k = 1; ; ++k)
+        {
+          auto due = start + k * tick;
+          if (due > deadline)
+          {
+            break;
+          }
+          std::this_thread::sleep_until(due);
+          double elapsed = std::chrono::duration<double>(due - start).count();
+          uint64_t target = (uint64_t)expected(opt, r, elapsed);
+          int64_t dueTime = startTime + micros(due - start);
+          // backlog: what should be written by now, but isn't
+          double late = std::chrono::duration<double>(clock_type::now() - start).count();
+          uint64_t should = (uint64_t)expected(opt, r, late);
+          queue.record(should > emitted ? should - emitted : 0);
+          while (emitted < target)
+          {
+            energy::bx::sample s;
+            s.id = 0;
+            s.device = channels[next].first;
+            s.entity = channels[next].second;
+            values[next] += step(rng);
+            s.value = values[next];
+            s.sampletime = dueTime;
+            batch.push_back(s);
+            next = (next + 1) % channels.size();
+            ++emitted;
+            if ((batch.size() >= opt.batch) || (emitted == target))
+            {
+              bool ok = t.write(batch);
+              if (!t.sharded())
+              {
+                int64_t now = energy::bx::store::now();
+                for (auto& b : batch)
+                {
+                  latency.record((uint64_t)std::max<int64_t>(0, now - b.sampletime));
+                }
+              }
+              (ok ? written : failed) += batch.size();
+              batch.clear();
+            }
+          }
+        }
+      }));
+    }
+
+    // -------- shard queue depths
+    thread monitor;
+    if (t.sharded())
+    {
+      monitor = thread([&]()
+      {
+        while (producing)
+        {
+          queue.record(t.pending());
+          std::this_thread::sleep_for(std::chrono::milliseconds(opt.tickMillis));
+        }
+      });
+    }
+
+    // -------- command injection and dispatch
+    std::atomic<uint64_t> sent{ 0 };
+    std::atomic<uint64_t> dispatched{ 0 };
+    thread injector;
+    thread dispatcher;
+    if (opt.commands > 0)
+    {
+      injector = thread([&]()
+      {
+        util::db d(t.primaryFile(opt).c_str(), SQLITE_OPEN_READWRITE);
+        sqlite3_busy_timeout(d, energy::bx::kBusyTimeout);
+        util::query insert(d, "insert into ControlCommandsIn (device,text1,text2,exectime) values (?1,?2,?3,?4);");
+        auto interval = std::chrono::microseconds((int64_t)(1e6 / opt.commands));
+        for (int64_t k = 1; start + k * interval <= deadline; ++k)
+        {
+          std::this_thread::sleep_until(start + k * interval);
+          insert.bind(1) = (int)(1 + k % opt.devices);
+          insert.bind(2) = "setpoint";
+          insert.bind(3) = "1500";
+          insert.bind(4) = energy::bx::store::now();    // the dispatcher measures against this
+          if (insert.run())
+          {
+            ++sent;
+          }
+        }
+      });
+      dispatcher = thread([&]()
+      {
+        // poll like the gateway does, the command text carries no time so we read exectime first
+        util::db d(t.primaryFile(opt).c_str(), SQLITE_OPEN_READONLY);
+        sqlite3_busy_timeout(d, energy::bx::kBusyTimeout);
+        util::query oldest(d, "select exectime from ControlCommandsIn order by exectime asc limit 1;");
+        while (running || (dispatched < sent))
+        {
+          int64_t exectime = 0;
+          oldest.run([&](util::query& row)
+          {
+            exectime = row[0];
+          });
+          bool ran = (exectime != 0) && t.runEvent([&](int device, const char* text1, const char* text2)
+          {
+            return true;
+          });
+          if (ran)
+          {
+            commands.record((uint64_t)std::max<int64_t>(0, energy::bx::store::now() - exectime));
+            ++dispatched;
+          }
+          else
+          {
+            if (!running)
+            {
+              break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+        }
+      });
+    }
+
+    // -------- upload scans
+    std::atomic<uint64_t> uploaded{ 0 };
+    thread uploader;
+    if (opt.uploadMillis > 0)
+    {
+      uploader = thread([&]()
+      {
+        int64_t from = startTime - energy::bx::kTicksPerSecond;
+        auto interval = std::chrono::milliseconds(opt.uploadMillis);
+        for (int64_t k = 1; running && (start + k * interval <= deadline); ++k)
+        {
+          std::this_thread::sleep_until(start + k * interval);
+          int64_t newest = from - 1;
+          auto t0 = clock_type::now();
+          uploaded += t.scan(from, INT64_MAX, newest);
+          uploads.record((uint64_t)micros(clock_type::now() - t0));
+          if (newest >= from)
+          {
+            from = newest + 1;
+          }
+        }
+      });
+    }
+
+    for (auto& p : producers)
+    {
+      p.join();
+    }
+    t.flush();
+    rep.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    producing = false;
+    if (monitor.joinable())
+    {
+      monitor.join();
+    }
+    if (injector.joinable())
+    {
+      injector.join();
+    }
+    running = false;
+    if (dispatcher.joinable())
+    {
+      dispatcher.join();
+    }
+    if (uploader.joinable())
+    {
+      uploader.join();
+    }
+    t.close();
+    if (!opt.keep)
+    {
+      t.remove(opt);
+    }
+
+    rep.samples = written;
+    rep.failed = failed;
+    rep.achievedRate = written / std::max(opt.seconds, rep.seconds);
+    if (opt.shards > 0)
+    {
+      shardLatency.take(*rep.latency);
+      rep.latency->subtract(*shardBefore);
+    }
+    else
+    {
+      latency.take(*rep.latency);
+    }
+    queue.take(*rep.queue);
+    commands.take(*rep.commands);
+    uploads.take(*rep.upload);
+    rep.commandsSent = sent;
+    rep.commandsRun = dispatched;
+    rep.uploaded = uploaded;
+    return true;
+  }
+
+  void print(const options& opt, const report& r)
+  {
+    printf("devices %d x %d entities @ %.2f Hz%s: target %.0f samples/s, achieved %.0f samples/s (%llu written, %llu failed, %.2f s) -> %s\n",
+      r.devices, opt.entities, opt.rate, opt.burstEvery > 0 ? " with bursts" : "", r.targetRate, r.achievedRate,
+      (unsigned long long)r.samples, (unsigned long long)r.failed, r.seconds, r.keptUp(opt) ? "kept up" : "FELL BEHIND");
+    printf("  sample to disk  p50 %8.2f ms  p90 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+      r.latency->percentile(50) / 1e3, r.latency->percentile(90) / 1e3, r.latency->percentile(99) / 1e3, r.latency->max / 1e3);
+    printf("  queue depth     p50 %8llu     p99 %8llu     max %8llu samples\n",
+      (unsigned long long)r.queue->percentile(50), (unsigned long long)r.queue->percentile(99), (unsigned long long)r.queue->max);
+    if (opt.commands > 0)
+    {
+      printf("  commands        %llu sent, %llu dispatched, latency p50 %.2f ms p99 %.2f ms\n",
+        (unsigned long long)r.commandsSent, (unsigned long long)r.commandsRun,
+        r.commands->percentile(50) / 1e3, r.commands->percentile(99) / 1e3);
+    }
+    if (opt.uploadMillis > 0)
+    {
+      printf("  upload scans    %llu rows in %llu scans, scan p50 %.2f ms p99 %.2f ms\n",
+        (unsigned long long)r.uploaded, (unsigned long long)r.upload->count,
+        r.upload->percentile(50) / 1e3, r.upload->percentile(99) / 1e3);
+    }
+  }
+
+  string toJson(const options& opt, const vector<report>& reports)
+  {
+    char line[1024];
+    string json = "{\n  \"runs\": [\n";
+    for (size_t i = 0; i < reports.size(); ++i)
+    {
+      auto& r = reports[i];
+      snprintf(line, sizeof(line),
+        "    { \"devices\": %d, \"entities\": %d, \"rate\": %.3f, \"shards\": %zu, \"target\": %.1f, \"achieved\": %.1f, "
+        "\"written\": %llu, \"failed\": %llu, \"seconds\": %.3f, \"latencyP50us\": %llu, \"latencyP99us\": %llu, "
+        "\"latencyMaxus\": %llu, \"queueP99\": %llu, \"queueMax\": %llu, \"commandsSent\": %llu, \"commandsRun\": %llu, "
+        "\"commandP99us\": %llu, \"uploaded\": %llu, \"keptUp\": %s }%s\n",
+        r.devices, opt.entities, opt.rate, opt.shards, r.targetRate, r.achievedRate,
+        (unsigned long long)r.samples, (unsigned long long)r.failed, r.seconds,
+        (unsigned long long)r.latency->percentile(50), (unsigned long long)r.latency->percentile(99),
+        (unsigned long long)r.latency->max, (unsigned long long)r.queue->percentile(99), (unsigned long long)r.queue->max,
+        (unsigned long long)r.commandsSent, (unsigned long long)r.commandsRun, (unsigned long long)r.commands->percentile(99),
+        (unsigned long long)r.uploaded, r.keptUp(opt) ? "true" : "false", (i + 1 < reports.size()) ? "," : "");
+      json += line;
+    }
+    json += "  ]\n}\n";
+    return json;
+  }
+
+  void usage(const char* name)
+  {
+    cerr << "usage: " << name << " [options]\n"
+      "  --devices N        batteries (10)\n"
+      "  --entities M       entities per battery (40)\n"
+      "  --rate HZ          samples per second and entity (1)\n"
+      "  --seconds S        duration of a run (10)\n"
+      "  --threads T        producer threads (4)\n"
+      "  --batch B          samples per write (100)\n"
+      "  --tick MS          pacing interval (10)\n"
+      "  --burst-every S    seconds between bursts (0 = none)\n"
+      "  --burst-length S   length of a burst (1)\n"
+      "  --burst-factor F   rate multiplier during a burst (5)\n"
+      "  --commands C       commands per second into ControlCommandsIn (0)\n"
+      "  --upload MS        upload scan interval (1000, 0 = none)\n"
+      "  --shards K         write through shardedstore with K shards (0 = bx::store)\n"
+      "  --pool P           run the shard writers on a scheduler with P threads (0 = own threads)\n"
+      "  --db FILE          database (loadgen.sq3)\n"
+      "  --keep             keep the database files\n"
+      "  --ramp             double the devices until the box falls behind\n"
+      "  --max-latency MS   p99 sample to disk limit for --ramp (1000)\n"
+      "  --json FILE        write the results as JSON\n";
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  options opt;
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    bool more = (i + 1 < argc);
+    if ((arg == "--devices") && more) opt.devices = atoi(argv[++i]);
+    else if ((arg == "--entities") && more) opt.entities = atoi(argv[++i]);
+    else if ((arg == "--rate") && more) opt.rate = atof(argv[++i]);
+    else if ((arg == "--seconds") && more) opt.seconds = atof(argv[++i]);
+    else if ((arg == "--threads") && more) opt.threads = atoi(argv[++i]);
+    else if ((arg == "--batch") && more) opt.batch = (size_t)atoi(argv[++i]);
+    else if ((arg == "--tick") && more) opt.tickMillis = atoi(argv[++i]);
+    else if ((arg == "--burst-every") && more) opt.burstEvery = atof(argv[++i]);
+    else if ((arg == "--burst-length") && more) opt.burstLength = atof(argv[++i]);
+    else if ((arg == "--burst-factor") && more) opt.burstFactor = atof(argv[++i]);
+    else if ((arg == "--commands") && more) opt.commands = atof(argv[++i]);
+    else if ((arg == "--upload") && more) opt.uploadMillis = atoi(argv[++i]);
+    else if ((arg == "--shards") && more) opt.shards = (size_t)atoi(argv[++i]);
+    else if ((arg == "--pool") && more) opt.pool = (size_t)atoi(argv[++i]);
+    else if ((arg == "--db") && more) opt.db = argv[++i];
+    else if ((arg == "--max-latency") && more) opt.maxLatency = atof(argv[++i]);
+    else if ((arg == "--json") && more) opt.json = argv[++i];
+    else if (arg == "--keep") opt.keep = true;
+    else if (arg == "--ramp") opt.ramp = true;
+    else
+    {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if ((opt.devices < 1) || (opt.entities < 1) || (opt.rate <= 0) || (opt.seconds <= 0) || (opt.batch < 1) || (opt.tickMillis < 1))
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  util::sampleclock::start();
+  vector<report> reports;
+  int lastGood = 0;
+  bool ok = true;
+  do
+  {
+    reports.push_back(report());
+    ok = run(opt, reports.back());
+    if (!ok)
+    {
+      break;
+    }
+    print(opt, reports.back());
+    if (!reports.back().keptUp(opt))
+    {
+      break;
+    }
+    lastGood = opt.devices;
+    opt.devices *= 2;
+  } while (opt.ramp);
+  util::sampleclock::stop();
+
+  if (opt.ramp && ok)
+  {
+    if (lastGood > 0)
+    {
+      printf("capacity: %d batteries of %d entities @ %.2f Hz (%.0f samples/s)\n",
+        lastGood, opt.entities, opt.rate, lastGood * opt.entities * opt.rate);
+    }
+    else
+    {
+      printf("capacity: below the starting point, try fewer --devices\n");
+    }
+  }
+  if (ok && !opt.json.empty())
+  {
+    auto json = toJson(opt, reports);
+    FILE* f = fopen(opt.json.c_str(), "wb");
+    ok = (f != nullptr) && (fwrite(json.data(), 1, json.size(), f) == json.size());
+    if (f)
+    {
+      fclose(f);
+    }
+  }
+  return ok ? 0 : 1;
+}